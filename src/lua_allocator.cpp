@@ -0,0 +1,152 @@
+#include "./lua_allocator.hpp"
+
+#include <lualib.h>
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+
+// registry key of the allocator, there is no lua_getallocf in luau
+static constexpr const char* registry_key = "tlm_allocator";
+
+LuaAllocator::LuaAllocator(size_t limit) {
+	_stats.limit = limit;
+}
+
+LuaAllocator::~LuaAllocator(void) {
+	for (auto* block : _free) {
+		while (block != nullptr) {
+			auto* next = block->next;
+			std::free(block);
+			block = next;
+		}
+	}
+}
+
+lua_State* LuaAllocator::newState(size_t limit) {
+	auto* allocator = new LuaAllocator(limit);
+	lua_State* L = lua_newstate(alloc, allocator);
+	if (L == nullptr) {
+		delete allocator;
+		return nullptr;
+	}
+
+	lua_pushlightuserdata(L, allocator);
+	lua_setfield(L, LUA_REGISTRYINDEX, registry_key);
+
+	return L;
+}
+
+void LuaAllocator::closeState(lua_State* L) {
+	if (L == nullptr) {
+		return;
+	}
+
+	auto* allocator = fromState(L);
+	lua_close(L);
+	delete allocator; // outlives the state, the close still frees through it
+}
+
+LuaAllocator* LuaAllocator::fromState(lua_State* L) {
+	lua_getfield(L, LUA_REGISTRYINDEX, registry_key);
+	auto* allocator = static_cast<LuaAllocator*>(lua_tolightuserdata(L, -1));
+	lua_pop(L, 1);
+	return allocator;
+}
+
+size_t LuaAllocator::sizeClass(size_t size) {
+	if (size > (size_t(1) << max_class_shift)) {
+		return class_count;
+	}
+
+	size_t shift = min_class_shift;
+	while ((size_t(1) << shift) < size) {
+		shift++;
+	}
+	return shift - min_class_shift;
+}
+
+void* LuaAllocator::acquire(size_t size) {
+	const size_t size_class = sizeClass(size);
+	if (size_class == class_count) {
+		return std::malloc(size);
+	}
+
+	if (auto* block = _free[size_class]; block != nullptr) {
+		_free[size_class] = block->next;
+		_stats.cached -= size_t(1) << (size_class + min_class_shift);
+		return block;
+	}
+
+	return std::malloc(size_t(1) << (size_class + min_class_shift));
+}
+
+void LuaAllocator::release(void* ptr, size_t size) {
+	const size_t size_class = sizeClass(size);
+	const size_t class_size = size_t(1) << (size_class + min_class_shift);
+	if (size_class == class_count || _stats.cached + class_size > _cache_limit) {
+		std::free(ptr);
+		return;
+	}
+
+	auto* block = static_cast<FreeBlock*>(ptr);
+	block->next = _free[size_class];
+	_free[size_class] = block;
+	_stats.cached += class_size;
+}
+
+void* LuaAllocator::alloc(void* ud, void* ptr, size_t osize, size_t nsize) {
+	auto* self = static_cast<LuaAllocator*>(ud);
+	auto& stats = self->_stats;
+
+	if (ptr == nullptr) {
+		osize = 0;
+	}
+
+	if (nsize == 0) {
+		if (ptr != nullptr) {
+			self->release(ptr, osize);
+			stats.bytes -= osize;
+		}
+		return nullptr;
+	}
+
+	// luau turns this into a memory error, which scripts can catch with pcall
+	if (nsize > osize && stats.limit != 0 && stats.bytes - osize + nsize > stats.limit) {
+		stats.failed++;
+		return nullptr;
+	}
+
+	void* block = nullptr;
+	if (ptr == nullptr) {
+		stats.allocs++;
+		block = self->acquire(nsize);
+	} else if (const size_t size_class = sizeClass(nsize); size_class == sizeClass(osize)) {
+		if (size_class != class_count) {
+			block = ptr; // still fits its block
+		} else {
+			stats.allocs++;
+			block = std::realloc(ptr, nsize);
+		}
+	} else {
+		stats.allocs++;
+		block = self->acquire(nsize);
+		if (block != nullptr) {
+			std::memcpy(block, ptr, std::min(osize, nsize));
+			self->release(ptr, osize);
+		}
+	}
+
+	if (block == nullptr) {
+		if (nsize > osize) {
+			return nullptr;
+		}
+		block = ptr; // shrinking must not fail, the old block is big enough
+	}
+
+	stats.bytes = stats.bytes - osize + nsize;
+	stats.peak = std::max(stats.peak, stats.bytes);
+
+	return block;
+}
+
@@ -0,0 +1,63 @@
+#pragma once
+
+#include <lua.h>
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+
+// lua_Alloc with byte accounting, a hard limit and pooled blocks
+// luau already packs small objects into ~16KiB pages, so the allocator mostly sees pages and big arrays
+// freed blocks up to 16KiB are kept per power of two size class, so floods do not churn the system heap
+class LuaAllocator {
+	public:
+		struct Stats {
+			size_t bytes {0}; // requested by lua, what the limit applies to
+			size_t peak {0};
+			size_t limit {0}; // 0 for none
+			size_t cached {0}; // free blocks kept in the pools
+			uint64_t failed {0}; // allocations refused by the limit
+			uint64_t allocs {0}; // blocks handed out, including moves on realloc
+		};
+
+	private:
+		static constexpr size_t min_class_shift = 5; // 32 bytes
+		static constexpr size_t max_class_shift = 14; // 16KiB
+		static constexpr size_t class_count = max_class_shift - min_class_shift + 1;
+
+		// blocks handed back, linked through their first bytes
+		struct FreeBlock {
+			FreeBlock* next;
+		};
+		std::array<FreeBlock*, class_count> _free {};
+
+		size_t _cache_limit {8*1024*1024};
+		Stats _stats;
+
+	public:
+		explicit LuaAllocator(size_t limit);
+		~LuaAllocator(void);
+
+		LuaAllocator(const LuaAllocator&) = delete;
+		LuaAllocator& operator=(const LuaAllocator&) = delete;
+
+		// new state using a new allocator (limit in bytes, 0 for none), nullptr on failure
+		static lua_State* newState(size_t limit);
+		// closes the state and deletes its allocator, use instead of lua_close
+		static void closeState(lua_State* L);
+		// nullptr for states not made by newState()
+		static LuaAllocator* fromState(lua_State* L);
+
+		const Stats& getStats(void) const { return _stats; }
+		void setLimit(size_t limit) { _stats.limit = limit; }
+
+		static void* alloc(void* ud, void* ptr, size_t osize, size_t nsize);
+
+	private:
+		// class_count for blocks too big to pool
+		static size_t sizeClass(size_t size);
+
+		void* acquire(size_t size);
+		void release(void* ptr, size_t size);
+};
+
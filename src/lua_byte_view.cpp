@@ -0,0 +1,178 @@
+#include "./lua_byte_view.hpp"
+
+#include <lualib.h>
+
+
+// userdata tag, so we can identify our views without a metatable compare
+static constexpr int BYTE_VIEW_TAG = 42;
+static constexpr const char* BYTE_VIEW_MT = "ByteView";
+
+// per thread, so states living on different threads don't expire each others views
+static thread_local uint64_t t_byte_view_epoch {1};
+
+bool ByteView::valid(void) const {
+	return epoch == t_byte_view_epoch;
+}
+
+void ByteView::expireAll(void) {
+	t_byte_view_epoch++;
+}
+
+void pushByteView(lua_State* L, const uint8_t* data, size_t size) {
+	auto* view = static_cast<ByteView*>(lua_newuserdatatagged(L, sizeof(ByteView), BYTE_VIEW_TAG));
+	view->data = data;
+	view->size = size;
+	view->epoch = t_byte_view_epoch;
+
+	luaL_getmetatable(L, BYTE_VIEW_MT);
+	lua_setmetatable(L, -2);
+}
+
+const ByteView* toByteView(lua_State* L, int idx) {
+	return static_cast<const ByteView*>(lua_touserdatatagged(L, idx, BYTE_VIEW_TAG));
+}
+
+static const ByteView& checkByteView(lua_State* L, int idx) {
+	const auto* view = toByteView(L, idx);
+	if (view == nullptr) {
+		luaL_typeerror(L, idx, BYTE_VIEW_MT);
+	}
+	if (!view->valid()) {
+		luaL_errorL(L, "ByteView used after its callback returned, use :copy() to keep the data");
+	}
+	return *view;
+}
+
+// 1 based byte offset, like string.byte
+static size_t checkOffset(lua_State* L, const ByteView& view, int idx, size_t width) {
+	const int pos = luaL_checkinteger(L, idx);
+	if (pos < 1 || static_cast<size_t>(pos) - 1 + width > view.size) {
+		luaL_error(L, "ByteView read of %d bytes at %d out of range (size %d)", int(width), pos, int(view.size));
+	}
+	return static_cast<size_t>(pos) - 1;
+}
+
+template<size_t N, bool BE>
+static int lua_byteview_read(lua_State* L) {
+	const auto& view = checkByteView(L, 1);
+	const size_t offset = checkOffset(L, view, 2, N);
+
+	uint32_t value = 0;
+	for (size_t i = 0; i < N; i++) {
+		const size_t byte = BE ? i : N - 1 - i;
+		value = (value << 8) | view.data[offset + byte];
+	}
+
+	lua_pushnumber(L, value);
+	return 1;
+}
+
+static int lua_byteview_len(lua_State* L) {
+	const auto& view = checkByteView(L, 1);
+	lua_pushinteger(L, static_cast<int>(view.size));
+	return 1;
+}
+
+// sub(i [, j]), inclusive and 1 based like string.sub, negative values count from the end
+static int lua_byteview_sub(lua_State* L) {
+	const auto& view = checkByteView(L, 1);
+	const int size = static_cast<int>(view.size);
+
+	int i = luaL_checkinteger(L, 2);
+	int j = luaL_optinteger(L, 3, -1);
+	if (i < 0) {
+		i += size + 1;
+	}
+	if (j < 0) {
+		j += size + 1;
+	}
+	if (i < 1) {
+		i = 1;
+	}
+	if (j > size) {
+		j = size;
+	}
+
+	if (i > j) {
+		pushByteView(L, view.data, 0);
+	} else {
+		pushByteView(L, view.data + (i-1), static_cast<size_t>(j - i + 1));
+	}
+	return 1;
+}
+
+// explicit copy out, as a (binary) string
+static int lua_byteview_copy(lua_State* L) {
+	const auto& view = checkByteView(L, 1);
+	lua_pushlstring(L, reinterpret_cast<const char*>(view.data), view.size);
+	return 1;
+}
+
+// explicit copy out, as a table of bytes (like events used to be)
+static int lua_byteview_totable(lua_State* L) {
+	const auto& view = checkByteView(L, 1);
+	lua_createtable(L, static_cast<int>(view.size), 0);
+	for (size_t i = 0; i < view.size; i++) {
+		lua_pushinteger(L, view.data[i]);
+		lua_rawseti(L, -2, static_cast<int>(i+1));
+	}
+	return 1;
+}
+
+static int lua_byteview_tostring(lua_State* L) {
+	const auto* view = toByteView(L, 1);
+	lua_pushfstring(L, "ByteView(%d)", view != nullptr ? int(view->size) : 0);
+	return 1;
+}
+
+// view[i] reads a byte, like the tables we used to hand out, everything else looks up methods
+static int lua_byteview_index(lua_State* L) {
+	if (lua_type(L, 2) == LUA_TNUMBER) {
+		const auto& view = checkByteView(L, 1);
+		const int pos = lua_tointeger(L, 2);
+		if (pos < 1 || static_cast<size_t>(pos) > view.size) {
+			lua_pushnil(L);
+		} else {
+			lua_pushinteger(L, view.data[pos-1]);
+		}
+		return 1;
+	}
+
+	lua_pushvalue(L, 2);
+	lua_rawget(L, lua_upvalueindex(1));
+	return 1;
+}
+
+void registerByteView(lua_State* L) {
+	static const luaL_Reg methods[] {
+		{"len", lua_byteview_len},
+		{"sub", lua_byteview_sub},
+		{"copy", lua_byteview_copy},
+		{"totable", lua_byteview_totable},
+		{"u8", lua_byteview_read<1, false>},
+		{"u16le", lua_byteview_read<2, false>},
+		{"u16be", lua_byteview_read<2, true>},
+		{"u32le", lua_byteview_read<4, false>},
+		{"u32be", lua_byteview_read<4, true>},
+		{nullptr, nullptr},
+	};
+
+	luaL_newmetatable(L, BYTE_VIEW_MT);
+
+	lua_newtable(L);
+	luaL_register(L, nullptr, methods);
+	lua_pushcclosure(L, lua_byteview_index, "ByteView.__index", 1);
+	lua_setfield(L, -2, "__index");
+
+	lua_pushcfunction(L, lua_byteview_len, "ByteView.__len");
+	lua_setfield(L, -2, "__len");
+
+	lua_pushcfunction(L, lua_byteview_tostring, "ByteView.__tostring");
+	lua_setfield(L, -2, "__tostring");
+
+	lua_pushstring(L, BYTE_VIEW_MT);
+	lua_setfield(L, -2, "__type");
+
+	lua_setreadonly(L, -1, true);
+	lua_pop(L, 1);
+}
@@ -0,0 +1,29 @@
+#pragma once
+
+#include <lua.h>
+
+#include <cstdint>
+#include <cstddef>
+
+// non owning view into event memory, handed to lua instead of a table with an entry per byte
+// a view is only valid until the callback it was created for returns
+struct ByteView {
+	const uint8_t* data {nullptr};
+	size_t size {0};
+	uint64_t epoch {0};
+
+	bool valid(void) const;
+
+	// invalidates every view created on this thread so far
+	// call after each callback that got views
+	static void expireAll(void);
+};
+
+// registers the ByteView metatable, once per lua state
+void registerByteView(lua_State* L);
+
+void pushByteView(lua_State* L, const uint8_t* data, size_t size);
+
+// returns nullptr if the value at idx is not a ByteView (does not check valid())
+const ByteView* toByteView(lua_State* L, int idx);
+
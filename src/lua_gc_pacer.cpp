@@ -0,0 +1,65 @@
+#include "./lua_gc_pacer.hpp"
+
+#include <algorithm>
+
+void LuaGCPacer::attach(lua_State* L) {
+	lua_gc(L, LUA_GCSTOP, 0);
+	_heap_after_cycle_kb = static_cast<size_t>(lua_gc(L, LUA_GCCOUNT, 0));
+	_in_cycle = false;
+	_auto = false;
+}
+
+size_t LuaGCPacer::goalKB(void) const {
+	const size_t goal_kb = std::max(_heap_after_cycle_kb, _min_heap_kb) * _goal / 100;
+	// past 3/4 of the limit the stepped cycles keep running
+	return _limit_kb != 0 ? std::min(goal_kb, _limit_kb / 4 * 3) : goal_kb;
+}
+
+void LuaGCPacer::step(lua_State* L) {
+	const auto start = std::chrono::steady_clock::now();
+
+	if (!_in_cycle && !_auto && static_cast<size_t>(lua_gc(L, LUA_GCCOUNT, 0)) < goalKB()) {
+		return;
+	}
+	_in_cycle = true;
+
+	const auto deadline = start + _budget;
+	do {
+		_stats.steps++;
+		if (lua_gc(L, LUA_GCSTEP, _step_kb) != 0) {
+			// cycle done
+			_in_cycle = false;
+			_stats.cycles++;
+			_heap_after_cycle_kb = static_cast<size_t>(lua_gc(L, LUA_GCCOUNT, 0));
+			break;
+		}
+	} while (std::chrono::steady_clock::now() < deadline);
+
+	// finishing a cycle sets a new threshold, so it has to be stopped again
+	lua_gc(L, LUA_GCSTOP, 0);
+	_auto = false;
+
+	_stats.last_tick = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start);
+}
+
+void LuaGCPacer::checkPressure(lua_State* L) {
+	const auto heap_kb = static_cast<size_t>(lua_gc(L, LUA_GCCOUNT, 0));
+
+	// close to the allocator limit, luau does not collect on a failed allocation by itself
+	// but only once the heap grew by a margin since the last cycle, a live heap legitimately above 3/4
+	// would get a full collection after every event otherwise, that is left to the stepped cycles
+	if (_limit_kb != 0 && heap_kb > _limit_kb / 4 * 3 && heap_kb > _heap_after_cycle_kb + _limit_kb / 16) {
+		lua_gc(L, LUA_GCCOLLECT, 0);
+		lua_gc(L, LUA_GCSTOP, 0);
+		_in_cycle = false;
+		_heap_after_cycle_kb = static_cast<size_t>(lua_gc(L, LUA_GCCOUNT, 0));
+		_stats.full++;
+		return;
+	}
+
+	if (!_auto && heap_kb > goalKB() * 2) {
+		lua_gc(L, LUA_GCRESTART, 0);
+		_auto = true;
+		_stats.pressure++;
+	}
+}
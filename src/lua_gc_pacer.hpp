@@ -0,0 +1,53 @@
+#pragma once
+
+#include <lua.h>
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+
+// runs the gc of a state in small steps under a time budget, from the loop instead of during allocations
+// the automatic gc only comes back on if the heap runs away between steps (eg. in a flood)
+class LuaGCPacer {
+	std::chrono::microseconds _budget {1000};
+	int _goal {200}; // percent, a cycle starts once the heap grew this much since the last one ended
+	int _step_kb {16}; // work per LUA_GCSTEP call
+	size_t _min_heap_kb {1024}; // below this cycles are not worth it
+	size_t _limit_kb {0}; // allocator limit, full collections past 3/4 of it (every 1/16 of it the heap grows)
+
+	size_t _heap_after_cycle_kb {0};
+	bool _in_cycle {false};
+	bool _auto {false}; // automatic gc turned back on
+
+	public:
+		struct Stats {
+			uint64_t cycles {0};
+			uint64_t steps {0};
+			uint64_t pressure {0}; // times the automatic gc had to be turned back on
+			uint64_t full {0}; // full collections close to the memory limit
+			std::chrono::microseconds last_tick {0};
+		};
+
+	private:
+		Stats _stats;
+
+	public:
+		// takes over the gc of L, call once per state
+		void attach(lua_State* L);
+
+		// some gc work, for at most the budget
+		void step(lua_State* L);
+
+		// call after running lua, turns the automatic gc back on if the heap outgrew the goal by far
+		// and collects everything right away close to the limit
+		void checkPressure(lua_State* L);
+
+		void setBudget(std::chrono::microseconds budget) { _budget = budget; }
+		void setLimit(size_t limit_bytes) { _limit_kb = limit_bytes / 1024; }
+
+		const Stats& getStats(void) const { return _stats; }
+
+	private:
+		size_t goalKB(void) const;
+};
+
@@ -0,0 +1,283 @@
+#include "./lua_module_loader.hpp"
+
+#include "./solanaceae/mapped_file.hpp"
+
+#include <luacode.h>
+#include <lualib.h>
+#include <Luau/Bytecode.h>
+
+#if LUNATIX_LUAU_NATIVE
+#include <Luau/CodeGen.h>
+#endif
+
+#include <memory>
+#include <fstream>
+#include <iostream>
+#include <cstdio>
+
+// registry table, resolved path -> module result
+static constexpr const char* LOADED_MODULES_KEY = "_TLM_LOADED";
+
+// marks a module that is still running, to catch require cycles
+static constexpr const char* LOADING_SENTINEL = "_TLM_LOADING";
+
+// the root itself is empty, there is nothing to load
+static std::filesystem::path insideRoot(std::filesystem::path path) {
+	if (path.empty() || path.has_root_path() || *path.begin() == "..") {
+		return {};
+	}
+	return path;
+}
+
+static uint64_t fnv1a64(std::string_view data) {
+	uint64_t hash = 0xcbf29ce484222325ull;
+	for (const char c : data) {
+		hash ^= static_cast<uint8_t>(c);
+		hash *= 0x100000001b3ull;
+	}
+	return hash;
+}
+
+LuaModuleLoader::LuaModuleLoader(std::filesystem::path script_root, std::filesystem::path cache_dir) :
+	_script_root(std::move(script_root)),
+	_cache_dir(std::move(cache_dir))
+{
+	if (!_cache_dir.empty()) {
+		std::error_code ec;
+		std::filesystem::create_directories(_cache_dir, ec);
+		if (ec) {
+			std::cerr << "TLM waring: can not create bytecode cache " << _cache_dir << ", caching disabled\n";
+			_cache_dir.clear();
+		}
+	}
+}
+
+void LuaModuleLoader::install(lua_State* L) {
+	lua_newtable(L);
+	lua_setfield(L, LUA_REGISTRYINDEX, LOADED_MODULES_KEY);
+
+	lua_pushlightuserdata(L, this);
+	lua_pushcclosure(L, lua_require, "require", 1);
+	lua_setglobal(L, "require");
+}
+
+LuaModuleLoader::NativeMode LuaModuleLoader::setNativeMode(lua_State* L, NativeMode mode) {
+	if (mode == NativeMode::off) {
+		_native_mode = mode;
+		return _native_mode;
+	}
+
+#if LUNATIX_LUAU_NATIVE
+	if (!Luau::CodeGen::isSupported()) {
+		std::cerr << "TLM waring: luau native code generation not supported on this cpu, using the interpreter\n";
+		_native_mode = NativeMode::off;
+		return _native_mode;
+	}
+
+	Luau::CodeGen::create(L);
+	_native_mode = mode;
+#else
+	(void)L;
+	std::cerr << "TLM waring: built without LUNATIX_LUAU_NATIVE, using the interpreter\n";
+	_native_mode = NativeMode::off;
+#endif
+
+	return _native_mode;
+}
+
+bool LuaModuleLoader::loadFile(lua_State* L, const std::string& path) {
+	const auto full_path = _script_root / path;
+	_loaded_files.insert(full_path);
+
+	MappedFile source{full_path.string()};
+	if (!source.isOpen()) {
+		lua_pushfstring(L, "can not open %s", full_path.string().c_str());
+		return false;
+	}
+
+	const std::string chunk_name = "=" + path;
+	const auto cache_path = cachePath(source.view());
+
+	bool loaded {false};
+	if (!cache_path.empty()) {
+		// straight from the mapping, luau_load copies what it needs
+		MappedFile cached{cache_path.string()};
+		if (cached.isOpen() && !cached.empty()) {
+			if (luau_load(L, chunk_name.c_str(), reinterpret_cast<const char*>(cached.data()), cached.size(), 0) == 0) {
+				_stats.cache_hits++;
+				loaded = true;
+
+				// the mtime is the last use, for pruning
+				std::error_code ec;
+				std::filesystem::last_write_time(cache_path, std::filesystem::file_time_type::clock::now(), ec);
+				_cache_used.insert(cache_path.filename().string());
+			} else {
+				// a truncated or otherwise broken cache file, not the scripts fault
+				std::cerr << "TLM waring: dropping broken cached bytecode " << cache_path << ": " << lua_tostring(L, -1) << "\n";
+				lua_pop(L, 1);
+				cached = MappedFile{};
+				std::error_code ec;
+				std::filesystem::remove(cache_path, ec);
+			}
+		}
+	}
+
+	if (!loaded) {
+		const auto bytecode = compile(source.view(), cache_path);
+		if (luau_load(L, chunk_name.c_str(), bytecode.data(), bytecode.size(), 0) != 0) {
+			return false; // error message is on the stack
+		}
+	}
+
+#if LUNATIX_LUAU_NATIVE
+	if (_native_mode == NativeMode::all || (_native_mode == NativeMode::annotated && source.view().substr(0, 9) == "--!native")) {
+		// the chunk and all functions defined in it
+		Luau::CodeGen::compile(L, -1);
+		_stats.native++;
+	}
+#endif
+
+	return true;
+}
+
+std::filesystem::path LuaModuleLoader::resolve(std::string_view name) const {
+	std::string rel_path {name};
+	if (rel_path.size() < 4 || rel_path.substr(rel_path.size() - 4) != ".lua") {
+		for (auto& c : rel_path) {
+			if (c == '.') {
+				c = '/';
+			}
+		}
+
+		auto file_path = std::filesystem::path{rel_path + ".lua"};
+		if (!std::filesystem::exists(_script_root / file_path)) {
+			file_path = std::filesystem::path{rel_path} / "init.lua";
+		}
+		return insideRoot(file_path.lexically_normal());
+	}
+
+	return insideRoot(std::filesystem::path{rel_path}.lexically_normal());
+}
+
+void LuaModuleLoader::pruneCache(std::chrono::hours grace) {
+	if (_cache_dir.empty()) {
+		return;
+	}
+
+	const auto now = std::filesystem::file_time_type::clock::now();
+	std::error_code ec;
+	for (auto it = std::filesystem::directory_iterator{_cache_dir, ec}; !ec && it != std::filesystem::directory_iterator{}; it.increment(ec)) {
+		const auto& path = it->path();
+		const auto ext = path.extension();
+		if ((ext != ".luac" && ext != ".tmp") || _cache_used.count(path.filename().string())) {
+			continue;
+		}
+
+		std::error_code file_ec;
+		const auto mtime = std::filesystem::last_write_time(path, file_ec);
+		if (file_ec || now - mtime < grace) {
+			continue;
+		}
+
+		if (std::filesystem::remove(path, file_ec)) {
+			_stats.pruned++;
+		}
+	}
+
+	_cache_used.clear();
+}
+
+std::filesystem::path LuaModuleLoader::cachePath(std::string_view source) const {
+	if (_cache_dir.empty()) {
+		return {};
+	}
+
+	char name[64];
+	std::snprintf(name, sizeof(name), "%016llx-%zx-v%d.luac", static_cast<unsigned long long>(fnv1a64(source)), source.size(), int(LBC_VERSION_TARGET));
+	return _cache_dir / name;
+}
+
+std::string LuaModuleLoader::compile(std::string_view source, const std::filesystem::path& cache_path) {
+	size_t bytecode_size = 0;
+	std::unique_ptr<char, void(*)(void*)> bytecode {
+		luau_compile(source.data(), source.size(), nullptr, &bytecode_size),
+		std::free
+	};
+	_stats.compiled++;
+
+	std::string result {bytecode.get(), bytecode_size};
+
+	// first byte 0 means the bytecode is an encoded compile error, never cache those
+	if (!cache_path.empty() && !result.empty() && result.front() != 0) {
+		const auto tmp_path = cache_path.string() + ".tmp";
+		std::ofstream ofile{tmp_path, std::ios::binary | std::ios::trunc};
+		ofile.write(result.data(), result.size());
+		ofile.close();
+
+		// only complete files get a cache name, a short write would be loaded as is
+		std::error_code ec;
+		if (ofile.good()) {
+			std::filesystem::rename(tmp_path, cache_path, ec);
+		}
+		if (ofile.good() && !ec) {
+			_cache_used.insert(cache_path.filename().string());
+		}
+		if (!ofile.good() || ec) {
+			std::cerr << "TLM waring: can not write cached bytecode " << cache_path << "\n";
+			std::filesystem::remove(tmp_path, ec);
+		}
+	}
+
+	return result;
+}
+
+int LuaModuleLoader::lua_require(lua_State* L) {
+	auto* loader = static_cast<LuaModuleLoader*>(lua_tolightuserdata(L, lua_upvalueindex(1)));
+	const std::string name = luaL_checkstring(L, 1);
+
+	const auto rel_path = loader->resolve(name).generic_string();
+	if (rel_path.empty()) {
+		luaL_errorL(L, "module '%s' is outside the script root", name.c_str());
+	}
+
+	lua_getfield(L, LUA_REGISTRYINDEX, LOADED_MODULES_KEY);
+	const int loaded_idx = lua_gettop(L);
+
+	lua_getfield(L, loaded_idx, rel_path.c_str());
+	if (!lua_isnil(L, -1)) {
+		if (lua_isstring(L, -1) && std::string_view{lua_tostring(L, -1)} == LOADING_SENTINEL) {
+			luaL_errorL(L, "require cycle while loading '%s'", rel_path.c_str());
+		}
+		return 1; // memoized
+	}
+	lua_pop(L, 1);
+
+	lua_pushstring(L, LOADING_SENTINEL);
+	lua_setfield(L, loaded_idx, rel_path.c_str());
+
+	if (!loader->loadFile(L, rel_path)) {
+		// unmark, so a fixed file can be required again
+		lua_pushnil(L);
+		lua_setfield(L, loaded_idx, rel_path.c_str());
+		luaL_errorL(L, "error loading module '%s': %s", name.c_str(), lua_tostring(L, -1));
+	}
+
+	const int status = lua_pcall(L, 0, 1, 0);
+	if (status != LUA_OK) {
+		lua_pushnil(L);
+		lua_setfield(L, loaded_idx, rel_path.c_str());
+		lua_error(L); // rethrow
+	}
+
+	// modules without a result still only run once
+	if (lua_isnil(L, -1)) {
+		lua_pop(L, 1);
+		lua_pushboolean(L, true);
+	}
+
+	lua_pushvalue(L, -1);
+	lua_setfield(L, loaded_idx, rel_path.c_str());
+
+	return 1;
+}
+
@@ -0,0 +1,84 @@
+#pragma once
+
+#include <lua.h>
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <set>
+#include <utility>
+#include <filesystem>
+#include <chrono>
+
+// compiles and runs script files, provides require()
+// modules resolve relative to the script root and run once, their results are memoized in the registry
+// bytecode is cached on disk, keyed by source hash and bytecode version
+// cached bytecode is loaded straight from the mapped file, a broken one is dropped and compiled again
+class LuaModuleLoader {
+	std::filesystem::path _script_root;
+	std::filesystem::path _cache_dir; // empty disables the disk cache
+
+	public:
+		struct Stats {
+			uint64_t compiled {0};
+			uint64_t cache_hits {0};
+			uint64_t native {0}; // modules compiled to native code
+			uint64_t pruned {0}; // cache files removed
+		};
+
+		enum class NativeMode {
+			off,
+			annotated, // only modules starting with a --!native comment
+			all,
+		};
+
+	private:
+		Stats _stats;
+		NativeMode _native_mode {NativeMode::off};
+
+		// every file loadFile() was asked for, so they can be watched
+		std::set<std::filesystem::path> _loaded_files;
+
+		// cache file names used since the last pruneCache()
+		std::set<std::string> _cache_used;
+
+	public:
+		LuaModuleLoader(std::filesystem::path script_root, std::filesystem::path cache_dir);
+
+		// sets the global require, once per state
+		void install(lua_State* L);
+
+		// needs a build with LUNATIX_LUAU_NATIVE and a supported cpu, falls back to off otherwise
+		// call once per state, before loading anything
+		NativeMode setNativeMode(lua_State* L, NativeMode mode);
+		NativeMode getNativeMode(void) const { return _native_mode; }
+
+		// pushes the compiled chunk of path (relative to the script root) as a function
+		// on error, pushes the error message and returns false
+		bool loadFile(lua_State* L, const std::string& path);
+
+		// "foo.bar" -> <root>/foo/bar.lua (or <root>/foo/bar/init.lua)
+		// empty if it would leave the script root ("../x.lua", absolute paths)
+		std::filesystem::path resolve(std::string_view name) const;
+
+		// removes cached bytecode not used since the last call, unless it was used within grace
+		// (the workers and other processes might share the directory), call once everything is loaded
+		void pruneCache(std::chrono::hours grace);
+
+		const std::filesystem::path& getScriptRoot(void) const { return _script_root; }
+		const std::filesystem::path& getCacheDir(void) const { return _cache_dir; }
+		const Stats& getStats(void) const { return _stats; }
+
+		// the files loaded since the last call, including ones that failed to load
+		std::set<std::filesystem::path> takeLoadedFiles(void) { return std::exchange(_loaded_files, {}); }
+
+	private:
+		// the cache file for source, empty if caching is disabled
+		std::filesystem::path cachePath(std::string_view source) const;
+		// compiles and caches it, unless cache_path is empty
+		// on compile errors, this is the luau encoded error
+		std::string compile(std::string_view source, const std::filesystem::path& cache_path);
+
+		static int lua_require(lua_State* L);
+};
+
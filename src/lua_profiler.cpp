@@ -0,0 +1,120 @@
+#include "./lua_profiler.hpp"
+
+#include <fstream>
+#include <iostream>
+
+// deeper stacks get cut at the outer end
+static constexpr int max_depth = 64;
+
+static int64_t nowNs(void) {
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+LuaProfiler::~LuaProfiler(void) {
+	stop();
+}
+
+void LuaProfiler::start(std::chrono::microseconds interval) {
+	if (running()) {
+		stop();
+	}
+
+	_interval = interval.count() > 0 ? interval : std::chrono::microseconds{1000};
+	_stop = false;
+	_thread = std::thread(&LuaProfiler::timerThread, this);
+}
+
+void LuaProfiler::stop(void) {
+	if (!running()) {
+		return;
+	}
+
+	{
+		std::lock_guard lock{_mutex};
+		_stop = true;
+	}
+	_cv.notify_one();
+	_thread.join();
+
+	_due.store(0, std::memory_order_relaxed);
+}
+
+void LuaProfiler::timerThread(void) {
+	std::unique_lock lock{_mutex};
+	while (!_cv.wait_for(lock, _interval, [this] { return _stop; })) {
+		_due.store(nowNs(), std::memory_order_relaxed);
+	}
+}
+
+void LuaProfiler::sample(lua_State* L, int gc) {
+	const int64_t due = _due.exchange(0, std::memory_order_relaxed);
+	if (due == 0) {
+		return;
+	}
+
+	// lua was not running when it became due, the sample would blame whatever runs next
+	if (nowNs() - due > 2 * std::chrono::duration_cast<std::chrono::nanoseconds>(_interval).count()) {
+		_dropped++;
+		return;
+	}
+
+	// innermost frame first, the strings are reused between samples
+	lua_Debug ar;
+	int depth = 0;
+	for (; depth < max_depth && lua_getinfo(L, depth, "sn", &ar); depth++) {
+		if (_frame_buffer.size() <= size_t(depth)) {
+			_frame_buffer.emplace_back();
+		}
+		std::string& frame = _frame_buffer[depth];
+		frame = ar.short_src != nullptr ? ar.short_src : "?";
+		frame += ":";
+		frame += std::to_string(ar.linedefined);
+		frame += ":";
+		frame += ar.name != nullptr ? ar.name : "anonymous";
+	}
+
+	_stack_buffer.clear();
+	for (int i = depth-1; i >= 0; i--) {
+		_stack_buffer += _frame_buffer[i];
+		if (i != 0) {
+			_stack_buffer += ";";
+		}
+	}
+	if (gc >= 0) {
+		_stack_buffer += _stack_buffer.empty() ? "[gc]" : ";[gc]";
+	}
+	if (_stack_buffer.empty()) {
+		_stack_buffer = "[unknown]";
+	}
+
+	_stacks[_stack_buffer]++;
+	_samples++;
+}
+
+std::string LuaProfiler::folded(void) const {
+	std::string out;
+	for (const auto& [stack, count] : _stacks) {
+		out += stack;
+		out += " ";
+		out += std::to_string(count);
+		out += "\n";
+	}
+	return out;
+}
+
+bool LuaProfiler::writeFolded(const std::string& path) const {
+	std::ofstream file{path, std::ios::trunc};
+	file << folded();
+	if (!file) {
+		std::cerr << "TLM error, failed writing profile to " << path << "\n";
+		return false;
+	}
+	return true;
+}
+
+void LuaProfiler::reset(void) {
+	_stacks.clear();
+	_samples = 0;
+	_dropped = 0;
+}
+
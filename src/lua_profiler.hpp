@@ -0,0 +1,66 @@
+#pragma once
+
+#include <lua.h>
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+
+// sampling profiler for a single lua state
+// a timer thread marks a sample as due, the next interrupt of the state takes it
+// stacks get aggregated until reset, output is folded stacks for flamegraph tools
+class LuaProfiler {
+	// steady clock ns of when the sample became due, 0 if none
+	std::atomic<int64_t> _due {0};
+
+	std::thread _thread;
+	std::mutex _mutex;
+	std::condition_variable _cv;
+	bool _stop {false}; // guarded by _mutex
+
+	std::chrono::microseconds _interval {1000};
+
+	// folded stack -> samples, only touched on the lua thread
+	std::unordered_map<std::string, uint64_t> _stacks;
+	uint64_t _samples {0};
+	uint64_t _dropped {0}; // due while no lua was running
+	std::vector<std::string> _frame_buffer;
+	std::string _stack_buffer;
+
+	public:
+		LuaProfiler(void) = default;
+		~LuaProfiler(void);
+
+		LuaProfiler(const LuaProfiler&) = delete;
+		LuaProfiler& operator=(const LuaProfiler&) = delete;
+
+		void start(std::chrono::microseconds interval);
+		void stop(void);
+		bool running(void) const { return _thread.joinable(); }
+
+		// call from the states interrupt callback, does nothing unless a sample is due
+		void interrupt(lua_State* L, int gc) {
+			if (_due.load(std::memory_order_relaxed) != 0) {
+				sample(L, gc);
+			}
+		}
+
+		uint64_t samples(void) const { return _samples; }
+		uint64_t dropped(void) const { return _dropped; }
+
+		// "frame;frame;frame count" lines, outermost frame first
+		std::string folded(void) const;
+		bool writeFolded(const std::string& path) const;
+		void reset(void);
+
+	private:
+		void sample(lua_State* L, int gc);
+		void timerThread(void);
+};
+
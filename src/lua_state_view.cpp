@@ -0,0 +1,364 @@
+#include "./lua_state_view.hpp"
+
+#include "./tox_state_cache.hpp"
+
+#include <lualib.h>
+
+#include <string_view>
+#include <iterator>
+
+// userdata tag, next to the ByteView one
+static constexpr int STATE_VIEW_TAG = 43;
+static constexpr const char* STATE_VIEW_MT = "StateView";
+
+namespace {
+
+struct StateView {
+	enum class Kind : uint8_t {
+		friends,
+		friend_state,
+		groups,
+		group,
+		group_peers,
+		group_peer,
+		conferences,
+		conference,
+		conference_peers,
+	};
+
+	ToxStateCache* cache {nullptr};
+	Kind kind {Kind::friends};
+	uint32_t number {0}; // friend, group or conference
+	uint32_t peer {0};
+};
+
+} // namespace
+
+static void pushStateView(lua_State* L, ToxStateCache* cache, StateView::Kind kind, uint32_t number = 0, uint32_t peer = 0) {
+	auto* view = static_cast<StateView*>(lua_newuserdatatagged(L, sizeof(StateView), STATE_VIEW_TAG));
+	view->cache = cache;
+	view->kind = kind;
+	view->number = number;
+	view->peer = peer;
+
+	luaL_getmetatable(L, STATE_VIEW_MT);
+	lua_setmetatable(L, -2);
+}
+
+static const StateView& checkStateView(lua_State* L, int idx) {
+	const auto* view = static_cast<const StateView*>(lua_touserdatatagged(L, idx, STATE_VIEW_TAG));
+	if (view == nullptr) {
+		luaL_typeerror(L, idx, STATE_VIEW_MT);
+	}
+	return *view;
+}
+
+static bool isCollection(StateView::Kind kind) {
+	switch (kind) {
+		case StateView::Kind::friends:
+		case StateView::Kind::groups:
+		case StateView::Kind::group_peers:
+		case StateView::Kind::conferences:
+		case StateView::Kind::conference_peers:
+			return true;
+		default:
+			return false;
+	}
+}
+
+// the element of a collection, nil if it does not exist (anymore)
+static void pushElement(lua_State* L, const StateView& view, uint32_t key) {
+	auto& cache = *view.cache;
+	switch (view.kind) {
+		case StateView::Kind::friends:
+			if (cache.getFriend(key) != nullptr) {
+				pushStateView(L, view.cache, StateView::Kind::friend_state, key);
+				return;
+			}
+			break;
+		case StateView::Kind::groups:
+			if (cache.getGroup(key) != nullptr) {
+				pushStateView(L, view.cache, StateView::Kind::group, key);
+				return;
+			}
+			break;
+		case StateView::Kind::group_peers:
+			if (cache.getGroupPeer(view.number, key) != nullptr) {
+				pushStateView(L, view.cache, StateView::Kind::group_peer, view.number, key);
+				return;
+			}
+			break;
+		case StateView::Kind::conferences:
+			if (cache.getConference(key) != nullptr) {
+				pushStateView(L, view.cache, StateView::Kind::conference, key);
+				return;
+			}
+			break;
+		case StateView::Kind::conference_peers:
+			if (const auto* conference = cache.getConference(view.number); conference != nullptr) {
+				if (const auto it = conference->peer_names.find(key); it != conference->peer_names.end()) {
+					lua_pushlstring(L, it->second.data(), it->second.size());
+					return;
+				}
+			}
+			break;
+		default:
+			break;
+	}
+	lua_pushnil(L);
+}
+
+static void pushString(lua_State* L, const std::string& str) {
+	lua_pushlstring(L, str.data(), str.size());
+}
+
+template<typename T>
+static void pushOptionalNumber(lua_State* L, const std::optional<T>& value) {
+	if (value.has_value()) {
+		lua_pushnumber(L, static_cast<double>(value.value()));
+	} else {
+		lua_pushnil(L);
+	}
+}
+
+// one field of an element view, false if there is no such field
+static bool pushField(lua_State* L, const StateView& view, std::string_view field) {
+	auto& cache = *view.cache;
+	switch (view.kind) {
+		case StateView::Kind::friend_state: {
+			const auto* f = cache.getFriend(view.number);
+			if (f == nullptr) {
+				return false;
+			}
+			if (field == "friend_number") { lua_pushnumber(L, view.number); }
+			else if (field == "name") { pushString(L, f->name); }
+			else if (field == "status_message") { pushString(L, f->status_message); }
+			else if (field == "status") { lua_pushnumber(L, f->status); }
+			else if (field == "connection_status") { lua_pushnumber(L, f->connection_status); }
+			else if (field == "typing") { lua_pushboolean(L, f->typing); }
+			else { return false; }
+			return true;
+		}
+		case StateView::Kind::group: {
+			const auto* group = cache.getGroup(view.number);
+			if (group == nullptr) {
+				return false;
+			}
+			if (field == "group_number") { lua_pushnumber(L, view.number); }
+			else if (field == "name") { pushString(L, group->name); }
+			else if (field == "topic") { pushString(L, group->topic); }
+			else if (field == "self_peer_id") { lua_pushnumber(L, group->self_peer_id); }
+			else if (field == "self_role") { lua_pushnumber(L, group->self_role); }
+			else if (field == "privacy_state") { pushOptionalNumber(L, group->privacy_state); }
+			else if (field == "voice_state") { pushOptionalNumber(L, group->voice_state); }
+			else if (field == "topic_lock") { pushOptionalNumber(L, group->topic_lock); }
+			else if (field == "peer_limit") { pushOptionalNumber(L, group->peer_limit); }
+			else if (field == "peers") { pushStateView(L, view.cache, StateView::Kind::group_peers, view.number); }
+			else { return false; }
+			return true;
+		}
+		case StateView::Kind::group_peer: {
+			const auto* peer = cache.getGroupPeer(view.number, view.peer);
+			if (peer == nullptr) {
+				return false;
+			}
+			if (field == "group_number") { lua_pushnumber(L, view.number); }
+			else if (field == "peer_id") { lua_pushnumber(L, view.peer); }
+			else if (field == "name") { pushString(L, peer->name); }
+			else if (field == "status") { lua_pushnumber(L, peer->status); }
+			else if (field == "role") { lua_pushnumber(L, peer->role); }
+			else { return false; }
+			return true;
+		}
+		case StateView::Kind::conference: {
+			const auto* conference = cache.getConference(view.number);
+			if (conference == nullptr) {
+				return false;
+			}
+			if (field == "conference_number") { lua_pushnumber(L, view.number); }
+			else if (field == "title") { pushString(L, conference->title); }
+			else if (field == "connected") { lua_pushboolean(L, conference->connected); }
+			else if (field == "peers") { pushStateView(L, view.cache, StateView::Kind::conference_peers, view.number); }
+			else { return false; }
+			return true;
+		}
+		default:
+			return false;
+	}
+}
+
+static int lua_stateview_index(lua_State* L) {
+	const auto& view = checkStateView(L, 1);
+
+	if (isCollection(view.kind)) {
+		if (lua_type(L, 2) == LUA_TNUMBER) {
+			pushElement(L, view, static_cast<uint32_t>(lua_tonumber(L, 2)));
+		} else {
+			lua_pushnil(L);
+		}
+		return 1;
+	}
+
+	size_t field_len = 0;
+	const char* field = lua_tolstring(L, 2, &field_len);
+	if (field == nullptr || !pushField(L, view, {field, field_len})) {
+		lua_pushnil(L);
+	}
+	return 1;
+}
+
+static int lua_stateview_newindex(lua_State* L) {
+	luaL_errorL(L, "StateView is read only, use the TOX functions to change things");
+}
+
+static int lua_stateview_len(lua_State* L) {
+	const auto& view = checkStateView(L, 1);
+	auto& cache = *view.cache;
+
+	size_t size = 0;
+	switch (view.kind) {
+		case StateView::Kind::friends: size = cache.friends().size(); break;
+		case StateView::Kind::groups: size = cache.groups().size(); break;
+		case StateView::Kind::conferences: size = cache.conferences().size(); break;
+		case StateView::Kind::group_peers: {
+			const auto* group = cache.getGroup(view.number);
+			size = group != nullptr ? group->peers.size() : 0;
+			break;
+		}
+		case StateView::Kind::conference_peers: {
+			const auto* conference = cache.getConference(view.number);
+			size = conference != nullptr ? conference->peer_names.size() : 0;
+			break;
+		}
+		default:
+			break;
+	}
+
+	lua_pushinteger(L, static_cast<int>(size));
+	return 1;
+}
+
+// the key after the one at idx (nil for the first), the map has no order, but it is stable while nothing changes
+// removing the current key while iterating ends the iteration
+template<typename Map>
+static bool nextKey(lua_State* L, const Map* map, int idx, uint32_t& key) {
+	if (map == nullptr) {
+		return false;
+	}
+
+	auto it = map->begin();
+	if (!lua_isnil(L, idx)) {
+		it = map->find(static_cast<uint32_t>(lua_tonumber(L, idx)));
+		if (it != map->end()) {
+			it = std::next(it);
+		}
+	}
+	if (it == map->end()) {
+		return false;
+	}
+
+	key = it->first;
+	return true;
+}
+
+// (view, key) -> next key, element
+static int lua_stateview_next(lua_State* L) {
+	const auto& view = checkStateView(L, 1);
+	auto& cache = *view.cache;
+
+	uint32_t key = 0;
+	bool found = false;
+	switch (view.kind) {
+		case StateView::Kind::friends: found = nextKey(L, &cache.friends(), 2, key); break;
+		case StateView::Kind::groups: found = nextKey(L, &cache.groups(), 2, key); break;
+		case StateView::Kind::conferences: found = nextKey(L, &cache.conferences(), 2, key); break;
+		case StateView::Kind::group_peers: {
+			const auto* group = cache.getGroup(view.number);
+			found = nextKey(L, group != nullptr ? &group->peers : nullptr, 2, key);
+			break;
+		}
+		case StateView::Kind::conference_peers: {
+			const auto* conference = cache.getConference(view.number);
+			found = nextKey(L, conference != nullptr ? &conference->peer_names : nullptr, 2, key);
+			break;
+		}
+		default:
+			break;
+	}
+
+	if (!found) {
+		lua_pushnil(L);
+		return 1;
+	}
+
+	lua_pushnumber(L, key);
+	pushElement(L, view, key);
+	return 2;
+}
+
+static int lua_stateview_iter(lua_State* L) {
+	const auto& view = checkStateView(L, 1);
+	if (!isCollection(view.kind)) {
+		luaL_errorL(L, "StateView is not a collection");
+	}
+
+	lua_pushcfunction(L, lua_stateview_next, "StateView.next");
+	lua_pushvalue(L, 1);
+	lua_pushnil(L);
+	return 3;
+}
+
+static int lua_stateview_tostring(lua_State* L) {
+	const auto& view = checkStateView(L, 1);
+	switch (view.kind) {
+		case StateView::Kind::friends: lua_pushliteral(L, "StateView(friends)"); break;
+		case StateView::Kind::friend_state: lua_pushfstring(L, "StateView(friend %u)", view.number); break;
+		case StateView::Kind::groups: lua_pushliteral(L, "StateView(groups)"); break;
+		case StateView::Kind::group: lua_pushfstring(L, "StateView(group %u)", view.number); break;
+		case StateView::Kind::group_peers: lua_pushfstring(L, "StateView(group %u peers)", view.number); break;
+		case StateView::Kind::group_peer: lua_pushfstring(L, "StateView(group %u peer %u)", view.number, view.peer); break;
+		case StateView::Kind::conferences: lua_pushliteral(L, "StateView(conferences)"); break;
+		case StateView::Kind::conference: lua_pushfstring(L, "StateView(conference %u)", view.number); break;
+		case StateView::Kind::conference_peers: lua_pushfstring(L, "StateView(conference %u peers)", view.number); break;
+	}
+	return 1;
+}
+
+void registerStateView(lua_State* L) {
+	luaL_newmetatable(L, STATE_VIEW_MT);
+
+	lua_pushcfunction(L, lua_stateview_index, "StateView.__index");
+	lua_setfield(L, -2, "__index");
+
+	lua_pushcfunction(L, lua_stateview_newindex, "StateView.__newindex");
+	lua_setfield(L, -2, "__newindex");
+
+	lua_pushcfunction(L, lua_stateview_len, "StateView.__len");
+	lua_setfield(L, -2, "__len");
+
+	lua_pushcfunction(L, lua_stateview_iter, "StateView.__iter");
+	lua_setfield(L, -2, "__iter");
+
+	lua_pushcfunction(L, lua_stateview_tostring, "StateView.__tostring");
+	lua_setfield(L, -2, "__tostring");
+
+	lua_pushstring(L, STATE_VIEW_MT);
+	lua_setfield(L, -2, "__type");
+
+	lua_setreadonly(L, -1, true);
+	lua_pop(L, 1);
+}
+
+void setStateViews(lua_State* L, int idx, ToxStateCache& cache) {
+	idx = lua_absindex(L, idx);
+
+	pushStateView(L, &cache, StateView::Kind::friends);
+	lua_setfield(L, idx, "friends");
+
+	pushStateView(L, &cache, StateView::Kind::groups);
+	lua_setfield(L, idx, "groups");
+
+	pushStateView(L, &cache, StateView::Kind::conferences);
+	lua_setfield(L, idx, "conferences");
+}
+
@@ -0,0 +1,17 @@
+#pragma once
+
+#include <lua.h>
+
+// fwd
+class ToxStateCache;
+
+// read only lua views into the ToxStateCache, fields are read from the cache on every access
+// TLM.friends[n].name, TLM.groups[g].peers[p].role, TLM.conferences[c].peers[p] (the name)
+// the collections support # and generalized iteration (for n, f in TLM.friends do)
+
+// registers the StateView metatable, once per lua state
+void registerStateView(lua_State* L);
+
+// sets friends, groups and conferences on the table at idx
+void setStateViews(lua_State* L, int idx, ToxStateCache& cache);
+
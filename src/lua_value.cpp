@@ -0,0 +1,92 @@
+#include "./lua_value.hpp"
+
+#include "./lua_byte_view.hpp"
+
+#include <lualib.h>
+
+LuaValue LuaValue::from(lua_State* L, int idx, int depth) {
+	idx = lua_absindex(L, idx);
+
+	LuaValue value;
+	switch (lua_type(L, idx)) {
+		case LUA_TBOOLEAN:
+			value.type = Type::boolean;
+			value.boolean = lua_toboolean(L, idx);
+			break;
+		case LUA_TNUMBER:
+			value.type = Type::number;
+			value.number = lua_tonumber(L, idx);
+			break;
+		case LUA_TSTRING: {
+			size_t len = 0;
+			const char* str = lua_tolstring(L, idx, &len);
+			value.type = Type::string;
+			value.str.assign(str, len);
+			break;
+		}
+		case LUA_TUSERDATA: {
+			const auto* view = toByteView(L, idx);
+			if (view != nullptr && view->valid()) {
+				value.type = Type::bytes;
+				value.str.assign(reinterpret_cast<const char*>(view->data), view->size);
+			}
+			break;
+		}
+		case LUA_TTABLE: {
+			if (depth >= max_depth) {
+				break;
+			}
+			luaL_checkstack(L, 2, "copying table");
+
+			value.type = Type::table;
+			lua_pushnil(L);
+			while (lua_next(L, idx) != 0) {
+				auto key = from(L, -2, depth + 1);
+				if (key.type != Type::nil) {
+					value.table.emplace_back(std::move(key), from(L, -1, depth + 1));
+				}
+				lua_pop(L, 1);
+			}
+			break;
+		}
+		default:
+			break;
+	}
+
+	return value;
+}
+
+void LuaValue::push(lua_State* L, bool bytes_as_view) const {
+	luaL_checkstack(L, 3, "pushing value");
+
+	switch (type) {
+		case Type::nil:
+			lua_pushnil(L);
+			break;
+		case Type::boolean:
+			lua_pushboolean(L, boolean);
+			break;
+		case Type::number:
+			lua_pushnumber(L, number);
+			break;
+		case Type::string:
+			lua_pushlstring(L, str.data(), str.size());
+			break;
+		case Type::bytes:
+			if (bytes_as_view) {
+				pushByteView(L, reinterpret_cast<const uint8_t*>(str.data()), str.size());
+			} else {
+				lua_pushlstring(L, str.data(), str.size());
+			}
+			break;
+		case Type::table:
+			lua_createtable(L, 0, static_cast<int>(table.size()));
+			for (const auto& [key, val] : table) {
+				key.push(L, bytes_as_view);
+				val.push(L, bytes_as_view);
+				lua_rawset(L, -3);
+			}
+			break;
+	}
+}
+
@@ -0,0 +1,37 @@
+#pragma once
+
+#include <lua.h>
+
+#include <string>
+#include <vector>
+#include <utility>
+#include <cstdint>
+
+// owning copy of plain lua data, to move values between states living on different threads
+// anything that is not plain data (functions, userdata, threads) becomes nil
+struct LuaValue {
+	enum class Type : uint8_t {
+		nil,
+		boolean,
+		number,
+		string,
+		bytes, // from a ByteView
+		table,
+	};
+
+	Type type {Type::nil};
+	bool boolean {false};
+	double number {0.0};
+	std::string str; // string and bytes
+	std::vector<std::pair<LuaValue, LuaValue>> table;
+
+	// tables nested deeper than this (or cyclic) get cut off
+	static constexpr int max_depth {32};
+
+	static LuaValue from(lua_State* L, int idx, int depth = 0);
+
+	// with bytes_as_view, bytes are pushed as a ByteView into this value,
+	// which is only valid while this value lives and until ByteView::expireAll()
+	void push(lua_State* L, bool bytes_as_view = true) const;
+};
+
@@ -0,0 +1,283 @@
+#include "./lua_worker_pool.hpp"
+
+#include "./lua_byte_view.hpp"
+
+#include <lualib.h>
+
+#include <stdexcept>
+#include <iostream>
+#include <chrono>
+
+LuaWorkerPool::LuaWorkerPool(
+	size_t count,
+	const std::string& script,
+	const std::filesystem::path& script_root,
+	const std::filesystem::path& cache_dir,
+	LuaModuleLoader::NativeMode native_mode,
+	size_t memory_limit
+) {
+	// load sequentially, the loaders share the bytecode cache
+	for (size_t i = 0; i < count; i++) {
+		auto& w = *_workers.emplace_back(std::make_unique<Worker>(script_root, cache_dir));
+		w.pool = this;
+		w.id = i;
+		w.state.reset(LuaAllocator::newState(memory_limit));
+		if (!w.state) {
+			throw std::runtime_error{"failed to create a lua state"};
+		}
+
+		auto* L = w.state.get();
+		luaL_openlibs(L);
+		registerByteView(L);
+		w.loader.install(L);
+		w.loader.setNativeMode(L, native_mode);
+
+		// TOX proxy, every method call gets queued to the tox thread
+		lua_newtable(L);
+		lua_newtable(L); // metatable
+		lua_pushlightuserdata(L, &w);
+		lua_pushcclosure(L, lua_tox_index, "TOX.__index", 1);
+		lua_setfield(L, -2, "__index");
+		lua_setmetatable(L, -2);
+		lua_setglobal(L, "TOX");
+
+		lua_pushnumber(L, static_cast<double>(i));
+		lua_setglobal(L, "TLM_WORKER_ID");
+		lua_pushnumber(L, static_cast<double>(count));
+		lua_setglobal(L, "TLM_WORKER_COUNT");
+
+		if (!w.loader.loadFile(L, script) || lua_pcall(L, 0, 0, 0) != LUA_OK) {
+			throw std::runtime_error{script + ": " + lua_tostring(L, -1)};
+		}
+	}
+
+	if (!_workers.empty()) {
+		auto* L = _workers.front()->state.get();
+		lua_getglobal(L, "TOX_EVENTS");
+		if (lua_istable(L, -1)) {
+			lua_pushnil(L);
+			while (lua_next(L, -2) != 0) {
+				if (lua_type(L, -2) == LUA_TSTRING && lua_isfunction(L, -1)) {
+					_handled_events.emplace_back(lua_tostring(L, -2));
+				}
+				lua_pop(L, 1);
+			}
+		}
+		lua_pop(L, 1);
+	}
+
+	_running = _workers.size();
+	for (auto& w : _workers) {
+		w->thread = std::thread(&LuaWorkerPool::workerThread, this, std::ref(*w));
+	}
+}
+
+LuaWorkerPool::~LuaWorkerPool(void) {
+	_stop = true;
+	for (auto& w : _workers) {
+		{ // so the flag can not slip between predicate check and wait
+			std::lock_guard lock{w->mutex};
+		}
+		w->events_cv.notify_all();
+	}
+
+	// workers might be blocked on a TOX call
+	while (_running > 0) {
+		failCommands("shutting down");
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+	failCommands("shutting down");
+
+	for (auto& w : _workers) {
+		if (w->thread.joinable()) {
+			w->thread.join();
+		}
+	}
+}
+
+void LuaWorkerPool::setWakeCallback(std::function<void(void)>&& fn) {
+	std::lock_guard lock{_wake_mutex};
+	_wake_main = std::move(fn);
+}
+
+void LuaWorkerPool::dispatch(Event&& event) {
+	if (_workers.empty()) {
+		return;
+	}
+
+	auto& w = *_workers[event.key % _workers.size()];
+	{
+		std::lock_guard lock{w.mutex};
+		w.events.emplace_back(std::move(event));
+	}
+	w.events_cv.notify_one();
+
+	_stats.events++;
+}
+
+size_t LuaWorkerPool::runCommands(lua_State* L) {
+	return _commands.drain([this, L](Command&& cmd) {
+		std::vector<LuaValue> results;
+		std::string error;
+
+		const int top = lua_gettop(L);
+		lua_getglobal(L, "TOX");
+		lua_getfield(L, -1, cmd.method.c_str());
+		if (!lua_isfunction(L, -1)) {
+			error = "TOX has no function " + cmd.method;
+		} else {
+			lua_pushvalue(L, top+1); // self
+			for (const auto& arg : cmd.args) {
+				arg.push(L);
+			}
+			if (lua_pcall(L, static_cast<int>(cmd.args.size()) + 1, LUA_MULTRET, 0) != LUA_OK) {
+				const char* msg = lua_tostring(L, -1);
+				error = msg != nullptr ? msg : "unknown error";
+			} else {
+				for (int i = top+2; i <= lua_gettop(L); i++) {
+					results.push_back(LuaValue::from(L, i));
+				}
+			}
+		}
+		ByteView::expireAll(); // views into cmd.args
+		lua_settop(L, top);
+
+		_stats.tox_calls++;
+
+		auto& w = *cmd.worker;
+		{
+			std::lock_guard lock{w.mutex};
+			w.call_results = std::move(results);
+			w.call_error = std::move(error);
+			w.call_done = true;
+		}
+		w.call_cv.notify_one();
+	});
+}
+
+void LuaWorkerPool::workerThread(Worker& w) {
+	while (true) {
+		Event event;
+		{
+			std::unique_lock lock{w.mutex};
+			w.events_cv.wait(lock, [this, &w]() { return _stop || !w.events.empty(); });
+			if (_stop) {
+				break;
+			}
+			event = std::move(w.events.front());
+			w.events.pop_front();
+		}
+
+		handleEvent(w, event);
+	}
+
+	_running--;
+}
+
+void LuaWorkerPool::handleEvent(Worker& w, const Event& event) {
+	auto* L = w.state.get();
+	const int top = lua_gettop(L);
+
+	lua_getglobal(L, "TOX_EVENTS");
+	if (!lua_istable(L, -1)) {
+		lua_settop(L, top);
+		return;
+	}
+
+	lua_getfield(L, -1, event.name);
+	if (!lua_isfunction(L, -1)) {
+		lua_settop(L, top);
+		return;
+	}
+
+	for (const auto& arg : event.args) {
+		arg.push(L);
+	}
+
+	if (lua_pcall(L, static_cast<int>(event.args.size()), 0, 0) != LUA_OK) {
+		std::cerr << "TLM error, worker " << w.id << " " << event.name << " callback failed " << lua_tostring(L, -1) << "\n";
+	}
+	ByteView::expireAll(); // views into event.args
+
+	lua_settop(L, top);
+}
+
+void LuaWorkerPool::wakeMain(void) {
+	std::lock_guard lock{_wake_mutex};
+	if (_wake_main) {
+		_wake_main();
+	}
+}
+
+void LuaWorkerPool::failCommands(const char* reason) {
+	_commands.drain([reason](Command&& cmd) {
+		auto& w = *cmd.worker;
+		{
+			std::lock_guard lock{w.mutex};
+			w.call_results.clear();
+			w.call_error = reason;
+			w.call_done = true;
+		}
+		w.call_cv.notify_one();
+	});
+}
+
+int LuaWorkerPool::lua_tox_index(lua_State* L) {
+	// (TOX, name), creates the forwarding function and caches it in TOX
+	luaL_checkstring(L, 2);
+
+	lua_pushvalue(L, lua_upvalueindex(1)); // worker
+	lua_pushvalue(L, 2);
+	lua_pushcclosure(L, lua_tox_call, "TOX call", 2);
+
+	lua_pushvalue(L, 2);
+	lua_pushvalue(L, -2);
+	lua_rawset(L, 1);
+
+	return 1;
+}
+
+int LuaWorkerPool::lua_tox_call(lua_State* L) {
+	auto* w = static_cast<Worker*>(lua_tolightuserdata(L, lua_upvalueindex(1)));
+	auto* pool = w->pool;
+
+	if (pool->_stop) {
+		luaL_errorL(L, "TOX call while shutting down");
+	}
+
+	Command cmd;
+	cmd.method = lua_tostring(L, lua_upvalueindex(2));
+	cmd.worker = w;
+	// arg 1 is TOX itself (method call syntax)
+	for (int i = 2; i <= lua_gettop(L); i++) {
+		cmd.args.push_back(LuaValue::from(L, i));
+	}
+
+	{
+		std::lock_guard lock{w->mutex};
+		w->call_done = false;
+	}
+	pool->_commands.push(std::move(cmd));
+	pool->wakeMain();
+
+	std::vector<LuaValue> results;
+	std::string error;
+	{
+		std::unique_lock lock{w->mutex};
+		w->call_cv.wait(lock, [w]() { return w->call_done; });
+		results = std::move(w->call_results);
+		error = std::move(w->call_error);
+	}
+
+	if (!error.empty()) {
+		luaL_errorL(L, "%s", error.c_str());
+	}
+
+	for (const auto& res : results) {
+		// results die with this call, so no views
+		res.push(L, false);
+	}
+
+	return static_cast<int>(results.size());
+}
+
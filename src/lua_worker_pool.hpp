@@ -0,0 +1,121 @@
+#pragma once
+
+#include "./lua_value.hpp"
+#include "./lua_module_loader.hpp"
+#include "./lua_allocator.hpp"
+#include "./mpsc_queue.hpp"
+
+#include <lua.h>
+
+#include <memory>
+#include <vector>
+#include <deque>
+#include <string>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <functional>
+#include <filesystem>
+#include <cstdint>
+
+// runs a worker script in N lua states, each on its own thread
+// events are routed by key (friend/conference/group number), so events of one conversation
+// always land on the same worker and stay in order
+// TOX calls from workers are queued to the tox thread and block until runCommands() ran them
+class LuaWorkerPool {
+	public:
+		struct Event {
+			const char* name {nullptr}; // eg. "Tox_Event_Friend_Message", static
+			uint32_t key {0};
+			std::vector<LuaValue> args;
+		};
+
+		struct Stats {
+			uint64_t events {0};
+			uint64_t tox_calls {0};
+		};
+
+	private:
+		struct Worker;
+
+		struct Command {
+			std::string method;
+			std::vector<LuaValue> args;
+			Worker* worker {nullptr};
+		};
+
+		struct Worker {
+			LuaWorkerPool* pool {nullptr};
+			size_t id {0};
+
+			LuaModuleLoader loader;
+			std::unique_ptr<lua_State, void(*)(lua_State*)> state {nullptr, LuaAllocator::closeState};
+			std::thread thread;
+
+			std::mutex mutex;
+			std::condition_variable events_cv;
+			std::deque<Event> events;
+
+			// result of the pending TOX call, guarded by mutex
+			std::condition_variable call_cv;
+			bool call_done {false};
+			std::vector<LuaValue> call_results;
+			std::string call_error;
+
+			Worker(const std::filesystem::path& script_root, const std::filesystem::path& cache_dir) : loader(script_root, cache_dir) {}
+		};
+
+		std::vector<std::unique_ptr<Worker>> _workers;
+		std::vector<std::string> _handled_events;
+
+		std::atomic<bool> _stop {false};
+		std::atomic<size_t> _running {0};
+
+		MPSCQueue<Command> _commands;
+
+		std::mutex _wake_mutex;
+		std::function<void(void)> _wake_main;
+
+		Stats _stats; // tox thread only
+
+	public:
+		// loads script into every worker state, throws std::runtime_error if that fails
+		LuaWorkerPool(
+			size_t count,
+			const std::string& script,
+			const std::filesystem::path& script_root,
+			const std::filesystem::path& cache_dir,
+			LuaModuleLoader::NativeMode native_mode,
+			size_t memory_limit = 0 // per worker state, see LuaAllocator
+		);
+		~LuaWorkerPool(void);
+
+		size_t size(void) const { return _workers.size(); }
+
+		// TOX_EVENTS keys the worker script has handlers for
+		const std::vector<std::string>& getHandledEvents(void) const { return _handled_events; }
+
+		// thread safe, called when a worker queued a TOX call, to wake the tox thread
+		void setWakeCallback(std::function<void(void)>&& fn);
+
+		// tox thread
+		void dispatch(Event&& event);
+
+		// tox thread, runs the queued TOX calls against the TOX global of L
+		size_t runCommands(lua_State* L);
+
+		const Stats& getStats(void) const { return _stats; }
+
+	private:
+		void workerThread(Worker& w);
+		void handleEvent(Worker& w, const Event& event);
+		void wakeMain(void);
+
+		// fails all queued calls, so blocked workers can exit
+		void failCommands(const char* reason);
+
+		static int lua_tox_index(lua_State* L);
+		static int lua_tox_call(lua_State* L);
+};
+
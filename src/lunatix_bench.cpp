@@ -0,0 +1,367 @@
+#include <tox/tox_events.h>
+
+#include "./tox_fake_client.hpp"
+#include "./tox_lua_module.hpp"
+#include "./solanaceae/latency_histogram.hpp"
+#include "./solanaceae/tox_event_log.hpp"
+#include "./solanaceae/tox_event_replay.hpp"
+
+#include <filesystem>
+#include <fstream>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <algorithm>
+#include <chrono>
+#include <atomic>
+#include <thread>
+#include <new>
+#include <iostream>
+#include <cstdlib>
+
+// replays recorded Tox_Events blobs into the lua module, without tox or network
+// usage: lunatix_bench [-r repeat] [-w warmup] [-t speed] [-f friends] [-g groups] [-p group_peers] <script_dir> <corpus file or dir>...
+// a corpus file is an event log (LUNATIX_RECORD_DIR) or holds one tox_events_get_bytes() blob, directories are read in name order
+// -t plays the event logs once, paced like they were recorded (1 real time, 2 twice as fast), instead of as fast as possible
+
+// c++ allocations, lua has its own allocator with stats
+static std::atomic<uint64_t> g_allocs {0};
+
+void* operator new(std::size_t size) {
+	g_allocs.fetch_add(1, std::memory_order_relaxed);
+	if (void* ptr = std::malloc(size != 0 ? size : 1); ptr != nullptr) {
+		return ptr;
+	}
+	throw std::bad_alloc{};
+}
+
+void operator delete(void* ptr) noexcept {
+	std::free(ptr);
+}
+
+void operator delete(void* ptr, std::size_t) noexcept {
+	std::free(ptr);
+}
+
+// subscribed before the module, so the time from one event to the next is what the module spent on it
+class EventClock : public ToxEventI {
+	using clock = std::chrono::steady_clock;
+
+	LatencyHistogram _latency;
+	uint64_t _events {0};
+
+	bool _pending {false};
+	clock::time_point _last;
+
+	void tick(void) {
+		const auto now = clock::now();
+		if (_pending) {
+			_latency.record(now - _last);
+		}
+		_last = now;
+		_pending = true;
+		_events++;
+	}
+
+	public:
+		EventClock(ToxEventProviderI& tep) {
+			for (int event_type = 0; event_type <= TOX_EVENT_GROUP_MODERATION; event_type++) {
+				tep.subscribe(this, static_cast<Tox_Event>(event_type));
+			}
+		}
+
+		// closes the last event of a batch
+		void finish(void) {
+			if (_pending) {
+				_latency.record(clock::now() - _last);
+				_pending = false;
+			}
+		}
+
+		void reset(void) {
+			_latency.reset();
+			_events = 0;
+			_pending = false;
+		}
+
+		const LatencyHistogram& getLatency(void) const { return _latency; }
+		uint64_t getEvents(void) const { return _events; }
+
+	protected:
+#define OVER_EVENT(x) bool onToxEvent(const x*) override { tick(); return false; }
+
+	OVER_EVENT(Tox_Event_Conference_Connected)
+	OVER_EVENT(Tox_Event_Conference_Invite)
+	OVER_EVENT(Tox_Event_Conference_Message)
+	OVER_EVENT(Tox_Event_Conference_Peer_List_Changed)
+	OVER_EVENT(Tox_Event_Conference_Peer_Name)
+	OVER_EVENT(Tox_Event_Conference_Title)
+
+	OVER_EVENT(Tox_Event_File_Chunk_Request)
+	OVER_EVENT(Tox_Event_File_Recv)
+	OVER_EVENT(Tox_Event_File_Recv_Chunk)
+	OVER_EVENT(Tox_Event_File_Recv_Control)
+
+	OVER_EVENT(Tox_Event_Friend_Connection_Status)
+	OVER_EVENT(Tox_Event_Friend_Lossless_Packet)
+	OVER_EVENT(Tox_Event_Friend_Lossy_Packet)
+	OVER_EVENT(Tox_Event_Friend_Message)
+	OVER_EVENT(Tox_Event_Friend_Name)
+	OVER_EVENT(Tox_Event_Friend_Read_Receipt)
+	OVER_EVENT(Tox_Event_Friend_Request)
+	OVER_EVENT(Tox_Event_Friend_Status)
+	OVER_EVENT(Tox_Event_Friend_Status_Message)
+	OVER_EVENT(Tox_Event_Friend_Typing)
+
+	OVER_EVENT(Tox_Event_Self_Connection_Status)
+
+	OVER_EVENT(Tox_Event_Group_Peer_Name)
+	OVER_EVENT(Tox_Event_Group_Peer_Status)
+	OVER_EVENT(Tox_Event_Group_Topic)
+	OVER_EVENT(Tox_Event_Group_Privacy_State)
+	OVER_EVENT(Tox_Event_Group_Voice_State)
+	OVER_EVENT(Tox_Event_Group_Topic_Lock)
+	OVER_EVENT(Tox_Event_Group_Peer_Limit)
+	OVER_EVENT(Tox_Event_Group_Password)
+	OVER_EVENT(Tox_Event_Group_Message)
+	OVER_EVENT(Tox_Event_Group_Private_Message)
+	OVER_EVENT(Tox_Event_Group_Custom_Packet)
+	OVER_EVENT(Tox_Event_Group_Custom_Private_Packet)
+	OVER_EVENT(Tox_Event_Group_Invite)
+	OVER_EVENT(Tox_Event_Group_Peer_Join)
+	OVER_EVENT(Tox_Event_Group_Peer_Exit)
+	OVER_EVENT(Tox_Event_Group_Self_Join)
+	OVER_EVENT(Tox_Event_Group_Join_Fail)
+	OVER_EVENT(Tox_Event_Group_Moderation)
+
+#undef OVER_EVENT
+};
+
+static bool loadLog(const std::filesystem::path& path, std::vector<Tox_Events*>& corpus) {
+	ToxEventLogReader reader;
+	if (!reader.open(path)) {
+		std::cerr << "BENCH error: can not open " << path << "\n";
+		return false;
+	}
+
+	for (size_t i = 0; i < reader.size(); i++) {
+		Tox_Events* events = reader.load(i);
+		if (events == nullptr) {
+			std::cerr << "BENCH warning: skipping broken batch " << i << " in " << path << "\n";
+			continue;
+		}
+		corpus.push_back(events);
+	}
+	return true;
+}
+
+static bool loadBatch(const std::filesystem::path& path, std::vector<Tox_Events*>& corpus) {
+	if (ToxEventLogReader::isLog(path)) {
+		return loadLog(path, corpus);
+	}
+
+	std::ifstream file{path, std::ios::binary};
+	if (!file.is_open()) {
+		std::cerr << "BENCH error: can not open " << path << "\n";
+		return false;
+	}
+	const std::vector<uint8_t> bytes{std::istreambuf_iterator<char>{file}, std::istreambuf_iterator<char>{}};
+
+	Tox_Events* events = tox_events_load(bytes.data(), static_cast<uint32_t>(bytes.size()));
+	if (events == nullptr) {
+		std::cerr << "BENCH error: " << path << " is not a tox events blob\n";
+		return false;
+	}
+	corpus.push_back(events);
+	return true;
+}
+
+static bool loadCorpus(const std::filesystem::path& path, std::vector<Tox_Events*>& corpus) {
+	if (!std::filesystem::is_directory(path)) {
+		return loadBatch(path, corpus);
+	}
+
+	std::vector<std::filesystem::path> files;
+	for (const auto& entry : std::filesystem::directory_iterator{path}) {
+		if (entry.is_regular_file() && entry.path().extension() != ".idx") { // event log indices
+			files.push_back(entry.path());
+		}
+	}
+	std::sort(files.begin(), files.end());
+
+	for (const auto& file : files) {
+		if (!loadBatch(file, corpus)) {
+			return false;
+		}
+	}
+	return true;
+}
+
+// logs of all corpus paths, for -t
+static std::vector<std::filesystem::path> listLogs(const std::filesystem::path& path) {
+	if (!std::filesystem::is_directory(path)) {
+		return {path};
+	}
+	return ToxEventLogReader::listLogs(path);
+}
+
+static double us(std::chrono::nanoseconds duration) {
+	return std::chrono::duration<double, std::micro>(duration).count();
+}
+
+int main(int argc, char** argv) {
+	int repeat = 10;
+	int warmup = 1;
+	double speed = 0.0;
+	uint32_t friends = 16;
+	uint32_t groups = 4;
+	uint32_t group_peers = 32;
+
+	std::vector<std::string_view> args;
+	for (int i = 1; i < argc; i++) {
+		const std::string_view arg{argv[i]};
+		if (arg.size() == 2 && arg[0] == '-' && i+1 < argc) {
+			const char* value_str = argv[++i];
+			const int value = std::atoi(value_str);
+			switch (arg[1]) {
+				case 'r': repeat = std::max(value, 1); continue;
+				case 'w': warmup = std::max(value, 0); continue;
+				case 't': speed = std::max(std::atof(value_str), 0.0); continue;
+				case 'f': friends = static_cast<uint32_t>(std::max(value, 0)); continue;
+				case 'g': groups = static_cast<uint32_t>(std::max(value, 0)); continue;
+				case 'p': group_peers = static_cast<uint32_t>(std::max(value, 0)); continue;
+				default: break;
+			}
+			i--;
+		}
+		args.push_back(arg);
+	}
+
+	if (args.size() < 2) {
+		std::cerr << "usage: " << argv[0] << " [-r repeat] [-w warmup] [-t speed] [-f friends] [-g groups] [-p group_peers] <script_dir> <corpus file or dir>...\n";
+		return 1;
+	}
+
+	// paced replays read the logs as they go
+	std::vector<Tox_Events*> corpus;
+	std::vector<std::filesystem::path> logs;
+	for (size_t i = 1; i < args.size(); i++) {
+		if (speed > 0.0) {
+			for (auto& log : listLogs(std::filesystem::absolute(args[i]))) {
+				logs.push_back(std::move(log));
+			}
+		} else if (!loadCorpus(std::filesystem::absolute(args[i]), corpus)) {
+			return 1;
+		}
+	}
+	if (speed > 0.0) {
+		repeat = 1;
+		warmup = 0;
+	}
+	if (corpus.empty() && logs.empty()) {
+		std::cerr << "BENCH error: empty corpus\n";
+		return 1;
+	}
+
+	// the module loads main.lua from the working directory
+	std::error_code ec;
+	std::filesystem::current_path(args.front(), ec);
+	if (ec) {
+		std::cerr << "BENCH error: can not enter " << args.front() << ": " << ec.message() << "\n";
+		return 1;
+	}
+
+	ToxFakeClient tfc;
+	tfc.setCounts(friends, groups, group_peers);
+
+	EventClock event_clock{tfc};
+
+	ToxLuaModule tlm{tfc, tfc};
+	tfc.subscribeRaw([&tlm](const Tox_Events*) { tlm.beginBatch(); });
+	tfc.subscribeRawDone([&tlm](const Tox_Events*) { tlm.endBatch(); });
+
+	std::chrono::nanoseconds dispatch_time {0};
+	std::chrono::nanoseconds iterate_time {0};
+	uint64_t cpp_allocs = 0;
+	uint64_t lua_allocs = 0;
+	ToxFakeClient::Stats tox_stats_start;
+
+	const auto run_batch = [&](const Tox_Events* batch, bool measuring) {
+		const uint64_t cpp_allocs_before = g_allocs.load(std::memory_order_relaxed);
+		const uint64_t lua_allocs_before = tlm.getMemoryStats().allocs;
+		const auto dispatch_start = std::chrono::steady_clock::now();
+
+		tfc.dispatch(batch);
+		event_clock.finish();
+
+		const auto iterate_start = std::chrono::steady_clock::now();
+		const uint64_t cpp_allocs_after = g_allocs.load(std::memory_order_relaxed);
+		const uint64_t lua_allocs_after = tlm.getMemoryStats().allocs;
+
+		// timers, outbox and gc steps, not part of the per event numbers
+		tlm.iterate();
+
+		if (measuring) {
+			dispatch_time += iterate_start - dispatch_start;
+			iterate_time += std::chrono::steady_clock::now() - iterate_start;
+			cpp_allocs += cpp_allocs_after - cpp_allocs_before;
+			lua_allocs += lua_allocs_after - lua_allocs_before;
+		}
+	};
+
+	if (speed > 0.0) {
+		ToxEventReplay replay{logs, [&run_batch](const Tox_Events* batch) { run_batch(batch, true); }};
+		replay.setSpeed(speed);
+		event_clock.reset();
+		tox_stats_start = tfc.getStats();
+		while (replay.iterate()) {
+			// the module keeps iterating between batches, like the main loop would
+			std::this_thread::sleep_until(std::min(replay.nextDue(), std::chrono::steady_clock::now() + std::chrono::milliseconds{50}));
+			tlm.iterate();
+		}
+		std::cout << "BENCH replay: " << replay.getStats().batches << " batches, " << replay.getStats().broken << " broken, max lag "
+			<< replay.getStats().max_lag.count() << "us\n";
+	}
+
+	for (int pass = 0; pass < warmup + repeat && !corpus.empty(); pass++) {
+		if (pass == warmup) {
+			event_clock.reset();
+			tox_stats_start = tfc.getStats();
+		}
+
+		for (const auto* batch : corpus) {
+			run_batch(batch, pass >= warmup);
+		}
+	}
+
+	const uint64_t events = event_clock.getEvents();
+	const auto& latency = event_clock.getLatency();
+	const auto& tox_stats = tfc.getStats();
+	const auto& memory = tlm.getMemoryStats();
+	const double per_event = events > 0 ? 1.0 / events : 0.0;
+
+	std::cout << "BENCH corpus: " << (corpus.empty() ? logs.size() : corpus.size()) << (corpus.empty() ? " logs, " : " batches, ") << events / repeat << " events, " << repeat << " runs after " << warmup << " warmup\n";
+	const double dispatch_s = std::chrono::duration<double>(dispatch_time).count();
+	const double total_s = std::chrono::duration<double>(dispatch_time + iterate_time).count();
+	std::cout << "BENCH events/s: " << (dispatch_s > 0.0 ? events / dispatch_s : 0.0)
+		<< " (" << (total_s > 0.0 ? events / total_s : 0.0) << " with iterate)\n";
+	std::cout << "BENCH latency us per event:"
+		<< " mean " << us(latency.sum()) * per_event
+		<< " p50 " << us(latency.quantile(0.5))
+		<< " p90 " << us(latency.quantile(0.9))
+		<< " p99 " << us(latency.quantile(0.99))
+		<< " p999 " << us(latency.quantile(0.999))
+		<< " max " << us(latency.max())
+		<< "\n";
+	std::cout << "BENCH allocations per event: c++ " << cpp_allocs * per_event << " lua " << lua_allocs * per_event << "\n";
+	std::cout << "BENCH tox calls per event: " << (tox_stats.calls - tox_stats_start.calls) * per_event
+		<< " sends " << (tox_stats.sends - tox_stats_start.sends) * per_event << "\n";
+	std::cout << "BENCH lua memory: " << memory.bytes << " bytes, peak " << memory.peak << "\n";
+
+	for (auto* batch : corpus) {
+		tox_events_free(batch);
+	}
+
+	return 0;
+}
+
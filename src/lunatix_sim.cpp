@@ -0,0 +1,82 @@
+#include "./tox_sim.hpp"
+
+#include <fstream>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <algorithm>
+#include <iostream>
+#include <cstdlib>
+
+// runs the bot and a bunch of load generating tox nodes in one process, over loopback with a local bootstrap node
+// usage: lunatix_sim [-n load_nodes] [-s script_dir] [-P start_port] [-r recv_dir] [-a 0|1] <step>... | @<steps file>
+// steps: friends[:timeout_s] messages:count[:per_s] group:count[:per_s] files:size[:count] wait:seconds
+// a steps file has one step per line, # starts a comment. "connect" always runs first
+// -a 0 leaves accepting friend requests to the scripts
+
+static bool readSteps(const std::string& path, std::vector<std::string>& steps) {
+	std::ifstream file{path};
+	if (!file.is_open()) {
+		std::cerr << "SIM error: can not open " << path << "\n";
+		return false;
+	}
+
+	std::string line;
+	while (std::getline(file, line)) {
+		line = line.substr(0, line.find('#'));
+		line.erase(0, line.find_first_not_of(" \t\r"));
+		line.erase(line.find_last_not_of(" \t\r") + 1);
+		if (!line.empty()) {
+			steps.push_back(line);
+		}
+	}
+	return true;
+}
+
+int main(int argc, char** argv) {
+	ToxSim::Options options;
+
+	std::vector<std::string> steps;
+	for (int i = 1; i < argc; i++) {
+		const std::string_view arg{argv[i]};
+		if (arg.size() == 2 && arg[0] == '-' && i+1 < argc) {
+			const char* value_str = argv[++i];
+			const int value = std::atoi(value_str);
+			switch (arg[1]) {
+				case 'n': options.load_nodes = static_cast<size_t>(std::max(value, 1)); continue;
+				case 's': options.script_dir = value_str; continue;
+				case 'P': options.start_port = static_cast<uint16_t>(std::clamp(value, 1, 65535)); continue;
+				case 'r': options.recv_dir = value_str; continue;
+				case 'a': options.accept_friends = value != 0; continue;
+				default: break;
+			}
+			i--;
+		}
+
+		if (arg.size() > 1 && arg[0] == '@') {
+			if (!readSteps(std::string{arg.substr(1)}, steps)) {
+				return 1;
+			}
+		} else {
+			steps.emplace_back(arg);
+		}
+	}
+
+	if (steps.empty()) {
+		std::cerr << "usage: " << argv[0] << " [-n load_nodes] [-s script_dir] [-P start_port] [-r recv_dir] [-a 0|1] <step>... | @<steps file>\n";
+		return 1;
+	}
+
+	ToxSim sim{options};
+
+	bool ok = sim.runStep("connect", std::cout);
+	for (const auto& step : steps) {
+		if (!ok) {
+			break;
+		}
+		ok = sim.runStep(step, std::cout);
+	}
+
+	return ok ? 0 : 2;
+}
+
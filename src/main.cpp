@@ -4,17 +4,23 @@
 #include "./solanaceae/tox_client.hpp"
 #include "./solanaceae/auto_dirty.hpp"
 #include "./solanaceae/transfer_manager.hpp"
+#include "./solanaceae/loop_driver.hpp"
+#include "./solanaceae/tox_event_log.hpp"
 
 #include "./tox_lua_module.hpp"
 
 #include <string_view>
+#include <optional>
 #include <iostream>
-#include <thread>
 #include <cassert>
 #include <cstdlib>
+#include <csignal>
 
 // https://youtu.be/YIE4b8gT3ho
 
+// set by SIGUSR1, toggles the lua profiler
+static volatile std::sig_atomic_t g_toggle_profiler {0};
+
 int main(void) {
 	std::cout << "LUNATiX - because we have to be insane\n";
 
@@ -26,15 +32,42 @@ int main(void) {
 	AutoDirty ad{tc};
 
 	TransferManager tm{tc, tc};
+	if (const char* recv_dir = std::getenv("LUNATIX_RECV_DIR"); recv_dir != nullptr) {
+		tm.setRecvPolicy(TransferManager::recvIntoDir(recv_dir));
+	}
+
+	// LUNATIX_RECORD_DIR=dir records every event batch, to replay them later (see lunatix_bench -t)
+	// subscribed first, so a batch is on disk before anything handles it
+	std::optional<ToxEventRecorder> recorder;
+	if (const char* record_dir = std::getenv("LUNATIX_RECORD_DIR"); record_dir != nullptr && record_dir[0] != '\0') {
+		recorder.emplace(record_dir);
+		tc.subscribeRaw([&recorder](const Tox_Events* events) { recorder->record(events); });
+	}
 
 	ToxLuaModule tlm{tc, tc};
+	tc.subscribeRaw([&tlm](const Tox_Events*) { tlm.beginBatch(); });
+	tc.subscribeRawDone([&tlm](const Tox_Events*) { tlm.endBatch(); });
+	tlm.getMetrics().addHistogram("tox_events_iterate", &tc.getIterateStats().events_iterate);
+	tlm.getMetrics().addHistogram("tox_dispatch", &tc.getIterateStats().dispatch);
+	tlm.getMetrics().addHistogram("tox_save", &tc.getIterateStats().save);
 
 	std::cout << "tox id: " << tc.toxSelfGetAddressStr() << "\n";
 
+	LoopDriver ld{tc};
+	tlm.setWakeCallback([&ld](void) { ld.wake(); });
+
+#ifdef SIGUSR1
+	std::signal(SIGUSR1, [](int) { g_toggle_profiler = 1; });
+#endif
+
 	while (tc.iterate()) {
-		tm.iterate(); // currently does nothing
+		tm.iterate();
+		if (g_toggle_profiler) {
+			g_toggle_profiler = 0;
+			tlm.toggleProfiler();
+		}
 		tlm.iterate();
-		std::this_thread::sleep_for(std::chrono::milliseconds(5));
+		ld.wait();
 	}
 
 	return 0;
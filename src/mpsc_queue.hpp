@@ -0,0 +1,60 @@
+#pragma once
+
+#include <atomic>
+#include <utility>
+#include <cstddef>
+
+// lock-free multi producer, single consumer queue
+// producers push onto an intrusive stack, the consumer takes all of it at once and restores the order
+template<typename T>
+class MPSCQueue {
+	struct Node {
+		T value;
+		Node* next {nullptr};
+	};
+
+	std::atomic<Node*> _head {nullptr};
+
+	public:
+		MPSCQueue(void) = default;
+		MPSCQueue(const MPSCQueue&) = delete;
+		MPSCQueue& operator=(const MPSCQueue&) = delete;
+
+		~MPSCQueue(void) {
+			drain([](T&&) {});
+		}
+
+		// any thread
+		void push(T&& value) {
+			auto* node = new Node{std::move(value), _head.load(std::memory_order_relaxed)};
+			while (!_head.compare_exchange_weak(node->next, node, std::memory_order_release, std::memory_order_relaxed)) {
+			}
+		}
+
+		// consumer thread only, calls fn with every value, in push order per producer
+		template<typename FN>
+		size_t drain(FN&& fn) {
+			Node* node = _head.exchange(nullptr, std::memory_order_acquire);
+
+			// the stack is newest first
+			Node* ordered = nullptr;
+			while (node != nullptr) {
+				Node* next = node->next;
+				node->next = ordered;
+				ordered = node;
+				node = next;
+			}
+
+			size_t count = 0;
+			while (ordered != nullptr) {
+				Node* next = ordered->next;
+				fn(std::move(ordered->value));
+				delete ordered;
+				ordered = next;
+				count++;
+			}
+
+			return count;
+		}
+};
+
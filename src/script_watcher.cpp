@@ -0,0 +1,170 @@
+#include "./script_watcher.hpp"
+
+#include <iostream>
+#include <system_error>
+
+#ifdef __linux__
+#include <sys/inotify.h>
+#include <unistd.h>
+#include <cerrno>
+#endif
+
+static std::filesystem::path normalizePath(const std::filesystem::path& path) {
+	std::error_code ec;
+	auto abs_path = std::filesystem::absolute(path, ec);
+	if (ec) {
+		return path.lexically_normal();
+	}
+	return abs_path.lexically_normal();
+}
+
+ScriptWatcher::ScriptWatcher(void) {
+#ifdef __linux__
+	_inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (_inotify_fd < 0) {
+		std::cerr << "TLM waring: inotify_init1 failed (" << errno << "), script changes are not detected\n";
+	}
+#endif
+}
+
+ScriptWatcher::~ScriptWatcher(void) {
+#ifdef __linux__
+	if (_inotify_fd >= 0) {
+		close(_inotify_fd);
+	}
+#endif
+}
+
+void ScriptWatcher::setFiles(const std::set<std::filesystem::path>& files) {
+	_files.clear();
+	for (const auto& file : files) {
+		_files.insert(normalizePath(file));
+	}
+
+#ifdef __linux__
+	if (_inotify_fd < 0) {
+		return;
+	}
+
+	for (const auto& [wd, dir] : _watch_dirs) {
+		inotify_rm_watch(_inotify_fd, wd);
+	}
+	_watch_dirs.clear();
+
+	std::set<std::filesystem::path> dirs;
+	for (const auto& file : _files) {
+		dirs.insert(file.parent_path());
+	}
+
+	for (const auto& dir : dirs) {
+		const int wd = inotify_add_watch(_inotify_fd, dir.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO | IN_DELETE);
+		if (wd < 0) {
+			std::cerr << "TLM waring: can not watch " << dir << " (" << errno << ")\n";
+			continue;
+		}
+		_watch_dirs[wd] = dir;
+	}
+#else
+	_mtimes.clear();
+	for (const auto& file : _files) {
+		std::error_code ec;
+		_mtimes[file] = std::filesystem::last_write_time(file, ec);
+	}
+#endif
+}
+
+void ScriptWatcher::addFiles(const std::set<std::filesystem::path>& files) {
+	for (const auto& file : files) {
+		const auto path = normalizePath(file);
+		if (!_files.insert(path).second) {
+			continue;
+		}
+
+#ifdef __linux__
+		if (_inotify_fd < 0) {
+			continue;
+		}
+
+		const auto dir = path.parent_path();
+		bool watched = false;
+		for (const auto& [wd, watch_dir] : _watch_dirs) {
+			if (watch_dir == dir) {
+				watched = true;
+				break;
+			}
+		}
+		if (watched) {
+			continue;
+		}
+
+		const int wd = inotify_add_watch(_inotify_fd, dir.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO | IN_DELETE);
+		if (wd < 0) {
+			std::cerr << "TLM waring: can not watch " << dir << " (" << errno << ")\n";
+			continue;
+		}
+		_watch_dirs[wd] = dir;
+#else
+		std::error_code ec;
+		_mtimes[path] = std::filesystem::last_write_time(path, ec);
+#endif
+	}
+}
+
+bool ScriptWatcher::poll(void) {
+	const auto now = std::chrono::steady_clock::now();
+
+#ifdef __linux__
+	if (_inotify_fd >= 0) {
+		alignas(inotify_event) char buffer[4096];
+		while (true) {
+			const ssize_t len = read(_inotify_fd, buffer, sizeof(buffer));
+			if (len <= 0) {
+				break; // EAGAIN, nothing (more) pending
+			}
+
+			for (ssize_t i = 0; i < len;) {
+				const auto* ev = reinterpret_cast<const inotify_event*>(buffer + i);
+				i += sizeof(inotify_event) + ev->len;
+
+				if (ev->mask & IN_Q_OVERFLOW) {
+					// lost events, better reload once too often
+					_changed = true;
+					_last_change = now;
+					continue;
+				}
+
+				const auto dir_it = _watch_dirs.find(ev->wd);
+				if (dir_it == _watch_dirs.end() || ev->len == 0) {
+					continue;
+				}
+
+				if (_files.count(dir_it->second / ev->name)) {
+					_changed = true;
+					_last_change = now;
+				}
+			}
+		}
+	}
+#else
+	if (now - _last_scan >= std::chrono::seconds(1)) {
+		_last_scan = now;
+		for (auto& [file, mtime] : _mtimes) {
+			std::error_code ec;
+			const auto new_mtime = std::filesystem::last_write_time(file, ec);
+			if (new_mtime != mtime) {
+				mtime = new_mtime;
+				_changed = true;
+				_last_change = now;
+			}
+		}
+	}
+#endif
+
+	if (_changed && now - _last_change >= _settle_time) {
+		_changed = false;
+		return true;
+	}
+
+	return false;
+}
+
@@ -0,0 +1,44 @@
+#pragma once
+
+#include <filesystem>
+#include <set>
+#include <map>
+#include <chrono>
+
+// watches a set of script files for changes, without blocking
+// watches the parent directories, since editors often replace files instead of writing to them
+// linux uses inotify, elsewhere the modification times get polled once a second
+class ScriptWatcher {
+	std::set<std::filesystem::path> _files;
+
+#ifdef __linux__
+	int _inotify_fd {-1};
+	std::map<int, std::filesystem::path> _watch_dirs; // watch descriptor -> directory
+#else
+	std::map<std::filesystem::path, std::filesystem::file_time_type> _mtimes;
+	std::chrono::steady_clock::time_point _last_scan;
+#endif
+
+	bool _changed {false};
+	std::chrono::steady_clock::time_point _last_change;
+
+	// saving usually touches files multiple times, wait for it to settle
+	static constexpr std::chrono::milliseconds _settle_time {200};
+
+	public:
+		ScriptWatcher(void);
+		~ScriptWatcher(void);
+
+		ScriptWatcher(const ScriptWatcher&) = delete;
+		ScriptWatcher& operator=(const ScriptWatcher&) = delete;
+
+		// replaces the watched set
+		void setFiles(const std::set<std::filesystem::path>& files);
+
+		// adds to the watched set, eg. modules required after startup
+		void addFiles(const std::set<std::filesystem::path>& files);
+
+		// true once, after a watched file changed and then was left alone for a bit
+		bool poll(void);
+};
+
@@ -0,0 +1,149 @@
+#include "./blob_cache.hpp"
+
+#include <cstring>
+
+static uint64_t fingerprint(const std::vector<uint8_t>& data) {
+	// fnv1a, seeded with the size
+	uint64_t hash = 0xcbf29ce484222325ull ^ data.size();
+	for (const uint8_t byte : data) {
+		hash ^= byte;
+		hash *= 0x100000001b3ull;
+	}
+	return hash;
+}
+
+BlobCache::BlobCache(HashFn&& hash_fn, uint64_t max_bytes) : _hash_fn(std::move(hash_fn)), _max_bytes(max_bytes) {
+}
+
+BlobCache::BlobPtr BlobCache::intern(const std::vector<uint8_t>& data) {
+	if (auto blob = lookupAddress(&data); blob) {
+		return blob;
+	}
+
+	const auto fp = fingerprint(data);
+	if (auto blob = lookup(fp, data); blob) {
+		return blob;
+	}
+	return add(fp, std::make_shared<const std::vector<uint8_t>>(data));
+}
+
+BlobCache::BlobPtr BlobCache::intern(std::vector<uint8_t>&& data) {
+	const auto fp = fingerprint(data);
+	if (auto blob = lookup(fp, data); blob) {
+		return blob;
+	}
+	return add(fp, std::make_shared<const std::vector<uint8_t>>(std::move(data)));
+}
+
+BlobCache::BlobPtr BlobCache::intern(std::shared_ptr<const std::vector<uint8_t>> data) {
+	if (!data) {
+		return nullptr;
+	}
+
+	if (auto blob = lookupAddress(data.get()); blob) {
+		return blob;
+	}
+
+	const auto fp = fingerprint(*data);
+	if (auto blob = lookup(fp, *data); blob) {
+		return blob;
+	}
+	return add(fp, std::move(data));
+}
+
+BlobCache::BlobPtr BlobCache::find(const std::vector<uint8_t>& hash) {
+	auto it = _blobs.find(hash);
+	if (it == _blobs.end()) {
+		return nullptr;
+	}
+
+	_lru.splice(_lru.begin(), _lru, it->second.lru_it);
+	return it->second.blob;
+}
+
+void BlobCache::setMaxBytes(uint64_t max_bytes) {
+	_max_bytes = max_bytes;
+	evict();
+}
+
+BlobCache::BlobPtr BlobCache::lookupAddress(const std::vector<uint8_t>* data) {
+	const auto it = _by_address.find(data);
+	if (it == _by_address.end()) {
+		return nullptr;
+	}
+
+	_stats.hits++;
+	auto& entry = _blobs.at(it->second);
+	_lru.splice(_lru.begin(), _lru, entry.lru_it);
+	return entry.blob;
+}
+
+BlobCache::BlobPtr BlobCache::lookup(uint64_t fp, const std::vector<uint8_t>& data) {
+	const auto [begin, end] = _by_fingerprint.equal_range(fp);
+	for (auto it = begin; it != end; it++) {
+		auto& entry = _blobs.at(it->second);
+		const auto& cached = *entry.blob->data;
+		// fingerprints can collide, the content decides
+		if (cached.size() == data.size() && (data.empty() || std::memcmp(cached.data(), data.data(), data.size()) == 0)) {
+			_stats.hits++;
+			_lru.splice(_lru.begin(), _lru, entry.lru_it);
+			return entry.blob;
+		}
+	}
+
+	_stats.misses++;
+	return nullptr;
+}
+
+BlobCache::BlobPtr BlobCache::add(uint64_t fp, std::shared_ptr<const std::vector<uint8_t>> data) {
+	auto blob = std::make_shared<Blob>();
+	blob->hash = _hash_fn(*data);
+	blob->data = std::move(data);
+
+	if (auto it = _blobs.find(blob->hash); it != _blobs.end()) {
+		// same address, different fingerprint can not happen, but keep the index consistent
+		return it->second.blob;
+	}
+
+	_lru.push_front(blob->hash);
+
+	auto& entry = _blobs[blob->hash];
+	entry.blob = blob;
+	entry.fingerprint = fp;
+	entry.lru_it = _lru.begin();
+
+	_by_fingerprint.emplace(fp, blob->hash);
+	_by_address.emplace(blob->data.get(), blob->hash);
+
+	_stats.bytes += blob->data->size();
+	_stats.blobs = _blobs.size();
+
+	evict();
+
+	return blob;
+}
+
+void BlobCache::evict(void) {
+	// never evict the newest one, it is about to be used
+	while (_stats.bytes > _max_bytes && _lru.size() > 1) {
+		const auto hash = _lru.back();
+		_lru.pop_back();
+
+		auto it = _blobs.find(hash);
+		const auto [begin, end] = _by_fingerprint.equal_range(it->second.fingerprint);
+		for (auto fp_it = begin; fp_it != end; fp_it++) {
+			if (fp_it->second == hash) {
+				_by_fingerprint.erase(fp_it);
+				break;
+			}
+		}
+
+		_by_address.erase(it->second.blob->data.get());
+		_stats.bytes -= it->second.blob->data->size();
+		_stats.evictions++;
+		_blobs.erase(it);
+	}
+
+	_stats.blobs = _blobs.size();
+}
+
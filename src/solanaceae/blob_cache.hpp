@@ -0,0 +1,77 @@
+#pragma once
+
+#include <vector>
+#include <map>
+#include <unordered_map>
+#include <list>
+#include <memory>
+#include <functional>
+#include <cstdint>
+
+// content addressed, read only payloads, shared by every transfer sending them
+// each content gets hashed once, repeats are found by a cheap fingerprint first
+// the data the cache holds is found by its address, without reading it (eg. one payload sent to many friends)
+// blobs in use stay alive after eviction, eviction only drops the cache's reference
+// not thread safe, lives on the tox thread
+class BlobCache {
+	public:
+		struct Blob {
+			std::vector<uint8_t> hash; // content address
+			std::shared_ptr<const std::vector<uint8_t>> data;
+		};
+		using BlobPtr = std::shared_ptr<const Blob>;
+
+		using HashFn = std::function<std::vector<uint8_t>(const std::vector<uint8_t>&)>;
+
+		struct Stats {
+			uint64_t hits {0};
+			uint64_t misses {0};
+			uint64_t evictions {0};
+
+			uint64_t bytes {0}; // held by the cache
+			size_t blobs {0};
+		};
+
+	private:
+		HashFn _hash_fn;
+		uint64_t _max_bytes;
+
+		using LRUList = std::list<std::vector<uint8_t>>; // hashes, most recent first
+
+		struct Entry {
+			BlobPtr blob;
+			uint64_t fingerprint {0};
+			LRUList::iterator lru_it;
+		};
+
+		std::map<std::vector<uint8_t>, Entry> _blobs; // hash -> entry
+		std::unordered_multimap<uint64_t, std::vector<uint8_t>> _by_fingerprint; // fingerprint -> hash
+		// blob->data.get() -> hash, the cache keeps them alive, so an address can not be reused while in here
+		std::unordered_map<const std::vector<uint8_t>*, std::vector<uint8_t>> _by_address;
+		LRUList _lru;
+
+		Stats _stats;
+
+	public:
+		BlobCache(HashFn&& hash_fn, uint64_t max_bytes);
+
+		// the cached blob with the same content, or a new one
+		// copies/moves data only on a miss
+		// data the cache already holds (the same shared_ptr again, or *blob->data) is neither hashed nor compared
+		BlobPtr intern(const std::vector<uint8_t>& data);
+		BlobPtr intern(std::vector<uint8_t>&& data);
+		BlobPtr intern(std::shared_ptr<const std::vector<uint8_t>> data);
+
+		// by content address, nullptr if not cached
+		BlobPtr find(const std::vector<uint8_t>& hash);
+
+		void setMaxBytes(uint64_t max_bytes);
+		const Stats& getStats(void) const { return _stats; }
+
+	private:
+		BlobPtr lookupAddress(const std::vector<uint8_t>* data);
+		BlobPtr lookup(uint64_t fingerprint, const std::vector<uint8_t>& data);
+		BlobPtr add(uint64_t fingerprint, std::shared_ptr<const std::vector<uint8_t>> data);
+		void evict(void);
+};
+
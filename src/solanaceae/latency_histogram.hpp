@@ -0,0 +1,80 @@
+#pragma once
+
+#include <array>
+#include <chrono>
+#include <cstdint>
+
+// log-linear histogram of durations, 4 buckets per power of two microseconds
+// quantiles are the upper bucket bound, so within 25% above the real value
+class LatencyHistogram {
+	static constexpr size_t bucket_count = 128; // up to 2^33us, a bit over 2 hours
+
+	std::array<uint64_t, bucket_count> _buckets {};
+	uint64_t _count {0};
+	std::chrono::nanoseconds _sum {0};
+	std::chrono::nanoseconds _max {0};
+
+	static size_t bucketIndex(uint64_t us) {
+		if (us < 4) {
+			return us;
+		}
+		size_t e = 2;
+		while ((us >> (e+1)) != 0) {
+			e++;
+		}
+		const size_t index = (e-1)*4 + ((us >> (e-2)) & 3);
+		return index < bucket_count ? index : bucket_count-1;
+	}
+
+	// exclusive, in microseconds
+	static uint64_t bucketUpper(size_t index) {
+		if (index < 4) {
+			return index+1;
+		}
+		const size_t e = index/4 + 1;
+		return uint64_t(5 + index%4) << (e-2);
+	}
+
+	public:
+		void record(std::chrono::nanoseconds duration) {
+			if (duration.count() < 0) {
+				duration = std::chrono::nanoseconds{0};
+			}
+			const auto us = std::chrono::duration_cast<std::chrono::microseconds>(duration).count();
+			_buckets[bucketIndex(static_cast<uint64_t>(us))]++;
+			_count++;
+			_sum += duration;
+			if (duration > _max) {
+				_max = duration;
+			}
+		}
+
+		uint64_t count(void) const { return _count; }
+		std::chrono::nanoseconds sum(void) const { return _sum; }
+		std::chrono::nanoseconds max(void) const { return _max; }
+
+		// q in [0,1], 0 if empty
+		std::chrono::nanoseconds quantile(double q) const {
+			if (_count == 0) {
+				return std::chrono::nanoseconds{0};
+			}
+
+			uint64_t target = static_cast<uint64_t>(q * _count + 0.5);
+			if (target < 1) {
+				target = 1;
+			}
+
+			uint64_t seen = 0;
+			for (size_t i = 0; i < bucket_count; i++) {
+				seen += _buckets[i];
+				if (seen >= target) {
+					const std::chrono::nanoseconds upper = std::chrono::microseconds{bucketUpper(i)};
+					return upper < _max ? upper : _max;
+				}
+			}
+			return _max;
+		}
+
+		void reset(void) { *this = {}; }
+};
+
@@ -0,0 +1,205 @@
+#include "./loop_driver.hpp"
+
+#include "./tox_client.hpp"
+
+#include <algorithm>
+#include <array>
+#include <stdexcept>
+#include <iostream>
+
+#if defined(__linux__)
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include <cerrno>
+#endif
+
+float LoopDriver::Stats::utilization(void) const {
+	const auto total = time_busy + time_waiting;
+	if (total.count() == 0) {
+		return 0.f;
+	}
+	return std::chrono::duration<float>(time_busy).count() / std::chrono::duration<float>(total).count();
+}
+
+LoopDriver::LoopDriver(ToxClient& tc) : _tc(tc) {
+#if defined(__linux__)
+	_epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	_wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (_epoll_fd < 0 || _wake_fd < 0) {
+		throw std::runtime_error{"LoopDriver failed to create epoll/eventfd"};
+	}
+
+	epoll_event ev {};
+	ev.events = EPOLLIN;
+	ev.data.fd = _wake_fd;
+	epoll_ctl(_epoll_fd, EPOLL_CTL_ADD, _wake_fd, &ev);
+
+	syncSockets();
+#endif
+
+	_report_stream = &std::cout;
+}
+
+LoopDriver::~LoopDriver(void) {
+#if defined(__linux__)
+	close(_wake_fd);
+	close(_epoll_fd);
+#endif
+}
+
+void LoopDriver::wait(void) {
+	const auto wait_start = clock::now();
+	_stats.time_busy += wait_start - _last_wait_end;
+
+	auto deadline = wait_start + std::chrono::milliseconds(_tc.toxIterationInterval());
+	if (_next_deadline < deadline) {
+		deadline = _next_deadline;
+	}
+	_next_deadline = clock::time_point::max();
+
+#if defined(__linux__)
+	syncSockets();
+
+	const auto timeout = std::max<int64_t>(0, std::chrono::ceil<std::chrono::milliseconds>(deadline - wait_start).count());
+
+	std::array<epoll_event, 16> events;
+	const int count = epoll_wait(_epoll_fd, events.data(), events.size(), static_cast<int>(timeout));
+	if (count < 0 && errno != EINTR) {
+		std::cerr << "LD error: epoll_wait failed " << errno << "\n";
+	}
+
+	if (count <= 0) {
+		_stats.wakeups_timeout++;
+	} else {
+		bool posted = false;
+		for (int i = 0; i < count; i++) {
+			if (events[i].data.fd == _wake_fd) {
+				posted = true;
+				uint64_t value;
+				// drain, nonblocking
+				(void)!read(_wake_fd, &value, sizeof(value));
+			}
+		}
+		if (posted) {
+			_stats.wakeups_posted++;
+		} else {
+			_stats.wakeups_socket++;
+		}
+	}
+#else
+	{
+		std::unique_lock lock{_posted_mutex};
+		if (_wake_cv.wait_until(lock, deadline, [this]() { return _woken; })) {
+			_stats.wakeups_posted++;
+		} else {
+			_stats.wakeups_timeout++;
+		}
+		_woken = false;
+	}
+#endif
+
+	_last_wait_end = clock::now();
+	_stats.time_waiting += _last_wait_end - wait_start;
+
+	runPosted();
+
+	if (_report_stream != nullptr && _report_interval.count() > 0 && _last_wait_end - _last_report >= _report_interval) {
+		printStats(*_report_stream, _stats_last_report);
+		_stats_last_report = _stats;
+		_last_report = _last_wait_end;
+	}
+}
+
+void LoopDriver::wake(void) {
+#if defined(__linux__)
+	const uint64_t value = 1;
+	(void)!write(_wake_fd, &value, sizeof(value));
+#else
+	{
+		std::lock_guard lock{_posted_mutex};
+		_woken = true;
+	}
+	_wake_cv.notify_one();
+#endif
+}
+
+void LoopDriver::post(std::function<void(void)>&& fn) {
+	{
+		std::lock_guard lock{_posted_mutex};
+		_posted.emplace_back(std::move(fn));
+	}
+	wake();
+}
+
+void LoopDriver::wakeAt(clock::time_point tp) {
+	if (tp < _next_deadline) {
+		_next_deadline = tp;
+	}
+}
+
+void LoopDriver::printStats(std::ostream& os, const Stats& since) const {
+	Stats delta;
+	delta.wakeups_timeout = _stats.wakeups_timeout - since.wakeups_timeout;
+	delta.wakeups_socket = _stats.wakeups_socket - since.wakeups_socket;
+	delta.wakeups_posted = _stats.wakeups_posted - since.wakeups_posted;
+	delta.time_busy = _stats.time_busy - since.time_busy;
+	delta.time_waiting = _stats.time_waiting - since.time_waiting;
+
+	const float seconds = std::chrono::duration<float>(delta.time_busy + delta.time_waiting).count();
+
+	os << "LD stats: "
+		<< "utilization " << delta.utilization() * 100.f << "% "
+		<< "wakeups " << delta.wakeups() << " (" << (seconds > 0.f ? delta.wakeups() / seconds : 0.f) << "/s) "
+		<< "timeout " << delta.wakeups_timeout << " "
+		<< "socket " << delta.wakeups_socket << " "
+		<< "posted " << delta.wakeups_posted << "\n"
+	;
+}
+
+#if defined(__linux__)
+void LoopDriver::syncSockets(void) {
+	if (_polled_sockets_generation == _tc.getToxSocketsGeneration()) {
+		return;
+	}
+	_polled_sockets_generation = _tc.getToxSocketsGeneration();
+
+	const auto& tox_sockets = _tc.getToxSockets();
+
+	// closed sockets drop out of the epoll set on their own, this just keeps our set in sync
+	for (auto it = _polled_sockets.begin(); it != _polled_sockets.end();) {
+		if (!tox_sockets.count(*it)) {
+			epoll_ctl(_epoll_fd, EPOLL_CTL_DEL, *it, nullptr);
+			it = _polled_sockets.erase(it);
+		} else {
+			it++;
+		}
+	}
+
+	// add all of them again, a closed fd might have been reused by a new socket in between
+	// which looks watched by number, but the kernel already dropped it from the epoll set
+	for (const int sock : tox_sockets) {
+		epoll_event ev {};
+		ev.events = EPOLLIN;
+		ev.data.fd = sock;
+		if (epoll_ctl(_epoll_fd, EPOLL_CTL_ADD, sock, &ev) == 0 || errno == EEXIST) {
+			_polled_sockets.emplace(sock);
+		} else {
+			_polled_sockets.erase(sock);
+		}
+	}
+}
+#endif
+
+void LoopDriver::runPosted(void) {
+	std::vector<std::function<void(void)>> posted;
+	{
+		std::lock_guard lock{_posted_mutex};
+		posted.swap(_posted);
+	}
+
+	for (auto& fn : posted) {
+		fn();
+	}
+}
+
@@ -0,0 +1,93 @@
+#pragma once
+
+#include <chrono>
+#include <functional>
+#include <mutex>
+#include <vector>
+#include <set>
+#include <cstdint>
+#include <ostream>
+
+#if !defined(__linux__)
+#include <condition_variable>
+#endif
+
+// fwd
+class ToxClient;
+
+// drives the main loop, instead of a fixed sleep
+// sleeps until tox wants to be iterated, the next deadline is due,
+// a tox socket becomes readable (linux only, epoll) or work is posted from another thread
+class LoopDriver {
+	public:
+		using clock = std::chrono::steady_clock;
+
+		struct Stats {
+			uint64_t wakeups_timeout {0};
+			uint64_t wakeups_socket {0};
+			uint64_t wakeups_posted {0};
+
+			clock::duration time_busy {0};
+			clock::duration time_waiting {0};
+
+			uint64_t wakeups(void) const { return wakeups_timeout + wakeups_socket + wakeups_posted; }
+			// fraction of time not spent waiting, 0-1
+			float utilization(void) const;
+		};
+
+	private:
+		ToxClient& _tc;
+
+#if defined(__linux__)
+		int _epoll_fd {-1};
+		int _wake_fd {-1}; // eventfd
+		std::set<int> _polled_sockets;
+		uint64_t _polled_sockets_generation {0};
+#else
+		std::condition_variable _wake_cv;
+		bool _woken {false}; // guarded by _posted_mutex
+#endif
+
+		std::mutex _posted_mutex;
+		std::vector<std::function<void(void)>> _posted;
+
+		clock::time_point _next_deadline {clock::time_point::max()};
+
+		clock::time_point _last_wait_end {clock::now()};
+		Stats _stats;
+
+		// periodically print stats, 0 disables
+		clock::duration _report_interval {std::chrono::minutes(1)};
+		clock::time_point _last_report {clock::now()};
+		Stats _stats_last_report;
+		std::ostream* _report_stream {nullptr};
+
+	public:
+		LoopDriver(ToxClient& tc);
+		~LoopDriver(void);
+
+		// blocks until the next iteration is due, then runs posted work
+		void wait(void);
+
+		// thread safe, makes the current (or next) wait() return
+		void wake(void);
+
+		// thread safe, fn runs on the loop thread at the end of the next wait()
+		void post(std::function<void(void)>&& fn);
+
+		// the next wait() does not sleep past tp
+		void wakeAt(clock::time_point tp);
+		void wakeIn(clock::duration d) { wakeAt(clock::now() + d); }
+
+		const Stats& getStats(void) const { return _stats; }
+
+		void setReport(std::ostream* os, clock::duration interval) { _report_stream = os; _report_interval = interval; }
+		void printStats(std::ostream& os, const Stats& since) const;
+
+	private:
+#if defined(__linux__)
+		void syncSockets(void);
+#endif
+		void runPosted(void);
+};
+
@@ -0,0 +1,107 @@
+#include "./mapped_file.hpp"
+
+#include <fstream>
+#include <utility>
+
+#if !defined(_WIN32)
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+MappedFile::MappedFile(const std::string& path) {
+#if !defined(_WIN32)
+	const int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		return;
+	}
+
+	struct stat st {};
+	if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+		_open = true;
+
+		if (st.st_size == 0) {
+			close(fd);
+			return; // nothing to map
+		}
+
+		void* ptr = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (ptr != MAP_FAILED) {
+			// we read it front to back, right away
+			madvise(ptr, st.st_size, MADV_SEQUENTIAL);
+			madvise(ptr, st.st_size, MADV_WILLNEED);
+
+			_data = static_cast<const uint8_t*>(ptr);
+			_size = st.st_size;
+			_mapped = true;
+			close(fd); // the mapping stays valid
+			return;
+		}
+	}
+	close(fd);
+	_open = false;
+#endif
+
+	// fallback, bulk read
+	std::ifstream ifile{path, std::ios::binary | std::ios::ate};
+	if (!ifile.is_open()) {
+		return;
+	}
+
+	const auto file_size = ifile.tellg();
+	if (file_size < 0) {
+		return;
+	}
+	ifile.seekg(0);
+
+	_buffer.resize(static_cast<size_t>(file_size));
+	if (!ifile.read(reinterpret_cast<char*>(_buffer.data()), _buffer.size())) {
+		_buffer.clear();
+		return;
+	}
+
+	_data = _buffer.data();
+	_size = _buffer.size();
+	_open = true;
+}
+
+MappedFile::~MappedFile(void) {
+	reset();
+}
+
+MappedFile::MappedFile(MappedFile&& other) noexcept {
+	*this = std::move(other);
+}
+
+MappedFile& MappedFile::operator=(MappedFile&& other) noexcept {
+	if (this != &other) {
+		reset();
+
+		_buffer = std::move(other._buffer);
+		_data = other._mapped ? other._data : _buffer.data();
+		_size = other._size;
+		_open = other._open;
+		_mapped = other._mapped;
+
+		other._data = nullptr;
+		other._size = 0;
+		other._open = false;
+		other._mapped = false;
+	}
+	return *this;
+}
+
+void MappedFile::reset(void) {
+#if !defined(_WIN32)
+	if (_mapped && _data != nullptr) {
+		munmap(const_cast<uint8_t*>(_data), _size);
+	}
+#endif
+	_data = nullptr;
+	_size = 0;
+	_open = false;
+	_mapped = false;
+	_buffer.clear();
+}
+
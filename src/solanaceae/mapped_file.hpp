@@ -0,0 +1,40 @@
+#pragma once
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+
+// read only contents of a whole file
+// mmaped where possible, otherwise read in one go
+class MappedFile {
+	const uint8_t* _data {nullptr};
+	size_t _size {0};
+	bool _open {false};
+	bool _mapped {false};
+	std::vector<uint8_t> _buffer; // fallback
+
+	public:
+		MappedFile(void) = default;
+		explicit MappedFile(const std::string& path);
+		~MappedFile(void);
+
+		MappedFile(const MappedFile&) = delete;
+		MappedFile& operator=(const MappedFile&) = delete;
+		MappedFile(MappedFile&& other) noexcept;
+		MappedFile& operator=(MappedFile&& other) noexcept;
+
+		bool isOpen(void) const { return _open; }
+		bool isMapped(void) const { return _mapped; }
+
+		const uint8_t* data(void) const { return _data; }
+		size_t size(void) const { return _size; }
+		bool empty(void) const { return _size == 0; }
+
+		std::string_view view(void) const { return {reinterpret_cast<const char*>(_data), _size}; }
+
+	private:
+		void reset(void);
+};
+
@@ -1,13 +1,29 @@
 #include "./tox_client.hpp"
 
+#include "./mapped_file.hpp"
+
+#include <toxcore/tox_private.h>
+#include <toxcore/network.h>
+
 #include <sodium.h>
 
 #include <vector>
 #include <fstream>
 #include <iostream>
+#include <filesystem>
+#include <algorithm>
 #include <cassert>
 
-ToxClient::ToxClient(std::string_view save_path) :
+#if !defined(_WIN32)
+#include <fcntl.h>
+#include <unistd.h>
+#include <cerrno>
+#endif
+
+ToxClient::ToxClient(std::string_view save_path) : ToxClient(save_path, NetworkOptions{}) {
+}
+
+ToxClient::ToxClient(std::string_view save_path, const NetworkOptions& network_options) :
 	_tox_profile_path(save_path)
 //ToxClient::ToxClient(/*const CommandLine& cl*/)
 	//_self_name(cl.self_name),
@@ -17,21 +33,28 @@ ToxClient::ToxClient(std::string_view save_path) :
 	Tox_Options* options = tox_options_new(&err_opt_new);
 	assert(err_opt_new == TOX_ERR_OPTIONS_NEW::TOX_ERR_OPTIONS_NEW_OK);
 
-	std::vector<uint8_t> profile_data{};
+	tox_options_set_ipv6_enabled(options, network_options.ipv6);
+	tox_options_set_udp_enabled(options, network_options.udp);
+	tox_options_set_local_discovery_enabled(options, network_options.local_discovery);
+	if (network_options.start_port != 0) {
+		tox_options_set_start_port(options, network_options.start_port);
+		tox_options_set_end_port(options, std::max(network_options.start_port, network_options.end_port));
+	}
+
+	auto phase_start = std::chrono::steady_clock::now();
+	const auto phase_ms = [&phase_start](void) {
+		const auto now = std::chrono::steady_clock::now();
+		const auto ms = std::chrono::duration<double, std::milli>(now - phase_start).count();
+		phase_start = now;
+		return ms;
+	};
+
+	MappedFile profile_data{}; // needs to outlive tox_new()
 	if (!_tox_profile_path.empty()) {
-		std::ifstream ifile{_tox_profile_path, std::ios::binary};
+		profile_data = MappedFile{_tox_profile_path};
 
-		if (ifile.is_open()) {
+		if (profile_data.isOpen()) {
 			std::cout << "TOX loading save " << _tox_profile_path << "\n";
-			// fill savedata
-			while (ifile.good()) {
-				auto ch = ifile.get();
-				if (ch == EOF) {
-					break;
-				} else {
-					profile_data.push_back(ch);
-				}
-			}
 
 			if (profile_data.empty()) {
 				std::cerr << "empty tox save\n";
@@ -41,10 +64,23 @@ ToxClient::ToxClient(std::string_view save_path) :
 				tox_options_set_savedata_data(options, profile_data.data(), profile_data.size());
 			}
 
-			ifile.close(); // do i need this?
+			std::cout << "TOX loading save (" << profile_data.size() << " bytes) took " << phase_ms() << "ms\n";
 		}
 	}
 
+	// same as the system network, but lets us know about the sockets tox opens
+	static const Network_Funcs tracking_network_funcs = [](void) {
+		Network_Funcs funcs = *system_network()->funcs;
+		funcs.socket = netSocket;
+		funcs.accept = netAccept;
+		funcs.close = netClose;
+		return funcs;
+	}();
+	const Network tracking_network {&tracking_network_funcs, this};
+	Tox_System tox_system = tox_default_system();
+	tox_system.ns = &tracking_network; // copied by tox_new
+	tox_options_set_operating_system(options, &tox_system);
+
 	TOX_ERR_NEW err_new;
 	_tox = tox_new(options, &err_new);
 	tox_options_free(options);
@@ -52,6 +88,7 @@ ToxClient::ToxClient(std::string_view save_path) :
 		std::cerr << "tox_new failed with error code " << err_new << "\n";
 		throw std::runtime_error{"tox failed"};
 	}
+	std::cout << "TOX tox_new took " << phase_ms() << "ms\n";
 
 	// no callbacks, use events
 	tox_events_init(_tox);
@@ -62,84 +99,291 @@ ToxClient::ToxClient(std::string_view save_path) :
 	tox_self_set_name(_tox, reinterpret_cast<const uint8_t*>(_self_name.data()), _self_name.size(), nullptr);
 
 	// dht bootstrap
-	{
-		struct DHT_node {
-			const char *ip;
-			uint16_t port;
-			const char key_hex[TOX_PUBLIC_KEY_SIZE*2 + 1]; // 1 for null terminator
-			unsigned char key_bin[TOX_PUBLIC_KEY_SIZE];
-		};
-
-		DHT_node nodes[] =
-		{
-			// you can change or add your own bs and tcprelays here, ideally closer to you
-			{"tox.plastiras.org",	443,	"8E8B63299B3D520FB377FE5100E65E3322F7AE5B20A0ACED2981769FC5B43725", {}}, // LU tha14
-			{"tox2.plastiras.org",	33445,	"B6626D386BE7E3ACA107B46F48A5C4D522D29281750D44A0CBA6A2721E79C951", {}}, // DE tha14
-
-		};
-
-		for (size_t i = 0; i < sizeof(nodes)/sizeof(DHT_node); i ++) {
-			sodium_hex2bin(
-				nodes[i].key_bin, sizeof(nodes[i].key_bin),
-				nodes[i].key_hex, sizeof(nodes[i].key_hex)-1,
-				NULL, NULL, NULL
-			);
-			tox_bootstrap(_tox, nodes[i].ip, nodes[i].port, nodes[i].key_bin, NULL);
+	const auto bootstrap_nodes = network_options.bootstrap.has_value() ? network_options.bootstrap.value() : defaultBootstrapNodes();
+	for (const auto& node : bootstrap_nodes) {
+		if (node.public_key.size() != TOX_PUBLIC_KEY_SIZE) {
+			std::cerr << "TOX bootstrap node " << node.host << " has no valid public key\n";
+			continue;
+		}
+
+		tox_bootstrap(_tox, node.host.c_str(), node.port, node.public_key.data(), nullptr);
+		if (node.tcp_relay) {
 			// TODO: use extra tcp option to avoid error msgs
 			// ... this is hardcore
-			tox_add_tcp_relay(_tox, nodes[i].ip, nodes[i].port, nodes[i].key_bin, NULL);
+			tox_add_tcp_relay(_tox, node.host.c_str(), node.port, node.public_key.data(), nullptr);
 		}
 	}
 }
 
+std::vector<ToxClient::BootstrapNode> ToxClient::defaultBootstrapNodes(void) {
+	struct DHT_node {
+		const char *ip;
+		uint16_t port;
+		const char key_hex[TOX_PUBLIC_KEY_SIZE*2 + 1]; // 1 for null terminator
+	};
+
+	const DHT_node nodes[] =
+	{
+		// you can change or add your own bs and tcprelays here, ideally closer to you
+		{"tox.plastiras.org",	443,	"8E8B63299B3D520FB377FE5100E65E3322F7AE5B20A0ACED2981769FC5B43725"}, // LU tha14
+		{"tox2.plastiras.org",	33445,	"B6626D386BE7E3ACA107B46F48A5C4D522D29281750D44A0CBA6A2721E79C951"}, // DE tha14
+	};
+
+	std::vector<BootstrapNode> list;
+	for (size_t i = 0; i < sizeof(nodes)/sizeof(DHT_node); i ++) {
+		BootstrapNode node{nodes[i].ip, nodes[i].port, std::vector<uint8_t>(TOX_PUBLIC_KEY_SIZE), true};
+		sodium_hex2bin(
+			node.public_key.data(), node.public_key.size(),
+			nodes[i].key_hex, sizeof(nodes[i].key_hex)-1,
+			NULL, NULL, NULL
+		);
+		list.push_back(std::move(node));
+	}
+	return list;
+}
+
 ToxClient::~ToxClient(void) {
+	// flush, regardless of debounce
+	if (_tox_profile_dirty) {
+		saveToxProfile();
+	}
+
+	if (_saver_thread.joinable()) {
+		{
+			std::lock_guard lock{_saver_mutex};
+			_saver_stop = true;
+		}
+		_saver_cv.notify_one();
+		_saver_thread.join(); // writes what is still pending
+	}
+
 	tox_kill(_tox);
 }
 
+void ToxClient::setDirty(void) {
+	const auto now = std::chrono::steady_clock::now();
+	if (!_tox_profile_dirty) {
+		_tox_profile_dirty_first = now;
+	}
+	_tox_profile_dirty_last = now;
+	_tox_profile_dirty = true;
+	_tox_profile_dirty_requests++;
+}
+
+ToxClient::SaveStats ToxClient::getSaveStats(void) {
+	std::lock_guard lock{_saver_mutex};
+	SaveStats stats = _save_stats;
+	stats.requests = _tox_profile_dirty_requests;
+	return stats;
+}
+
 bool ToxClient::iterate(void) {
 	auto new_time = std::chrono::high_resolution_clock::now();
 	const float time_delta {std::chrono::duration<float>(new_time - _last_time).count()};
 	_last_time = new_time;
 
 	Tox_Err_Events_Iterate err_e_it = TOX_ERR_EVENTS_ITERATE_OK;
+	const auto iterate_start = std::chrono::steady_clock::now();
 	auto* events = tox_events_iterate(_tox, false, &err_e_it);
+	const auto dispatch_start = std::chrono::steady_clock::now();
+	_iterate_stats.events_iterate.record(dispatch_start - iterate_start);
+
 	if (err_e_it == TOX_ERR_EVENTS_ITERATE_OK && events != nullptr) {
-		_subscriber_raw(events);
+		for (const auto& fn : _subscribers_raw) {
+			fn(events);
+		}
 
 		// forward events to event handlers
 		dispatchEvents(events);
+
+		for (const auto& fn : _subscribers_raw_done) {
+			fn(events);
+		}
+
+		_iterate_stats.dispatch.record(std::chrono::steady_clock::now() - dispatch_start);
 	}
 
 	tox_events_free(events);
 
+	if (!_first_connect_reported && tox_self_get_connection_status(_tox) != TOX_CONNECTION_NONE) {
+		_first_connect_reported = true;
+		std::cout << "TOX first DHT connect after " << std::chrono::duration<double>(std::chrono::steady_clock::now() - _start_time).count() << "s\n";
+	}
+
+	{ // try_lock, the tox thread never waits on the saver, the copy catches up next time
+		std::unique_lock lock{_saver_mutex, std::try_to_lock};
+		if (lock.owns_lock() && _save_stats.durations.count() != _iterate_stats.save.count()) {
+			_iterate_stats.save = _save_stats.durations;
+		}
+	}
+
 	if (_tox_profile_dirty) {
-		saveToxProfile();
+		const auto now = std::chrono::steady_clock::now();
+		if (now - _tox_profile_dirty_last >= _save_debounce || now - _tox_profile_dirty_first >= _save_max_latency) {
+			saveToxProfile();
+		}
 	}
 
 	return true;
 }
 
 void ToxClient::subscribeRaw(std::function<void(const Tox_Events*)> fn) {
-	_subscriber_raw = fn;
+	_subscribers_raw.push_back(std::move(fn));
+}
+
+void ToxClient::subscribeRawDone(std::function<void(const Tox_Events*)> fn) {
+	_subscribers_raw_done.push_back(std::move(fn));
 }
 
 void ToxClient::saveToxProfile(void) {
+	_tox_profile_dirty = false;
+
 	if (_tox_profile_path.empty()) {
 		return;
 	}
-	std::cout << "TOX saving\n";
 
+	// the snapshot has to happen on the tox thread, the writing does not
 	std::vector<uint8_t> data{};
 	data.resize(tox_get_savedata_size(_tox));
 	tox_get_savedata(_tox, data.data());
 
-	std::ofstream ofile{_tox_profile_path, std::ios::binary};
-	// TODO: improve
-	for (const auto& ch : data) {
-		ofile.put(ch);
+	{
+		std::lock_guard lock{_saver_mutex};
+		_saver_pending = std::move(data); // replaces an unwritten older snapshot
 	}
-	ofile.close(); // TODO: do i need this
 
-	_tox_profile_dirty = false;
+	if (!_saver_thread.joinable()) {
+		_saver_thread = std::thread{&ToxClient::saverThread, this};
+	} else {
+		_saver_cv.notify_one();
+	}
+}
+
+void ToxClient::saverThread(void) {
+	std::unique_lock lock{_saver_mutex};
+	while (true) {
+		_saver_cv.wait(lock, [this]() { return _saver_stop || _saver_pending.has_value(); });
+
+		if (!_saver_pending.has_value()) {
+			break; // stop, and nothing left to write
+		}
+
+		const auto data = std::move(_saver_pending.value());
+		_saver_pending.reset();
+		const auto path = _tox_profile_path;
+
+		lock.unlock();
+
+		std::cout << "TOX saving\n";
+		const auto start = std::chrono::steady_clock::now();
+		const bool ok = writeFileAtomic(path, data);
+		const auto duration = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start);
+
+		lock.lock();
+
+		if (ok) {
+			_save_stats.saves++;
+			_save_stats.last_size = data.size();
+			_save_stats.last_duration = duration;
+			_save_stats.max_duration = std::max(_save_stats.max_duration, duration);
+			_save_stats.total_duration += duration;
+			_save_stats.durations.record(duration);
+		} else {
+			_save_stats.failures++;
+			std::cerr << "TOX error: saving profile to " << path << " failed\n";
+		}
+	}
 }
 
+bool ToxClient::writeFileAtomic(const std::string& path, const std::vector<uint8_t>& data) {
+	const std::string tmp_path = path + ".tmp";
+
+#if !defined(_WIN32)
+	const int fd = open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+	if (fd < 0) {
+		return false;
+	}
+
+	size_t written = 0;
+	while (written < data.size()) {
+		const ssize_t res = write(fd, data.data() + written, data.size() - written);
+		if (res < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			close(fd);
+			return false;
+		}
+		written += res;
+	}
+
+	if (fsync(fd) != 0) {
+		close(fd);
+		return false;
+	}
+	close(fd);
+
+	if (rename(tmp_path.c_str(), path.c_str()) != 0) {
+		return false;
+	}
+
+	{ // make the rename itself durable
+		auto dir = std::filesystem::path{path}.parent_path();
+		if (dir.empty()) {
+			dir = ".";
+		}
+		const int dir_fd = open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		if (dir_fd >= 0) {
+			fsync(dir_fd);
+			close(dir_fd);
+		}
+	}
+
+	return true;
+#else
+	{
+		std::ofstream ofile{tmp_path, std::ios::binary | std::ios::trunc};
+		ofile.write(reinterpret_cast<const char*>(data.data()), data.size());
+		ofile.flush();
+		if (!ofile.good()) {
+			return false;
+		}
+	}
+
+	std::error_code ec;
+	std::filesystem::rename(tmp_path, path, ec); // replaces
+	return !ec;
+#endif
+}
+
+int ToxClient::netSocket(void* obj, int domain, int type, int proto) {
+	const Network* sys_ns = system_network();
+	const int sock = sys_ns->funcs->socket(sys_ns->obj, domain, type, proto);
+	if (sock >= 0) {
+		auto* tc = static_cast<ToxClient*>(obj);
+		tc->_tox_sockets.emplace(sock);
+		tc->_tox_sockets_generation++;
+	}
+	return sock;
+}
+
+int ToxClient::netAccept(void* obj, int sock) {
+	const Network* sys_ns = system_network();
+	const int new_sock = sys_ns->funcs->accept(sys_ns->obj, sock);
+	if (new_sock >= 0) {
+		auto* tc = static_cast<ToxClient*>(obj);
+		tc->_tox_sockets.emplace(new_sock);
+		tc->_tox_sockets_generation++;
+	}
+	return new_sock;
+}
+
+int ToxClient::netClose(void* obj, int sock) {
+	auto* tc = static_cast<ToxClient*>(obj);
+	if (tc->_tox_sockets.erase(sock) > 0) {
+		tc->_tox_sockets_generation++;
+	}
+
+	const Network* sys_ns = system_network();
+	return sys_ns->funcs->close(sys_ns->obj, sock);
+}
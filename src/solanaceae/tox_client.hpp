@@ -4,26 +4,99 @@
 #include <solanaceae/toxcore/tox_event_interface.hpp>
 #include <solanaceae/toxcore/tox_event_provider_base.hpp>
 
+#include "./latency_histogram.hpp"
+
 #include <string>
 #include <string_view>
 #include <vector>
+#include <set>
 #include <chrono>
 #include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <optional>
 
 struct ToxEventI;
 
 class ToxClient : public ToxDefaultImpl, public ToxEventProviderBase {
+	public:
+		struct SaveStats {
+			uint64_t requests {0}; // setDirty() calls, most get coalesced
+			uint64_t saves {0};
+			uint64_t failures {0};
+
+			size_t last_size {0};
+			std::chrono::microseconds last_duration {0};
+			std::chrono::microseconds max_duration {0};
+			std::chrono::microseconds total_duration {0};
+			LatencyHistogram durations; // successful saves
+		};
+
+		struct BootstrapNode {
+			std::string host;
+			uint16_t port {0};
+			std::vector<uint8_t> public_key; // TOX_PUBLIC_KEY_SIZE
+			bool tcp_relay {true}; // also use it as tcp relay
+		};
+
+		struct NetworkOptions {
+			bool ipv6 {true};
+			bool udp {true};
+			bool local_discovery {true};
+			uint16_t start_port {0}; // 0 for the tox default range
+			uint16_t end_port {0};
+			// nullopt for the public nodes, an empty list for none (eg. the first of a local network)
+			std::optional<std::vector<BootstrapNode>> bootstrap;
+		};
+
+		struct IterateStats {
+			LatencyHistogram events_iterate; // tox_events_iterate()
+			LatencyHistogram dispatch; // raw subscriber and event handlers
+			// SaveStats::durations, copied over in iterate(), so it can be read on the tox thread (eg. metrics)
+			LatencyHistogram save;
+		};
+
 	private:
 		bool _should_stop {false};
 
-		std::function<void(const Tox_Events*)> _subscriber_raw {[](const auto*) {}}; // only 1?
+		// called in subscription order, before the event handlers
+		std::vector<std::function<void(const Tox_Events*)>> _subscribers_raw;
+		// after the event handlers, before the batch gets freed
+		std::vector<std::function<void(const Tox_Events*)>> _subscribers_raw_done;
 
 		std::chrono::time_point<std::chrono::high_resolution_clock> _last_time {std::chrono::high_resolution_clock::now()};
 
 		std::string _self_name;
 
+		// startup timing
+		std::chrono::steady_clock::time_point _start_time {std::chrono::steady_clock::now()};
+		bool _first_connect_reported {false};
+
 		std::string _tox_profile_path;
 		bool _tox_profile_dirty {true}; // set in callbacks
+		uint64_t _tox_profile_dirty_requests {0};
+
+		// a save is started once it stayed clean for the debounce time,
+		// or at the latest max latency after it first became dirty
+		std::chrono::milliseconds _save_debounce {1000};
+		std::chrono::milliseconds _save_max_latency {10000};
+		std::chrono::steady_clock::time_point _tox_profile_dirty_first;
+		std::chrono::steady_clock::time_point _tox_profile_dirty_last;
+
+		// background saver, writes snapshots off the tox thread
+		std::thread _saver_thread;
+		std::mutex _saver_mutex;
+		std::condition_variable _saver_cv;
+		bool _saver_stop {false}; // guarded by _saver_mutex
+		std::optional<std::vector<uint8_t>> _saver_pending; // guarded by _saver_mutex, only the newest snapshot is kept
+		SaveStats _save_stats; // guarded by _saver_mutex
+
+		IterateStats _iterate_stats;
+
+		// sockets tox has open, tracked by wrapping the system network
+		std::set<int> _tox_sockets;
+		uint64_t _tox_sockets_generation {0};
 
 		//std::vector<uint8_t> _join_group_after_dht_connect;
 
@@ -39,18 +112,26 @@ class ToxClient : public ToxDefaultImpl, public ToxEventProviderBase {
 	public:
 		//ToxClient(/*const CommandLine& cl*/);
 		ToxClient(std::string_view save_path);
+		ToxClient(std::string_view save_path, const NetworkOptions& network_options);
 		~ToxClient(void);
 
 	public: // tox stuff
 		Tox* getTox(void) { return _tox; }
 
-		void setDirty(void) { _tox_profile_dirty = true; }
+		void setDirty(void);
 
 		// returns false when we shoul stop the program
 		bool iterate(void);
 		void stop(void); // let it know it should exit
 
+		// eg. for polling, changes whenever getToxSocketsGeneration() does
+		const std::set<int>& getToxSockets(void) const { return _tox_sockets; }
+		uint64_t getToxSocketsGeneration(void) const { return _tox_sockets_generation; }
+
 		void setToxProfilePath(const std::string& new_path) { _tox_profile_path = new_path; }
+		void setSaveDebounce(std::chrono::milliseconds debounce, std::chrono::milliseconds max_latency) { _save_debounce = debounce; _save_max_latency = max_latency; }
+		SaveStats getSaveStats(void);
+		const IterateStats& getIterateStats(void) const { return _iterate_stats; }
 		void setSelfName(std::string_view new_name) { _self_name = new_name; toxSelfSetName(new_name); }
 
 		//std::string_view getGroupPeerName(uint32_t group_number, uint32_t peer_number) const;
@@ -75,9 +156,24 @@ class ToxClient : public ToxDefaultImpl, public ToxEventProviderBase {
 #endif
 
 	public: // raw events
+		// every batch of tox_events_iterate() with events in it, eg. for the lua module and the event recorder
 		void subscribeRaw(std::function<void(const Tox_Events*)> fn);
+		// same batch again once it is dispatched
+		void subscribeRawDone(std::function<void(const Tox_Events*)> fn);
+
+		// public nodes, ideally close to us
+		static std::vector<BootstrapNode> defaultBootstrapNodes(void);
 
 	private:
+		// snapshots the savedata and hands it to the saver thread
 		void saveToxProfile(void);
+		void saverThread(void);
+		// temp file, fsync, rename
+		static bool writeFileAtomic(const std::string& path, const std::vector<uint8_t>& data);
+
+		// Network_Funcs hooks, obj is the ToxClient
+		static int netSocket(void* obj, int domain, int type, int proto);
+		static int netAccept(void* obj, int sock);
+		static int netClose(void* obj, int sock);
 };
 
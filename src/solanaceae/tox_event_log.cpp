@@ -0,0 +1,273 @@
+#include "./tox_event_log.hpp"
+
+#include <algorithm>
+#include <string>
+#include <string_view>
+#include <iostream>
+#include <cstring>
+
+static constexpr std::string_view log_magic {"TLMEVLG1"};
+static constexpr std::string_view log_extension {".tlmev"};
+static constexpr std::string_view index_extension {".idx"};
+static constexpr size_t record_header_size = 8 + 4;
+static constexpr size_t index_entry_size = 8 + 8 + 4;
+
+template<typename T>
+static void putNum(uint8_t* out, T value) {
+	std::memcpy(out, &value, sizeof(T));
+}
+
+template<typename T>
+static T getNum(const uint8_t* data) {
+	T value;
+	std::memcpy(&value, data, sizeof(T));
+	return value;
+}
+
+static std::filesystem::path indexPath(const std::filesystem::path& log_path) {
+	auto path = log_path;
+	path += index_extension;
+	return path;
+}
+
+ToxEventRecorder::ToxEventRecorder(std::filesystem::path dir) : _dir(std::move(dir)) {
+	std::error_code ec;
+	std::filesystem::create_directories(_dir, ec);
+	if (ec) {
+		std::cerr << "TER error: creating " << _dir << ": " << ec.message() << "\n";
+	}
+}
+
+void ToxEventRecorder::setRotation(size_t max_file_size, std::chrono::seconds max_file_age, size_t max_files) {
+	_max_file_size = max_file_size;
+	_max_file_age = max_file_age;
+	_max_files = max_files;
+}
+
+void ToxEventRecorder::record(const Tox_Events* events) {
+	if (events == nullptr) {
+		return;
+	}
+
+	const uint32_t size = tox_events_bytes_size(events);
+	if (size <= 1) {
+		return; // just the empty array
+	}
+
+	if (!_log.is_open()
+		|| _log_size >= _max_file_size
+		|| std::chrono::steady_clock::now() - _log_opened >= _max_file_age
+	) {
+		if (!openLog()) {
+			_stats.errors++;
+			return;
+		}
+	}
+
+	const uint64_t time = std::chrono::duration_cast<std::chrono::microseconds>(
+		std::chrono::system_clock::now().time_since_epoch()
+	).count();
+
+	_buffer.resize(record_header_size + size);
+	putNum<uint64_t>(_buffer.data(), time);
+	putNum<uint32_t>(_buffer.data() + 8, size);
+	tox_events_get_bytes(events, _buffer.data() + record_header_size);
+
+	uint8_t index_entry[index_entry_size];
+	putNum<uint64_t>(index_entry, _log_size);
+	putNum<uint64_t>(index_entry + 8, time);
+	putNum<uint32_t>(index_entry + 16, size);
+
+	_log.write(reinterpret_cast<const char*>(_buffer.data()), _buffer.size());
+	_log.flush();
+	// the index goes second, readers scan whatever the index misses
+	_index.write(reinterpret_cast<const char*>(index_entry), index_entry_size);
+	_index.flush();
+
+	if (!_log.good() || !_index.good()) {
+		std::cerr << "TER error: writing " << _log_path << "\n";
+		_stats.errors++;
+		closeLog(); // next batch starts a new log
+		return;
+	}
+
+	_log_size += _buffer.size();
+	_stats.batches++;
+	_stats.bytes += _buffer.size();
+}
+
+bool ToxEventRecorder::openLog(void) {
+	closeLog();
+
+	// fixed width, so the names sort by time
+	const uint64_t now_us = std::chrono::duration_cast<std::chrono::microseconds>(
+		std::chrono::system_clock::now().time_since_epoch()
+	).count();
+	std::string name = std::to_string(now_us);
+	name.insert(0, name.size() < 20 ? 20 - name.size() : 0, '0');
+
+	_log_path = _dir / ("events-" + name + std::string{log_extension});
+
+	_log.open(_log_path, std::ios::binary | std::ios::trunc);
+	_index.open(indexPath(_log_path), std::ios::binary | std::ios::trunc);
+	if (!_log.is_open() || !_index.is_open()) {
+		std::cerr << "TER error: can not create " << _log_path << "\n";
+		closeLog();
+		return false;
+	}
+
+	_log.write(log_magic.data(), log_magic.size());
+	_log_size = log_magic.size();
+	_log_opened = std::chrono::steady_clock::now();
+	_stats.files++;
+
+	std::cout << "TER recording events to " << _log_path << "\n";
+
+	pruneLogs();
+
+	return true;
+}
+
+void ToxEventRecorder::closeLog(void) {
+	if (_log.is_open()) {
+		_log.close();
+	}
+	if (_index.is_open()) {
+		_index.close();
+	}
+	_log.clear();
+	_index.clear();
+}
+
+void ToxEventRecorder::pruneLogs(void) {
+	if (_max_files == 0) {
+		return;
+	}
+
+	const auto logs = ToxEventLogReader::listLogs(_dir);
+	if (logs.size() <= _max_files) {
+		return;
+	}
+
+	for (size_t i = 0; i < logs.size() - _max_files; i++) {
+		if (logs[i] == _log_path) {
+			continue;
+		}
+
+		std::error_code ec;
+		std::filesystem::remove(logs[i], ec);
+		std::filesystem::remove(indexPath(logs[i]), ec);
+	}
+}
+
+bool ToxEventLogReader::open(const std::filesystem::path& path) {
+	_entries.clear();
+	_log.close();
+	_log.clear();
+
+	_log.open(path, std::ios::binary);
+	if (!_log.is_open()) {
+		return false;
+	}
+
+	char magic[log_magic.size()];
+	if (!_log.read(magic, sizeof(magic)) || std::string_view{magic, sizeof(magic)} != log_magic) {
+		_log.close();
+		return false;
+	}
+
+	std::error_code ec;
+	const uint64_t file_size = std::filesystem::file_size(path, ec);
+	if (ec) {
+		_log.close();
+		return false;
+	}
+
+	uint64_t offset = log_magic.size();
+
+	if (std::ifstream index{indexPath(path), std::ios::binary}; index.is_open()) {
+		uint8_t index_entry[index_entry_size];
+		while (index.read(reinterpret_cast<char*>(index_entry), index_entry_size)) {
+			Entry entry;
+			entry.offset = getNum<uint64_t>(index_entry);
+			entry.time = getNum<uint64_t>(index_entry + 8);
+			entry.size = getNum<uint32_t>(index_entry + 16);
+
+			// an index that does not line up with the log is not trusted any further
+			if (entry.offset != offset || entry.offset + record_header_size + entry.size > file_size) {
+				break;
+			}
+
+			_entries.push_back(entry);
+			offset += record_header_size + entry.size;
+		}
+	}
+
+	// records the index does not know about
+	while (offset + record_header_size <= file_size) {
+		uint8_t header[record_header_size];
+		_log.seekg(offset);
+		if (!_log.read(reinterpret_cast<char*>(header), record_header_size)) {
+			break;
+		}
+
+		Entry entry;
+		entry.offset = offset;
+		entry.time = getNum<uint64_t>(header);
+		entry.size = getNum<uint32_t>(header + 8);
+		if (offset + record_header_size + entry.size > file_size) {
+			break; // truncated
+		}
+
+		_entries.push_back(entry);
+		offset += record_header_size + entry.size;
+	}
+
+	_log.clear();
+	return true;
+}
+
+size_t ToxEventLogReader::find(uint64_t time) const {
+	const auto it = std::lower_bound(_entries.cbegin(), _entries.cend(), time, [](const Entry& entry, uint64_t t) {
+		return entry.time < t;
+	});
+	return static_cast<size_t>(it - _entries.cbegin());
+}
+
+Tox_Events* ToxEventLogReader::load(size_t i) {
+	if (i >= _entries.size()) {
+		return nullptr;
+	}
+
+	const auto& entry = _entries[i];
+	_buffer.resize(entry.size);
+
+	_log.seekg(entry.offset + record_header_size);
+	if (!_log.read(reinterpret_cast<char*>(_buffer.data()), entry.size)) {
+		_log.clear();
+		return nullptr;
+	}
+
+	return tox_events_load(_buffer.data(), entry.size);
+}
+
+std::vector<std::filesystem::path> ToxEventLogReader::listLogs(const std::filesystem::path& dir) {
+	std::vector<std::filesystem::path> logs;
+
+	std::error_code ec;
+	for (const auto& dir_entry : std::filesystem::directory_iterator{dir, ec}) {
+		if (dir_entry.is_regular_file() && dir_entry.path().extension() == log_extension) {
+			logs.push_back(dir_entry.path());
+		}
+	}
+
+	std::sort(logs.begin(), logs.end());
+	return logs;
+}
+
+bool ToxEventLogReader::isLog(const std::filesystem::path& path) {
+	std::ifstream file{path, std::ios::binary};
+	char magic[log_magic.size()];
+	return file.read(magic, sizeof(magic)) && std::string_view{magic, sizeof(magic)} == log_magic;
+}
+
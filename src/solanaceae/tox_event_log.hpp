@@ -0,0 +1,92 @@
+#pragma once
+
+#include <tox/tox_events.h>
+
+#include <filesystem>
+#include <fstream>
+#include <vector>
+#include <chrono>
+#include <cstdint>
+
+// event logs, the raw batches of tox_events_iterate() with the time they came in
+// "TLMEVLG1" then records of time:u64 (us since epoch) size:u32 tox_events_get_bytes(), host byte order
+// every log has an index next to it (<log>.idx) with offset:u64 time:u64 size:u32 per record
+
+// appends every batch it gets to the current log in a directory (see ToxClient::subscribeRaw)
+// starts a new log once the current one is too big or too old, and deletes the oldest ones past a count
+class ToxEventRecorder {
+	public:
+		struct Stats {
+			uint64_t batches {0};
+			uint64_t bytes {0};
+			uint64_t files {0};
+			uint64_t errors {0};
+		};
+
+	private:
+		std::filesystem::path _dir;
+
+		size_t _max_file_size {64*1024*1024};
+		std::chrono::seconds _max_file_age {60*60};
+		size_t _max_files {24};
+
+		std::filesystem::path _log_path;
+		std::ofstream _log;
+		std::ofstream _index;
+		uint64_t _log_size {0};
+		std::chrono::steady_clock::time_point _log_opened;
+
+		std::vector<uint8_t> _buffer; // reused for every batch
+
+		Stats _stats;
+
+	public:
+		explicit ToxEventRecorder(std::filesystem::path dir);
+
+		// a max_files of 0 keeps all of them
+		void setRotation(size_t max_file_size, std::chrono::seconds max_file_age, size_t max_files);
+
+		// empty batches are skipped, written through right away so a crash loses nothing
+		void record(const Tox_Events* events);
+
+		const Stats& getStats(void) const { return _stats; }
+
+	private:
+		bool openLog(void);
+		void closeLog(void);
+		void pruneLogs(void);
+};
+
+// reads the batches of one log, a truncated tail (eg. after a crash) is ignored
+class ToxEventLogReader {
+	public:
+		struct Entry {
+			uint64_t offset {0}; // of the record
+			uint64_t time {0}; // us since epoch
+			uint32_t size {0};
+		};
+
+	private:
+		std::ifstream _log;
+		std::vector<Entry> _entries;
+		std::vector<uint8_t> _buffer;
+
+	public:
+		// false if it is not an event log
+		// takes the index if there is one, the records after it (or all without one) are scanned
+		bool open(const std::filesystem::path& path);
+
+		size_t size(void) const { return _entries.size(); }
+		const Entry& entry(size_t i) const { return _entries.at(i); }
+
+		// index of the first batch at or after time, size() if there is none
+		size_t find(uint64_t time) const;
+
+		// nullptr if the record is broken, free with tox_events_free()
+		Tox_Events* load(size_t i);
+
+		// logs in a directory, oldest first
+		static std::vector<std::filesystem::path> listLogs(const std::filesystem::path& dir);
+		static bool isLog(const std::filesystem::path& path);
+};
+
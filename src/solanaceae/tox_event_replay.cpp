@@ -0,0 +1,81 @@
+#include "./tox_event_replay.hpp"
+
+#include <algorithm>
+#include <iostream>
+
+ToxEventReplay::ToxEventReplay(std::vector<std::filesystem::path> logs, std::function<void(const Tox_Events*)> dispatch) :
+	_logs(std::move(logs)), _dispatch(std::move(dispatch))
+{
+}
+
+bool ToxEventReplay::current(void) {
+	while (!_reader_open || _entry >= _reader.size()) {
+		if (_next_log >= _logs.size()) {
+			return false;
+		}
+
+		const auto& path = _logs[_next_log++];
+		_reader_open = _reader.open(path);
+		_entry = 0;
+		if (!_reader_open) {
+			std::cerr << "TER error: " << path << " is not an event log\n";
+		}
+	}
+	return true;
+}
+
+ToxEventReplay::clock::time_point ToxEventReplay::dueOf(const ToxEventLogReader::Entry& entry) {
+	if (!_started) {
+		_started = true;
+		_base_time = entry.time;
+		_base_due = clock::now();
+		_last_time = entry.time;
+		_last_due = _base_due;
+	} else if (entry.time < _last_time || entry.time - _last_time > static_cast<uint64_t>(_max_gap.count())) {
+		// clock jump or a long pause, continue at most max gap after the last one
+		const auto gap = entry.time < _last_time ? std::chrono::microseconds{0} : _max_gap;
+		_base_time = entry.time;
+		_base_due = _last_due + std::chrono::duration_cast<clock::duration>(gap / _speed);
+	}
+
+	return _base_due + std::chrono::duration_cast<clock::duration>(std::chrono::microseconds{entry.time - _base_time} / _speed);
+}
+
+bool ToxEventReplay::iterate(void) {
+	if (!current()) {
+		return false;
+	}
+
+	const auto& entry = _reader.entry(_entry);
+
+	if (_speed > 0.0) {
+		const auto due = dueOf(entry);
+		const auto now = clock::now();
+		if (now < due) {
+			return true;
+		}
+
+		_stats.max_lag = std::max(_stats.max_lag, std::chrono::duration_cast<std::chrono::microseconds>(now - due));
+		_last_time = entry.time;
+		_last_due = due;
+	}
+
+	if (auto* events = _reader.load(_entry); events != nullptr) {
+		_dispatch(events);
+		tox_events_free(events);
+		_stats.batches++;
+	} else {
+		_stats.broken++;
+	}
+	_entry++;
+
+	return true;
+}
+
+ToxEventReplay::clock::time_point ToxEventReplay::nextDue(void) {
+	if (_speed <= 0.0 || !current()) {
+		return clock::now();
+	}
+	return dueOf(_reader.entry(_entry));
+}
+
@@ -0,0 +1,66 @@
+#pragma once
+
+#include "./tox_event_log.hpp"
+
+#include <filesystem>
+#include <vector>
+#include <functional>
+#include <chrono>
+#include <cstdint>
+
+// plays event logs back in order, paced like they were recorded or as fast as possible
+// one batch per iterate(), like tox hands them out
+class ToxEventReplay {
+	public:
+		using clock = std::chrono::steady_clock;
+
+		struct Stats {
+			uint64_t batches {0};
+			uint64_t broken {0}; // records that did not load
+			std::chrono::microseconds max_lag {0}; // behind the recorded pace
+		};
+
+	private:
+		std::vector<std::filesystem::path> _logs;
+		size_t _next_log {0};
+
+		ToxEventLogReader _reader;
+		size_t _entry {0};
+		bool _reader_open {false};
+
+		std::function<void(const Tox_Events*)> _dispatch;
+
+		double _speed {1.0}; // 0 for as fast as possible
+		std::chrono::microseconds _max_gap {std::chrono::seconds{10}};
+
+		// recorded time -> replay time, moved on clock jumps and long pauses
+		bool _started {false};
+		uint64_t _base_time {0};
+		clock::time_point _base_due;
+		uint64_t _last_time {0};
+		clock::time_point _last_due;
+
+		Stats _stats;
+
+	public:
+		ToxEventReplay(std::vector<std::filesystem::path> logs, std::function<void(const Tox_Events*)> dispatch);
+
+		// eg. 2 plays twice as fast as recorded, 0 as fast as possible
+		void setSpeed(double speed) { _speed = speed; }
+		// pauses longer than this (eg. between two runs) get cut short
+		void setMaxGap(std::chrono::microseconds max_gap) { _max_gap = max_gap; }
+
+		// dispatches the next batch if it is due, false once everything got played
+		bool iterate(void);
+
+		// when the next batch is due, now if there is none or the speed is 0
+		clock::time_point nextDue(void);
+
+		const Stats& getStats(void) const { return _stats; }
+
+	private:
+		// opens logs until there is an entry to play
+		bool current(void);
+		clock::time_point dueOf(const ToxEventLogReader::Entry& entry);
+};
+
@@ -1,52 +1,685 @@
 #include "./transfer_manager.hpp"
 
+#include "./mapped_file.hpp"
+
 #include <solanaceae/toxcore/tox_interface.hpp>
 
 #include <memory>
 #include <vector>
+#include <algorithm>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
 #include <cassert>
+#include <cstring>
+
+#if !defined(_WIN32)
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <cerrno>
+#endif
 
 struct FileRMem : public TransferManager::FileRI {
-	std::vector<uint8_t> data;
+	std::shared_ptr<const std::vector<uint8_t>> data;
 
-	FileRMem(const std::vector<uint8_t>& data_) : data(data_) {}
+	FileRMem(std::shared_ptr<const std::vector<uint8_t>> data_) : data(std::move(data_)) {}
 	virtual ~FileRMem(void) {}
 
-	std::vector<uint8_t> read(uint64_t pos, uint32_t size) {
-		if (pos >= data.size()) {
+	uint64_t size(void) const override {
+		return data->size();
+	}
+
+	TransferManager::ChunkView read(uint64_t pos, uint32_t size, std::vector<uint8_t>&) override {
+		if (pos >= data->size()) {
+			return {};
+		}
+
+		return {data->data() + pos, static_cast<size_t>(std::min<uint64_t>(size, data->size() - pos))};
+	}
+};
+
+struct FileRMapped : public TransferManager::FileRI {
+	MappedFile file;
+
+	FileRMapped(MappedFile&& file_) : file(std::move(file_)) {}
+	virtual ~FileRMapped(void) {}
+
+	uint64_t size(void) const override {
+		return file.size();
+	}
+
+	TransferManager::ChunkView read(uint64_t pos, uint32_t size, std::vector<uint8_t>&) override {
+		if (pos >= file.size()) {
 			return {};
 		}
 
-		// TODO: optimize
-		std::vector<uint8_t> chunk;
-		for (size_t i = 0; i < size && i+pos < data.size(); i++) {
-			chunk.push_back(data[pos+i]);
+		return {file.data() + pos, static_cast<size_t>(std::min<uint64_t>(size, file.size() - pos))};
+	}
+};
+
+// reads each chunk from disk as it is requested
+// non seekable files (pipes) are streams, they keep the last chunk around, since tox might seek back to it
+// streams are non blocking, a chunk is only handed out once it is full (a short one ends the transfer)
+// until then read() says again, and the request gets served from a later iterate()
+struct FileRStream : public TransferManager::FileRI {
+#if !defined(_WIN32)
+	int fd {-1};
+#else
+	std::ifstream file;
+#endif
+	uint64_t file_size {UINT64_MAX};
+	bool seekable {true};
+
+	// streams only
+	uint64_t next_pos {0};
+	uint64_t last_chunk_pos {0};
+	std::vector<uint8_t> last_chunk;
+	std::vector<uint8_t> filling; // the chunk at next_pos, read so far
+	bool writer_seen {false}; // a fifo reads as eof until a writer opens it
+	bool eof {false};
+
+	FileRStream(const std::string& path) {
+#if !defined(_WIN32)
+		// a fifo would block here until a writer shows up, and reads would block the tox thread
+		fd = open(path.c_str(), O_RDONLY | O_CLOEXEC | O_NONBLOCK);
+		if (fd < 0) {
+			return;
+		}
+
+		struct stat st;
+		if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+			file_size = static_cast<uint64_t>(st.st_size);
+#if defined(POSIX_FADV_SEQUENTIAL)
+			posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+		} else {
+			seekable = false;
+		}
+#else
+		file.open(path, std::ios::binary);
+		std::error_code ec;
+		const auto fs_size = std::filesystem::file_size(path, ec);
+		if (!ec) {
+			file_size = fs_size;
+		} else {
+			seekable = false;
+		}
+#endif
+	}
+
+	virtual ~FileRStream(void) {
+#if !defined(_WIN32)
+		if (fd >= 0) {
+			close(fd);
+		}
+#endif
+	}
+
+	bool isOpen(void) const {
+#if !defined(_WIN32)
+		return fd >= 0;
+#else
+		return file.is_open();
+#endif
+	}
+
+	uint64_t size(void) const override {
+		return file_size;
+	}
+
+	// reads until size or eof, returns bytes read
+	size_t readAt(uint64_t pos, uint8_t* dst, size_t size) {
+		size_t done = 0;
+#if !defined(_WIN32)
+		while (done < size) {
+			const ssize_t ret = seekable
+				? pread(fd, dst + done, size - done, static_cast<off_t>(pos + done))
+				: ::read(fd, dst + done, size - done)
+			;
+			if (ret < 0 && errno == EINTR) {
+				continue;
+			}
+			if (ret <= 0) {
+				break; // eof or error, the transfer ends short
+			}
+			done += static_cast<size_t>(ret);
+		}
+#else
+		if (seekable) {
+			file.clear();
+			file.seekg(static_cast<std::streamoff>(pos));
+		}
+		file.read(reinterpret_cast<char*>(dst), static_cast<std::streamsize>(size));
+		done = static_cast<size_t>(file.gcount());
+#endif
+		return done;
+	}
+
+	TransferManager::ChunkView read(uint64_t pos, uint32_t size, std::vector<uint8_t>& buffer) override {
+		if (seekable) {
+			if (pos >= file_size) {
+				return {};
+			}
+			buffer.resize(static_cast<size_t>(std::min<uint64_t>(size, file_size - pos)));
+			buffer.resize(readAt(pos, buffer.data(), buffer.size()));
+			return {buffer.data(), buffer.size()};
+		}
+
+		if (pos == last_chunk_pos && pos != next_pos) {
+			// seek back to a chunk that failed to send
+			return {last_chunk.data(), std::min<size_t>(size, last_chunk.size())};
+		}
+
+		if (pos != next_pos) {
+			return {}; // can not seek in a stream
+		}
+
+#if !defined(_WIN32)
+		if (!fill(size)) {
+			return {nullptr, 0, true};
+		}
+		last_chunk.swap(filling);
+		filling.clear();
+#else
+		last_chunk.resize(size);
+		last_chunk.resize(readAt(pos, last_chunk.data(), last_chunk.size()));
+#endif
+		last_chunk_pos = pos;
+		next_pos = pos + last_chunk.size();
+		return {last_chunk.data(), last_chunk.size()};
+	}
+
+#if !defined(_WIN32)
+	// reads what is there into filling, true once it holds size bytes or the stream ended
+	bool fill(size_t size) {
+		while (filling.size() < size && !eof) {
+			const size_t have = filling.size();
+			filling.resize(size);
+			const ssize_t ret = ::read(fd, filling.data() + have, size - have);
+			filling.resize(have + static_cast<size_t>(std::max<ssize_t>(ret, 0)));
+
+			if (ret > 0) {
+				writer_seen = true;
+			} else if (ret < 0 && errno == EINTR) {
+				continue;
+			} else if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+				writer_seen = true; // only with a writer attached, eof otherwise
+				return false;
+			} else if (ret == 0 && !writer_seen) {
+				return false; // nobody opened the other end yet
+			} else {
+				eof = true; // or an error, the transfer ends short
+			}
 		}
-		return chunk;
+		return true;
 	}
+#endif
 };
 
-TransferManager::TransferManager(ToxI& t, ToxEventProviderI& tep) : _t(t) {
+struct TransferManager::RecvFile {
+#if !defined(_WIN32)
+	int fd {-1};
+#else
+	std::fstream file;
+#endif
+	std::string path;
+	std::string part_path;
+	std::string resume_path;
+	std::string file_id_hex;
+	uint64_t size {UINT64_MAX};
+
+	// writer thread only
+	uint64_t written_end {0}; // everything before this is on disk
+	bool failed {false};
+
+	bool open(bool truncate) {
+#if !defined(_WIN32)
+		fd = ::open(part_path.c_str(), O_WRONLY | O_CREAT | O_CLOEXEC | (truncate ? O_TRUNC : 0), 0644);
+		return fd >= 0;
+#else
+		if (truncate || !std::filesystem::exists(part_path)) {
+			std::ofstream{part_path, std::ios::binary | std::ios::trunc};
+		}
+		file.open(part_path, std::ios::binary | std::ios::in | std::ios::out);
+		return file.is_open();
+#endif
+	}
+
+	// reserve the space up front, less fragmentation and an early error if the disk is full
+	void preallocate(void) {
+		if (size == UINT64_MAX || size == 0) {
+			return;
+		}
+#if defined(__linux__)
+		if (fallocate(fd, 0, 0, static_cast<off_t>(size)) == 0) {
+			return;
+		}
+#endif
+#if !defined(_WIN32)
+		posix_fallocate(fd, 0, static_cast<off_t>(size));
+#endif
+	}
+
+	bool write(uint64_t pos, const uint8_t* data, size_t data_size) {
+#if !defined(_WIN32)
+		size_t done = 0;
+		while (done < data_size) {
+			const ssize_t ret = pwrite(fd, data + done, data_size - done, static_cast<off_t>(pos + done));
+			if (ret < 0 && errno == EINTR) {
+				continue;
+			}
+			if (ret <= 0) {
+				return false;
+			}
+			done += static_cast<size_t>(ret);
+		}
+		return true;
+#else
+		file.seekp(static_cast<std::streamoff>(pos));
+		file.write(reinterpret_cast<const char*>(data), static_cast<std::streamsize>(data_size));
+		return file.good();
+#endif
+	}
+
+	// synced either way, the rename and the resume record both promise the data is on disk
+	void close(void) {
+#if !defined(_WIN32)
+		if (fd >= 0) {
+			fsync(fd);
+			::close(fd);
+			fd = -1;
+		}
+#else
+		file.close();
+#endif
+	}
+
+	// "<file id> <written_end>", tells a later offer of the same file where to continue
+	void writeResume(void) const {
+		const auto tmp_path = resume_path + ".tmp";
+		{
+			std::ofstream ofile{tmp_path, std::ios::trunc};
+			ofile << file_id_hex << " " << written_end << "\n";
+		}
+		std::error_code ec;
+		std::filesystem::rename(tmp_path, resume_path, ec);
+	}
+
+	uint64_t readResume(void) const {
+		std::ifstream ifile{resume_path};
+		std::string id;
+		uint64_t pos {0};
+		if (!(ifile >> id >> pos) || id != file_id_hex || pos >= size) {
+			return 0;
+		}
+
+		// the record alone is not enough, the .part might be gone or cut short
+		// and reopening it would quietly create a file with a zero filled head
+		std::error_code ec;
+		const auto part_size = std::filesystem::file_size(part_path, ec);
+		if (ec || part_size < pos) {
+			return 0;
+		}
+
+		return pos;
+	}
+};
+
+static std::string toHex(const std::vector<uint8_t>& data) {
+	static constexpr const char* digits = "0123456789abcdef";
+	std::string hex;
+	hex.reserve(data.size() * 2);
+	for (const uint8_t byte : data) {
+		hex.push_back(digits[byte >> 4]);
+		hex.push_back(digits[byte & 0xf]);
+	}
+	return hex;
+}
+
+TransferManager::RecvPolicy TransferManager::recvIntoDir(std::string dir, uint64_t max_size) {
+	return [dir = std::move(dir), max_size](uint32_t, uint32_t file_kind, uint64_t file_size, std::string_view filename) -> std::optional<std::string> {
+		if (file_kind != TOX_FILE_KIND_DATA || file_size > max_size) {
+			return std::nullopt;
+		}
+
+		// never trust the sender with paths
+		const auto name = std::filesystem::path{std::string{filename}}.filename();
+		if (name.empty() || name == "." || name == "..") {
+			return std::nullopt;
+		}
+
+		return (std::filesystem::path{dir} / name).string();
+	};
+}
+
+TransferManager::TransferManager(ToxI& t, ToxEventProviderI& tep) :
+	_t(t),
+	_blob_cache([this](const std::vector<uint8_t>& data) { return _t.toxHash(data); }, 512ull * 1024 * 1024)
+{
 	tep.subscribe(this, Tox_Event::TOX_EVENT_FILE_RECV);
 	tep.subscribe(this, Tox_Event::TOX_EVENT_FILE_RECV_CONTROL);
 	tep.subscribe(this, Tox_Event::TOX_EVENT_FILE_RECV_CHUNK);
 	tep.subscribe(this, Tox_Event::TOX_EVENT_FILE_CHUNK_REQUEST);
+	tep.subscribe(this, Tox_Event::TOX_EVENT_FRIEND_CONNECTION_STATUS);
 }
 
 TransferManager::~TransferManager(void) {
+	// keep what we got, so it can be resumed
+	while (!_friend_transfers_receiving.empty()) {
+		auto& [friend_number, transfers] = *_friend_transfers_receiving.begin();
+		finishReceiving(friend_number, transfers.begin()->first, false);
+	}
+
+	if (_writer_thread.joinable()) {
+		{
+			std::lock_guard lock{_writer_mutex};
+			_writer_stop = true;
+		}
+		_writer_cv.notify_all();
+		_writer_thread.join();
+	}
 }
 
 void TransferManager::iterate(void) {
+	const auto now = clock::now();
+	// long stalls don't turn into huge bursts
+	const double dt = std::min(std::chrono::duration<double>(now - _last_iterate).count(), 1.0);
+	_last_iterate = now;
+
+	// buckets hold 100ms worth (but at least a few chunks), so a limit holds over short intervals too
+	const auto refill = [dt](double& tokens, uint64_t rate_limit) {
+		if (rate_limit == 0) {
+			tokens = 0.0;
+			return;
+		}
+		tokens = std::min(tokens + rate_limit * dt, std::max(rate_limit * 0.1, 4096.0));
+	};
+
+	refill(_global_tokens, _global_rate_limit);
+	for (auto& [friend_number, fs] : _friend_transfers_sending) {
+		refill(fs.tokens, _friend_shaping[friend_number].rate_limit);
+		fs.blocked = false;
+		for (auto& [file_number, sending] : fs.transfers) {
+			sending.waiting = false;
+		}
+	}
+
+	// one chunk at a time, to the friend and then the transfer that is furthest behind on its share
+	// a chunk may take a bucket below 0, it is paid back by the next refill
+	while (_global_rate_limit == 0 || _global_tokens > 0.0) {
+		FriendSending* next_fs = nullptr;
+		uint32_t next_friend_number = 0;
+		for (auto& [friend_number, fs] : _friend_transfers_sending) {
+			if (fs.blocked || (_friend_shaping[friend_number].rate_limit != 0 && fs.tokens <= 0.0)) {
+				continue;
+			}
+			const bool pending = std::any_of(fs.transfers.cbegin(), fs.transfers.cend(), [](const auto& it) { return !it.second.requests.empty() && !it.second.waiting; });
+			if (pending && (next_fs == nullptr || fs.vtime < next_fs->vtime)) {
+				next_fs = &fs;
+				next_friend_number = friend_number;
+			}
+		}
+		if (next_fs == nullptr) {
+			break;
+		}
+
+		Sending* next_s = nullptr;
+		uint32_t next_file_number = 0;
+		for (auto& [file_number, sending] : next_fs->transfers) {
+			if (sending.requests.empty() || sending.waiting) {
+				continue;
+			}
+			if (next_s == nullptr
+				|| sending.priority > next_s->priority
+				|| (sending.priority == next_s->priority && sending.vtime < next_s->vtime)
+			) {
+				next_s = &sending;
+				next_file_number = file_number;
+			}
+		}
+
+		const uint32_t length = next_s->requests.front().length;
+		if (!sendChunk(next_friend_number, next_file_number, *next_s)) {
+			next_fs->blocked = true;
+			continue;
+		}
+		if (next_s->waiting) {
+			continue;
+		}
+
+		next_fs->vtime += double(length) / _friend_shaping[next_friend_number].weight;
+		next_fs->tokens -= length;
+		_global_tokens -= length;
+	}
+
+	// catch idle transfers up, so they don't get to burst after waking up
+	double min_fs_vtime = -1.0;
+	for (auto& [friend_number, fs] : _friend_transfers_sending) {
+		double min_s_vtime = -1.0;
+		for (auto& [file_number, sending] : fs.transfers) {
+			if (!sending.requests.empty() && (min_s_vtime < 0.0 || sending.vtime < min_s_vtime)) {
+				min_s_vtime = sending.vtime;
+			}
+		}
+		for (auto& [file_number, sending] : fs.transfers) {
+			if (sending.requests.empty() && min_s_vtime >= 0.0) {
+				sending.vtime = std::max(sending.vtime, min_s_vtime);
+			}
+
+			if (sending.paused && sending.requests.size() <= _max_queued_chunks/4) {
+				if (_t.toxFileControl(friend_number, file_number, TOX_FILE_CONTROL_RESUME) == TOX_ERR_FILE_CONTROL_OK) {
+					sending.paused = false;
+				}
+			}
+		}
+
+		if (min_s_vtime >= 0.0 && (min_fs_vtime < 0.0 || fs.vtime < min_fs_vtime)) {
+			min_fs_vtime = fs.vtime;
+		}
+	}
+	for (auto& [friend_number, fs] : _friend_transfers_sending) {
+		if (min_fs_vtime >= 0.0 && std::all_of(fs.transfers.cbegin(), fs.transfers.cend(), [](const auto& it) { return it.second.requests.empty(); })) {
+			fs.vtime = std::max(fs.vtime, min_fs_vtime);
+		}
+	}
+
+	// smoothed rates
+	const double stats_dt = std::chrono::duration<double>(now - _last_stats).count();
+	if (stats_dt >= 1.0) {
+		_last_stats = now;
+		for (auto& [friend_number, fs] : _friend_transfers_sending) {
+			for (auto& [file_number, sending] : fs.transfers) {
+				sending.rate = 0.7f * sending.rate + 0.3f * float(sending.window_bytes / stats_dt);
+				sending.window_bytes = 0;
+			}
+		}
+	}
+}
+
+TransferManager::Sending* TransferManager::findSending(uint32_t friend_number, uint32_t file_number) {
+	auto friend_it = _friend_transfers_sending.find(friend_number);
+	if (friend_it == _friend_transfers_sending.end()) {
+		return nullptr;
+	}
+	auto transfer_it = friend_it->second.transfers.find(file_number);
+	if (transfer_it == friend_it->second.transfers.end()) {
+		return nullptr;
+	}
+	return &transfer_it->second;
+}
+
+void TransferManager::eraseSending(uint32_t friend_number, uint32_t file_number) {
+	auto friend_it = _friend_transfers_sending.find(friend_number);
+	if (friend_it == _friend_transfers_sending.end()) {
+		return;
+	}
+	friend_it->second.transfers.erase(file_number);
+	if (friend_it->second.transfers.empty()) {
+		_friend_transfers_sending.erase(friend_it);
+	}
+}
+
+bool TransferManager::sendChunk(uint32_t friend_number, uint32_t file_number, Sending& s) {
+	const auto request = s.requests.front();
+
+	const auto chunk = s.source->read(request.position, request.length, _chunk_buffer);
+	if (chunk.again) {
+		s.waiting = true;
+		return true; // not the send queues fault, the others can go on
+	}
+	if (chunk.data != _chunk_buffer.data() || chunk.size != _chunk_buffer.size()) {
+		// sources with their own memory, one copy into the reused buffer
+		_chunk_buffer.resize(chunk.size);
+		if (chunk.size > 0) {
+			std::memcpy(_chunk_buffer.data(), chunk.data, chunk.size);
+		}
+	}
+
+	const auto err = _t.toxFileSendChunk(friend_number, file_number, request.position, _chunk_buffer);
+	if (err == TOX_ERR_FILE_SEND_CHUNK_SENDQ) {
+		return false; // try again later, tox still expects this position
+	}
+
+	// sent, or tox does not want it anymore
+	s.requests.pop_front();
+	if (err == TOX_ERR_FILE_SEND_CHUNK_OK) {
+		s.sent = request.position + chunk.size;
+		s.window_bytes += chunk.size;
+		s.vtime += double(chunk.size) / s.weight;
+	}
+
+	return true;
+}
+
+bool TransferManager::setTransferPriority(uint32_t friend_number, uint32_t file_number, int priority) {
+	auto* s = findSending(friend_number, file_number);
+	if (s == nullptr) {
+		return false;
+	}
+	s->priority = priority;
+	return true;
+}
+
+bool TransferManager::setTransferWeight(uint32_t friend_number, uint32_t file_number, uint32_t weight) {
+	auto* s = findSending(friend_number, file_number);
+	if (s == nullptr) {
+		return false;
+	}
+	s->weight = weight > 0 ? weight : 1;
+	return true;
+}
+
+std::vector<TransferManager::TransferStats> TransferManager::getSendingStats(void) const {
+	std::vector<TransferStats> stats;
+	for (const auto& [friend_number, fs] : _friend_transfers_sending) {
+		for (const auto& [file_number, sending] : fs.transfers) {
+			auto& ts = stats.emplace_back();
+			ts.friend_number = friend_number;
+			ts.file_number = file_number;
+			ts.priority = sending.priority;
+			ts.weight = sending.weight;
+			ts.size = sending.source->size();
+			ts.sent = sending.sent;
+			ts.queue_depth = sending.requests.size();
+			ts.rate = sending.rate;
+			if (ts.size != UINT64_MAX && sending.rate > 0.f) {
+				ts.eta = float((ts.size - std::min(ts.sent, ts.size)) / sending.rate);
+			}
+			ts.paused = sending.paused;
+		}
+	}
+	return stats;
 }
 
 bool TransferManager::friendSendMem(uint32_t friend_number, uint32_t file_kind, std::string_view filename, const std::vector<uint8_t>& data) {
-	// TODO: change this?
-	const auto data_hash = _t.toxHash(data);
-	assert(data_hash.size() >= TOX_FILE_ID_LENGTH);
+	return friendSendBlob(friend_number, file_kind, filename, _blob_cache.intern(data));
+}
+
+bool TransferManager::friendSendMem(uint32_t friend_number, uint32_t file_kind, std::string_view filename, std::vector<uint8_t>&& data) {
+	return friendSendBlob(friend_number, file_kind, filename, _blob_cache.intern(std::move(data)));
+}
+
+bool TransferManager::friendSendMem(uint32_t friend_number, uint32_t file_kind, std::string_view filename, std::shared_ptr<const std::vector<uint8_t>> data) {
+	return friendSendBlob(friend_number, file_kind, filename, _blob_cache.intern(std::move(data)));
+}
+
+bool TransferManager::friendSendBlob(uint32_t friend_number, uint32_t file_kind, std::string_view filename, const BlobCache::BlobPtr& blob) {
+	if (!blob) {
+		return false;
+	}
+
+	assert(blob->hash.size() >= TOX_FILE_ID_LENGTH);
+
+	// aliasing, the transfer keeps the whole blob alive
+	std::shared_ptr<const std::vector<uint8_t>> data {blob, blob->data.get()};
+	return friendSend(friend_number, file_kind, filename, blob->hash, std::make_unique<FileRMem>(std::move(data)));
+}
+
+bool TransferManager::friendSendFile(uint32_t friend_number, uint32_t file_kind, const std::string& path, std::string_view filename) {
+	std::unique_ptr<FileRI> source;
+
+	std::error_code ec;
+	const auto status = std::filesystem::status(path, ec);
+	if (ec) {
+		return false;
+	}
+
+	const bool regular = std::filesystem::is_regular_file(status);
+	const uint64_t file_size = regular ? std::filesystem::file_size(path, ec) : UINT64_MAX;
+	if (ec) {
+		return false;
+	}
+
+	if (regular && file_size <= _mmap_max_size) {
+		MappedFile file{path};
+		if (file.isOpen() && file.isMapped()) {
+			source = std::make_unique<FileRMapped>(std::move(file));
+		}
+	}
+
+	if (!source) {
+		auto stream = std::make_unique<FileRStream>(path);
+		if (!stream->isOpen()) {
+			return false;
+		}
+		source = std::move(stream);
+	}
+
+	// hashing multi GB files up front is too slow, identify them by what they are instead
+	std::vector<uint8_t> file_id_src {path.cbegin(), path.cend()};
+	const uint64_t mtime = regular ? static_cast<uint64_t>(std::filesystem::last_write_time(path, ec).time_since_epoch().count()) : 0;
+	for (const uint64_t value : {file_size, mtime}) {
+		for (size_t i = 0; i < sizeof(value); i++) {
+			file_id_src.push_back(static_cast<uint8_t>(value >> (i*8)));
+		}
+	}
 
-	const auto&& [transfer_id, err] = _t.toxFileSend(friend_number, file_kind, data.size(), data_hash, filename);
+	return friendSend(friend_number, file_kind, filename, file_id_src, std::move(source));
+}
+
+bool TransferManager::friendSend(uint32_t friend_number, uint32_t file_kind, std::string_view filename, const std::vector<uint8_t>& file_id, std::unique_ptr<FileRI>&& source) {
+	if (!source) {
+		return false;
+	}
+
+	const auto&& [transfer_id, err] = _t.toxFileSend(
+		friend_number,
+		file_kind,
+		source->size(),
+		file_id.size() == TOX_FILE_ID_LENGTH ? file_id : _t.toxHash(file_id),
+		filename
+	);
 	if (err == TOX_ERR_FILE_SEND_OK) {
-		_friend_transfers_sending[friend_number][transfer_id.value()] = std::make_unique<FileRMem>(data);
+		auto& fs = _friend_transfers_sending[friend_number];
+		auto& sending = fs.transfers[transfer_id.value()];
+		sending.source = std::move(source);
+		// start at the current share, not at 0
+		for (const auto& [file_number, other] : fs.transfers) {
+			if (&other != &sending) {
+				sending.vtime = std::max(sending.vtime, other.vtime);
+			}
+		}
 		return true;
 	} else {
 		return false;
@@ -54,19 +687,253 @@ bool TransferManager::friendSendMem(uint32_t friend_number, uint32_t file_kind,
 }
 
 
+void TransferManager::flushRun(Receiving& r) {
+	if (r.run.empty()) {
+		return;
+	}
+
+	const size_t run_size = r.run.size();
+
+	WriteJob job;
+	job.file = r.file;
+	job.pos = r.run_pos;
+	job.data = std::move(r.run);
+	pushWriteJob(std::move(job));
+
+	r.run_pos += run_size;
+	r.run = {};
+	r.run.reserve(_write_block);
+}
+
+void TransferManager::finishReceiving(uint32_t friend_number, uint32_t file_number, bool complete) {
+	auto friend_it = _friend_transfers_receiving.find(friend_number);
+	if (friend_it == _friend_transfers_receiving.end()) {
+		return;
+	}
+	auto transfer_it = friend_it->second.find(file_number);
+	if (transfer_it == friend_it->second.end()) {
+		return;
+	}
+
+	flushRun(transfer_it->second);
+
+	WriteJob job;
+	job.file = std::move(transfer_it->second.file);
+	job.finish = true;
+	job.complete = complete;
+	pushWriteJob(std::move(job));
+
+	friend_it->second.erase(transfer_it);
+	if (friend_it->second.empty()) {
+		_friend_transfers_receiving.erase(friend_it);
+	}
+}
+
+void TransferManager::pushWriteJob(WriteJob&& job) {
+	if (!_writer_thread.joinable()) {
+		_writer_thread = std::thread(&TransferManager::writerThread, this);
+	}
+
+	{
+		std::lock_guard lock{_writer_mutex};
+		_writer_jobs.emplace_back(std::move(job));
+	}
+	_writer_cv.notify_one();
+}
+
+void TransferManager::writerThread(void) {
+	while (true) {
+		WriteJob job;
+		{
+			std::unique_lock lock{_writer_mutex};
+			_writer_cv.wait(lock, [this]() { return _writer_stop || !_writer_jobs.empty(); });
+			if (_writer_jobs.empty()) {
+				break; // stop, but only once everything is written
+			}
+			job = std::move(_writer_jobs.front());
+			_writer_jobs.pop_front();
+		}
+
+		writeJob(job);
+	}
+}
+
+void TransferManager::writeJob(WriteJob& job) {
+	auto& file = *job.file;
+
+	if (!job.data.empty() && !file.failed) {
+		if (!file.write(job.pos, job.data.data(), job.data.size())) {
+			std::cerr << "TM error, writing " << file.part_path << " failed\n";
+			file.failed = true;
+		} else if (job.pos <= file.written_end && job.pos + job.data.size() > file.written_end) {
+			file.written_end = job.pos + job.data.size();
+		}
+	}
+
+	if (!job.finish) {
+		return;
+	}
+
+	const bool complete = job.complete && !file.failed;
+	file.close();
+
+	if (complete) {
+		// never replace an existing file, "photo.jpg" becomes "photo (1).jpg"
+		// only this thread moves received files in place, so nothing takes the name in between
+		std::string path = file.path;
+		const std::filesystem::path fs_path {file.path};
+		std::error_code ec;
+		for (int i = 1; std::filesystem::exists(path, ec) && i < 1000; i++) {
+			path = (fs_path.parent_path() / (fs_path.stem().string() + " (" + std::to_string(i) + ")" + fs_path.extension().string())).string();
+		}
+		if (std::filesystem::exists(path, ec)) {
+			std::cerr << "TM error, no free name for " << file.path << ", keeping " << file.part_path << "\n";
+			return;
+		}
+
+		std::filesystem::rename(file.part_path, path, ec);
+		if (ec) {
+			std::cerr << "TM error, can not move " << file.part_path << " to " << path << ": " << ec.message() << "\n";
+			return;
+		}
+		std::filesystem::remove(file.resume_path, ec);
+		std::cout << "TM received " << path << "\n";
+	} else {
+		file.writeResume();
+	}
+}
+
 bool TransferManager::onToxEvent(const Tox_Event_File_Recv* e) {
-	return false;
+	if (!_recv_policy) {
+		return false;
+	}
+
+	const auto friend_number = tox_event_file_recv_get_friend_number(e);
+	const auto file_number = tox_event_file_recv_get_file_number(e);
+	const auto file_kind = tox_event_file_recv_get_kind(e);
+	const auto file_size = tox_event_file_recv_get_file_size(e);
+	const std::string_view filename {
+		reinterpret_cast<const char*>(tox_event_file_recv_get_filename(e)),
+		tox_event_file_recv_get_filename_length(e)
+	};
+
+	const auto path = _recv_policy(friend_number, file_kind, file_size, filename);
+	if (!path.has_value()) {
+		return false;
+	}
+
+	auto file = std::make_shared<RecvFile>();
+	file->path = *path;
+	file->size = file_size;
+	if (const auto file_id = _t.toxFileGetFileID(friend_number, file_number); file_id.has_value()) {
+		file->file_id_hex = toHex(*file_id);
+	}
+
+	// one part file per sender and file, so two friends sending photo.jpg don't write into each other
+	// both stay the same when the file is offered again, so it can still be resumed
+	const auto public_key = _t.toxFriendGetPublicKey(friend_number);
+	const std::string sender_hex = public_key.has_value() ? toHex(*public_key).substr(0, 16) : std::to_string(friend_number);
+	const std::string file_hex = !file->file_id_hex.empty() ? file->file_id_hex.substr(0, 16) : std::to_string(file_number);
+	file->part_path = *path + "." + sender_hex + "-" + file_hex + ".part";
+	file->resume_path = file->part_path + ".resume";
+
+	// the same file from the same friend, twice at once
+	for (const auto& [other_friend_number, transfers] : _friend_transfers_receiving) {
+		for (const auto& [other_file_number, other] : transfers) {
+			if (other.file->part_path == file->part_path) {
+				std::cerr << "TM error, " << file->part_path << " is already being received\n";
+				_t.toxFileControl(friend_number, file_number, TOX_FILE_CONTROL_CANCEL);
+				return true;
+			}
+		}
+	}
+
+	// the same file offered again (eg. after a reconnect), continue where we left off
+	uint64_t resume_pos = file->file_id_hex.empty() ? 0 : file->readResume();
+	if (resume_pos > 0 && _t.toxFileSeek(friend_number, file_number, resume_pos) != TOX_ERR_FILE_SEEK_OK) {
+		resume_pos = 0;
+	}
+
+	if (!file->open(resume_pos == 0)) {
+		std::cerr << "TM error, can not open " << file->part_path << "\n";
+		_t.toxFileControl(friend_number, file_number, TOX_FILE_CONTROL_CANCEL);
+		return true;
+	}
+	if (resume_pos == 0) {
+		file->preallocate();
+	} else {
+		std::cout << "TM resuming " << file->path << " at " << resume_pos << "\n";
+	}
+	file->written_end = resume_pos;
+
+	auto& r = _friend_transfers_receiving[friend_number][file_number];
+	r.file = std::move(file);
+	r.run_pos = resume_pos;
+	r.run.reserve(_write_block);
+
+	_t.toxFileControl(friend_number, file_number, TOX_FILE_CONTROL_RESUME);
+
+	return true;
 }
 
 bool TransferManager::onToxEvent(const Tox_Event_File_Recv_Control* e) {
-	tox_event_file_recv_control_get_friend_number(e);
-	tox_event_file_recv_control_get_file_number(e);
-	tox_event_file_recv_control_get_control(e);
+	const auto friend_number = tox_event_file_recv_control_get_friend_number(e);
+	const auto file_number = tox_event_file_recv_control_get_file_number(e);
+	const auto control = tox_event_file_recv_control_get_control(e);
+
+	if (control == TOX_FILE_CONTROL_CANCEL) {
+		if (_friend_transfers_receiving.count(friend_number) && _friend_transfers_receiving[friend_number].count(file_number)) {
+			finishReceiving(friend_number, file_number, false);
+			return true;
+		}
+
+		// the other side gave up, drop the source (and its mapping/fd)
+		if (findSending(friend_number, file_number) != nullptr) {
+			eraseSending(friend_number, file_number);
+			return true;
+		}
+	}
+
 	return false;
 }
 
 bool TransferManager::onToxEvent(const Tox_Event_File_Recv_Chunk* e) {
-	return false;
+	const auto friend_number = tox_event_file_recv_chunk_get_friend_number(e);
+	const auto file_number = tox_event_file_recv_chunk_get_file_number(e);
+
+	auto friend_it = _friend_transfers_receiving.find(friend_number);
+	if (friend_it == _friend_transfers_receiving.end()) {
+		return false;
+	}
+	auto transfer_it = friend_it->second.find(file_number);
+	if (transfer_it == friend_it->second.end()) {
+		return false;
+	}
+
+	const auto position = tox_event_file_recv_chunk_get_position(e);
+	const auto* data = tox_event_file_recv_chunk_get_data(e);
+	const auto length = tox_event_file_recv_chunk_get_length(e);
+
+	if (length == 0) {
+		finishReceiving(friend_number, file_number, true);
+		return true;
+	}
+
+	auto& r = transfer_it->second;
+	if (position != r.run_pos + r.run.size()) {
+		// out of order, start a new run
+		flushRun(r);
+		r.run_pos = position;
+	}
+
+	r.run.insert(r.run.end(), data, data + length);
+
+	const uint64_t run_end = r.run_pos + r.run.size();
+	if (run_end % _write_block == 0 || r.run.size() >= _write_block) {
+		flushRun(r);
+	}
+
+	return true;
 }
 
 bool TransferManager::onToxEvent(const Tox_Event_File_Chunk_Request* e) {
@@ -75,14 +942,42 @@ bool TransferManager::onToxEvent(const Tox_Event_File_Chunk_Request* e) {
 	const auto position = tox_event_file_chunk_request_get_position(e);
 	const auto length = tox_event_file_chunk_request_get_length(e);
 
-	if (!_friend_transfers_sending.count(friend_number) || !_friend_transfers_sending[friend_number].count(file_number)) {
+	auto* s = findSending(friend_number, file_number);
+	if (s == nullptr) {
 		return false; // shrug, we don't know about it, might be someone else's
 	}
 
-	const auto data = _friend_transfers_sending[friend_number][file_number]->read(position, length);
+	if (length == 0) {
+		// done, the file number can be reused
+		eraseSending(friend_number, file_number);
+		return true;
+	}
 
-	const auto err = _t.toxFileSendChunk(friend_number, file_number, position, data);
+	// served by iterate()
+	s->requests.push_back({position, length});
+
+	// tox keeps asking as long as its send queue has room, stop it while we are behind
+	if (!s->paused && s->requests.size() >= _max_queued_chunks) {
+		if (_t.toxFileControl(friend_number, file_number, TOX_FILE_CONTROL_PAUSE) == TOX_ERR_FILE_CONTROL_OK) {
+			s->paused = true;
+		}
+	}
 
 	return true;
 }
 
+bool TransferManager::onToxEvent(const Tox_Event_Friend_Connection_Status* e) {
+	if (tox_event_friend_connection_status_get_connection_status(e) != TOX_CONNECTION_NONE) {
+		return false;
+	}
+
+	// tox drops all transfers of an offline friend without telling us
+	const auto friend_number = tox_event_friend_connection_status_get_friend_number(e);
+	while (_friend_transfers_receiving.count(friend_number)) {
+		finishReceiving(friend_number, _friend_transfers_receiving[friend_number].begin()->first, false);
+	}
+	_friend_transfers_sending.erase(friend_number);
+
+	return false; // others might care too
+}
+
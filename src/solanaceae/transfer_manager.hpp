@@ -2,10 +2,21 @@
 
 #include <solanaceae/toxcore/tox_event_interface.hpp>
 
+#include "./blob_cache.hpp"
+
+#include <string>
 #include <string_view>
 #include <vector>
+#include <deque>
 #include <map>
 #include <memory>
+#include <optional>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <cstdint>
 
 // fwd
 struct ToxI;
@@ -14,14 +25,139 @@ class TransferManager : public ToxEventI {
 	ToxI& _t;
 
 	public:
+		// non owning view of a chunk
+		struct ChunkView {
+			const uint8_t* data {nullptr};
+			size_t size {0};
+			bool again {false}; // nothing to read yet (streams), ask again later
+		};
+
 		struct FileRI {
 			virtual ~FileRI(void) {}
-			virtual std::vector<uint8_t> read(uint64_t pos, uint32_t size) = 0;
+
+			// UINT64_MAX for streams of unknown size
+			virtual uint64_t size(void) const = 0;
+
+			// up to size bytes at pos, valid until the next read()
+			// sources that don't have the data in memory read into buffer, which gets reused between calls
+			virtual ChunkView read(uint64_t pos, uint32_t size, std::vector<uint8_t>& buffer) = 0;
+		};
+
+		// returns the path to write an incoming file to, nullopt leaves it to someone else
+		using RecvPolicy = std::function<std::optional<std::string>(uint32_t friend_number, uint32_t file_kind, uint64_t file_size, std::string_view filename)>;
+
+		// accepts data files up to max_size into dir, keeping only the base name of the offered filename
+		static RecvPolicy recvIntoDir(std::string dir, uint64_t max_size = UINT64_MAX);
+
+		struct TransferStats {
+			uint32_t friend_number {0};
+			uint32_t file_number {0};
+			int priority {0};
+			uint32_t weight {1};
+			uint64_t size {0}; // UINT64_MAX for streams
+			uint64_t sent {0}; // bytes, position of the last sent chunk end
+			size_t queue_depth {0}; // chunks tox asked for, that are not sent yet
+			float rate {0.f}; // bytes per second, smoothed
+			float eta {-1.f}; // seconds, negative if unknown
+			bool paused {false}; // by us, since the queue is full
 		};
 
 	private:
-		// friend_number -> transfer_id -> FileRI
-		std::map<uint32_t, std::map<uint32_t, std::unique_ptr<FileRI>>> _friend_transfers_sending;
+		using clock = std::chrono::steady_clock;
+
+		struct ChunkRequest {
+			uint64_t position {0};
+			uint32_t length {0};
+		};
+
+		struct Sending {
+			std::unique_ptr<FileRI> source;
+
+			// tox asks for chunks as fast as its send queue allows, they get served from iterate()
+			std::deque<ChunkRequest> requests;
+			bool paused {false};
+			bool waiting {false}; // the source had nothing to read, skipped until the next iterate()
+
+			int priority {0}; // higher goes first, within a friend
+			uint32_t weight {1}; // share among transfers of the same priority
+			double vtime {0.0}; // bytes sent / weight, lowest gets the next chunk
+
+			uint64_t sent {0};
+			uint64_t window_bytes {0};
+			float rate {0.f};
+		};
+
+		struct FriendSending {
+			// transfer_id -> Sending
+			std::map<uint32_t, Sending> transfers;
+
+			double vtime {0.0}; // bytes sent / friend weight
+			double tokens {0.0};
+			bool blocked {false}; // tox send queue full, for this iteration
+		};
+
+		// per friend settings, they outlive the transfers
+		struct FriendShaping {
+			uint32_t weight {1};
+			uint64_t rate_limit {0}; // bytes per second, 0 is unlimited
+		};
+
+		std::map<uint32_t, FriendSending> _friend_transfers_sending;
+		std::map<uint32_t, FriendShaping> _friend_shaping;
+
+		uint64_t _global_rate_limit {0}; // bytes per second, 0 is unlimited
+		double _global_tokens {0.0};
+
+		// tox gets paused for a transfer with that many chunks queued, and resumed below a quarter of it
+		size_t _max_queued_chunks {128};
+
+		clock::time_point _last_iterate {clock::now()};
+		clock::time_point _last_stats {clock::now()};
+
+		// friendSendMem() payloads, so sending the same thing to many friends hashes and stores it once
+		BlobCache _blob_cache;
+
+		// every outgoing chunk goes through this, so its memory is reused (ToxI takes vectors)
+		std::vector<uint8_t> _chunk_buffer;
+
+		// regular files up to this size get mmaped, bigger ones and streams are read with pread
+		uint64_t _mmap_max_size {256ull * 1024 * 1024};
+
+		RecvPolicy _recv_policy;
+
+		// an incoming file, shared with the writer thread
+		// written to <path>.<sender>-<file id>.part, if interrupted the progress goes to <part>.resume
+		// once complete it moves to path, or "name (n).ext" if path exists
+		struct RecvFile;
+
+		struct Receiving {
+			std::shared_ptr<RecvFile> file;
+
+			// chunks get collected into runs, which are written once they reach a write block boundary
+			uint64_t run_pos {0};
+			std::vector<uint8_t> run;
+		};
+
+		// friend_number -> transfer_id -> Receiving
+		std::map<uint32_t, std::map<uint32_t, Receiving>> _friend_transfers_receiving;
+
+		// size and alignment of the writes
+		size_t _write_block {1024 * 1024};
+
+		struct WriteJob {
+			std::shared_ptr<RecvFile> file;
+			uint64_t pos {0};
+			std::vector<uint8_t> data;
+			bool finish {false}; // close the file after this
+			bool complete {false}; // and move it in place
+		};
+
+		// writes happen off the tox thread, started with the first incoming file
+		std::thread _writer_thread;
+		std::mutex _writer_mutex;
+		std::condition_variable _writer_cv;
+		bool _writer_stop {false}; // guarded by _writer_mutex
+		std::deque<WriteJob> _writer_jobs; // guarded by _writer_mutex
 
 	public:
 		TransferManager(ToxI& t, ToxEventProviderI& tep);
@@ -30,12 +166,57 @@ class TransferManager : public ToxEventI {
 		void iterate(void);
 
 	public:
+		// goes through the blob cache, data is only copied if the content is not cached yet
 		bool friendSendMem(uint32_t friend_number, uint32_t file_kind, std::string_view filename, const std::vector<uint8_t>& data);
+		bool friendSendMem(uint32_t friend_number, uint32_t file_kind, std::string_view filename, std::vector<uint8_t>&& data);
+		bool friendSendMem(uint32_t friend_number, uint32_t file_kind, std::string_view filename, std::shared_ptr<const std::vector<uint8_t>> data);
+		// the blob hash is the file id
+		bool friendSendBlob(uint32_t friend_number, uint32_t file_kind, std::string_view filename, const BlobCache::BlobPtr& blob);
+
+		// streams from disk with constant memory, the file is not read up front
+		bool friendSendFile(uint32_t friend_number, uint32_t file_kind, const std::string& path, std::string_view filename);
+
+		// file_id gets hashed if it is not TOX_FILE_ID_LENGTH long
+		bool friendSend(uint32_t friend_number, uint32_t file_kind, std::string_view filename, const std::vector<uint8_t>& file_id, std::unique_ptr<FileRI>&& source);
+
+		void setMmapMaxSize(uint64_t size) { _mmap_max_size = size; }
+
+		BlobCache& getBlobCache(void) { return _blob_cache; }
+
+		// outgoing bandwidth, 0 is unlimited
+		void setGlobalRateLimit(uint64_t bytes_per_second) { _global_rate_limit = bytes_per_second; }
+		void setFriendRateLimit(uint32_t friend_number, uint64_t bytes_per_second) { _friend_shaping[friend_number].rate_limit = bytes_per_second; }
+		// share of the bandwidth compared to other friends, default 1
+		void setFriendWeight(uint32_t friend_number, uint32_t weight) { _friend_shaping[friend_number].weight = weight > 0 ? weight : 1; }
+
+		// false if there is no such outgoing transfer
+		bool setTransferPriority(uint32_t friend_number, uint32_t file_number, int priority);
+		bool setTransferWeight(uint32_t friend_number, uint32_t file_number, uint32_t weight);
+
+		std::vector<TransferStats> getSendingStats(void) const;
+
+		// unset by default, so incoming files are left alone
+		void setRecvPolicy(RecvPolicy&& policy) { _recv_policy = std::move(policy); }
+
+	private:
+		Sending* findSending(uint32_t friend_number, uint32_t file_number);
+		void eraseSending(uint32_t friend_number, uint32_t file_number);
+		// false if the tox send queue is full, sets waiting if the source has nothing yet
+		bool sendChunk(uint32_t friend_number, uint32_t file_number, Sending& s);
+
+		void flushRun(Receiving& r);
+		// flushes and closes, complete moves the file in place, otherwise it stays resumable
+		void finishReceiving(uint32_t friend_number, uint32_t file_number, bool complete);
+
+		void pushWriteJob(WriteJob&& job);
+		void writerThread(void);
+		static void writeJob(WriteJob& job);
 
 	protected: // events
 		bool onToxEvent(const Tox_Event_File_Recv* e) override;
 		bool onToxEvent(const Tox_Event_File_Recv_Control* e) override;
 		bool onToxEvent(const Tox_Event_File_Recv_Chunk* e) override;
 		bool onToxEvent(const Tox_Event_File_Chunk_Request* e) override;
+		bool onToxEvent(const Tox_Event_Friend_Connection_Status* e) override;
 };
 
@@ -0,0 +1,117 @@
+#include "./tox_broadcast.hpp"
+
+#include <solanaceae/toxcore/tox_interface.hpp>
+
+#include <algorithm>
+
+std::vector<std::string_view> splitMessage(std::string_view message, size_t max_len) {
+	std::vector<std::string_view> parts;
+	if (max_len < 4) {
+		return parts; // can not fit every codepoint
+	}
+
+	while (message.size() > max_len) {
+		size_t split = max_len;
+		// back up to the start of a codepoint (continuation bytes are 10xxxxxx)
+		while (split > 0 && (static_cast<uint8_t>(message[split]) & 0xc0) == 0x80) {
+			split--;
+		}
+		if (split == 0) {
+			split = max_len; // not utf8, just cut
+		}
+
+		// a nicer place, if it does not waste too much of the part
+		for (size_t i = split; i > max_len/2; i--) {
+			if (message[i-1] == '\n' || message[i-1] == ' ') {
+				split = i;
+				break;
+			}
+		}
+
+		parts.push_back(message.substr(0, split));
+		message.remove_prefix(split);
+	}
+
+	if (!message.empty() || parts.empty()) {
+		parts.push_back(message);
+	}
+
+	return parts;
+}
+
+BroadcastResult broadcastMessage(ToxI& t, Tox_Message_Type type, std::string_view message, const BroadcastTargets& targets) {
+	BroadcastResult res;
+
+	const auto friend_parts = splitMessage(message, TOX_MAX_MESSAGE_LENGTH);
+	const auto group_parts = splitMessage(message, TOX_GROUP_MAX_MESSAGE_LENGTH);
+	res.parts = friend_parts.size();
+
+	std::vector<uint32_t> all_friends;
+	if (targets.all_friends) {
+		all_friends = t.toxSelfGetFriendList();
+	}
+	const auto& friend_list = targets.all_friends ? all_friends : targets.friends;
+	res.friends.reserve(friend_list.size());
+	for (const uint32_t friend_number : friend_list) {
+		if (targets.online_only && t.toxFriendGetConnectionStatus(friend_number).value_or(TOX_CONNECTION_NONE) == TOX_CONNECTION_NONE) {
+			res.skipped++;
+			continue;
+		}
+		if (targets.filter && !targets.filter(false, friend_number)) {
+			res.skipped++;
+			continue;
+		}
+
+		auto& target = res.friends.emplace_back();
+		target.number = friend_number;
+		for (const auto part : friend_parts) {
+			const auto [message_id, err] = t.toxFriendSendMessage(friend_number, type, part);
+			if (err != TOX_ERR_FRIEND_SEND_MESSAGE_OK) {
+				target.err = err;
+				break;
+			}
+			target.message_id = message_id;
+		}
+		if (target.err == 0) {
+			res.ok++;
+		} else {
+			res.failed++;
+		}
+	}
+
+	std::vector<uint32_t> all_groups;
+	if (targets.all_groups) {
+		all_groups = t.toxGroupGetList();
+	}
+	const auto& group_list = targets.all_groups ? all_groups : targets.groups;
+	res.groups.reserve(group_list.size());
+	for (const uint32_t group_number : group_list) {
+		if (targets.online_only && !t.toxGroupIsConnected(group_number).value_or(false)) {
+			res.skipped++;
+			continue;
+		}
+		if (targets.filter && !targets.filter(true, group_number)) {
+			res.skipped++;
+			continue;
+		}
+
+		auto& target = res.groups.emplace_back();
+		target.number = group_number;
+		for (const auto part : group_parts) {
+			const auto [message_id, err] = t.toxGroupSendMessage(group_number, type, part);
+			if (err != TOX_ERR_GROUP_SEND_MESSAGE_OK) {
+				target.err = err;
+				break;
+			}
+			target.message_id = message_id;
+		}
+		if (target.err == 0) {
+			res.ok++;
+		} else {
+			res.failed++;
+		}
+	}
+
+	return res;
+}
+
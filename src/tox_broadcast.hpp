@@ -0,0 +1,50 @@
+#pragma once
+
+#include <tox/tox.h>
+
+#include <string_view>
+#include <vector>
+#include <optional>
+#include <functional>
+#include <cstdint>
+
+// fwd
+struct ToxI;
+
+// parts of at most max_len bytes, never splitting a utf8 sequence
+// prefers to split after a line break or space in the second half of a part
+std::vector<std::string_view> splitMessage(std::string_view message, size_t max_len);
+
+struct BroadcastTargets {
+	bool all_friends {false};
+	std::vector<uint32_t> friends;
+
+	bool all_groups {false};
+	std::vector<uint32_t> groups;
+
+	// skips offline friends and disconnected groups
+	bool online_only {true};
+
+	// optional, return false to skip a target
+	std::function<bool(bool is_group, uint32_t number)> filter;
+};
+
+struct BroadcastResult {
+	struct Target {
+		uint32_t number {0};
+		int err {0}; // Tox_Err_Friend_Send_Message or Tox_Err_Group_Send_Message of the first failed part
+		std::optional<uint32_t> message_id; // of the last part sent, friends: for read receipts, groups: as seen by the peers
+	};
+
+	std::vector<Target> friends;
+	std::vector<Target> groups;
+
+	size_t parts {0};
+	size_t ok {0}; // targets that got every part
+	size_t failed {0};
+	size_t skipped {0}; // offline or filtered
+};
+
+// sends message (split if too long) to every target, stops at the first failed part per target
+BroadcastResult broadcastMessage(ToxI& t, Tox_Message_Type type, std::string_view message, const BroadcastTargets& targets);
+
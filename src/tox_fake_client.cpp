@@ -0,0 +1,542 @@
+#include "./tox_fake_client.hpp"
+
+void ToxFakeClient::setCounts(uint32_t friends, uint32_t groups, uint32_t group_peers) {
+	_friend_count = friends;
+	_group_count = groups;
+	_group_peer_count = group_peers;
+}
+
+void ToxFakeClient::subscribeRaw(std::function<void(const Tox_Events*)> fn) {
+	_subscribers_raw.push_back(std::move(fn));
+}
+
+void ToxFakeClient::subscribeRawDone(std::function<void(const Tox_Events*)> fn) {
+	_subscribers_raw_done.push_back(std::move(fn));
+}
+
+void ToxFakeClient::dispatch(const Tox_Events* events) {
+	_stats.batches++;
+	for (const auto& fn : _subscribers_raw) {
+		fn(events);
+	}
+	dispatchEvents(events);
+	for (const auto& fn : _subscribers_raw_done) {
+		fn(events);
+	}
+}
+
+std::vector<uint8_t> ToxFakeClient::fakeKey(uint8_t kind, uint32_t number, uint32_t sub) {
+	std::vector<uint8_t> key(TOX_PUBLIC_KEY_SIZE, 0);
+	key[0] = kind;
+	for (size_t i = 0; i < 4; i++) {
+		key[1+i] = (number >> (i*8)) & 0xff;
+		key[5+i] = (sub >> (i*8)) & 0xff;
+	}
+	return key;
+}
+
+void ToxFakeClient::countSend(size_t size) {
+	_stats.sends++;
+	_stats.send_bytes += size;
+}
+
+Tox_Connection ToxFakeClient::toxSelfGetConnectionStatus(void) {
+	_stats.calls++;
+	return TOX_CONNECTION_UDP;
+}
+
+uint32_t ToxFakeClient::toxIterationInterval(void) {
+	_stats.calls++;
+	return 50;
+}
+
+std::vector<uint8_t> ToxFakeClient::toxSelfGetAddress(void) {
+	_stats.calls++;
+	auto address = fakeKey('s', 0);
+	address.resize(TOX_ADDRESS_SIZE, 0);
+	return address;
+}
+
+void ToxFakeClient::toxSelfSetNospam(uint32_t nospam) {
+	_stats.calls++;
+	_nospam = nospam;
+}
+
+uint32_t ToxFakeClient::toxSelfGetNospam(void) {
+	_stats.calls++;
+	return _nospam;
+}
+
+std::vector<uint8_t> ToxFakeClient::toxSelfGetPublicKey(void) {
+	_stats.calls++;
+	return fakeKey('s', 0);
+}
+
+Tox_Err_Set_Info ToxFakeClient::toxSelfSetName(std::string_view name) {
+	_stats.calls++;
+	_self_name = name;
+	return TOX_ERR_SET_INFO_OK;
+}
+
+std::string ToxFakeClient::toxSelfGetName(void) {
+	_stats.calls++;
+	return _self_name;
+}
+
+Tox_Err_Set_Info ToxFakeClient::toxSelfSetStatusMessage(std::string_view status_message) {
+	_stats.calls++;
+	_self_status_message = status_message;
+	return TOX_ERR_SET_INFO_OK;
+}
+
+std::string ToxFakeClient::toxSelfGetStatusMessage(void) {
+	_stats.calls++;
+	return _self_status_message;
+}
+
+void ToxFakeClient::toxSelfSetStatus(Tox_User_Status status) {
+	_stats.calls++;
+	_self_status = status;
+}
+
+Tox_User_Status ToxFakeClient::toxSelfGetStatus(void) {
+	_stats.calls++;
+	return _self_status;
+}
+
+std::tuple<std::optional<uint32_t>, Tox_Err_Friend_Add> ToxFakeClient::toxFriendAdd(const std::vector<uint8_t>&, std::string_view) {
+	_stats.calls++;
+	return {_friend_count++, TOX_ERR_FRIEND_ADD_OK};
+}
+
+std::tuple<std::optional<uint32_t>, Tox_Err_Friend_Add> ToxFakeClient::toxFriendAddNorequest(const std::vector<uint8_t>&) {
+	_stats.calls++;
+	return {_friend_count++, TOX_ERR_FRIEND_ADD_OK};
+}
+
+Tox_Err_Friend_Delete ToxFakeClient::toxFriendDelete(uint32_t friend_number) {
+	_stats.calls++;
+	// the numbers stay dense, deleting is not simulated
+	return friendExists(friend_number) ? TOX_ERR_FRIEND_DELETE_OK : TOX_ERR_FRIEND_DELETE_FRIEND_NOT_FOUND;
+}
+
+std::tuple<std::optional<uint32_t>, Tox_Err_Friend_By_Public_Key> ToxFakeClient::toxFriendByPublicKey(const std::vector<uint8_t>& public_key) {
+	_stats.calls++;
+	if (public_key.size() == TOX_PUBLIC_KEY_SIZE && public_key[0] == 'f') {
+		const uint32_t friend_number = public_key[1] | public_key[2] << 8 | public_key[3] << 16 | uint32_t(public_key[4]) << 24;
+		if (friendExists(friend_number)) {
+			return {friend_number, TOX_ERR_FRIEND_BY_PUBLIC_KEY_OK};
+		}
+	}
+	return {std::nullopt, TOX_ERR_FRIEND_BY_PUBLIC_KEY_NOT_FOUND};
+}
+
+bool ToxFakeClient::toxFriendExists(uint32_t friend_number) {
+	_stats.calls++;
+	return friendExists(friend_number);
+}
+
+size_t ToxFakeClient::toxSelfGetFriendListSize(void) {
+	_stats.calls++;
+	return _friend_count;
+}
+
+std::vector<uint32_t> ToxFakeClient::toxSelfGetFriendList(void) {
+	_stats.calls++;
+	std::vector<uint32_t> list(_friend_count);
+	for (uint32_t i = 0; i < _friend_count; i++) {
+		list[i] = i;
+	}
+	return list;
+}
+
+std::optional<std::vector<uint8_t>> ToxFakeClient::toxFriendGetPublicKey(uint32_t friend_number) {
+	_stats.calls++;
+	if (!friendExists(friend_number)) {
+		return std::nullopt;
+	}
+	return fakeKey('f', friend_number);
+}
+
+std::optional<uint64_t> ToxFakeClient::toxFriendGetLastOnline(uint32_t friend_number) {
+	_stats.calls++;
+	if (!friendExists(friend_number)) {
+		return std::nullopt;
+	}
+	return 0;
+}
+
+std::optional<std::string> ToxFakeClient::toxFriendGetName(uint32_t friend_number) {
+	_stats.calls++;
+	if (!friendExists(friend_number)) {
+		return std::nullopt;
+	}
+	return "friend" + std::to_string(friend_number);
+}
+
+std::optional<std::string> ToxFakeClient::toxFriendGetStatusMessage(uint32_t friend_number) {
+	_stats.calls++;
+	if (!friendExists(friend_number)) {
+		return std::nullopt;
+	}
+	return std::string{};
+}
+
+std::optional<Tox_User_Status> ToxFakeClient::toxFriendGetStatus(uint32_t friend_number) {
+	_stats.calls++;
+	if (!friendExists(friend_number)) {
+		return std::nullopt;
+	}
+	return TOX_USER_STATUS_NONE;
+}
+
+std::optional<Tox_Connection> ToxFakeClient::toxFriendGetConnectionStatus(uint32_t friend_number) {
+	_stats.calls++;
+	if (!friendExists(friend_number)) {
+		return std::nullopt;
+	}
+	return TOX_CONNECTION_UDP;
+}
+
+std::optional<bool> ToxFakeClient::toxFriendGetTyping(uint32_t friend_number) {
+	_stats.calls++;
+	if (!friendExists(friend_number)) {
+		return std::nullopt;
+	}
+	return false;
+}
+
+Tox_Err_Set_Typing ToxFakeClient::toxSelfSetTyping(uint32_t friend_number, bool) {
+	_stats.calls++;
+	return friendExists(friend_number) ? TOX_ERR_SET_TYPING_OK : TOX_ERR_SET_TYPING_FRIEND_NOT_FOUND;
+}
+
+std::tuple<std::optional<uint32_t>, Tox_Err_Friend_Send_Message> ToxFakeClient::toxFriendSendMessage(uint32_t friend_number, Tox_Message_Type, std::string_view message) {
+	_stats.calls++;
+	if (!friendExists(friend_number)) {
+		return {std::nullopt, TOX_ERR_FRIEND_SEND_MESSAGE_FRIEND_NOT_FOUND};
+	}
+	if (message.empty()) {
+		return {std::nullopt, TOX_ERR_FRIEND_SEND_MESSAGE_EMPTY};
+	}
+	if (message.size() > TOX_MAX_MESSAGE_LENGTH) {
+		return {std::nullopt, TOX_ERR_FRIEND_SEND_MESSAGE_TOO_LONG};
+	}
+	countSend(message.size());
+	return {_next_message_id++, TOX_ERR_FRIEND_SEND_MESSAGE_OK};
+}
+
+std::vector<uint8_t> ToxFakeClient::toxHash(const std::vector<uint8_t>& data) {
+	_stats.calls++;
+	// not a real hash, but stable and the right size
+	std::vector<uint8_t> hash(TOX_HASH_LENGTH, 0);
+	for (size_t i = 0; i < data.size(); i++) {
+		hash[i % TOX_HASH_LENGTH] = static_cast<uint8_t>(hash[i % TOX_HASH_LENGTH] * 31 + data[i]);
+	}
+	return hash;
+}
+
+Tox_Err_File_Control ToxFakeClient::toxFileControl(uint32_t friend_number, uint32_t, Tox_File_Control) {
+	_stats.calls++;
+	return friendExists(friend_number) ? TOX_ERR_FILE_CONTROL_OK : TOX_ERR_FILE_CONTROL_FRIEND_NOT_FOUND;
+}
+
+Tox_Err_File_Seek ToxFakeClient::toxFileSeek(uint32_t friend_number, uint32_t, uint64_t) {
+	_stats.calls++;
+	return friendExists(friend_number) ? TOX_ERR_FILE_SEEK_OK : TOX_ERR_FILE_SEEK_FRIEND_NOT_FOUND;
+}
+
+std::optional<std::vector<uint8_t>> ToxFakeClient::toxFileGetFileID(uint32_t friend_number, uint32_t file_number) {
+	_stats.calls++;
+	if (!friendExists(friend_number)) {
+		return std::nullopt;
+	}
+	auto file_id = fakeKey('F', friend_number, file_number);
+	file_id.resize(TOX_FILE_ID_LENGTH, 0);
+	return file_id;
+}
+
+std::tuple<std::optional<uint32_t>, Tox_Err_File_Send> ToxFakeClient::toxFileSend(uint32_t friend_number, uint32_t, uint64_t, const std::vector<uint8_t>&, std::string_view) {
+	_stats.calls++;
+	if (!friendExists(friend_number)) {
+		return {std::nullopt, TOX_ERR_FILE_SEND_FRIEND_NOT_FOUND};
+	}
+	return {_next_file_number++, TOX_ERR_FILE_SEND_OK};
+}
+
+Tox_Err_File_Send_Chunk ToxFakeClient::toxFileSendChunk(uint32_t friend_number, uint32_t, uint64_t, const std::vector<uint8_t>& data) {
+	_stats.calls++;
+	if (!friendExists(friend_number)) {
+		return TOX_ERR_FILE_SEND_CHUNK_FRIEND_NOT_FOUND;
+	}
+	countSend(data.size());
+	return TOX_ERR_FILE_SEND_CHUNK_OK;
+}
+
+std::tuple<std::optional<uint32_t>, Tox_Err_Conference_Join> ToxFakeClient::toxConferenceJoin(uint32_t friend_number, const std::vector<uint8_t>&) {
+	_stats.calls++;
+	if (!friendExists(friend_number)) {
+		return {std::nullopt, TOX_ERR_CONFERENCE_JOIN_FRIEND_NOT_FOUND};
+	}
+	return {0, TOX_ERR_CONFERENCE_JOIN_OK};
+}
+
+Tox_Err_Conference_Send_Message ToxFakeClient::toxConferenceSendMessage(uint32_t, Tox_Message_Type, std::string_view message) {
+	_stats.calls++;
+	countSend(message.size());
+	return TOX_ERR_CONFERENCE_SEND_MESSAGE_OK;
+}
+
+Tox_Err_Friend_Custom_Packet ToxFakeClient::toxFriendSendLossyPacket(uint32_t friend_number, const std::vector<uint8_t>& data) {
+	_stats.calls++;
+	if (!friendExists(friend_number)) {
+		return TOX_ERR_FRIEND_CUSTOM_PACKET_FRIEND_NOT_FOUND;
+	}
+	countSend(data.size());
+	return TOX_ERR_FRIEND_CUSTOM_PACKET_OK;
+}
+
+Tox_Err_Friend_Custom_Packet ToxFakeClient::toxFriendSendLosslessPacket(uint32_t friend_number, const std::vector<uint8_t>& data) {
+	_stats.calls++;
+	if (!friendExists(friend_number)) {
+		return TOX_ERR_FRIEND_CUSTOM_PACKET_FRIEND_NOT_FOUND;
+	}
+	countSend(data.size());
+	return TOX_ERR_FRIEND_CUSTOM_PACKET_OK;
+}
+
+std::tuple<std::optional<uint32_t>, Tox_Err_Group_New> ToxFakeClient::toxGroupNew(Tox_Group_Privacy_State, std::string_view, std::string_view) {
+	_stats.calls++;
+	return {_group_count++, TOX_ERR_GROUP_NEW_OK};
+}
+
+std::tuple<std::optional<uint32_t>, Tox_Err_Group_Join> ToxFakeClient::toxGroupJoin(const std::vector<uint8_t>&, std::string_view, std::string_view) {
+	_stats.calls++;
+	return {_group_count++, TOX_ERR_GROUP_JOIN_OK};
+}
+
+std::optional<bool> ToxFakeClient::toxGroupIsConnected(uint32_t group_number) {
+	_stats.calls++;
+	if (!groupExists(group_number)) {
+		return std::nullopt;
+	}
+	return true;
+}
+
+Tox_Err_Group_Disconnect ToxFakeClient::toxGroupDisconnect(uint32_t group_number) {
+	_stats.calls++;
+	return groupExists(group_number) ? TOX_ERR_GROUP_DISCONNECT_OK : TOX_ERR_GROUP_DISCONNECT_GROUP_NOT_FOUND;
+}
+
+Tox_Err_Group_Reconnect ToxFakeClient::toxGroupReconnect(uint32_t group_number) {
+	_stats.calls++;
+	return groupExists(group_number) ? TOX_ERR_GROUP_RECONNECT_OK : TOX_ERR_GROUP_RECONNECT_GROUP_NOT_FOUND;
+}
+
+Tox_Err_Group_Leave ToxFakeClient::toxGroupLeave(uint32_t group_number, std::string_view) {
+	_stats.calls++;
+	return groupExists(group_number) ? TOX_ERR_GROUP_LEAVE_OK : TOX_ERR_GROUP_LEAVE_GROUP_NOT_FOUND;
+}
+
+Tox_Err_Group_Self_Name_Set ToxFakeClient::toxGroupSelfSetName(uint32_t group_number, std::string_view) {
+	_stats.calls++;
+	return groupExists(group_number) ? TOX_ERR_GROUP_SELF_NAME_SET_OK : TOX_ERR_GROUP_SELF_NAME_SET_GROUP_NOT_FOUND;
+}
+
+std::optional<std::string> ToxFakeClient::toxGroupSelfGetName(uint32_t group_number) {
+	_stats.calls++;
+	if (!groupExists(group_number)) {
+		return std::nullopt;
+	}
+	return _self_name;
+}
+
+Tox_Err_Group_Self_Status_Set ToxFakeClient::toxGroupSelfSetStatus(uint32_t group_number, Tox_User_Status) {
+	_stats.calls++;
+	return groupExists(group_number) ? TOX_ERR_GROUP_SELF_STATUS_SET_OK : TOX_ERR_GROUP_SELF_STATUS_SET_GROUP_NOT_FOUND;
+}
+
+std::optional<Tox_User_Status> ToxFakeClient::toxGroupSelfGetStatus(uint32_t group_number) {
+	_stats.calls++;
+	if (!groupExists(group_number)) {
+		return std::nullopt;
+	}
+	return _self_status;
+}
+
+std::optional<Tox_Group_Role> ToxFakeClient::toxGroupSelfGetRole(uint32_t group_number) {
+	_stats.calls++;
+	if (!groupExists(group_number)) {
+		return std::nullopt;
+	}
+	return TOX_GROUP_ROLE_USER;
+}
+
+std::optional<uint32_t> ToxFakeClient::toxGroupSelfGetPeerId(uint32_t group_number) {
+	_stats.calls++;
+	if (!groupExists(group_number)) {
+		return std::nullopt;
+	}
+	return _group_peer_count; // right after the other peers
+}
+
+std::optional<std::vector<uint8_t>> ToxFakeClient::toxGroupSelfGetPublicKey(uint32_t group_number) {
+	_stats.calls++;
+	if (!groupExists(group_number)) {
+		return std::nullopt;
+	}
+	return fakeKey('s', group_number);
+}
+
+std::optional<std::string> ToxFakeClient::toxGroupPeerGetName(uint32_t group_number, uint32_t peer_id) {
+	_stats.calls++;
+	if (!peerExists(group_number, peer_id)) {
+		return std::nullopt;
+	}
+	return "peer" + std::to_string(peer_id);
+}
+
+std::optional<Tox_User_Status> ToxFakeClient::toxGroupPeerGetStatus(uint32_t group_number, uint32_t peer_id) {
+	_stats.calls++;
+	if (!peerExists(group_number, peer_id)) {
+		return std::nullopt;
+	}
+	return TOX_USER_STATUS_NONE;
+}
+
+std::optional<Tox_Group_Role> ToxFakeClient::toxGroupPeerGetRole(uint32_t group_number, uint32_t peer_id) {
+	_stats.calls++;
+	if (!peerExists(group_number, peer_id)) {
+		return std::nullopt;
+	}
+	return TOX_GROUP_ROLE_USER;
+}
+
+std::tuple<std::optional<Tox_Connection>, Tox_Err_Group_Peer_Query> ToxFakeClient::toxGroupPeerGetConnectionStatus(uint32_t group_number, uint32_t peer_id) {
+	_stats.calls++;
+	if (!groupExists(group_number)) {
+		return {std::nullopt, TOX_ERR_GROUP_PEER_QUERY_GROUP_NOT_FOUND};
+	}
+	if (!peerExists(group_number, peer_id)) {
+		return {std::nullopt, TOX_ERR_GROUP_PEER_QUERY_PEER_NOT_FOUND};
+	}
+	return {TOX_CONNECTION_UDP, TOX_ERR_GROUP_PEER_QUERY_OK};
+}
+
+std::optional<std::vector<uint8_t>> ToxFakeClient::toxGroupPeerGetPublicKey(uint32_t group_number, uint32_t peer_id) {
+	_stats.calls++;
+	if (!peerExists(group_number, peer_id)) {
+		return std::nullopt;
+	}
+	return fakeKey('p', group_number, peer_id);
+}
+
+Tox_Err_Group_Topic_Set ToxFakeClient::toxGroupSetTopic(uint32_t group_number, std::string_view) {
+	_stats.calls++;
+	return groupExists(group_number) ? TOX_ERR_GROUP_TOPIC_SET_OK : TOX_ERR_GROUP_TOPIC_SET_GROUP_NOT_FOUND;
+}
+
+std::optional<std::string> ToxFakeClient::toxGroupGetTopic(uint32_t group_number) {
+	_stats.calls++;
+	if (!groupExists(group_number)) {
+		return std::nullopt;
+	}
+	return std::string{};
+}
+
+std::optional<std::string> ToxFakeClient::toxGroupGetName(uint32_t group_number) {
+	_stats.calls++;
+	if (!groupExists(group_number)) {
+		return std::nullopt;
+	}
+	return "group" + std::to_string(group_number);
+}
+
+std::optional<std::vector<uint8_t>> ToxFakeClient::toxGroupGetChatId(uint32_t group_number) {
+	_stats.calls++;
+	if (!groupExists(group_number)) {
+		return std::nullopt;
+	}
+	auto chat_id = fakeKey('g', group_number);
+	chat_id.resize(TOX_GROUP_CHAT_ID_SIZE, 0);
+	return chat_id;
+}
+
+uint32_t ToxFakeClient::toxGroupGetNumberGroups(void) {
+	_stats.calls++;
+	return _group_count;
+}
+
+std::vector<uint32_t> ToxFakeClient::toxGroupGetList(void) {
+	_stats.calls++;
+	std::vector<uint32_t> list(_group_count);
+	for (uint32_t i = 0; i < _group_count; i++) {
+		list[i] = i;
+	}
+	return list;
+}
+
+std::tuple<std::optional<uint32_t>, Tox_Err_Group_Send_Message> ToxFakeClient::toxGroupSendMessage(uint32_t group_number, Tox_Message_Type, std::string_view message) {
+	_stats.calls++;
+	if (!groupExists(group_number)) {
+		return {std::nullopt, TOX_ERR_GROUP_SEND_MESSAGE_GROUP_NOT_FOUND};
+	}
+	if (message.empty()) {
+		return {std::nullopt, TOX_ERR_GROUP_SEND_MESSAGE_EMPTY};
+	}
+	if (message.size() > TOX_GROUP_MAX_MESSAGE_LENGTH) {
+		return {std::nullopt, TOX_ERR_GROUP_SEND_MESSAGE_TOO_LONG};
+	}
+	countSend(message.size());
+	return {_next_message_id++, TOX_ERR_GROUP_SEND_MESSAGE_OK};
+}
+
+Tox_Err_Group_Send_Private_Message ToxFakeClient::toxGroupSendPrivateMessage(uint32_t group_number, uint32_t peer_id, Tox_Message_Type, std::string_view message) {
+	_stats.calls++;
+	if (!groupExists(group_number)) {
+		return TOX_ERR_GROUP_SEND_PRIVATE_MESSAGE_GROUP_NOT_FOUND;
+	}
+	if (!peerExists(group_number, peer_id)) {
+		return TOX_ERR_GROUP_SEND_PRIVATE_MESSAGE_PEER_NOT_FOUND;
+	}
+	countSend(message.size());
+	return TOX_ERR_GROUP_SEND_PRIVATE_MESSAGE_OK;
+}
+
+Tox_Err_Group_Send_Custom_Packet ToxFakeClient::toxGroupSendCustomPacket(uint32_t group_number, bool, const std::vector<uint8_t>& data) {
+	_stats.calls++;
+	if (!groupExists(group_number)) {
+		return TOX_ERR_GROUP_SEND_CUSTOM_PACKET_GROUP_NOT_FOUND;
+	}
+	countSend(data.size());
+	return TOX_ERR_GROUP_SEND_CUSTOM_PACKET_OK;
+}
+
+Tox_Err_Group_Send_Custom_Private_Packet ToxFakeClient::toxGroupSendCustomPrivatePacket(uint32_t group_number, uint32_t peer_id, bool, const std::vector<uint8_t>& data) {
+	_stats.calls++;
+	if (!groupExists(group_number)) {
+		return TOX_ERR_GROUP_SEND_CUSTOM_PRIVATE_PACKET_GROUP_NOT_FOUND;
+	}
+	if (!peerExists(group_number, peer_id)) {
+		return TOX_ERR_GROUP_SEND_CUSTOM_PRIVATE_PACKET_PEER_NOT_FOUND;
+	}
+	countSend(data.size());
+	return TOX_ERR_GROUP_SEND_CUSTOM_PRIVATE_PACKET_OK;
+}
+
+Tox_Err_Group_Invite_Friend ToxFakeClient::toxGroupInviteFriend(uint32_t group_number, uint32_t friend_number) {
+	_stats.calls++;
+	if (!groupExists(group_number)) {
+		return TOX_ERR_GROUP_INVITE_FRIEND_GROUP_NOT_FOUND;
+	}
+	if (!friendExists(friend_number)) {
+		return TOX_ERR_GROUP_INVITE_FRIEND_FRIEND_NOT_FOUND;
+	}
+	return TOX_ERR_GROUP_INVITE_FRIEND_OK;
+}
+
+std::tuple<std::optional<uint32_t>, Tox_Err_Group_Invite_Accept> ToxFakeClient::toxGroupInviteAccept(uint32_t, const std::vector<uint8_t>&, std::string_view, std::string_view) {
+	_stats.calls++;
+	return {_group_count++, TOX_ERR_GROUP_INVITE_ACCEPT_OK};
+}
+
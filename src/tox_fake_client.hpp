@@ -0,0 +1,145 @@
+#pragma once
+
+#include <solanaceae/toxcore/tox_default_impl.hpp>
+#include <solanaceae/toxcore/tox_event_interface.hpp>
+#include <solanaceae/toxcore/tox_event_provider_base.hpp>
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <tuple>
+#include <optional>
+#include <functional>
+#include <cstdint>
+
+// tox without a tox instance or network, for feeding recorded events into the lua module
+// friends and groups below the set counts exist and are online, sends always succeed and are only counted
+// calls not overridden here would go to the (null) tox instance
+class ToxFakeClient : public ToxDefaultImpl, public ToxEventProviderBase {
+	public:
+		struct Stats {
+			uint64_t batches {0};
+			uint64_t calls {0}; // anything scripts called on tox
+			uint64_t sends {0}; // messages and packets
+			uint64_t send_bytes {0};
+		};
+
+	private:
+		std::vector<std::function<void(const Tox_Events*)>> _subscribers_raw;
+		std::vector<std::function<void(const Tox_Events*)>> _subscribers_raw_done;
+
+		uint32_t _friend_count {16};
+		uint32_t _group_count {4};
+		uint32_t _group_peer_count {32};
+
+		std::string _self_name {"LUNATiX"};
+		std::string _self_status_message;
+		Tox_User_Status _self_status {TOX_USER_STATUS_NONE};
+		uint32_t _nospam {0};
+
+		uint32_t _next_message_id {1};
+		uint32_t _next_file_number {0};
+
+		Stats _stats;
+
+	public:
+		ToxFakeClient(void) = default;
+		virtual ~ToxFakeClient(void) {}
+
+		void setCounts(uint32_t friends, uint32_t groups, uint32_t group_peers);
+
+		// same as ToxClient::subscribeRaw() and subscribeRawDone()
+		void subscribeRaw(std::function<void(const Tox_Events*)> fn);
+		void subscribeRawDone(std::function<void(const Tox_Events*)> fn);
+
+		// raw subscribers, the event handlers, then the raw done subscribers, like ToxClient::iterate() does
+		void dispatch(const Tox_Events* events);
+
+		const Stats& getStats(void) const { return _stats; }
+
+	private:
+		bool friendExists(uint32_t friend_number) const { return friend_number < _friend_count; }
+		bool groupExists(uint32_t group_number) const { return group_number < _group_count; }
+		bool peerExists(uint32_t group_number, uint32_t peer_id) const { return groupExists(group_number) && peer_id < _group_peer_count; }
+
+		// deterministic fake keys, the number in the first bytes
+		static std::vector<uint8_t> fakeKey(uint8_t kind, uint32_t number, uint32_t sub = 0);
+
+		void countSend(size_t size);
+
+	public: // ToxI
+		Tox_Connection toxSelfGetConnectionStatus(void) override;
+		uint32_t toxIterationInterval(void) override;
+		std::vector<uint8_t> toxSelfGetAddress(void) override;
+		void toxSelfSetNospam(uint32_t nospam) override;
+		uint32_t toxSelfGetNospam(void) override;
+		std::vector<uint8_t> toxSelfGetPublicKey(void) override;
+		Tox_Err_Set_Info toxSelfSetName(std::string_view name) override;
+		std::string toxSelfGetName(void) override;
+		Tox_Err_Set_Info toxSelfSetStatusMessage(std::string_view status_message) override;
+		std::string toxSelfGetStatusMessage(void) override;
+		void toxSelfSetStatus(Tox_User_Status status) override;
+		Tox_User_Status toxSelfGetStatus(void) override;
+
+		std::tuple<std::optional<uint32_t>, Tox_Err_Friend_Add> toxFriendAdd(const std::vector<uint8_t>& address, std::string_view message) override;
+		std::tuple<std::optional<uint32_t>, Tox_Err_Friend_Add> toxFriendAddNorequest(const std::vector<uint8_t>& public_key) override;
+		Tox_Err_Friend_Delete toxFriendDelete(uint32_t friend_number) override;
+		std::tuple<std::optional<uint32_t>, Tox_Err_Friend_By_Public_Key> toxFriendByPublicKey(const std::vector<uint8_t>& public_key) override;
+		bool toxFriendExists(uint32_t friend_number) override;
+		size_t toxSelfGetFriendListSize(void) override;
+		std::vector<uint32_t> toxSelfGetFriendList(void) override;
+		std::optional<std::vector<uint8_t>> toxFriendGetPublicKey(uint32_t friend_number) override;
+		std::optional<uint64_t> toxFriendGetLastOnline(uint32_t friend_number) override;
+		std::optional<std::string> toxFriendGetName(uint32_t friend_number) override;
+		std::optional<std::string> toxFriendGetStatusMessage(uint32_t friend_number) override;
+		std::optional<Tox_User_Status> toxFriendGetStatus(uint32_t friend_number) override;
+		std::optional<Tox_Connection> toxFriendGetConnectionStatus(uint32_t friend_number) override;
+		std::optional<bool> toxFriendGetTyping(uint32_t friend_number) override;
+		Tox_Err_Set_Typing toxSelfSetTyping(uint32_t friend_number, bool typing) override;
+		std::tuple<std::optional<uint32_t>, Tox_Err_Friend_Send_Message> toxFriendSendMessage(uint32_t friend_number, Tox_Message_Type type, std::string_view message) override;
+
+		std::vector<uint8_t> toxHash(const std::vector<uint8_t>& data) override;
+		Tox_Err_File_Control toxFileControl(uint32_t friend_number, uint32_t file_number, Tox_File_Control control) override;
+		Tox_Err_File_Seek toxFileSeek(uint32_t friend_number, uint32_t file_number, uint64_t position) override;
+		std::optional<std::vector<uint8_t>> toxFileGetFileID(uint32_t friend_number, uint32_t file_number) override;
+		std::tuple<std::optional<uint32_t>, Tox_Err_File_Send> toxFileSend(uint32_t friend_number, uint32_t kind, uint64_t file_size, const std::vector<uint8_t>& file_id, std::string_view filename) override;
+		Tox_Err_File_Send_Chunk toxFileSendChunk(uint32_t friend_number, uint32_t file_number, uint64_t position, const std::vector<uint8_t>& data) override;
+
+		std::tuple<std::optional<uint32_t>, Tox_Err_Conference_Join> toxConferenceJoin(uint32_t friend_number, const std::vector<uint8_t>& cookie) override;
+		Tox_Err_Conference_Send_Message toxConferenceSendMessage(uint32_t conference_number, Tox_Message_Type type, std::string_view message) override;
+
+		Tox_Err_Friend_Custom_Packet toxFriendSendLossyPacket(uint32_t friend_number, const std::vector<uint8_t>& data) override;
+		Tox_Err_Friend_Custom_Packet toxFriendSendLosslessPacket(uint32_t friend_number, const std::vector<uint8_t>& data) override;
+
+		std::tuple<std::optional<uint32_t>, Tox_Err_Group_New> toxGroupNew(Tox_Group_Privacy_State privacy_state, std::string_view group_name, std::string_view name) override;
+		std::tuple<std::optional<uint32_t>, Tox_Err_Group_Join> toxGroupJoin(const std::vector<uint8_t>& chat_id, std::string_view name, std::string_view password) override;
+		std::optional<bool> toxGroupIsConnected(uint32_t group_number) override;
+		Tox_Err_Group_Disconnect toxGroupDisconnect(uint32_t group_number) override;
+		Tox_Err_Group_Reconnect toxGroupReconnect(uint32_t group_number) override;
+		Tox_Err_Group_Leave toxGroupLeave(uint32_t group_number, std::string_view part_message) override;
+		Tox_Err_Group_Self_Name_Set toxGroupSelfSetName(uint32_t group_number, std::string_view name) override;
+		std::optional<std::string> toxGroupSelfGetName(uint32_t group_number) override;
+		Tox_Err_Group_Self_Status_Set toxGroupSelfSetStatus(uint32_t group_number, Tox_User_Status status) override;
+		std::optional<Tox_User_Status> toxGroupSelfGetStatus(uint32_t group_number) override;
+		std::optional<Tox_Group_Role> toxGroupSelfGetRole(uint32_t group_number) override;
+		std::optional<uint32_t> toxGroupSelfGetPeerId(uint32_t group_number) override;
+		std::optional<std::vector<uint8_t>> toxGroupSelfGetPublicKey(uint32_t group_number) override;
+		std::optional<std::string> toxGroupPeerGetName(uint32_t group_number, uint32_t peer_id) override;
+		std::optional<Tox_User_Status> toxGroupPeerGetStatus(uint32_t group_number, uint32_t peer_id) override;
+		std::optional<Tox_Group_Role> toxGroupPeerGetRole(uint32_t group_number, uint32_t peer_id) override;
+		std::tuple<std::optional<Tox_Connection>, Tox_Err_Group_Peer_Query> toxGroupPeerGetConnectionStatus(uint32_t group_number, uint32_t peer_id) override;
+		std::optional<std::vector<uint8_t>> toxGroupPeerGetPublicKey(uint32_t group_number, uint32_t peer_id) override;
+		Tox_Err_Group_Topic_Set toxGroupSetTopic(uint32_t group_number, std::string_view topic) override;
+		std::optional<std::string> toxGroupGetTopic(uint32_t group_number) override;
+		std::optional<std::string> toxGroupGetName(uint32_t group_number) override;
+		std::optional<std::vector<uint8_t>> toxGroupGetChatId(uint32_t group_number) override;
+		uint32_t toxGroupGetNumberGroups(void) override;
+		std::vector<uint32_t> toxGroupGetList(void) override;
+		std::tuple<std::optional<uint32_t>, Tox_Err_Group_Send_Message> toxGroupSendMessage(uint32_t group_number, Tox_Message_Type type, std::string_view message) override;
+		Tox_Err_Group_Send_Private_Message toxGroupSendPrivateMessage(uint32_t group_number, uint32_t peer_id, Tox_Message_Type type, std::string_view message) override;
+		Tox_Err_Group_Send_Custom_Packet toxGroupSendCustomPacket(uint32_t group_number, bool lossless, const std::vector<uint8_t>& data) override;
+		Tox_Err_Group_Send_Custom_Private_Packet toxGroupSendCustomPrivatePacket(uint32_t group_number, uint32_t peer_id, bool lossless, const std::vector<uint8_t>& data) override;
+		Tox_Err_Group_Invite_Friend toxGroupInviteFriend(uint32_t group_number, uint32_t friend_number) override;
+		std::tuple<std::optional<uint32_t>, Tox_Err_Group_Invite_Accept> toxGroupInviteAccept(uint32_t friend_number, const std::vector<uint8_t>& invite_data, std::string_view name, std::string_view password) override;
+};
+
@@ -0,0 +1,74 @@
+#pragma once
+
+// every tox event the lua module handles, one line each, everything else gets generated from this
+// X(event type, Tox_Event value, getter prefix, fields...)
+// fields are pushed to the handlers in this order, names come from the getters:
+//   (num, x)              tox_event_<prefix>_get_x(), integers and enums
+//   (boolean, x)          tox_event_<prefix>_get_x()
+//   (text, x, len)        string from tox_event_<prefix>_get_x() and _get_len()
+//   (text_nul, x, len)    same, but cut at the first \0
+//   (bytes, x, len)       ByteView, only valid during the handler call
+//   (public_key, x)       TOX_PUBLIC_KEY_SIZE bytes, as an array of numbers
+#define TLM_TOX_EVENTS(X) \
+	X(Tox_Event_Conference_Connected, TOX_EVENT_CONFERENCE_CONNECTED, conference_connected, (num, conference_number)) \
+	X(Tox_Event_Conference_Invite, TOX_EVENT_CONFERENCE_INVITE, conference_invite, (num, friend_number), (num, type), (bytes, cookie, cookie_length)) \
+	X(Tox_Event_Conference_Message, TOX_EVENT_CONFERENCE_MESSAGE, conference_message, (num, conference_number), (num, peer_number), (num, type), (text, message, message_length)) \
+	X(Tox_Event_Conference_Peer_List_Changed, TOX_EVENT_CONFERENCE_PEER_LIST_CHANGED, conference_peer_list_changed, (num, conference_number)) \
+	X(Tox_Event_Conference_Peer_Name, TOX_EVENT_CONFERENCE_PEER_NAME, conference_peer_name, (num, conference_number), (num, peer_number), (text, name, name_length)) \
+	X(Tox_Event_Conference_Title, TOX_EVENT_CONFERENCE_TITLE, conference_title, (num, conference_number), (num, peer_number), (text, title, title_length)) \
+	\
+	X(Tox_Event_File_Chunk_Request, TOX_EVENT_FILE_CHUNK_REQUEST, file_chunk_request, (num, friend_number), (num, file_number), (num, position), (num, length)) \
+	X(Tox_Event_File_Recv, TOX_EVENT_FILE_RECV, file_recv, (num, friend_number), (num, file_number), (num, kind), (num, file_size), (text, filename, filename_length)) \
+	X(Tox_Event_File_Recv_Chunk, TOX_EVENT_FILE_RECV_CHUNK, file_recv_chunk, (num, friend_number), (num, file_number), (num, position), (bytes, data, length)) \
+	X(Tox_Event_File_Recv_Control, TOX_EVENT_FILE_RECV_CONTROL, file_recv_control, (num, friend_number), (num, file_number), (num, control)) \
+	\
+	X(Tox_Event_Friend_Connection_Status, TOX_EVENT_FRIEND_CONNECTION_STATUS, friend_connection_status, (num, friend_number), (num, connection_status)) \
+	X(Tox_Event_Friend_Lossless_Packet, TOX_EVENT_FRIEND_LOSSLESS_PACKET, friend_lossless_packet, (num, friend_number), (bytes, data, data_length)) \
+	X(Tox_Event_Friend_Lossy_Packet, TOX_EVENT_FRIEND_LOSSY_PACKET, friend_lossy_packet, (num, friend_number), (bytes, data, data_length)) \
+	X(Tox_Event_Friend_Message, TOX_EVENT_FRIEND_MESSAGE, friend_message, (num, friend_number), (num, type), (text_nul, message, message_length)) \
+	X(Tox_Event_Friend_Name, TOX_EVENT_FRIEND_NAME, friend_name, (num, friend_number), (text, name, name_length)) \
+	X(Tox_Event_Friend_Read_Receipt, TOX_EVENT_FRIEND_READ_RECEIPT, friend_read_receipt, (num, friend_number), (num, message_id)) \
+	X(Tox_Event_Friend_Request, TOX_EVENT_FRIEND_REQUEST, friend_request, (public_key, public_key), (text, message, message_length)) \
+	X(Tox_Event_Friend_Status, TOX_EVENT_FRIEND_STATUS, friend_status, (num, friend_number), (num, status)) \
+	X(Tox_Event_Friend_Status_Message, TOX_EVENT_FRIEND_STATUS_MESSAGE, friend_status_message, (num, friend_number), (text, message, message_length)) \
+	X(Tox_Event_Friend_Typing, TOX_EVENT_FRIEND_TYPING, friend_typing, (num, friend_number), (boolean, typing)) \
+	\
+	X(Tox_Event_Self_Connection_Status, TOX_EVENT_SELF_CONNECTION_STATUS, self_connection_status, (num, connection_status)) \
+	\
+	X(Tox_Event_Group_Peer_Name, TOX_EVENT_GROUP_PEER_NAME, group_peer_name, (num, group_number), (num, peer_id), (text, name, name_length)) \
+	X(Tox_Event_Group_Peer_Status, TOX_EVENT_GROUP_PEER_STATUS, group_peer_status, (num, group_number), (num, peer_id), (num, status)) \
+	X(Tox_Event_Group_Topic, TOX_EVENT_GROUP_TOPIC, group_topic, (num, group_number), (num, peer_id), (text, topic, topic_length)) \
+	X(Tox_Event_Group_Privacy_State, TOX_EVENT_GROUP_PRIVACY_STATE, group_privacy_state, (num, group_number), (num, privacy_state)) \
+	X(Tox_Event_Group_Voice_State, TOX_EVENT_GROUP_VOICE_STATE, group_voice_state, (num, group_number), (num, voice_state)) \
+	X(Tox_Event_Group_Topic_Lock, TOX_EVENT_GROUP_TOPIC_LOCK, group_topic_lock, (num, group_number), (num, topic_lock)) \
+	X(Tox_Event_Group_Peer_Limit, TOX_EVENT_GROUP_PEER_LIMIT, group_peer_limit, (num, group_number), (num, peer_limit)) \
+	X(Tox_Event_Group_Password, TOX_EVENT_GROUP_PASSWORD, group_password, (num, group_number), (text, password, password_length)) \
+	X(Tox_Event_Group_Message, TOX_EVENT_GROUP_MESSAGE, group_message, (num, group_number), (num, peer_id), (num, type), (text, message, message_length), (num, message_id)) \
+	X(Tox_Event_Group_Private_Message, TOX_EVENT_GROUP_PRIVATE_MESSAGE, group_private_message, (num, group_number), (num, peer_id), (num, type), (text, message, message_length)) \
+	X(Tox_Event_Group_Custom_Packet, TOX_EVENT_GROUP_CUSTOM_PACKET, group_custom_packet, (num, group_number), (num, peer_id), (bytes, data, data_length)) \
+	X(Tox_Event_Group_Custom_Private_Packet, TOX_EVENT_GROUP_CUSTOM_PRIVATE_PACKET, group_custom_private_packet, (num, group_number), (num, peer_id), (bytes, data, data_length)) \
+	X(Tox_Event_Group_Invite, TOX_EVENT_GROUP_INVITE, group_invite, (num, friend_number), (bytes, invite_data, invite_data_length), (text, group_name, group_name_length)) \
+	X(Tox_Event_Group_Peer_Join, TOX_EVENT_GROUP_PEER_JOIN, group_peer_join, (num, group_number), (num, peer_id)) \
+	X(Tox_Event_Group_Peer_Exit, TOX_EVENT_GROUP_PEER_EXIT, group_peer_exit, (num, group_number), (num, peer_id), (num, exit_type), (text, name, name_length), (text, part_message, part_message_length)) \
+	X(Tox_Event_Group_Self_Join, TOX_EVENT_GROUP_SELF_JOIN, group_self_join, (num, group_number)) \
+	X(Tox_Event_Group_Join_Fail, TOX_EVENT_GROUP_JOIN_FAIL, group_join_fail, (num, group_number), (num, fail_type)) \
+	X(Tox_Event_Group_Moderation, TOX_EVENT_GROUP_MODERATION, group_moderation, (num, group_number), (num, source_peer_id), (num, target_peer_id), (num, mod_type))
+
+// applies f(event type, prefix, (field)) to each field of a table line, up to 6
+#define TLM_EVENT_FIELDS(f, x, lower, ...) TLM_EVENT_CAT(TLM_EVENT_FIELDS_, TLM_EVENT_NARGS(__VA_ARGS__))(f, x, lower, __VA_ARGS__)
+#define TLM_EVENT_FIELDS_1(f, x, lower, a) f(x, lower, a)
+#define TLM_EVENT_FIELDS_2(f, x, lower, a, ...) f(x, lower, a) TLM_EVENT_FIELDS_1(f, x, lower, __VA_ARGS__)
+#define TLM_EVENT_FIELDS_3(f, x, lower, a, ...) f(x, lower, a) TLM_EVENT_FIELDS_2(f, x, lower, __VA_ARGS__)
+#define TLM_EVENT_FIELDS_4(f, x, lower, a, ...) f(x, lower, a) TLM_EVENT_FIELDS_3(f, x, lower, __VA_ARGS__)
+#define TLM_EVENT_FIELDS_5(f, x, lower, a, ...) f(x, lower, a) TLM_EVENT_FIELDS_4(f, x, lower, __VA_ARGS__)
+#define TLM_EVENT_FIELDS_6(f, x, lower, a, ...) f(x, lower, a) TLM_EVENT_FIELDS_5(f, x, lower, __VA_ARGS__)
+
+#define TLM_EVENT_NARGS(...) TLM_EVENT_NARGS_(__VA_ARGS__, 6, 5, 4, 3, 2, 1, 0)
+#define TLM_EVENT_NARGS_(_1, _2, _3, _4, _5, _6, n, ...) n
+#define TLM_EVENT_CAT(a, b) TLM_EVENT_CAT_(a, b)
+#define TLM_EVENT_CAT_(a, b) a##b
+
+// (kind, args...) -> kind, args...
+#define TLM_EVENT_UNPAREN(...) __VA_ARGS__
+#define TLM_EVENT_CALL(m, args) m args
+
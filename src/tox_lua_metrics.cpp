@@ -0,0 +1,187 @@
+#include "./tox_lua_metrics.hpp"
+
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+#include <iostream>
+
+static double toSeconds(std::chrono::nanoseconds duration) {
+	return std::chrono::duration<double>(duration).count();
+}
+
+static std::string labelSet(const std::string& labels, const std::string& extra = {}) {
+	if (labels.empty() && extra.empty()) {
+		return {};
+	}
+	return "{" + labels + (labels.empty() || extra.empty() ? "" : ",") + extra + "}";
+}
+
+// summary with p50, p99, sum and count
+static void writeSummary(std::ostream& out, const std::string& name, const std::string& labels, const LatencyHistogram& histogram) {
+	out << name << labelSet(labels, "quantile=\"0.5\"") << " " << toSeconds(histogram.quantile(0.5)) << "\n";
+	out << name << labelSet(labels, "quantile=\"0.99\"") << " " << toSeconds(histogram.quantile(0.99)) << "\n";
+	out << name << "_sum" << labelSet(labels) << " " << toSeconds(histogram.sum()) << "\n";
+	out << name << "_count" << labelSet(labels) << " " << histogram.count() << "\n";
+}
+
+// the max is a gauge of its own, summaries have no place for it
+static void writeMax(std::ostream& out, const std::string& name, const std::string& labels, const LatencyHistogram& histogram) {
+	out << name << labelSet(labels) << " " << toSeconds(histogram.max()) << "\n";
+}
+
+static void pushHistogram(lua_State* L, const LatencyHistogram& histogram) {
+	lua_createtable(L, 0, 5);
+	lua_pushnumber(L, static_cast<double>(histogram.count()));
+	lua_setfield(L, -2, "count");
+	lua_pushnumber(L, toSeconds(histogram.quantile(0.5)));
+	lua_setfield(L, -2, "p50");
+	lua_pushnumber(L, toSeconds(histogram.quantile(0.99)));
+	lua_setfield(L, -2, "p99");
+	lua_pushnumber(L, toSeconds(histogram.max()));
+	lua_setfield(L, -2, "max");
+	lua_pushnumber(L, toSeconds(histogram.sum()));
+	lua_setfield(L, -2, "sum");
+}
+
+void ToxLuaMetrics::recordEvent(Tox_Event event_type, const char* name, bool consumed, clock::duration duration) {
+	auto& event = _events.at(event_type);
+	event.name = name;
+	event.count++;
+	if (consumed) {
+		event.consumed++;
+	}
+	event.handler.record(duration);
+}
+
+void ToxLuaMetrics::recordBatch(Tox_Event event_type, const char* name, clock::duration duration) {
+	auto& event = _events.at(event_type);
+	event.name = name;
+	event.handler.record(duration);
+}
+
+void ToxLuaMetrics::gcInterrupt(int gc) {
+	if (gc < 0) {
+		return; // regular safepoint
+	}
+
+	if (!_in_gc) {
+		_gc_start = clock::now();
+		_in_gc = true;
+	} else {
+		_gc.record(clock::now() - _gc_start);
+		_in_gc = false;
+	}
+}
+
+void ToxLuaMetrics::addHistogram(std::string name, const LatencyHistogram* histogram) {
+	_external.emplace_back(std::move(name), histogram);
+}
+
+void ToxLuaMetrics::setDumpFile(std::string path, std::chrono::seconds interval) {
+	_dump_path = std::move(path);
+	_dump_interval = interval;
+	_last_dump = clock::now();
+}
+
+void ToxLuaMetrics::iterate(void) {
+	if (_dump_path.empty()) {
+		return;
+	}
+
+	const auto now = clock::now();
+	if (now - _last_dump < _dump_interval) {
+		return;
+	}
+	_last_dump = now;
+
+	// scrapers never see a half written file
+	const std::string tmp_path = _dump_path + ".tmp";
+	{
+		std::ofstream file{tmp_path, std::ios::trunc};
+		file << toPrometheus();
+		if (!file) {
+			std::cerr << "TLM error, failed writing metrics to " << tmp_path << "\n";
+			return;
+		}
+	}
+
+	std::error_code ec;
+	std::filesystem::rename(tmp_path, _dump_path, ec);
+	if (ec) {
+		std::cerr << "TLM error, failed replacing " << _dump_path << ": " << ec.message() << "\n";
+	}
+}
+
+std::string ToxLuaMetrics::toPrometheus(void) const {
+	std::ostringstream out;
+
+	out << "# TYPE tlm_events_total counter\n";
+	for (const auto& event : _events) {
+		if (event.name != nullptr) {
+			out << "tlm_events_total{event=\"" << event.name << "\"} " << event.count << "\n";
+		}
+	}
+
+	out << "# TYPE tlm_events_consumed_total counter\n";
+	for (const auto& event : _events) {
+		if (event.name != nullptr) {
+			out << "tlm_events_consumed_total{event=\"" << event.name << "\"} " << event.consumed << "\n";
+		}
+	}
+
+	out << "# TYPE tlm_event_handler_seconds summary\n";
+	for (const auto& event : _events) {
+		if (event.name != nullptr) {
+			writeSummary(out, "tlm_event_handler_seconds", std::string{"event=\""} + event.name + "\"", event.handler);
+		}
+	}
+
+	out << "# TYPE tlm_event_handler_max_seconds gauge\n";
+	for (const auto& event : _events) {
+		if (event.name != nullptr) {
+			writeMax(out, "tlm_event_handler_max_seconds", std::string{"event=\""} + event.name + "\"", event.handler);
+		}
+	}
+
+	std::vector<std::pair<std::string, const LatencyHistogram*>> histograms {
+		{"iterate", &_iterate},
+		{"gc_step", &_gc},
+	};
+	histograms.insert(histograms.end(), _external.cbegin(), _external.cend());
+	for (const auto& [name, histogram] : histograms) {
+		out << "# TYPE tlm_" << name << "_seconds summary\n";
+		writeSummary(out, "tlm_" + name + "_seconds", "", *histogram);
+		out << "# TYPE tlm_" << name << "_max_seconds gauge\n";
+		writeMax(out, "tlm_" + name + "_max_seconds", "", *histogram);
+	}
+
+	return out.str();
+}
+
+void ToxLuaMetrics::push(lua_State* L) const {
+	lua_createtable(L, 0, 3 + static_cast<int>(_external.size()));
+
+	lua_newtable(L);
+	for (const auto& event : _events) {
+		if (event.name == nullptr) {
+			continue;
+		}
+		pushHistogram(L, event.handler);
+		lua_pushnumber(L, static_cast<double>(event.consumed));
+		lua_setfield(L, -2, "consumed");
+		lua_setfield(L, -2, event.name);
+	}
+	lua_setfield(L, -2, "events");
+
+	pushHistogram(L, _iterate);
+	lua_setfield(L, -2, "iterate");
+
+	pushHistogram(L, _gc);
+	lua_setfield(L, -2, "gc");
+
+	for (const auto& [name, histogram] : _external) {
+		pushHistogram(L, *histogram);
+		lua_setfield(L, -2, name.c_str());
+	}
+}
+
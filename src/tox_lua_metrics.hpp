@@ -0,0 +1,66 @@
+#pragma once
+
+#include <solanaceae/toxcore/tox_event_interface.hpp>
+
+#include "./solanaceae/latency_histogram.hpp"
+
+#include <lua.h>
+
+#include <array>
+#include <vector>
+#include <string>
+#include <chrono>
+#include <cstdint>
+
+// event counts and handler latencies of the lua bridge
+// exposed to lua and optionally dumped as a prometheus text file
+class ToxLuaMetrics {
+	public:
+		using clock = std::chrono::steady_clock;
+
+		struct Event {
+			const char* name {nullptr}; // set on the first event
+			uint64_t count {0};
+			uint64_t consumed {0}; // handler returned true
+			LatencyHistogram handler; // batch handlers add one sample per call, on top of the ones collecting their events
+		};
+
+	private:
+		std::array<Event, TOX_EVENT_GROUP_MODERATION+1> _events;
+		LatencyHistogram _iterate; // tlm_iterate()
+		LatencyHistogram _gc; // gc steps
+
+		// owned by someone else, eg. ToxClient::IterateStats
+		std::vector<std::pair<std::string, const LatencyHistogram*>> _external;
+
+		// gc steps interrupt once before and once after
+		bool _in_gc {false};
+		clock::time_point _gc_start;
+
+		std::string _dump_path;
+		std::chrono::seconds _dump_interval {10};
+		clock::time_point _last_dump;
+
+	public:
+		void recordEvent(Tox_Event event_type, const char* name, bool consumed, clock::duration duration);
+		// a "<event>_Batch" handler call, its events are already counted by recordEvent()
+		void recordBatch(Tox_Event event_type, const char* name, clock::duration duration);
+		void recordIterate(clock::duration duration) { _iterate.record(duration); }
+
+		// call from the states interrupt callback, times the gc steps
+		void gcInterrupt(int gc);
+
+		// exported as tlm_<name>_seconds, has to outlive the metrics
+		void addHistogram(std::string name, const LatencyHistogram* histogram);
+
+		// empty path disables it
+		void setDumpFile(std::string path, std::chrono::seconds interval);
+		// writes the dump file if it is due, call regularly
+		void iterate(void);
+
+		std::string toPrometheus(void) const;
+
+		// {events = {[name] = {count, consumed, p50, p99, max, sum}}, iterate = {...}, gc = {...}, <added> = {...}}, in seconds
+		void push(lua_State* L) const;
+};
+
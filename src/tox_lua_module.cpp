@@ -1,14 +1,22 @@
 #include "./tox_lua_module.hpp"
 
+#include "./lua_byte_view.hpp"
+#include "./lua_state_view.hpp"
+#include "./tox_broadcast.hpp"
+
 #include <solanaceae/toxcore/tox_interface.hpp>
 
-#include <luacode.h>
 #include <LuaBridge3/LuaBridge.h>
 
-#include <fstream>
+#include <optional>
+#include <chrono>
+#include <cstdlib>
+#include <string_view>
 #include <tuple>
 #include <vector>
+#include <unordered_map>
 #include <type_traits>
+#include <iterator>
 
 #define REG_ENUM(x) template<> struct luabridge::Stack<x> : luabridge::Enum<x> {};
 
@@ -69,23 +77,521 @@ REG_ENUM(Tox_Err_Group_Set_Ignore)
 REG_ENUM(Tox_Err_Group_Mod_Set_Role)
 REG_ENUM(Tox_Err_Group_Mod_Kick_Peer)
 
-ToxLuaModule::ToxLuaModule(ToxI& t, ToxEventProviderI& tep) : _t(t) {
-	auto* L = _lua_state_global.get();
+template<>
+struct luabridge::Stack<ByteView> {
+	[[nodiscard]] static luabridge::Result push(lua_State* L, const ByteView& view) {
+		pushByteView(L, view.data, view.size);
+		return {};
+	}
+
+	[[nodiscard]] static luabridge::TypeResult<ByteView> get(lua_State* L, int index) {
+		const auto* view = toByteView(L, index);
+		if (view == nullptr || !view->valid()) {
+			return luabridge::makeErrorCode(luabridge::ErrorCode::InvalidTypeCast);
+		}
+		return *view;
+	}
+
+	[[nodiscard]] static bool isInstance(lua_State* L, int index) {
+		return toByteView(L, index) != nullptr;
+	}
+};
+
+// ToxI wants vectors, reuse one instead of allocating per call
+static const std::vector<uint8_t>& scratchBytes(const ByteView& view) {
+	static thread_local std::vector<uint8_t> scratch;
+	scratch.assign(view.data, view.data + view.size);
+	return scratch;
+}
+
+// indexed by Tox_Event, these are the keys looked up in TOX_EVENTS
+static constexpr std::array<const char*, TOX_EVENT_GROUP_MODERATION+1> eventNames(void) {
+	std::array<const char*, TOX_EVENT_GROUP_MODERATION+1> names {};
+#define EVENT_NAME(x, t, ...) names[t] = #x;
+	TLM_TOX_EVENTS(EVENT_NAME)
+#undef EVENT_NAME
+	return names;
+}
+static constexpr auto g_event_names = eventNames();
+
+// one field of an event, pushed straight from the event onto the lua stack
+template<typename EventT>
+struct EventField {
+	const char* name;
+	void (*push)(lua_State* L, const EventT* e);
+};
+
+template<typename EventT, auto Get>
+static void pushNumberField(lua_State* L, const EventT* e) {
+	// luau numbers are doubles, so sizes and positions above 2^31 still make it
+	lua_pushnumber(L, static_cast<double>(Get(e)));
+}
+
+template<typename EventT, auto Get>
+static void pushBooleanField(lua_State* L, const EventT* e) {
+	lua_pushboolean(L, Get(e));
+}
+
+template<typename EventT, auto Get, auto GetLength>
+static void pushTextField(lua_State* L, const EventT* e) {
+	lua_pushlstring(L, reinterpret_cast<const char*>(Get(e)), static_cast<size_t>(GetLength(e)));
+}
+
+template<typename EventT, auto Get, auto GetLength>
+static void pushTextNulField(lua_State* L, const EventT* e) {
+	// thx zoff
+	auto text = std::string_view{reinterpret_cast<const char*>(Get(e)), static_cast<size_t>(GetLength(e))};
+	text = text.substr(0, text.find_first_of('\0')); // trim \0 // hi zoff
+	lua_pushlstring(L, text.data(), text.size());
+}
+
+template<typename EventT, auto Get, auto GetLength>
+static void pushBytesField(lua_State* L, const EventT* e) {
+	pushByteView(L, Get(e), static_cast<size_t>(GetLength(e)));
+}
+
+template<typename EventT, auto Get>
+static void pushPublicKeyField(lua_State* L, const EventT* e) {
+	// same array of numbers the bindings use for keys
+	const uint8_t* key = Get(e);
+	lua_createtable(L, TOX_PUBLIC_KEY_SIZE, 0);
+	for (int i = 0; i < TOX_PUBLIC_KEY_SIZE; i++) {
+		lua_pushinteger(L, key[i]);
+		lua_rawseti(L, -2, i+1);
+	}
+}
+
+#define EVENT_FIELD(x, lower, field) TLM_EVENT_CALL(EVENT_FIELD_, (x, lower, TLM_EVENT_UNPAREN field))
+#define EVENT_FIELD_(x, lower, kind, ...) EVENT_FIELD_##kind(x, lower, __VA_ARGS__)
+#define EVENT_FIELD_num(x, lower, f) EventField<x>{#f, &pushNumberField<x, &tox_event_##lower##_get_##f>},
+#define EVENT_FIELD_boolean(x, lower, f) EventField<x>{#f, &pushBooleanField<x, &tox_event_##lower##_get_##f>},
+#define EVENT_FIELD_text(x, lower, f, len) EventField<x>{#f, &pushTextField<x, &tox_event_##lower##_get_##f, &tox_event_##lower##_get_##len>},
+#define EVENT_FIELD_text_nul(x, lower, f, len) EventField<x>{#f, &pushTextNulField<x, &tox_event_##lower##_get_##f, &tox_event_##lower##_get_##len>},
+#define EVENT_FIELD_bytes(x, lower, f, len) EventField<x>{#f, &pushBytesField<x, &tox_event_##lower##_get_##f, &tox_event_##lower##_get_##len>},
+#define EVENT_FIELD_public_key(x, lower, f) EventField<x>{#f, &pushPublicKeyField<x, &tox_event_##lower##_get_##f>},
+
+// everything the module needs to know about an event type, generated from TLM_TOX_EVENTS
+template<typename EventT>
+struct EventTable;
+
+#define EVENT_TABLE(x, t, lower, ...) \
+template<> \
+struct EventTable<x> { \
+	static constexpr Tox_Event type = t; \
+	static constexpr const char* name = #x; \
+	static constexpr const char* batch_name = #x "_Batch"; \
+	static constexpr EventField<x> fields[] = { TLM_EVENT_FIELDS(EVENT_FIELD, x, lower, __VA_ARGS__) }; \
+};
+
+TLM_TOX_EVENTS(EVENT_TABLE)
+
+#undef EVENT_TABLE
+#undef EVENT_FIELD_public_key
+#undef EVENT_FIELD_bytes
+#undef EVENT_FIELD_text_nul
+#undef EVENT_FIELD_text
+#undef EVENT_FIELD_boolean
+#undef EVENT_FIELD_num
+#undef EVENT_FIELD_
+#undef EVENT_FIELD
+
+template<typename EventT>
+static void setEventFieldNames(lua_State* L) {
+	const auto& fields = EventTable<EventT>::fields;
+	lua_createtable(L, static_cast<int>(std::size(fields)), 0);
+	for (size_t i = 0; i < std::size(fields); i++) {
+		lua_pushstring(L, fields[i].name);
+		lua_rawseti(L, -2, static_cast<int>(i+1));
+	}
+	lua_setfield(L, -2, EventTable<EventT>::name);
+}
+
+// TLM.EVENT_FIELDS, the field names of every event in handler argument order, eg. to name the batch arrays
+static void pushEventFieldNames(lua_State* L) {
+	lua_createtable(L, 0, TOX_EVENT_GROUP_MODERATION+1);
+#define EVENT_FIELD_NAMES(x, ...) setEventFieldNames<x>(L);
+	TLM_TOX_EVENTS(EVENT_FIELD_NAMES)
+#undef EVENT_FIELD_NAMES
+}
+
+// "Tox_Event_X" -> {X, false}, "Tox_Event_X_Batch" -> {X, true}
+static std::optional<std::pair<Tox_Event, bool>> eventKeyFromName(std::string_view name) {
+	constexpr std::string_view batch_suffix {"_Batch"};
+
+	bool batch = false;
+	if (name.size() > batch_suffix.size() && name.substr(name.size() - batch_suffix.size()) == batch_suffix) {
+		name.remove_suffix(batch_suffix.size());
+		batch = true;
+	}
+
+	for (size_t i = 0; i < g_event_names.size(); i++) {
+		if (g_event_names[i] != nullptr && name == g_event_names[i]) {
+			return std::make_pair(static_cast<Tox_Event>(i), batch);
+		}
+	}
+	return std::nullopt;
+}
+
+static bool isCallable(lua_State* L, int idx) {
+	if (lua_isfunction(L, idx)) {
+		return true;
+	}
+
+	if (luaL_getmetafield(L, idx, "__call")) {
+		lua_pop(L, 1);
+		return true;
+	}
+
+	return false;
+}
+
+// an opts field that is either true (all) or an array of numbers
+static void readBroadcastTargets(lua_State* L, int opts_idx, const char* field, bool& all, std::vector<uint32_t>& list) {
+	lua_getfield(L, opts_idx, field);
+	if (lua_isboolean(L, -1)) {
+		all = lua_toboolean(L, -1);
+	} else if (lua_istable(L, -1)) {
+		const int count = lua_objlen(L, -1);
+		list.reserve(count);
+		for (int i = 1; i <= count; i++) {
+			lua_rawgeti(L, -1, i);
+			list.push_back(static_cast<uint32_t>(lua_tointeger(L, -1)));
+			lua_pop(L, 1);
+		}
+	}
+	lua_pop(L, 1);
+}
+
+// TLM.broadcast(message, {friends = true|{...}, groups = true|{...}, online_only = true, type = 0, filter = function(is_group, number) end})
+// returns {parts, ok, failed, skipped, friends = {[friend_number] = err}, groups = {[group_number] = err},
+//   message_ids = {[friend_number] = id}, group_message_ids = {[group_number] = id}}
+static int lua_broadcast(lua_State* L) {
+	auto* t = static_cast<ToxI*>(lua_tolightuserdata(L, lua_upvalueindex(1)));
+
+	size_t message_len = 0;
+	const char* message = luaL_checklstring(L, 1, &message_len);
+	luaL_checktype(L, 2, LUA_TTABLE);
+
+	BroadcastTargets targets;
+	readBroadcastTargets(L, 2, "friends", targets.all_friends, targets.friends);
+	readBroadcastTargets(L, 2, "groups", targets.all_groups, targets.groups);
+
+	lua_getfield(L, 2, "online_only");
+	if (!lua_isnil(L, -1)) {
+		targets.online_only = lua_toboolean(L, -1);
+	}
+	lua_pop(L, 1);
+
+	lua_getfield(L, 2, "type");
+	const auto type = static_cast<Tox_Message_Type>(lua_isnumber(L, -1) ? lua_tointeger(L, -1) : TOX_MESSAGE_TYPE_NORMAL);
+	lua_pop(L, 1);
+
+	lua_getfield(L, 2, "filter"); // stays on the stack for the calls
+	if (lua_isfunction(L, -1)) {
+		const int filter_idx = lua_gettop(L);
+		targets.filter = [L, filter_idx](bool is_group, uint32_t number) {
+			lua_pushvalue(L, filter_idx);
+			lua_pushboolean(L, is_group);
+			lua_pushinteger(L, static_cast<int>(number));
+			lua_call(L, 2, 1);
+			const bool keep = lua_toboolean(L, -1);
+			lua_pop(L, 1);
+			return keep;
+		};
+	}
+
+	const auto res = broadcastMessage(*t, type, {message, message_len}, targets);
+
+	lua_createtable(L, 0, 8);
+
+	lua_pushinteger(L, static_cast<int>(res.parts));
+	lua_setfield(L, -2, "parts");
+	lua_pushinteger(L, static_cast<int>(res.ok));
+	lua_setfield(L, -2, "ok");
+	lua_pushinteger(L, static_cast<int>(res.failed));
+	lua_setfield(L, -2, "failed");
+	lua_pushinteger(L, static_cast<int>(res.skipped));
+	lua_setfield(L, -2, "skipped");
+
+	lua_createtable(L, 0, static_cast<int>(res.friends.size()));
+	lua_createtable(L, 0, static_cast<int>(res.friends.size()));
+	for (const auto& target : res.friends) {
+		lua_pushinteger(L, target.err);
+		lua_rawseti(L, -3, static_cast<int>(target.number));
+		if (target.message_id.has_value()) {
+			// ids are full uint32, an int would wrap
+			lua_pushnumber(L, target.message_id.value());
+			lua_rawseti(L, -2, static_cast<int>(target.number));
+		}
+	}
+	lua_setfield(L, -3, "message_ids");
+	lua_setfield(L, -2, "friends");
+
+	lua_createtable(L, 0, static_cast<int>(res.groups.size()));
+	lua_createtable(L, 0, static_cast<int>(res.groups.size()));
+	for (const auto& target : res.groups) {
+		lua_pushinteger(L, target.err);
+		lua_rawseti(L, -3, static_cast<int>(target.number));
+		if (target.message_id.has_value()) {
+			lua_pushnumber(L, target.message_id.value());
+			lua_rawseti(L, -2, static_cast<int>(target.number));
+		}
+	}
+	lua_setfield(L, -3, "group_message_ids");
+	lua_setfield(L, -2, "groups");
+
+	return 1;
+}
+
+// TLM.cancel(id), true if unsent parts got dropped, the callback gets "failed" with err 0
+static int lua_outbox_cancel(lua_State* L) {
+	auto* outbox = static_cast<ToxOutbox*>(lua_tolightuserdata(L, lua_upvalueindex(1)));
+	lua_pushboolean(L, outbox->cancel(static_cast<uint64_t>(luaL_checknumber(L, 1))));
+	return 1;
+}
+
+// TLM.setOutboxRate("friends"|"groups", per_second, burst), per_second <= 0 sends as fast as tox takes it
+static int lua_outbox_set_rate(lua_State* L) {
+	auto* outbox = static_cast<ToxOutbox*>(lua_tolightuserdata(L, lua_upvalueindex(1)));
+	const std::string_view kind = luaL_checkstring(L, 1);
+	const double per_second = luaL_checknumber(L, 2);
+	const double burst = luaL_optnumber(L, 3, per_second*2.0);
+	if (kind == "friends") {
+		outbox->setFriendRate(per_second, burst);
+	} else if (kind == "groups") {
+		outbox->setGroupRate(per_second, burst);
+	} else {
+		luaL_argerrorL(L, 1, "expected \"friends\" or \"groups\"");
+	}
+	return 0;
+}
+
+// TLM.sendLater(friend_number, message, type), type is optional
+// stored on disk and sent once the friend is online, even after a restart, false if it could not be stored
+static int lua_outbox_send_later(lua_State* L) {
+	auto* store = static_cast<ToxOutboxStore*>(lua_tolightuserdata(L, lua_upvalueindex(1)));
+
+	const auto friend_number = static_cast<uint32_t>(luaL_checkinteger(L, 1));
+	size_t message_len = 0;
+	const char* message = luaL_checklstring(L, 2, &message_len);
+	const auto type = static_cast<Tox_Message_Type>(luaL_optinteger(L, 3, TOX_MESSAGE_TYPE_NORMAL));
+
+	lua_pushboolean(L, store->friendSend(friend_number, type, {message, message_len}));
+	return 1;
+}
+
+// TLM.outboxDepth(friend_number), stored messages not delivered yet
+static int lua_outbox_depth(lua_State* L) {
+	auto* store = static_cast<ToxOutboxStore*>(lua_tolightuserdata(L, lua_upvalueindex(1)));
+	lua_pushinteger(L, static_cast<int>(store->depth(static_cast<uint32_t>(luaL_checkinteger(L, 1)))));
+	return 1;
+}
+
+// TLM.outboxStats(), {queued, sent, delivered, failed, retries, resent}
+static int lua_outbox_stats(lua_State* L) {
+	const auto* outbox = static_cast<const ToxOutbox*>(lua_tolightuserdata(L, lua_upvalueindex(1)));
+	const auto& stats = outbox->getStats();
+
+	lua_createtable(L, 0, 6);
+	lua_pushnumber(L, static_cast<double>(outbox->queued()));
+	lua_setfield(L, -2, "queued");
+	lua_pushnumber(L, static_cast<double>(stats.sent));
+	lua_setfield(L, -2, "sent");
+	lua_pushnumber(L, static_cast<double>(stats.delivered));
+	lua_setfield(L, -2, "delivered");
+	lua_pushnumber(L, static_cast<double>(stats.failed));
+	lua_setfield(L, -2, "failed");
+	lua_pushnumber(L, static_cast<double>(stats.retries));
+	lua_setfield(L, -2, "retries");
+	lua_pushnumber(L, static_cast<double>(stats.resent));
+	lua_setfield(L, -2, "resent");
+
+	return 1;
+}
+
+// TLM.metrics(), see ToxLuaMetrics::push()
+static int lua_metrics(lua_State* L) {
+	const auto* metrics = static_cast<const ToxLuaMetrics*>(lua_tolightuserdata(L, lua_upvalueindex(1)));
+	metrics->push(L);
+	return 1;
+}
+
+// TLM.metricsText(), same as the TLM_METRICS_FILE dump
+static int lua_metrics_text(lua_State* L) {
+	const auto* metrics = static_cast<const ToxLuaMetrics*>(lua_tolightuserdata(L, lua_upvalueindex(1)));
+	const auto text = metrics->toPrometheus();
+	lua_pushlstring(L, text.data(), text.size());
+	return 1;
+}
+
+// TLM.profilerStart(interval_us), 1000us by default, drops the stacks of the last run
+static int lua_profiler_start(lua_State* L) {
+	auto* profiler = static_cast<LuaProfiler*>(lua_tolightuserdata(L, lua_upvalueindex(1)));
+	profiler->reset();
+	profiler->start(std::chrono::microseconds{luaL_optinteger(L, 1, 1000)});
+	return 0;
+}
+
+// TLM.profilerStop(path), returns the folded stacks and writes them to path, if given
+static int lua_profiler_stop(lua_State* L) {
+	auto* profiler = static_cast<LuaProfiler*>(lua_tolightuserdata(L, lua_upvalueindex(1)));
+	profiler->stop();
+	if (lua_isstring(L, 1)) {
+		profiler->writeFolded(lua_tostring(L, 1));
+	}
+	const auto folded = profiler->folded();
+	lua_pushlstring(L, folded.data(), folded.size());
+	return 1;
+}
+
+// TLM.memory(), {bytes, peak, limit, cached, failed, gc_cycles, gc_steps, gc_pressure, gc_full, gc_last_tick} of this state
+static int lua_memory(lua_State* L) {
+	const auto* pacer = static_cast<const LuaGCPacer*>(lua_tolightuserdata(L, lua_upvalueindex(1)));
+
+	lua_createtable(L, 0, 11);
+	if (const auto* allocator = LuaAllocator::fromState(L); allocator != nullptr) {
+		const auto& stats = allocator->getStats();
+		lua_pushnumber(L, static_cast<double>(stats.bytes));
+		lua_setfield(L, -2, "bytes");
+		lua_pushnumber(L, static_cast<double>(stats.peak));
+		lua_setfield(L, -2, "peak");
+		lua_pushnumber(L, static_cast<double>(stats.limit));
+		lua_setfield(L, -2, "limit");
+		lua_pushnumber(L, static_cast<double>(stats.cached));
+		lua_setfield(L, -2, "cached");
+		lua_pushnumber(L, static_cast<double>(stats.failed));
+		lua_setfield(L, -2, "failed");
+		lua_pushnumber(L, static_cast<double>(stats.allocs));
+		lua_setfield(L, -2, "allocs");
+	}
+
+	const auto& gc = pacer->getStats();
+	lua_pushnumber(L, static_cast<double>(gc.cycles));
+	lua_setfield(L, -2, "gc_cycles");
+	lua_pushnumber(L, static_cast<double>(gc.steps));
+	lua_setfield(L, -2, "gc_steps");
+	lua_pushnumber(L, static_cast<double>(gc.pressure));
+	lua_setfield(L, -2, "gc_pressure");
+	lua_pushnumber(L, static_cast<double>(gc.full));
+	lua_setfield(L, -2, "gc_full");
+	lua_pushnumber(L, static_cast<double>(gc.last_tick.count()) / 1e6);
+	lua_setfield(L, -2, "gc_last_tick");
+
+	return 1;
+}
+
+ToxLuaModule::ToxLuaModule(ToxI& t, ToxEventProviderI& tep) : _t(t), _tep(tep), _state_cache(t, tep), _outbox(t, tep), _outbox_store(t, tep, _outbox, ".tlm_outbox") {
+	_event_handler_refs.fill(LUA_NOREF);
+	_event_batch_handler_refs.fill(LUA_NOREF);
+
+	// native code, TLM_NATIVE=off|annotated|all, annotated by default if built with it
+	const char* native_env = std::getenv("TLM_NATIVE");
+#if LUNATIX_LUAU_NATIVE
+	const std::string_view native_str = native_env != nullptr ? native_env : "annotated";
+#else
+	const std::string_view native_str = native_env != nullptr ? native_env : "off";
+#endif
+	if (native_str == "all") {
+		_native_mode = LuaModuleLoader::NativeMode::all;
+	} else if (native_str == "annotated") {
+		_native_mode = LuaModuleLoader::NativeMode::annotated;
+	}
+
+	// TLM_MEMORY_LIMIT_MB per lua state, 0 for none, and TLM_GC_BUDGET_US of gc work per iterate()
+	if (const char* limit_env = std::getenv("TLM_MEMORY_LIMIT_MB"); limit_env != nullptr) {
+		_memory_limit = static_cast<size_t>(std::strtoull(limit_env, nullptr, 10)) * 1024 * 1024;
+	}
+	_gc_pacer.setLimit(_memory_limit);
+	if (const char* budget_env = std::getenv("TLM_GC_BUDGET_US"); budget_env != nullptr && std::atoi(budget_env) > 0) {
+		_gc_pacer.setBudget(std::chrono::microseconds{std::atoi(budget_env)});
+	}
+
+	_lua_state_global = startState();
+	if (!_lua_state_global) {
+		exit(1);
+	}
+	_lua_state_id = _lua_state_count;
+	_gc_pacer.attach(_lua_state_global.get());
+
+	if (_native_mode != LuaModuleLoader::NativeMode::off) {
+		std::cout << "TLM luau native code generation enabled (" << native_str << ")\n";
+	}
+
+	// cache handlers and subscribe to the events the script actually handles
+	adoptEventsTable();
+
+	_script_watcher.setFiles(_module_loader.takeLoadedFiles());
+
+	// drop bytecode of old script versions, workers load their own modules and get a grace period
+	_module_loader.pruneCache(std::chrono::hours{24});
+
+	// prometheus text file, TLM_METRICS_FILE=path and TLM_METRICS_INTERVAL=seconds (10)
+	if (const char* metrics_env = std::getenv("TLM_METRICS_FILE"); metrics_env != nullptr && metrics_env[0] != '\0') {
+		const char* interval_env = std::getenv("TLM_METRICS_INTERVAL");
+		const int interval = interval_env != nullptr ? std::atoi(interval_env) : 0;
+		_metrics.setDumpFile(metrics_env, std::chrono::seconds{interval > 0 ? interval : 10});
+	}
+
+	if (const char* workers_env = std::getenv("TLM_WORKERS"); workers_env != nullptr && std::atoi(workers_env) > 0) {
+		startWorkers(std::atoi(workers_env));
+	}
+}
+
+const LuaAllocator::Stats& ToxLuaModule::getMemoryStats(void) const {
+	return LuaAllocator::fromState(_lua_state_global.get())->getStats();
+}
+
+void ToxLuaModule::setWakeCallback(std::function<void(void)>&& fn) {
+	if (_worker_pool) {
+		_worker_pool->setWakeCallback(std::move(fn));
+	}
+}
+
+void ToxLuaModule::startWorkers(size_t count) {
+	try {
+		_worker_pool = std::make_unique<LuaWorkerPool>(count, "worker.lua", _module_loader.getScriptRoot(), _module_loader.getCacheDir(), _native_mode, _memory_limit);
+	} catch (const std::exception& ex) {
+		std::cerr << "TLM waring: not starting lua workers, " << ex.what() << "\n";
+		return;
+	}
+
+	for (const auto& name : _worker_pool->getHandledEvents()) {
+		const auto event_key = eventKeyFromName(name);
+		if (!event_key.has_value() || event_key->second) {
+			std::cerr << "TLM waring: worker.lua handles unknown or batch event " << name << ", ignored\n";
+			continue;
+		}
+		_worker_event_handled[event_key->first] = true;
+		subscribeEvent(event_key->first);
+	}
+
+	std::cout << "TLM started " << count << " lua workers\n";
+}
+
+ToxLuaModule::LuaStatePtr ToxLuaModule::startState(void) {
+	LuaStatePtr state {LuaAllocator::newState(_memory_limit), LuaAllocator::closeState};
+	if (!state) {
+		std::cerr << "TLM error, failed to create a lua state\n";
+		return state;
+	}
+
+	auto* L = state.get();
+	const uint64_t state_id = ++_lua_state_count;
 	{ // setup global lua state
 		luaL_openlibs(L);
+		registerByteView(L);
+		registerStateView(L);
 
 		{ // add global functions
-			//static const luaL_Reg funcs[] = {
-				//{"loadstring", lua_loadstring},
-				//{"require", lua_require},
-				//{NULL, NULL},
-			//};
-
-			//lua_pushvalue(L, LUA_GLOBALSINDEX);
-			//luaL_register(L, NULL, funcs);
-			//lua_pop(L, 1);
+			_module_loader.install(L); // require
 		}
 
+		// sticks to off if not supported, so it only warns once
+		_native_mode = _module_loader.setNativeMode(L, _native_mode);
+
+		lua_callbacks(L)->userdata = this;
+		lua_callbacks(L)->interrupt = lua_interrupt;
+
 		luabridge::getGlobalNamespace(L)
 		.beginNamespace("tox")
 			.beginClass<ToxI>("Tox")
@@ -105,7 +611,14 @@ ToxLuaModule::ToxLuaModule(ToxI& t, ToxEventProviderI& tep) : _t(t) {
 				.addFunction("toxSelfGetStatus", &ToxI::toxSelfGetStatus)
 				.addFunction("toxFriendAdd", &ToxI::toxFriendAdd)
 				.addFunction("toxFriendAddNorequest", &ToxI::toxFriendAddNorequest)
-				.addFunction("toxFriendDelete", &ToxI::toxFriendDelete)
+				.addFunction("toxFriendDelete", [this](ToxI* tox, uint32_t friend_number) {
+					// there is no event for it
+					// the store goes first, so it does not ack the messages the outbox fails
+					_state_cache.forgetFriend(friend_number);
+					_outbox_store.forgetFriend(friend_number);
+					_outbox.forgetFriend(friend_number);
+					return tox->toxFriendDelete(friend_number);
+				})
 				.addFunction("toxFriendByPublicKey", &ToxI::toxFriendByPublicKey)
 				.addFunction("toxFriendExists", &ToxI::toxFriendExists)
 				.addFunction("toxSelfGetFriendListSize", &ToxI::toxSelfGetFriendListSize)
@@ -124,17 +637,40 @@ ToxLuaModule::ToxLuaModule(ToxI& t, ToxEventProviderI& tep) : _t(t) {
 				.addFunction("toxFileSeek", &ToxI::toxFileSeek)
 				.addFunction("toxFileGetFileID", &ToxI::toxFileGetFileID)
 				.addFunction("toxFileSend", &ToxI::toxFileSend)
-				.addFunction("toxFileSendChunk", &ToxI::toxFileSendChunk)
-				.addFunction("toxConferenceJoin", &ToxI::toxConferenceJoin)
+				.addFunction("toxFileSendChunk",
+					[](ToxI* tox, uint32_t friend_number, uint32_t file_number, uint64_t position, ByteView data) {
+						return tox->toxFileSendChunk(friend_number, file_number, position, scratchBytes(data));
+					},
+					&ToxI::toxFileSendChunk
+				)
+				.addFunction("toxConferenceJoin",
+					[](ToxI* tox, uint32_t friend_number, ByteView cookie) {
+						return tox->toxConferenceJoin(friend_number, scratchBytes(cookie));
+					},
+					&ToxI::toxConferenceJoin
+				)
 				.addFunction("toxConferenceSendMessage", &ToxI::toxConferenceSendMessage)
-				.addFunction("toxFriendSendLossyPacket", &ToxI::toxFriendSendLossyPacket)
-				.addFunction("toxFriendSendLosslessPacket", &ToxI::toxFriendSendLosslessPacket)
+				.addFunction("toxFriendSendLossyPacket",
+					[](ToxI* tox, uint32_t friend_number, ByteView data) {
+						return tox->toxFriendSendLossyPacket(friend_number, scratchBytes(data));
+					},
+					&ToxI::toxFriendSendLossyPacket
+				)
+				.addFunction("toxFriendSendLosslessPacket",
+					[](ToxI* tox, uint32_t friend_number, ByteView data) {
+						return tox->toxFriendSendLosslessPacket(friend_number, scratchBytes(data));
+					},
+					&ToxI::toxFriendSendLosslessPacket
+				)
 				.addFunction("toxGroupNew", &ToxI::toxGroupNew)
 				.addFunction("toxGroupJoin", &ToxI::toxGroupJoin)
 				.addFunction("toxGroupIsConnected", &ToxI::toxGroupIsConnected)
 				.addFunction("toxGroupDisconnect", &ToxI::toxGroupDisconnect)
 				.addFunction("toxGroupReconnect", &ToxI::toxGroupReconnect)
-				.addFunction("toxGroupLeave", &ToxI::toxGroupLeave)
+				.addFunction("toxGroupLeave", [this](ToxI* tox, uint32_t group_number, std::string_view part_message) {
+					_state_cache.forgetGroup(group_number);
+					return tox->toxGroupLeave(group_number, part_message);
+				})
 				.addFunction("toxGroupSelfSetName", &ToxI::toxGroupSelfSetName)
 				.addFunction("toxGroupSelfGetName", &ToxI::toxGroupSelfGetName)
 				.addFunction("toxGroupSelfGetName", &ToxI::toxGroupSelfGetName)
@@ -156,103 +692,311 @@ ToxLuaModule::ToxLuaModule(ToxI& t, ToxEventProviderI& tep) : _t(t) {
 				.addFunction("toxGroupGetList", &ToxI::toxGroupGetList)
 				.addFunction("toxGroupSendMessage", &ToxI::toxGroupSendMessage)
 				.addFunction("toxGroupSendPrivateMessage", &ToxI::toxGroupSendPrivateMessage)
-				.addFunction("toxGroupSendCustomPacket", &ToxI::toxGroupSendCustomPacket)
-				.addFunction("toxGroupSendCustomPrivatePacket", &ToxI::toxGroupSendCustomPrivatePacket)
+				.addFunction("toxGroupSendCustomPacket",
+					[](ToxI* tox, uint32_t group_number, bool lossless, ByteView data) {
+						return tox->toxGroupSendCustomPacket(group_number, lossless, scratchBytes(data));
+					},
+					&ToxI::toxGroupSendCustomPacket
+				)
+				.addFunction("toxGroupSendCustomPrivatePacket",
+					[](ToxI* tox, uint32_t group_number, uint32_t peer_id, bool lossless, ByteView data) {
+						return tox->toxGroupSendCustomPrivatePacket(group_number, peer_id, lossless, scratchBytes(data));
+					},
+					&ToxI::toxGroupSendCustomPrivatePacket
+				)
 				.addFunction("toxGroupInviteFriend", &ToxI::toxGroupInviteFriend)
-				.addFunction("toxGroupInviteAccept", &ToxI::toxGroupInviteAccept)
+				.addFunction("toxGroupInviteAccept",
+					[](ToxI* tox, uint32_t friend_number, ByteView invite_data, std::string_view name, std::string_view password) {
+						return tox->toxGroupInviteAccept(friend_number, scratchBytes(invite_data), name, password);
+					},
+					&ToxI::toxGroupInviteAccept
+				)
 			.endClass()
 		.endNamespace();
 
 		luabridge::push(L, &_t);
 		lua_setglobal(L, "TOX");
+
+		{ // native helpers, for things that would be slow through the bindings
+			lua_newtable(L);
+
+			lua_pushlightuserdata(L, &_t);
+			lua_pushcclosure(L, lua_broadcast, "TLM.broadcast", 1);
+			lua_setfield(L, -2, "broadcast");
+
+			for (const bool is_group : {false, true}) {
+				lua_pushlightuserdata(L, this);
+				lua_pushboolean(L, is_group);
+				lua_pushnumber(L, static_cast<double>(state_id));
+				lua_pushcclosure(L, lua_outbox_send, is_group ? "TLM.groupSend" : "TLM.send", 3);
+				lua_setfield(L, -2, is_group ? "groupSend" : "send");
+			}
+
+			lua_pushlightuserdata(L, &_outbox);
+			lua_pushcclosure(L, lua_outbox_cancel, "TLM.cancel", 1);
+			lua_setfield(L, -2, "cancel");
+
+			lua_pushlightuserdata(L, &_outbox);
+			lua_pushcclosure(L, lua_outbox_set_rate, "TLM.setOutboxRate", 1);
+			lua_setfield(L, -2, "setOutboxRate");
+
+			lua_pushlightuserdata(L, &_outbox);
+			lua_pushcclosure(L, lua_outbox_stats, "TLM.outboxStats", 1);
+			lua_setfield(L, -2, "outboxStats");
+
+			lua_pushlightuserdata(L, &_outbox_store);
+			lua_pushcclosure(L, lua_outbox_send_later, "TLM.sendLater", 1);
+			lua_setfield(L, -2, "sendLater");
+
+			lua_pushlightuserdata(L, &_outbox_store);
+			lua_pushcclosure(L, lua_outbox_depth, "TLM.outboxDepth", 1);
+			lua_setfield(L, -2, "outboxDepth");
+
+			lua_pushlightuserdata(L, &_metrics);
+			lua_pushcclosure(L, lua_metrics, "TLM.metrics", 1);
+			lua_setfield(L, -2, "metrics");
+
+			lua_pushlightuserdata(L, &_metrics);
+			lua_pushcclosure(L, lua_metrics_text, "TLM.metricsText", 1);
+			lua_setfield(L, -2, "metricsText");
+
+			lua_pushlightuserdata(L, &_profiler);
+			lua_pushcclosure(L, lua_profiler_start, "TLM.profilerStart", 1);
+			lua_setfield(L, -2, "profilerStart");
+
+			lua_pushlightuserdata(L, &_profiler);
+			lua_pushcclosure(L, lua_profiler_stop, "TLM.profilerStop", 1);
+			lua_setfield(L, -2, "profilerStop");
+
+			lua_pushlightuserdata(L, &_gc_pacer);
+			lua_pushcclosure(L, lua_memory, "TLM.memory", 1);
+			lua_setfield(L, -2, "memory");
+
+			pushEventFieldNames(L);
+			lua_setfield(L, -2, "EVENT_FIELDS");
+
+			// TLM.friends, TLM.groups and TLM.conferences
+			setStateViews(L, -1, _state_cache);
+
+			lua_setglobal(L, "TLM");
+		}
 	}
 
 	{ // start lua
-		std::ifstream ifile{"main.lua", std::ios::binary};
+		auto phase_start = std::chrono::steady_clock::now();
+		const auto phase_ms = [&phase_start](void) {
+			const auto now = std::chrono::steady_clock::now();
+			const auto ms = std::chrono::duration<double, std::milli>(now - phase_start).count();
+			phase_start = now;
+			return ms;
+		};
+
+		// load lua
+		if (!_module_loader.loadFile(L, "main.lua")) {
+			std::cerr << "TLM failed loading main.lua: " << lua_tostring(L, -1) << "\n";
+			return {nullptr, LuaAllocator::closeState};
+		}
+		std::cout << "TLM loading main.lua took " << phase_ms() << "ms"
+			<< (_module_loader.getStats().cache_hits > 0 ? " (cached bytecode)" : "") << "\n";
 
-		if (!ifile.is_open()) {
-			std::cerr << "TLM missing main.lua\n";
-			exit(1);
+		// execute lua
+		if (lua_pcall(L, 0, 0, 0) != LUA_OK) {
+			std::cerr << "TLM failed running main.lua: " << lua_tostring(L, -1) << "\n";
+			return {nullptr, LuaAllocator::closeState};
 		}
+		std::cout << "TLM running main.lua took " << phase_ms() << "ms"
+			<< " (modules compiled: " << _module_loader.getStats().compiled
+			<< ", from cache: " << _module_loader.getStats().cache_hits
+			<< ", native: " << _module_loader.getStats().native << ")\n";
+	}
 
-		std::cout << "TLM loading main.lua\n";
-		std::string lua_main_code;
-		while (ifile.good()) {
-			auto ch = ifile.get();
-			if (ch == EOF) {
+	return state;
+}
+
+// copies plain data (nil, booleans, numbers, strings and tables of those) into another state
+// anything else turns into nil, shared and cyclic tables stay shared
+static void copyLuaValue(lua_State* from, int idx, lua_State* to, std::unordered_map<const void*, int>& copied) {
+	idx = lua_absindex(from, idx);
+	luaL_checkstack(from, 3, "copying state");
+	luaL_checkstack(to, 3, "copying state");
+
+	switch (lua_type(from, idx)) {
+		case LUA_TBOOLEAN:
+			lua_pushboolean(to, lua_toboolean(from, idx));
+			break;
+		case LUA_TNUMBER:
+			lua_pushnumber(to, lua_tonumber(from, idx));
+			break;
+		case LUA_TSTRING: {
+			size_t len = 0;
+			const char* str = lua_tolstring(from, idx, &len);
+			lua_pushlstring(to, str, len);
+			break;
+		}
+		case LUA_TTABLE: {
+			const void* ptr = lua_topointer(from, idx);
+			if (const auto it = copied.find(ptr); it != copied.end()) {
+				lua_getref(to, it->second);
 				break;
-			} else {
-				lua_main_code.push_back(ch); // TODO: this is slow
 			}
+
+			lua_newtable(to);
+			copied[ptr] = lua_ref(to, -1);
+
+			lua_pushnil(from);
+			while (lua_next(from, idx) != 0) {
+				copyLuaValue(from, -2, to, copied); // key
+				copyLuaValue(from, -1, to, copied); // value
+				if (lua_isnil(to, -2)) {
+					lua_pop(to, 2);
+				} else {
+					lua_rawset(to, -3);
+				}
+				lua_pop(from, 1);
+			}
+			break;
 		}
+		default:
+			lua_pushnil(to);
+	}
+}
 
-		// load lua
-		size_t byte_code_size = 0;
-		std::unique_ptr<char, void(*)(void*)> byte_code {
-			luau_compile(lua_main_code.data(), lua_main_code.size(), nullptr, &byte_code_size),
-			std::free
-		};
-		// TODO: error handling
-		assert(byte_code);
+bool ToxLuaModule::migrateState(lua_State* old_L, lua_State* new_L) {
+	lua_getglobal(new_L, "tlm_migrate");
+	if (!lua_isfunction(new_L, -1)) {
+		lua_pop(new_L, 1);
+		return true; // nothing to migrate
+	}
 
-		// execute lua
-		luau_load(L, "main.lua", byte_code.get(), byte_code_size, 0);
-		lua_call(L, 0, 0);
-		// once executed, can we free it? (unique_ptr frees here)
-	}
-
-	tep.subscribe(this, TOX_EVENT_SELF_CONNECTION_STATUS);
-
-	tep.subscribe(this, TOX_EVENT_FRIEND_REQUEST);
-	tep.subscribe(this, TOX_EVENT_FRIEND_CONNECTION_STATUS);
-	tep.subscribe(this, TOX_EVENT_FRIEND_LOSSY_PACKET);
-	tep.subscribe(this, TOX_EVENT_FRIEND_LOSSLESS_PACKET);
-
-	tep.subscribe(this, TOX_EVENT_FRIEND_NAME);
-	tep.subscribe(this, TOX_EVENT_FRIEND_STATUS);
-	tep.subscribe(this, TOX_EVENT_FRIEND_STATUS_MESSAGE);
-
-	tep.subscribe(this, TOX_EVENT_FRIEND_MESSAGE);
-	tep.subscribe(this, TOX_EVENT_FRIEND_READ_RECEIPT);
-	tep.subscribe(this, TOX_EVENT_FRIEND_TYPING);
-
-	tep.subscribe(this, TOX_EVENT_FILE_CHUNK_REQUEST);
-	tep.subscribe(this, TOX_EVENT_FILE_RECV);
-	tep.subscribe(this, TOX_EVENT_FILE_RECV_CHUNK);
-	tep.subscribe(this, TOX_EVENT_FILE_RECV_CONTROL);
-
-	tep.subscribe(this, TOX_EVENT_CONFERENCE_INVITE);
-	tep.subscribe(this, TOX_EVENT_CONFERENCE_CONNECTED);
-	tep.subscribe(this, TOX_EVENT_CONFERENCE_PEER_LIST_CHANGED);
-	tep.subscribe(this, TOX_EVENT_CONFERENCE_PEER_NAME);
-	tep.subscribe(this, TOX_EVENT_CONFERENCE_TITLE);
-
-	tep.subscribe(this, TOX_EVENT_CONFERENCE_MESSAGE);
-
-	tep.subscribe(this, TOX_EVENT_GROUP_PEER_NAME);
-	tep.subscribe(this, TOX_EVENT_GROUP_PEER_STATUS);
-	tep.subscribe(this, TOX_EVENT_GROUP_TOPIC);
-	tep.subscribe(this, TOX_EVENT_GROUP_PRIVACY_STATE);
-	tep.subscribe(this, TOX_EVENT_GROUP_VOICE_STATE);
-	tep.subscribe(this, TOX_EVENT_GROUP_TOPIC_LOCK);
-	tep.subscribe(this, TOX_EVENT_GROUP_PEER_LIMIT);
-	tep.subscribe(this, TOX_EVENT_GROUP_PASSWORD);
-	tep.subscribe(this, TOX_EVENT_GROUP_MESSAGE);
-	tep.subscribe(this, TOX_EVENT_GROUP_PRIVATE_MESSAGE);
-	tep.subscribe(this, TOX_EVENT_GROUP_CUSTOM_PACKET);
-	tep.subscribe(this, TOX_EVENT_GROUP_CUSTOM_PRIVATE_PACKET);
-	tep.subscribe(this, TOX_EVENT_GROUP_INVITE);
-	tep.subscribe(this, TOX_EVENT_GROUP_PEER_JOIN);
-	tep.subscribe(this, TOX_EVENT_GROUP_PEER_EXIT);
-	tep.subscribe(this, TOX_EVENT_GROUP_SELF_JOIN);
-	tep.subscribe(this, TOX_EVENT_GROUP_JOIN_FAIL);
-	tep.subscribe(this, TOX_EVENT_GROUP_MODERATION);
+	lua_getglobal(old_L, "tlm_save_state");
+	if (lua_isfunction(old_L, -1)) {
+		if (lua_pcall(old_L, 0, 1, 0) != LUA_OK) {
+			std::cerr << "TLM waring: tlm_save_state failed: " << lua_tostring(old_L, -1) << "\n";
+			lua_pop(old_L, 1);
+			lua_pushnil(old_L);
+		}
+	} else {
+		lua_pop(old_L, 1);
+		lua_pushnil(old_L);
+	}
+
+	std::unordered_map<const void*, int> copied;
+	copyLuaValue(old_L, -1, new_L, copied);
+	lua_pop(old_L, 1);
+	for (const auto& [ptr, ref] : copied) {
+		lua_unref(new_L, ref);
+	}
+
+	if (lua_pcall(new_L, 1, 0, 0) != LUA_OK) {
+		std::cerr << "TLM error, tlm_migrate failed: " << lua_tostring(new_L, -1) << "\n";
+		lua_pop(new_L, 1);
+		return false;
+	}
+
+	return true;
+}
+
+bool ToxLuaModule::reload(void) {
+	std::cout << "TLM scripts changed, reloading\n";
+	const auto reload_start = std::chrono::steady_clock::now();
+
+	auto old_files = _module_loader.takeLoadedFiles();
+
+	// the new code runs in its own state, so a broken script never touches the running one
+	auto new_state = startState();
+	auto new_files = _module_loader.takeLoadedFiles();
+
+	if (!new_state || !migrateState(_lua_state_global.get(), new_state.get())) {
+		std::cerr << "TLM reload failed, keeping the old scripts\n";
+		// keep watching the old files, and whatever the new version tried to load
+		new_files.merge(old_files);
+		_script_watcher.addFiles(new_files);
+		return false;
+	}
+
+	// the refs belong to the old state and die with it
+	_event_handler_refs.fill(LUA_NOREF);
+	_event_batch_handler_refs.fill(LUA_NOREF);
+	_events_table_ref = LUA_NOREF;
+	_events_proxy_ref = LUA_NOREF;
+
+	// events that got no handler now still reach us, but return early (see setEventHandler())
+	_lua_state_global = std::move(new_state);
+	_lua_state_id = _lua_state_count;
+	_gc_pacer.attach(_lua_state_global.get());
+	adoptEventsTable();
+
+	_script_watcher.setFiles(new_files);
+	_module_loader.pruneCache(std::chrono::hours{24});
+
+	std::cout << "TLM reload took "
+		<< std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - reload_start).count()
+		<< "ms\n";
+
+	return true;
 }
 
 ToxLuaModule::~ToxLuaModule(void) {
 }
 
+void ToxLuaModule::toggleProfiler(void) {
+	if (!_profiler.running()) {
+		const char* interval_env = std::getenv("TLM_PROFILE_INTERVAL_US");
+		const int interval = interval_env != nullptr ? std::atoi(interval_env) : 0;
+		_profiler.reset();
+		_profiler.start(std::chrono::microseconds{interval > 0 ? interval : 1000});
+		std::cout << "TLM profiler started\n";
+		return;
+	}
+
+	_profiler.stop();
+	const char* path_env = std::getenv("TLM_PROFILE_FILE");
+	const std::string path = path_env != nullptr ? path_env : "tlm_profile.folded";
+	if (_profiler.writeFolded(path)) {
+		std::cout << "TLM profiler stopped, wrote " << _profiler.samples() << " samples to " << path
+			<< " (" << _profiler.dropped() << " taken while idle dropped)\n";
+	}
+}
+
+void ToxLuaModule::lua_interrupt(lua_State* L, int gc) {
+	auto* tlm = static_cast<ToxLuaModule*>(lua_callbacks(L)->userdata);
+	tlm->_metrics.gcInterrupt(gc);
+	tlm->_profiler.interrupt(L, gc);
+}
+
 void ToxLuaModule::iterate(void) {
+	// between ToxClient::iterate()s nothing holds on to the state, so it can be swapped
+	if (_script_watcher.poll()) {
+		reload();
+	}
+
+	// modules required lazily, from handlers or tlm_iterate
+	if (auto loaded_files = _module_loader.takeLoadedFiles(); !loaded_files.empty()) {
+		_script_watcher.addFiles(loaded_files);
+	}
+
+	if (_worker_pool) {
+		_worker_pool->runCommands(_lua_state_global.get());
+	}
+
+	_outbox.iterate();
+	_metrics.iterate();
+
+	// between ticks, so collection pauses do not land in the middle of handling events
+	_gc_pacer.step(_lua_state_global.get());
+
+	{ // the script might have replaced TOX_EVENTS with a plain table
+		auto* L = _lua_state_global.get();
+		lua_getglobal(L, "TOX_EVENTS");
+		lua_getref(L, _events_proxy_ref);
+		const bool replaced = !lua_rawequal(L, -1, -2);
+		lua_pop(L, 2);
+
+		if (replaced) {
+			adoptEventsTable();
+		}
+	}
+
 	luabridge::LuaRef g_iterate_fn = luabridge::getGlobal(_lua_state_global.get(), "tlm_iterate");
 	if (!g_iterate_fn.isCallable()) {
 		std::cerr << "TLM waring: tlm_iterate is not callable\n";
@@ -260,7 +1004,10 @@ void ToxLuaModule::iterate(void) {
 	}
 
 	// call
+	const auto iterate_start = std::chrono::steady_clock::now();
 	auto res = g_iterate_fn();
+	_metrics.recordIterate(std::chrono::steady_clock::now() - iterate_start);
+	_gc_pacer.checkPressure(_lua_state_global.get());
 
 	if (res.hasFailed() || res.size() != 0) {
 		std::cerr << "TLM error, tlm_iterate callback failed " << res.errorCode() << ":" << res.errorMessage() << "\n";
@@ -268,455 +1015,336 @@ void ToxLuaModule::iterate(void) {
 	}
 }
 
-#if 0
-template<typename EventT, typename FN>
-auto callEventArgs(const EventT* e, FN&& fn) {
-	if constexpr (std::is_same_v<EventT, Tox_Event_Self_Connection_Status>) {
-		return fn(
-			tox_event_self_connection_status_get_connection_status(e)
-		);
-	} // else if ...
+void ToxLuaModule::beginBatch(void) {
+	_in_batch = true;
 }
 
-#endif
+void ToxLuaModule::endBatch(void) {
+	_in_batch = false;
 
-//template<typename EventT, typename FN>
-//auto callEventArgs(const EventT* e, FN&& fn) { return fn(); }
-
-template<typename FN>
-auto callEventArgs(const Tox_Event_Self_Connection_Status* e, FN&& fn) {
-	return fn(
-		tox_event_self_connection_status_get_connection_status(e)
-	);
-}
-
-template<typename FN>
-auto callEventArgs(const Tox_Event_Conference_Connected* e, FN&& fn) {
-	return fn(
-		tox_event_conference_connected_get_conference_number(e)
-	);
-}
-
-template<typename FN>
-auto callEventArgs(const Tox_Event_Conference_Invite* e, FN&& fn) {
-	return fn(
-		tox_event_conference_invite_get_friend_number(e),
-		tox_event_conference_invite_get_type(e),
-		std::vector<uint8_t>(tox_event_conference_invite_get_cookie(e), tox_event_conference_invite_get_cookie(e) + tox_event_conference_invite_get_cookie_length(e))
-	);
-}
-
-template<typename FN>
-auto callEventArgs(const Tox_Event_Conference_Message* e, FN&& fn) {
-	return fn(
-		tox_event_conference_message_get_conference_number(e),
-		tox_event_conference_message_get_peer_number(e),
-		tox_event_conference_message_get_type(e),
-		std::string_view{reinterpret_cast<const char*>(tox_event_conference_message_get_message(e)), tox_event_conference_message_get_message_length(e)}
-	);
-}
-
-template<typename FN>
-auto callEventArgs(const Tox_Event_Conference_Peer_List_Changed* e, FN&& fn) {
-	return fn(
-		tox_event_conference_peer_list_changed_get_conference_number(e)
-	);
-}
-
-template<typename FN>
-auto callEventArgs(const Tox_Event_Conference_Peer_Name* e, FN&& fn) {
-	return fn(
-		tox_event_conference_peer_name_get_conference_number(e),
-		tox_event_conference_peer_name_get_peer_number(e),
-		std::string_view{reinterpret_cast<const char*>(tox_event_conference_peer_name_get_name(e)), tox_event_conference_peer_name_get_name_length(e)}
-	);
-}
-
-template<typename FN>
-auto callEventArgs(const Tox_Event_Conference_Title* e, FN&& fn) {
-	return fn(
-		tox_event_conference_title_get_conference_number(e),
-		tox_event_conference_title_get_peer_number(e),
-		std::string_view{reinterpret_cast<const char*>(tox_event_conference_title_get_title(e)), tox_event_conference_title_get_title_length(e)}
-	);
-}
-
-template<typename FN>
-auto callEventArgs(const Tox_Event_File_Chunk_Request* e, FN&& fn) {
-	return fn(
-		tox_event_file_chunk_request_get_friend_number(e),
-		tox_event_file_chunk_request_get_file_number(e),
-		tox_event_file_chunk_request_get_position(e),
-		tox_event_file_chunk_request_get_length(e)
-	);
-}
-
-template<typename FN>
-auto callEventArgs(const Tox_Event_File_Recv* e, FN&& fn) {
-	return fn(
-		tox_event_file_recv_get_friend_number(e),
-		tox_event_file_recv_get_file_number(e),
-		tox_event_file_recv_get_kind(e),
-		tox_event_file_recv_get_file_size(e),
-		std::string_view{reinterpret_cast<const char*>(tox_event_file_recv_get_filename(e)), tox_event_file_recv_get_filename_length(e)}
-	);
-}
-
-template<typename FN>
-auto callEventArgs(const Tox_Event_File_Recv_Chunk* e, FN&& fn) {
-	return fn(
-		tox_event_file_recv_chunk_get_friend_number(e),
-		tox_event_file_recv_chunk_get_file_number(e),
-		tox_event_file_recv_chunk_get_position(e),
-		std::vector<uint8_t>(tox_event_file_recv_chunk_get_data(e), tox_event_file_recv_chunk_get_data(e) + tox_event_file_recv_chunk_get_length(e))
-	);
-}
-
-template<typename FN>
-auto callEventArgs(const Tox_Event_File_Recv_Control* e, FN&& fn) {
-	return fn(
-		tox_event_file_recv_control_get_friend_number(e),
-		tox_event_file_recv_control_get_file_number(e),
-		tox_event_file_recv_control_get_control(e)
-	);
-}
-
-template<typename FN>
-auto callEventArgs(const Tox_Event_Friend_Connection_Status* e, FN&& fn) {
-	return fn(
-		tox_event_friend_connection_status_get_friend_number(e),
-		tox_event_friend_connection_status_get_connection_status(e)
-	);
-}
-
-template<typename FN>
-auto callEventArgs(const Tox_Event_Friend_Lossless_Packet* e, FN&& fn) {
-	return fn(
-		tox_event_friend_lossless_packet_get_friend_number(e),
-		std::vector<uint8_t>(tox_event_friend_lossless_packet_get_data(e), tox_event_friend_lossless_packet_get_data(e) + tox_event_friend_lossless_packet_get_data_length(e))
-	);
-}
-
-template<typename FN>
-auto callEventArgs(const Tox_Event_Friend_Lossy_Packet* e, FN&& fn) {
-	return fn(
-		tox_event_friend_lossy_packet_get_friend_number(e),
-		std::vector<uint8_t>(tox_event_friend_lossy_packet_get_data(e), tox_event_friend_lossy_packet_get_data(e) + tox_event_friend_lossy_packet_get_data_length(e))
-	);
-}
-
-template<typename FN>
-auto callEventArgs(const Tox_Event_Friend_Message* e, FN&& fn) {
-	// thx zoff
-	auto message = std::string_view{reinterpret_cast<const char*>(tox_event_friend_message_get_message(e)), tox_event_friend_message_get_message_length(e)};
-	message = message.substr(0, message.find_first_of('\0')); // trim \0 // hi zoff
+	// the events are still alive until the client frees the batch
+#define FLUSH_BATCH(x, t, ...) \
+	if (!_event_batch_pending[t].empty()) { \
+		const auto start = std::chrono::steady_clock::now(); \
+		flushEventBatch<x>(); \
+		_metrics.recordBatch(t, #x, std::chrono::steady_clock::now() - start); \
+	}
+	TLM_TOX_EVENTS(FLUSH_BATCH)
+#undef FLUSH_BATCH
+
+	_gc_pacer.checkPressure(_lua_state_global.get());
+}
+
+void ToxLuaModule::adoptEventsTable(void) {
+	auto* L = _lua_state_global.get();
+
+	for (auto* refs : {&_event_handler_refs, &_event_batch_handler_refs}) {
+		for (auto& fn_ref : *refs) {
+			if (fn_ref != LUA_NOREF) {
+				lua_unref(L, fn_ref);
+				fn_ref = LUA_NOREF;
+			}
+		}
+	}
+	if (_events_table_ref != LUA_NOREF) {
+		lua_unref(L, _events_table_ref);
+		_events_table_ref = LUA_NOREF;
+	}
+	if (_events_proxy_ref != LUA_NOREF) {
+		lua_unref(L, _events_proxy_ref);
+		_events_proxy_ref = LUA_NOREF;
+	}
+
+	lua_getglobal(L, "TOX_EVENTS");
+	if (!lua_istable(L, -1)) {
+		std::cerr << "TLM waring: global table TOX_EVENTS not set\n";
+		lua_pop(L, 1);
+		lua_newtable(L);
+	}
+	const int table_idx = lua_gettop(L);
+
+	// pin everything already in there
+	lua_pushnil(L);
+	while (lua_next(L, table_idx) != 0) {
+		if (lua_type(L, -2) == LUA_TSTRING) {
+			if (const auto event_key = eventKeyFromName(lua_tostring(L, -2)); event_key.has_value()) {
+				setEventHandler(event_key->first, event_key->second, lua_gettop(L));
+			}
+		}
+		lua_pop(L, 1);
+	}
+
+	_events_table_ref = lua_ref(L, table_idx);
 
-	return fn(
-		tox_event_friend_message_get_friend_number(e),
-		tox_event_friend_message_get_type(e),
-		message
-	);
+	// the proxy stays empty, so every assignment goes through __newindex
+	lua_newtable(L);
+	lua_newtable(L); // metatable
+
+	lua_pushvalue(L, table_idx);
+	lua_setfield(L, -2, "__index");
+
+	lua_pushlightuserdata(L, this);
+	lua_pushcclosure(L, lua_events_newindex, "TOX_EVENTS.__newindex", 1);
+	lua_setfield(L, -2, "__newindex");
+
+	// keep generalized iteration (for k, v in TOX_EVENTS do) working
+	lua_pushvalue(L, table_idx);
+	lua_pushcclosure(L, [](lua_State* L_) -> int {
+		lua_getglobal(L_, "next");
+		lua_pushvalue(L_, lua_upvalueindex(1));
+		return 2;
+	}, "TOX_EVENTS.__iter", 1);
+	lua_setfield(L, -2, "__iter");
+
+	lua_setmetatable(L, -2);
+
+	_events_proxy_ref = lua_ref(L, -1);
+	lua_setglobal(L, "TOX_EVENTS");
+
+	lua_pop(L, 1); // table
 }
 
-template<typename FN>
-auto callEventArgs(const Tox_Event_Friend_Name* e, FN&& fn) {
-	return fn(
-		tox_event_friend_name_get_friend_number(e),
-		std::string_view{reinterpret_cast<const char*>(tox_event_friend_name_get_name(e)), tox_event_friend_name_get_name_length(e)}
-	);
+void ToxLuaModule::setEventHandler(Tox_Event event_type, bool batch, int idx) {
+	auto* L = _lua_state_global.get();
+
+	int& fn_ref = batch ? _event_batch_handler_refs.at(event_type) : _event_handler_refs.at(event_type);
+	if (fn_ref != LUA_NOREF) {
+		lua_unref(L, fn_ref);
+		fn_ref = LUA_NOREF;
+	}
+
+	if (!isCallable(L, idx)) {
+		// stays subscribed (see header), the event reaches us and returns early
+		return;
+	}
+
+	fn_ref = lua_ref(L, idx);
+
+	subscribeEvent(event_type);
 }
 
-template<typename FN>
-auto callEventArgs(const Tox_Event_Friend_Read_Receipt* e, FN&& fn) {
-	return fn(
-		tox_event_friend_read_receipt_get_friend_number(e),
-		tox_event_friend_read_receipt_get_message_id(e)
-	);
+void ToxLuaModule::subscribeEvent(Tox_Event event_type) {
+	if (!_event_subscribed.at(event_type)) {
+		_tep.subscribe(this, event_type);
+		_event_subscribed.at(event_type) = true;
+	}
 }
 
-template<typename FN>
-auto callEventArgs(const Tox_Event_Friend_Request* e, FN&& fn) {
-	return fn(
-		std::vector<uint8_t>(tox_event_friend_request_get_public_key(e), tox_event_friend_request_get_public_key(e)+TOX_PUBLIC_KEY_SIZE),
-		std::string_view{reinterpret_cast<const char*>(tox_event_friend_request_get_message(e)), tox_event_friend_request_get_message_length(e)}
-	);
-}
-
-template<typename FN>
-auto callEventArgs(const Tox_Event_Friend_Status* e, FN&& fn) {
-	return fn(
-		tox_event_friend_status_get_friend_number(e),
-		tox_event_friend_status_get_status(e)
-	);
-}
-
-template<typename FN>
-auto callEventArgs(const Tox_Event_Friend_Status_Message* e, FN&& fn) {
-	return fn(
-		tox_event_friend_status_message_get_friend_number(e),
-		std::string_view{reinterpret_cast<const char*>(tox_event_friend_status_message_get_message(e)), tox_event_friend_status_message_get_message_length(e)}
-	);
-}
-
-template<typename FN>
-auto callEventArgs(const Tox_Event_Friend_Typing* e, FN&& fn) {
-	return fn(
-		tox_event_friend_typing_get_friend_number(e),
-		tox_event_friend_typing_get_typing(e)
-	);
-}
-
-template<typename FN>
-auto callEventArgs(const Tox_Event_Group_Peer_Name* e, FN&& fn) {
-	return fn(
-		tox_event_group_peer_name_get_group_number(e),
-		tox_event_group_peer_name_get_peer_id(e),
-		std::string_view{reinterpret_cast<const char*>(tox_event_group_peer_name_get_name(e)), tox_event_group_peer_name_get_name_length(e)}
-	);
-}
-
-template<typename FN>
-auto callEventArgs(const Tox_Event_Group_Peer_Status* e, FN&& fn) {
-	return fn(
-		tox_event_group_peer_status_get_group_number(e),
-		tox_event_group_peer_status_get_peer_id(e),
-		tox_event_group_peer_status_get_status(e)
-	);
-}
-
-template<typename FN>
-auto callEventArgs(const Tox_Event_Group_Topic* e, FN&& fn) {
-	return fn(
-		tox_event_group_topic_get_group_number(e),
-		tox_event_group_topic_get_peer_id(e),
-		std::string_view{reinterpret_cast<const char*>(tox_event_group_topic_get_topic(e)), tox_event_group_topic_get_topic_length(e)}
-	);
-}
-
-template<typename FN>
-auto callEventArgs(const Tox_Event_Group_Privacy_State* e, FN&& fn) {
-	return fn(
-		tox_event_group_privacy_state_get_group_number(e),
-		tox_event_group_privacy_state_get_privacy_state(e)
-	);
-}
-
-template<typename FN>
-auto callEventArgs(const Tox_Event_Group_Voice_State* e, FN&& fn) {
-	return fn(
-		tox_event_group_voice_state_get_group_number(e),
-		tox_event_group_voice_state_get_voice_state(e)
-	);
-}
-
-template<typename FN>
-auto callEventArgs(const Tox_Event_Group_Topic_Lock* e, FN&& fn) {
-	return fn(
-		tox_event_group_topic_lock_get_group_number(e),
-		tox_event_group_topic_lock_get_topic_lock(e)
-	);
-}
-
-template<typename FN>
-auto callEventArgs(const Tox_Event_Group_Peer_Limit* e, FN&& fn) {
-	return fn(
-		tox_event_group_peer_limit_get_group_number(e),
-		tox_event_group_peer_limit_get_peer_limit(e)
-	);
-}
-
-template<typename FN>
-auto callEventArgs(const Tox_Event_Group_Password* e, FN&& fn) {
-	return fn(
-		tox_event_group_password_get_group_number(e),
-		std::string_view{reinterpret_cast<const char*>(tox_event_group_password_get_password(e)), tox_event_group_password_get_password_length(e)}
-	);
-}
-
-template<typename FN>
-auto callEventArgs(const Tox_Event_Group_Message* e, FN&& fn) {
-	return fn(
-		tox_event_group_message_get_group_number(e),
-		tox_event_group_message_get_peer_id(e),
-		tox_event_group_message_get_type(e),
-		std::string_view{reinterpret_cast<const char*>(tox_event_group_message_get_message(e)), tox_event_group_message_get_message_length(e)},
-		tox_event_group_message_get_message_id(e)
-	);
-}
-
-template<typename FN>
-auto callEventArgs(const Tox_Event_Group_Private_Message* e, FN&& fn) {
-	return fn(
-		tox_event_group_private_message_get_group_number(e),
-		tox_event_group_private_message_get_peer_id(e),
-		tox_event_group_private_message_get_type(e),
-		std::string_view{reinterpret_cast<const char*>(tox_event_group_private_message_get_message(e)), tox_event_group_private_message_get_message_length(e)}
-	);
-}
-
-template<typename FN>
-auto callEventArgs(const Tox_Event_Group_Custom_Packet* e, FN&& fn) {
-	return fn(
-		tox_event_group_custom_packet_get_group_number(e),
-		tox_event_group_custom_packet_get_peer_id(e),
-		std::vector<uint8_t>(tox_event_group_custom_packet_get_data(e), tox_event_group_custom_packet_get_data(e) + tox_event_group_custom_packet_get_data_length(e))
-	);
-}
-
-template<typename FN>
-auto callEventArgs(const Tox_Event_Group_Custom_Private_Packet* e, FN&& fn) {
-	return fn(
-		tox_event_group_custom_private_packet_get_group_number(e),
-		tox_event_group_custom_private_packet_get_peer_id(e),
-		std::vector<uint8_t>(tox_event_group_custom_private_packet_get_data(e), tox_event_group_custom_private_packet_get_data(e) + tox_event_group_custom_private_packet_get_data_length(e))
-	);
-}
-
-template<typename FN>
-auto callEventArgs(const Tox_Event_Group_Invite* e, FN&& fn) {
-	return fn(
-		tox_event_group_invite_get_friend_number(e),
-		std::vector<uint8_t>(tox_event_group_invite_get_invite_data(e), tox_event_group_invite_get_invite_data(e) + tox_event_group_invite_get_invite_data_length(e)),
-		std::string_view{reinterpret_cast<const char*>(tox_event_group_invite_get_group_name(e)), tox_event_group_invite_get_group_name_length(e)}
-	);
-}
-
-template<typename FN>
-auto callEventArgs(const Tox_Event_Group_Peer_Join* e, FN&& fn) {
-	return fn(
-		tox_event_group_peer_join_get_group_number(e),
-		tox_event_group_peer_join_get_peer_id(e)
-	);
-}
-
-template<typename FN>
-auto callEventArgs(const Tox_Event_Group_Peer_Exit* e, FN&& fn) {
-	return fn(
-		tox_event_group_peer_exit_get_group_number(e),
-		tox_event_group_peer_exit_get_peer_id(e),
-		tox_event_group_peer_exit_get_exit_type(e),
-		std::string_view{reinterpret_cast<const char*>(tox_event_group_peer_exit_get_name(e)), tox_event_group_peer_exit_get_name_length(e)},
-		std::string_view{reinterpret_cast<const char*>(tox_event_group_peer_exit_get_part_message(e)), tox_event_group_peer_exit_get_part_message_length(e)}
-	);
-}
-
-template<typename FN>
-auto callEventArgs(const Tox_Event_Group_Self_Join* e, FN&& fn) {
-	return fn(
-		tox_event_group_self_join_get_group_number(e)
-	);
-}
-
-template<typename FN>
-auto callEventArgs(const Tox_Event_Group_Join_Fail* e, FN&& fn) {
-	return fn(
-		tox_event_group_join_fail_get_group_number(e),
-		tox_event_group_join_fail_get_fail_type(e)
-	);
-}
-
-template<typename FN>
-auto callEventArgs(const Tox_Event_Group_Moderation* e, FN&& fn) {
-	return fn(
-		tox_event_group_moderation_get_group_number(e),
-		tox_event_group_moderation_get_source_peer_id(e),
-		tox_event_group_moderation_get_target_peer_id(e),
-		tox_event_group_moderation_get_mod_type(e)
-	);
-}
-
-bool ToxLuaModule::onToxEvent(const Tox_Event_Self_Connection_Status* e) {
-	// get lua function
-	luabridge::LuaRef g_events_table = luabridge::getGlobal(_lua_state_global.get(), "TOX_EVENTS");
-	if (!g_events_table.isTable()) {
-		std::cerr << "TLM waring: global table TOX_EVENTS not set\n";
-		return false;
+int ToxLuaModule::lua_events_newindex(lua_State* L) {
+	// (proxy, key, value)
+	auto* tlm = static_cast<ToxLuaModule*>(lua_tolightuserdata(L, lua_upvalueindex(1)));
+
+	lua_getref(L, tlm->_events_table_ref);
+	lua_pushvalue(L, 2);
+	lua_pushvalue(L, 3);
+	lua_rawset(L, -3);
+	lua_pop(L, 1);
+
+	if (lua_type(L, 2) == LUA_TSTRING) {
+		if (const auto event_key = eventKeyFromName(lua_tostring(L, 2)); event_key.has_value()) {
+			tlm->setEventHandler(event_key->first, event_key->second, 3);
+		}
 	}
 
-	auto lr_fn = g_events_table["Tox_Event_Self_Connection_Status"];
-	if (!lr_fn.isCallable()) {
-		std::cerr << "TLM waring: Tox_Event_Self_Connection_Status is not callable\n";
-		return false;
+	return 0;
+}
+
+// TLM.send(friend_number, message, fn, type) / TLM.groupSend(group_number, message, fn, type)
+// queues the message and returns its id, fn and type are optional
+// fn(id, "delivered"|"sent"|"failed", err) runs once the message is done, unless the scripts got reloaded by then
+int ToxLuaModule::lua_outbox_send(lua_State* L) {
+	auto* tlm = static_cast<ToxLuaModule*>(lua_tolightuserdata(L, lua_upvalueindex(1)));
+	const bool is_group = lua_toboolean(L, lua_upvalueindex(2));
+	const uint64_t state_id = static_cast<uint64_t>(lua_tonumber(L, lua_upvalueindex(3)));
+
+	const auto number = static_cast<uint32_t>(luaL_checkinteger(L, 1));
+	size_t message_len = 0;
+	const char* message = luaL_checklstring(L, 2, &message_len);
+	const auto type = static_cast<Tox_Message_Type>(luaL_optinteger(L, 4, TOX_MESSAGE_TYPE_NORMAL));
+
+	ToxOutbox::DoneFn done;
+	if (!lua_isnoneornil(L, 3)) {
+		luaL_checktype(L, 3, LUA_TFUNCTION);
+		const int fn_ref = lua_ref(L, 3);
+		done = [tlm, state_id, fn_ref](uint64_t id, ToxOutbox::Result result, int err) {
+			if (state_id != tlm->_lua_state_id) {
+				return; // the ref died with its state
+			}
+
+			auto* L_ = tlm->_lua_state_global.get();
+			lua_getref(L_, fn_ref);
+			lua_unref(L_, fn_ref);
+			lua_pushnumber(L_, static_cast<double>(id));
+			switch (result) {
+				case ToxOutbox::Result::delivered: lua_pushliteral(L_, "delivered"); break;
+				case ToxOutbox::Result::sent: lua_pushliteral(L_, "sent"); break;
+				case ToxOutbox::Result::failed: lua_pushliteral(L_, "failed"); break;
+			}
+			lua_pushinteger(L_, err);
+
+			if (lua_pcall(L_, 3, 0, 0) != LUA_OK) {
+				std::cerr << "TLM error, outbox callback failed " << lua_tostring(L_, -1) << "\n";
+				lua_pop(L_, 1);
+			}
+		};
 	}
 
-	// call
-	auto res = callEventArgs(e, lr_fn);
+	const uint64_t id = is_group
+		? tlm->_outbox.groupSend(number, type, {message, message_len}, std::move(done))
+		: tlm->_outbox.friendSend(number, type, {message, message_len}, std::move(done))
+	;
+
+	lua_pushnumber(L, static_cast<double>(id));
+	return 1;
+}
+
+// calls the pinned handler with the event arguments, returns the handlers bool
+template<typename EventT>
+static bool callEventHandler(lua_State* L, int fn_ref, const EventT* e) {
+	using Table = EventTable<EventT>;
+	const char* event_name = Table::name;
+	const int top = lua_gettop(L);
 
-	if (res.hasFailed() || res.size() != 1) {
-		std::cerr << "TLM error, Tox_Event_Self_Connection_Status callback failed " << res.errorCode() << ":" << res.errorMessage() << "\n";
+	lua_getref(L, fn_ref);
+	for (const auto& field : Table::fields) {
+		field.push(L, e);
+	}
+
+	const int call_res = lua_pcall(L, static_cast<int>(std::size(Table::fields)), 1, 0);
+	ByteView::expireAll(); // views into e are dead now
+
+	if (call_res != LUA_OK) {
+		std::cerr << "TLM error, " << event_name << " callback failed " << lua_tostring(L, -1) << "\n";
+		lua_settop(L, top);
 		return false;
 	}
 
-	if (!res[0].isBool()) {
-		std::cerr << "TLM error, Tox_Event_Self_Connection_Status callback did not return a bool\n";
+	if (!lua_isboolean(L, -1)) {
+		std::cerr << "TLM error, " << event_name << " callback did not return a bool\n";
+		lua_settop(L, top);
 		return false;
 	}
 
-	return static_cast<bool>(res[0]);
+	const bool handled = lua_toboolean(L, -1);
+	lua_settop(L, top);
+	return handled;
 }
 
-#define EVENT_IMPL(x) \
+// pushes a table with the event arguments, in the same order the single event handlers get them
+template<typename EventT>
+static void pushEventArgsTable(lua_State* L, const EventT* e) {
+	const auto& fields = EventTable<EventT>::fields;
+	lua_createtable(L, static_cast<int>(std::size(fields)), 0);
+	for (size_t i = 0; i < std::size(fields); i++) {
+		fields[i].push(L, e);
+		lua_rawseti(L, -2, static_cast<int>(i+1));
+	}
+}
+
+// copies the event arguments and hands them to a worker, routed by the friend/conference/group number
+template<typename EventT>
+static void dispatchToWorkers(LuaWorkerPool& pool, lua_State* L, const EventT* e) {
+	using Table = EventTable<EventT>;
+	LuaWorkerPool::Event event;
+	event.name = Table::name;
+
+	const int top = lua_gettop(L);
+	event.args.reserve(std::size(Table::fields));
+	for (const auto& field : Table::fields) {
+		field.push(L, e);
+		event.args.push_back(LuaValue::from(L, -1));
+		lua_settop(L, top);
+	}
+	ByteView::expireAll(); // the bytes got copied
+
+	// all other events start with the friend/conference/group number
+	if (Table::type != TOX_EVENT_SELF_CONNECTION_STATUS && Table::type != TOX_EVENT_FRIEND_REQUEST
+		&& !event.args.empty() && event.args.front().type == LuaValue::Type::number
+	) {
+		event.key = static_cast<uint32_t>(event.args.front().number);
+	}
+
+	pool.dispatch(std::move(event));
+}
+
+// calls the batch handler with the collected events of that type
+template<typename EventT>
+static void callEventBatchHandler(lua_State* L, int fn_ref, const std::vector<const void*>& events) {
+	using Table = EventTable<EventT>;
+	const char* event_name = Table::batch_name;
+
+	const int top = lua_gettop(L);
+
+	lua_getref(L, fn_ref);
+	lua_createtable(L, static_cast<int>(events.size()), 0);
+	for (size_t i = 0; i < events.size(); i++) {
+		pushEventArgsTable(L, static_cast<const EventT*>(events[i]));
+		lua_rawseti(L, -2, static_cast<int>(i+1));
+	}
+
+	const int call_res = lua_pcall(L, 1, 0, 0);
+	ByteView::expireAll(); // views into the batch are dead now
+
+	if (call_res != LUA_OK) {
+		std::cerr << "TLM error, " << event_name << " callback failed " << lua_tostring(L, -1) << "\n";
+	}
+
+	lua_settop(L, top);
+}
+
+template<typename EventT>
+bool ToxLuaModule::onBatchedEvent(const EventT* e) {
+	_event_batch_pending[EventTable<EventT>::type].push_back(e);
+
+	if (!_in_batch) {
+		// nobody tells us when the batch ends (eg. plugin), degrade to batches of one
+		// timed as part of this event
+		flushEventBatch<EventT>();
+	}
+
+	return false; // the handler runs after dispatching, too late to consume
+}
+
+template<typename EventT>
+void ToxLuaModule::flushEventBatch(void) {
+	constexpr Tox_Event event_type = EventTable<EventT>::type;
+	auto& pending = _event_batch_pending[event_type];
+	if (pending.empty()) {
+		return;
+	}
+
+	// the handler might be gone since (reload, TOX_EVENTS change)
+	if (_event_batch_handler_refs[event_type] != LUA_NOREF) {
+		callEventBatchHandler<EventT>(_lua_state_global.get(), _event_batch_handler_refs[event_type], pending);
+	}
+	pending.clear(); // keeps the capacity for the next batch
+}
+
+template<typename EventT>
+bool ToxLuaModule::handleEvent(const EventT* e) {
+	constexpr Tox_Event event_type = EventTable<EventT>::type;
+	if (_worker_pool && _worker_event_handled[event_type]) {
+		dispatchToWorkers(*_worker_pool, _lua_state_global.get(), e);
+	}
+	if (_event_batch_handler_refs[event_type] != LUA_NOREF) {
+		return onBatchedEvent(e);
+	}
+	const int fn_ref = _event_handler_refs[event_type];
+	if (fn_ref == LUA_NOREF) {
+		return false;
+	}
+	return callEventHandler(_lua_state_global.get(), fn_ref, e);
+}
+
+#define EVENT_IMPL(x, t, ...) \
 bool ToxLuaModule::onToxEvent(const x* e) { \
-	luabridge::LuaRef g_events_table = luabridge::getGlobal(_lua_state_global.get(), "TOX_EVENTS"); \
-	if (!g_events_table.isTable()) { \
-		std::cerr << "TLM waring: global table TOX_EVENTS not set\n"; \
-		return false; \
-	} \
-	auto lr_fn = g_events_table[#x]; \
-	if (!lr_fn.isCallable()) { \
-		return false; \
-	} \
-	auto res = callEventArgs(e, lr_fn); \
-	if (res.hasFailed() || res.size() != 1) { \
-		std::cerr << "TLM error, " #x " callback failed " << res.errorCode() << ":" << res.errorMessage() << "\n"; \
-		return false; \
-	} \
-	if (!res[0].isBool()) { \
-		std::cerr << "TLM error, " #x " callback did not return a bool\n"; \
-		return false; \
-	} \
-	return static_cast<bool>(res[0]); \
-}
-
-EVENT_IMPL(Tox_Event_Conference_Connected)
-EVENT_IMPL(Tox_Event_Conference_Invite)
-EVENT_IMPL(Tox_Event_Conference_Message)
-EVENT_IMPL(Tox_Event_Conference_Peer_List_Changed)
-EVENT_IMPL(Tox_Event_Conference_Peer_Name)
-EVENT_IMPL(Tox_Event_Conference_Title)
-
-EVENT_IMPL(Tox_Event_File_Chunk_Request)
-EVENT_IMPL(Tox_Event_File_Recv)
-EVENT_IMPL(Tox_Event_File_Recv_Chunk)
-EVENT_IMPL(Tox_Event_File_Recv_Control)
-
-EVENT_IMPL(Tox_Event_Friend_Connection_Status)
-EVENT_IMPL(Tox_Event_Friend_Lossless_Packet)
-EVENT_IMPL(Tox_Event_Friend_Lossy_Packet)
-EVENT_IMPL(Tox_Event_Friend_Message)
-EVENT_IMPL(Tox_Event_Friend_Name)
-EVENT_IMPL(Tox_Event_Friend_Read_Receipt)
-EVENT_IMPL(Tox_Event_Friend_Request)
-EVENT_IMPL(Tox_Event_Friend_Status)
-EVENT_IMPL(Tox_Event_Friend_Status_Message)
-EVENT_IMPL(Tox_Event_Friend_Typing)
-
-EVENT_IMPL(Tox_Event_Group_Peer_Name)
-EVENT_IMPL(Tox_Event_Group_Peer_Status)
-EVENT_IMPL(Tox_Event_Group_Topic)
-EVENT_IMPL(Tox_Event_Group_Privacy_State)
-EVENT_IMPL(Tox_Event_Group_Voice_State)
-EVENT_IMPL(Tox_Event_Group_Topic_Lock)
-EVENT_IMPL(Tox_Event_Group_Peer_Limit)
-EVENT_IMPL(Tox_Event_Group_Password)
-EVENT_IMPL(Tox_Event_Group_Message)
-EVENT_IMPL(Tox_Event_Group_Private_Message)
-EVENT_IMPL(Tox_Event_Group_Custom_Packet)
-EVENT_IMPL(Tox_Event_Group_Custom_Private_Packet)
-EVENT_IMPL(Tox_Event_Group_Invite)
-EVENT_IMPL(Tox_Event_Group_Peer_Join)
-EVENT_IMPL(Tox_Event_Group_Peer_Exit)
-EVENT_IMPL(Tox_Event_Group_Self_Join)
-EVENT_IMPL(Tox_Event_Group_Join_Fail)
-EVENT_IMPL(Tox_Event_Group_Moderation)
+	const auto start = std::chrono::steady_clock::now(); \
+	const bool consumed = handleEvent(e); \
+	_metrics.recordEvent(t, #x, consumed, std::chrono::steady_clock::now() - start); \
+	_gc_pacer.checkPressure(_lua_state_global.get()); \
+	return consumed; \
+}
+
+TLM_TOX_EVENTS(EVENT_IMPL)
 
+#undef EVENT_IMPL
@@ -2,18 +2,82 @@
 
 #include <solanaceae/toxcore/tox_event_interface.hpp>
 
+#include "./tox_lua_events.hpp"
+#include "./lua_module_loader.hpp"
+#include "./script_watcher.hpp"
+#include "./lua_worker_pool.hpp"
+#include "./tox_state_cache.hpp"
+#include "./tox_outbox.hpp"
+#include "./tox_outbox_store.hpp"
+#include "./tox_lua_metrics.hpp"
+#include "./lua_profiler.hpp"
+#include "./lua_allocator.hpp"
+#include "./lua_gc_pacer.hpp"
+
 #include <lua.h>
 #include <lualib.h>
 
 #include <memory>
+#include <functional>
+#include <array>
+#include <vector>
+#include <cstdint>
 
 // fwd
 struct ToxI;
 
 class ToxLuaModule : public ToxEventI {
 	ToxI& _t;
+	ToxEventProviderI& _tep;
+
+	using LuaStatePtr = std::unique_ptr<lua_State, void(*)(lua_State*)>;
+	LuaStatePtr _lua_state_global {nullptr, LuaAllocator::closeState};
+	// every started state gets a new id, outbox callbacks only run in the state they came from
+	uint64_t _lua_state_count {0};
+	uint64_t _lua_state_id {0};
+
+	// friend/group/conference state for TLM.friends and co, subscribes before the scripts do
+	ToxStateCache _state_cache;
+
+	// subscribes before the scripts do, so it sees every read receipt
+	ToxOutbox _outbox;
+	// TLM.sendLater(), messages on disk until the friend is online
+	ToxOutboxStore _outbox_store;
+
+	ToxLuaMetrics _metrics;
+	LuaProfiler _profiler;
+
+	// every state gets its own allocator with this limit, TLM_MEMORY_LIMIT_MB
+	size_t _memory_limit {size_t(1024)*1024*1024};
+	// gc of the global state, stepped from iterate()
+	LuaGCPacer _gc_pacer;
+
+	// scripts live in the working directory, bytecode gets cached next to them
+	LuaModuleLoader _module_loader {".", ".tlm_cache"};
+	LuaModuleLoader::NativeMode _native_mode {LuaModuleLoader::NativeMode::off};
 
-	std::unique_ptr<lua_State, void(*)(lua_State*)> _lua_state_global {luaL_newstate(), lua_close};
+	// reloads the scripts when any loaded file changes
+	ScriptWatcher _script_watcher;
+
+	// optional, handlers from worker.lua running on other threads (TLM_WORKERS=N)
+	std::unique_ptr<LuaWorkerPool> _worker_pool;
+	std::array<bool, TOX_EVENT_GROUP_MODERATION+1> _worker_event_handled {};
+
+	// TOX_EVENTS is a proxy, the actual handlers live in this backing table
+	int _events_proxy_ref {LUA_NOREF};
+	int _events_table_ref {LUA_NOREF};
+
+	// registry refs to the handler functions, indexed by Tox_Event
+	// LUA_NOREF if the script does not handle the event
+	std::array<int, TOX_EVENT_GROUP_MODERATION+1> _event_handler_refs;
+	// same for the "<event>_Batch" handlers, which get all events of a type in one call
+	std::array<int, TOX_EVENT_GROUP_MODERATION+1> _event_batch_handler_refs;
+	std::array<bool, TOX_EVENT_GROUP_MODERATION+1> _event_subscribed {};
+
+	// between beginBatch() and endBatch(), the batch handlers run at the end
+	bool _in_batch {false};
+	// events of the current batch that reached the module, by Tox_Event, for the batch handlers
+	std::array<std::vector<const void*>, TOX_EVENT_GROUP_MODERATION+1> _event_batch_pending;
 
 	public:
 		ToxLuaModule(ToxI& t, ToxEventProviderI& tep);
@@ -22,53 +86,65 @@ class ToxLuaModule : public ToxEventI {
 	public:
 		void iterate(void);
 
+		// eg. to add ToxClient::IterateStats to the dump
+		ToxLuaMetrics& getMetrics(void) { return _metrics; }
+		// allocator of the global state
+		const LuaAllocator::Stats& getMemoryStats(void) const;
+
+		// starts sampling, or stops it and writes the folded stacks to TLM_PROFILE_FILE (tlm_profile.folded)
+		void toggleProfiler(void);
+
+		// thread safe fn, lets lua workers wake the loop when they need the tox thread
+		void setWakeCallback(std::function<void(void)>&& fn);
+
+		// starts the scripts again in a fresh state, keeping the old one if that fails
+		// calls tlm_migrate(state) in the new state with a copy of what tlm_save_state() returned in the old one
+		bool reload(void);
+
+		// call before and after every raw batch gets dispatched (see ToxClient::subscribeRaw and subscribeRawDone)
+		// "<event>_Batch" handlers then get all events of a type in one call, once the batch is dispatched
+		// only the events that reached the module, none an earlier subscriber consumed
+		// they are too late to consume anything themselves, their return value is ignored
+		// without these calls, batch handlers get batches of one
+		void beginBatch(void);
+		void endBatch(void);
+
+	private: // script lifetime
+		// new state with everything set up and main.lua run, nullptr on failure
+		LuaStatePtr startState(void);
+		bool migrateState(lua_State* old_L, lua_State* new_L);
+		void startWorkers(size_t count);
+
+	private: // event handler registry
+		// (re)builds the handler cache from a plain TOX_EVENTS table and replaces it with the proxy
+		void adoptEventsTable(void);
+		// pins the value at idx as the handler for event_type (or clears it if not callable)
+		// clearing does not unsubscribe, ToxEventProviderI has no way to, so the event keeps being dispatched to us
+		void setEventHandler(Tox_Event event_type, bool batch, int idx);
+		void subscribeEvent(Tox_Event event_type);
+
+		// handler or batch handler, and the workers, returns if the event got consumed
+		template<typename EventT>
+		bool handleEvent(const EventT* e);
+		template<typename EventT>
+		bool onBatchedEvent(const EventT* e);
+		template<typename EventT>
+		void flushEventBatch(void);
+
+		static int lua_events_newindex(lua_State* L);
+
+		// gc step timing and profiler samples, userdata is the module
+		static void lua_interrupt(lua_State* L, int gc);
+
+	private: // outbox
+		// TLM.send() and TLM.groupSend()
+		static int lua_outbox_send(lua_State* L);
+
 	protected: // tox events
 
-#define OVER_EVENT(x) bool onToxEvent(const x*) override;
-
-	OVER_EVENT(Tox_Event_Conference_Connected)
-	OVER_EVENT(Tox_Event_Conference_Invite)
-	OVER_EVENT(Tox_Event_Conference_Message)
-	OVER_EVENT(Tox_Event_Conference_Peer_List_Changed)
-	OVER_EVENT(Tox_Event_Conference_Peer_Name)
-	OVER_EVENT(Tox_Event_Conference_Title)
-
-	OVER_EVENT(Tox_Event_File_Chunk_Request)
-	OVER_EVENT(Tox_Event_File_Recv)
-	OVER_EVENT(Tox_Event_File_Recv_Chunk)
-	OVER_EVENT(Tox_Event_File_Recv_Control)
-
-	OVER_EVENT(Tox_Event_Friend_Connection_Status)
-	OVER_EVENT(Tox_Event_Friend_Lossless_Packet)
-	OVER_EVENT(Tox_Event_Friend_Lossy_Packet)
-	OVER_EVENT(Tox_Event_Friend_Message)
-	OVER_EVENT(Tox_Event_Friend_Name)
-	OVER_EVENT(Tox_Event_Friend_Read_Receipt)
-	OVER_EVENT(Tox_Event_Friend_Request)
-	OVER_EVENT(Tox_Event_Friend_Status)
-	OVER_EVENT(Tox_Event_Friend_Status_Message)
-	OVER_EVENT(Tox_Event_Friend_Typing)
-
-	OVER_EVENT(Tox_Event_Self_Connection_Status)
-
-	OVER_EVENT(Tox_Event_Group_Peer_Name)
-	OVER_EVENT(Tox_Event_Group_Peer_Status)
-	OVER_EVENT(Tox_Event_Group_Topic)
-	OVER_EVENT(Tox_Event_Group_Privacy_State)
-	OVER_EVENT(Tox_Event_Group_Voice_State)
-	OVER_EVENT(Tox_Event_Group_Topic_Lock)
-	OVER_EVENT(Tox_Event_Group_Peer_Limit)
-	OVER_EVENT(Tox_Event_Group_Password)
-	OVER_EVENT(Tox_Event_Group_Message)
-	OVER_EVENT(Tox_Event_Group_Private_Message)
-	OVER_EVENT(Tox_Event_Group_Custom_Packet)
-	OVER_EVENT(Tox_Event_Group_Custom_Private_Packet)
-	OVER_EVENT(Tox_Event_Group_Invite)
-	OVER_EVENT(Tox_Event_Group_Peer_Join)
-	OVER_EVENT(Tox_Event_Group_Peer_Exit)
-	OVER_EVENT(Tox_Event_Group_Self_Join)
-	OVER_EVENT(Tox_Event_Group_Join_Fail)
-	OVER_EVENT(Tox_Event_Group_Moderation)
+#define OVER_EVENT(x, ...) bool onToxEvent(const x*) override;
+
+	TLM_TOX_EVENTS(OVER_EVENT)
 
 #undef OVER_EVENT
 
@@ -0,0 +1,286 @@
+#include "./tox_outbox.hpp"
+
+#include "./tox_broadcast.hpp"
+
+#include <solanaceae/toxcore/tox_interface.hpp>
+
+#include <algorithm>
+
+// SENDQ doubles the wait, up to the max
+static constexpr std::chrono::milliseconds min_backoff {50};
+static constexpr std::chrono::milliseconds max_backoff {5000};
+// offline friends get woken up by their connection status, groups have nothing like that
+static constexpr std::chrono::milliseconds offline_retry {1000};
+
+ToxOutbox::ToxOutbox(ToxI& t, ToxEventProviderI& tep) : _t(t) {
+	tep.subscribe(this, Tox_Event::TOX_EVENT_FRIEND_CONNECTION_STATUS);
+	tep.subscribe(this, Tox_Event::TOX_EVENT_FRIEND_READ_RECEIPT);
+}
+
+uint64_t ToxOutbox::friendSend(uint32_t friend_number, Tox_Message_Type type, std::string_view message, DoneFn&& done) {
+	return enqueue(_friends, _friend_rate, friend_number, type, message, TOX_MAX_MESSAGE_LENGTH, std::move(done));
+}
+
+uint64_t ToxOutbox::groupSend(uint32_t group_number, Tox_Message_Type type, std::string_view message, DoneFn&& done) {
+	return enqueue(_groups, _group_rate, group_number, type, message, TOX_GROUP_MAX_MESSAGE_LENGTH, std::move(done));
+}
+
+uint64_t ToxOutbox::enqueue(std::map<uint32_t, Queue>& queues, const Rate& rate, uint32_t number, Tox_Message_Type type, std::string_view message, size_t max_len, DoneFn&& done) {
+	const auto [it, inserted] = queues.try_emplace(number);
+	auto& queue = it->second;
+	if (inserted) {
+		queue.tokens = rate.burst;
+		queue.last_refill = clock::now();
+	}
+
+	const uint64_t id = _next_id++;
+
+	// an empty message stays one (empty) part and fails like it would without the queue
+	const auto parts = splitMessage(message, max_len);
+	for (size_t i = 0; i < parts.size(); i++) {
+		auto& entry = queue.entries.emplace_back();
+		entry.id = id;
+		entry.type = type;
+		entry.text = parts[i];
+		if (i+1 == parts.size()) {
+			entry.last = true;
+			entry.done = std::move(done);
+		}
+	}
+	_stats.queued += parts.size();
+
+	return id;
+}
+
+bool ToxOutbox::cancel(uint64_t id) {
+	for (auto* queues : {&_friends, &_groups}) {
+		for (auto& [number, queue] : *queues) {
+			auto first = std::find_if(queue.entries.begin(), queue.entries.end(), [id](const Entry& entry) { return entry.id == id; });
+			if (first == queue.entries.end()) {
+				continue;
+			}
+
+			// parts of a message are next to each other
+			auto end = std::find_if(first, queue.entries.end(), [id](const Entry& entry) { return entry.id != id; });
+			if ((end-1)->last) {
+				finish(*(end-1), Result::failed, 0);
+			}
+			queue.entries.erase(first, end);
+
+			runDone();
+			return true;
+		}
+	}
+
+	return false;
+}
+
+void ToxOutbox::forgetFriend(uint32_t friend_number) {
+	const auto it = _friends.find(friend_number);
+	if (it == _friends.end()) {
+		return;
+	}
+	auto& queue = it->second;
+
+	for (auto& [message_id, entry] : queue.in_flight) {
+		if (entry.last) {
+			finish(entry, Result::failed, 0);
+		}
+	}
+	for (auto& entry : queue.entries) {
+		if (entry.last) {
+			finish(entry, Result::failed, 0);
+		}
+	}
+	_friends.erase(it);
+
+	runDone();
+}
+
+void ToxOutbox::iterate(void) {
+	const auto now = clock::now();
+
+	for (const bool is_group : {false, true}) {
+		auto& queues = is_group ? _groups : _friends;
+		const auto& rate = is_group ? _group_rate : _friend_rate;
+		const bool unlimited = rate.per_second <= 0.0;
+
+		for (auto it = queues.begin(); it != queues.end();) {
+			auto& queue = it->second;
+
+			const double elapsed = std::chrono::duration<double>(now - queue.last_refill).count();
+			queue.tokens = std::min(rate.burst, queue.tokens + elapsed * rate.per_second);
+			queue.last_refill = now;
+
+			while (!queue.entries.empty() && now >= queue.retry_at && (unlimited || queue.tokens >= 1.0)) {
+				if (!sendFront(is_group, it->first, queue, now)) {
+					break;
+				}
+			}
+
+			// forget idle targets, once forgetting does not hand out extra tokens
+			if (queue.entries.empty() && queue.in_flight.empty() && (unlimited || queue.tokens >= rate.burst)) {
+				it = queues.erase(it);
+			} else {
+				it++;
+			}
+		}
+	}
+
+	runDone();
+}
+
+bool ToxOutbox::sendFront(bool is_group, uint32_t number, Queue& queue, clock::time_point now) {
+	auto& entry = queue.entries.front();
+
+	std::optional<uint32_t> message_id;
+	bool ok {false};
+	bool full {false}; // send queue full, try again later
+	bool offline {false};
+	int err {0};
+	if (is_group) {
+		const auto [res_id, res_err] = _t.toxGroupSendMessage(number, entry.type, entry.text);
+		message_id = res_id;
+		ok = res_err == TOX_ERR_GROUP_SEND_MESSAGE_OK;
+		full = res_err == TOX_ERR_GROUP_SEND_MESSAGE_FAIL_SEND;
+		offline = res_err == TOX_ERR_GROUP_SEND_MESSAGE_DISCONNECTED;
+		err = res_err;
+	} else {
+		const auto [res_id, res_err] = _t.toxFriendSendMessage(number, entry.type, entry.text);
+		message_id = res_id;
+		ok = res_err == TOX_ERR_FRIEND_SEND_MESSAGE_OK;
+		full = res_err == TOX_ERR_FRIEND_SEND_MESSAGE_SENDQ;
+		offline = res_err == TOX_ERR_FRIEND_SEND_MESSAGE_FRIEND_NOT_CONNECTED;
+		err = res_err;
+	}
+
+	if (ok) {
+		queue.tokens -= 1.0;
+		queue.backoff = std::chrono::milliseconds{0};
+		_stats.sent++;
+
+		if (is_group) {
+			if (entry.last) {
+				finish(entry, Result::sent, 0);
+			}
+		} else {
+			queue.in_flight.emplace_back(message_id.value_or(0), std::move(entry));
+		}
+		queue.entries.pop_front();
+		return true;
+	}
+
+	if (full) {
+		_stats.retries++;
+		queue.backoff = std::clamp(queue.backoff * 2, min_backoff, max_backoff);
+		queue.retry_at = now + queue.backoff;
+		return false;
+	}
+
+	if (offline) {
+		queue.retry_at = now + offline_retry;
+		return false;
+	}
+
+	// not found, too long, ... retrying does not help
+	failFront(queue, err);
+	return true;
+}
+
+void ToxOutbox::failFront(Queue& queue, int err) {
+	const uint64_t id = queue.entries.front().id;
+	while (!queue.entries.empty() && queue.entries.front().id == id) {
+		if (queue.entries.front().last) {
+			finish(queue.entries.front(), Result::failed, err);
+		}
+		queue.entries.pop_front();
+	}
+}
+
+void ToxOutbox::finish(Entry& entry, Result result, int err) {
+	if (result == Result::failed) {
+		_stats.failed++;
+	} else {
+		_stats.delivered++;
+	}
+
+	if (entry.done) {
+		_done.emplace_back(std::move(entry.done), entry.id, result, err);
+	}
+}
+
+void ToxOutbox::runDone(void) {
+	// done might queue new messages
+	auto done = std::move(_done);
+	_done.clear();
+	for (auto& [fn, id, result, err] : done) {
+		fn(id, result, err);
+	}
+}
+
+void ToxOutbox::setFriendRate(double per_second, double burst) {
+	_friend_rate = {per_second, std::max(burst, 1.0)};
+}
+
+void ToxOutbox::setGroupRate(double per_second, double burst) {
+	_group_rate = {per_second, std::max(burst, 1.0)};
+}
+
+size_t ToxOutbox::queued(void) const {
+	size_t count = 0;
+	for (const auto* queues : {&_friends, &_groups}) {
+		for (const auto& it : *queues) {
+			count += it.second.entries.size();
+		}
+	}
+	return count;
+}
+
+bool ToxOutbox::onToxEvent(const Tox_Event_Friend_Connection_Status* e) {
+	const auto it = _friends.find(tox_event_friend_connection_status_get_friend_number(e));
+	if (it == _friends.end()) {
+		return false;
+	}
+	auto& queue = it->second;
+
+	if (tox_event_friend_connection_status_get_connection_status(e) != TOX_CONNECTION_NONE) {
+		queue.retry_at = {};
+		queue.backoff = std::chrono::milliseconds{0};
+		return false;
+	}
+
+	// tox forgets unconfirmed messages of an offline friend, send them again once it is back
+	// (the friend sees a part twice, if only the receipt got lost)
+	_stats.resent += queue.in_flight.size();
+	for (auto rit = queue.in_flight.rbegin(); rit != queue.in_flight.rend(); rit++) {
+		queue.entries.push_front(std::move(rit->second));
+	}
+	queue.in_flight.clear();
+
+	return false; // others might care too
+}
+
+bool ToxOutbox::onToxEvent(const Tox_Event_Friend_Read_Receipt* e) {
+	const auto it = _friends.find(tox_event_friend_read_receipt_get_friend_number(e));
+	if (it == _friends.end()) {
+		return false;
+	}
+	auto& in_flight = it->second.in_flight;
+
+	// receipts mostly arrive in order
+	const uint32_t message_id = tox_event_friend_read_receipt_get_message_id(e);
+	const auto fit = std::find_if(in_flight.begin(), in_flight.end(), [message_id](const auto& pair) { return pair.first == message_id; });
+	if (fit == in_flight.end()) {
+		return false; // not ours
+	}
+
+	if (fit->second.last) {
+		finish(fit->second, Result::delivered, 0);
+	}
+	in_flight.erase(fit);
+
+	runDone();
+
+	return false; // the script might track its own messages too
+}
+
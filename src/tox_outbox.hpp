@@ -0,0 +1,124 @@
+#pragma once
+
+#include <solanaceae/toxcore/tox_event_interface.hpp>
+
+#include <string>
+#include <string_view>
+#include <deque>
+#include <map>
+#include <optional>
+#include <vector>
+#include <functional>
+#include <tuple>
+#include <chrono>
+#include <cstdint>
+
+// fwd
+struct ToxI;
+
+// queued text messages per friend and group
+// sends at a steady rate, backs off while the send queue is full
+// and tracks read receipts until a friend message got delivered
+class ToxOutbox : public ToxEventI {
+	ToxI& _t;
+
+	public:
+		using clock = std::chrono::steady_clock;
+
+		enum class Result {
+			delivered, // friends, got the read receipt of the last part
+			sent, // groups, last part handed to tox (there are no receipts)
+			failed,
+		};
+
+		// called exactly once per message, never from inside send()
+		// err is the Tox_Err_Friend_Send_Message or Tox_Err_Group_Send_Message of the failed part, 0 if canceled
+		using DoneFn = std::function<void(uint64_t id, Result result, int err)>;
+
+		struct Stats {
+			uint64_t queued {0}; // parts
+			uint64_t sent {0};
+			uint64_t delivered {0}; // messages, sent for groups
+			uint64_t failed {0};
+			uint64_t retries {0}; // SENDQ
+			uint64_t resent {0}; // parts in flight when the friend went offline
+		};
+
+	private:
+		struct Entry {
+			uint64_t id {0};
+			Tox_Message_Type type {TOX_MESSAGE_TYPE_NORMAL};
+			std::string text; // one part
+			bool last {false}; // last part of the message, holds done
+			DoneFn done;
+		};
+
+		struct Queue {
+			std::deque<Entry> entries;
+
+			double tokens {0.0};
+			clock::time_point last_refill;
+
+			// waiting for the send queue to drain or the target to come online
+			clock::time_point retry_at;
+			std::chrono::milliseconds backoff {0};
+
+			// friends only, parts handed to tox in sending order, waiting for their receipt
+			std::deque<std::pair<uint32_t, Entry>> in_flight;
+		};
+
+		std::map<uint32_t, Queue> _friends;
+		std::map<uint32_t, Queue> _groups;
+
+		struct Rate {
+			double per_second {0.0};
+			double burst {0.0};
+		};
+		Rate _friend_rate {10.0, 20.0};
+		Rate _group_rate {5.0, 10.0};
+
+		uint64_t _next_id {1};
+
+		// finished messages, so done never runs while a queue is being changed
+		std::vector<std::tuple<DoneFn, uint64_t, Result, int>> _done;
+
+		Stats _stats;
+
+	public:
+		ToxOutbox(ToxI& t, ToxEventProviderI& tep);
+
+		// splits message if too long, returns the id passed to done
+		uint64_t friendSend(uint32_t friend_number, Tox_Message_Type type, std::string_view message, DoneFn&& done = {});
+		uint64_t groupSend(uint32_t group_number, Tox_Message_Type type, std::string_view message, DoneFn&& done = {});
+
+		// drops the unsent parts of a message, false if nothing was left to send
+		bool cancel(uint64_t id);
+
+		// fails everything queued for a friend about to be deleted, so a reused friend number starts empty
+		void forgetFriend(uint32_t friend_number);
+
+		void iterate(void);
+
+		// messages per second per friend/group, and how many can go out at once after being idle
+		void setFriendRate(double per_second, double burst);
+		void setGroupRate(double per_second, double burst);
+
+		// parts not yet handed to tox
+		size_t queued(void) const;
+		const Stats& getStats(void) const { return _stats; }
+
+	private:
+		uint64_t enqueue(std::map<uint32_t, Queue>& queues, const Rate& rate, uint32_t number, Tox_Message_Type type, std::string_view message, size_t max_len, DoneFn&& done);
+
+		// false if the queue has to wait
+		bool sendFront(bool is_group, uint32_t number, Queue& queue, clock::time_point now);
+		// drops the remaining parts of the message at the front
+		void failFront(Queue& queue, int err);
+		void finish(Entry& entry, Result result, int err);
+		void runDone(void);
+
+	protected:
+		bool onToxEvent(const Tox_Event_Friend_Connection_Status* e) override;
+		bool onToxEvent(const Tox_Event_Friend_Read_Receipt* e) override;
+};
+
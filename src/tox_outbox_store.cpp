@@ -0,0 +1,368 @@
+#include "./tox_outbox_store.hpp"
+
+#include "./tox_outbox.hpp"
+
+#include <solanaceae/toxcore/tox_interface.hpp>
+
+#include <filesystem>
+#include <iostream>
+#include <vector>
+#include <algorithm>
+#include <cstring>
+
+// the log is the magic followed by records, numbers in host byte order
+// 'M' seq:u64 type:u8 size:u32 text
+// 'A' seq:u64 (message done, delivered or failed for good)
+static constexpr std::string_view log_magic {"TLMOBOX1"};
+static constexpr size_t message_header_size = 1 + 8 + 1 + 4;
+static constexpr size_t ack_size = 1 + 8;
+
+// compaction kicks in past this many acks, if they outnumber the pending messages
+static constexpr size_t compact_min_acks = 64;
+
+static std::string toHex(const std::vector<uint8_t>& data) {
+	static constexpr const char* digits = "0123456789abcdef";
+	std::string hex;
+	hex.reserve(data.size() * 2);
+	for (const uint8_t byte : data) {
+		hex.push_back(digits[byte >> 4]);
+		hex.push_back(digits[byte & 0xf]);
+	}
+	return hex;
+}
+
+template<typename T>
+static void putNum(std::string& out, T value) {
+	char buffer[sizeof(T)];
+	std::memcpy(buffer, &value, sizeof(T));
+	out.append(buffer, sizeof(T));
+}
+
+template<typename T>
+static T getNum(const char* data) {
+	T value;
+	std::memcpy(&value, data, sizeof(T));
+	return value;
+}
+
+static std::string messageRecord(uint64_t seq, Tox_Message_Type type, std::string_view text) {
+	std::string record;
+	record.reserve(message_header_size + text.size());
+	record.push_back('M');
+	putNum<uint64_t>(record, seq);
+	putNum<uint8_t>(record, static_cast<uint8_t>(type));
+	putNum<uint32_t>(record, static_cast<uint32_t>(text.size()));
+	record.append(text);
+	return record;
+}
+
+static std::string ackRecord(uint64_t seq) {
+	std::string record;
+	record.reserve(ack_size);
+	record.push_back('A');
+	putNum<uint64_t>(record, seq);
+	return record;
+}
+
+ToxOutboxStore::ToxOutboxStore(ToxI& t, ToxEventProviderI& tep, ToxOutbox& outbox, std::string dir) : _t(t), _outbox(outbox), _dir(std::move(dir)) {
+	tep.subscribe(this, Tox_Event::TOX_EVENT_FRIEND_CONNECTION_STATUS);
+}
+
+bool ToxOutboxStore::friendSend(uint32_t friend_number, Tox_Message_Type type, std::string_view message) {
+	auto* log = getLog(friend_number);
+	if (log == nullptr) {
+		return false;
+	}
+
+	const uint64_t seq = log->next_seq;
+	if (!append(*log, messageRecord(seq, type, message))) {
+		return false;
+	}
+	log->next_seq++;
+
+	auto& pending = log->pending[seq];
+	pending.offset = log->size - message.size();
+	pending.size = static_cast<uint32_t>(message.size());
+	pending.type = type;
+
+	flush(friend_number, *log);
+
+	return true;
+}
+
+size_t ToxOutboxStore::depth(uint32_t friend_number) {
+	const auto* log = getLog(friend_number);
+	return log != nullptr ? log->pending.size() : 0;
+}
+
+void ToxOutboxStore::forgetFriend(uint32_t friend_number) {
+	_online.erase(friend_number);
+
+	const auto public_key = _t.toxFriendGetPublicKey(friend_number);
+	if (public_key.has_value()) {
+		// messages handed to the outbox find no log and are not acked
+		_logs.erase(toHex(public_key.value()));
+	}
+}
+
+ToxOutboxStore::FriendLog* ToxOutboxStore::getLog(uint32_t friend_number) {
+	const auto public_key = _t.toxFriendGetPublicKey(friend_number);
+	if (!public_key.has_value()) {
+		return nullptr;
+	}
+	const auto key = toHex(public_key.value());
+
+	if (auto it = _logs.find(key); it != _logs.end()) {
+		return &it->second;
+	}
+
+	auto& log = _logs[key];
+	log.key = key;
+	log.path = _dir + "/" + key + ".outbox";
+	if (!openLog(log)) {
+		_logs.erase(key);
+		return nullptr;
+	}
+
+	return &log;
+}
+
+bool ToxOutboxStore::openLog(FriendLog& log) {
+	log.size = 0;
+	log.pending.clear();
+	log.handed = 0;
+	log.acks = 0;
+
+	std::error_code ec;
+	const auto file_size = std::filesystem::file_size(log.path, ec);
+	if (ec) {
+		return true; // nothing stored, created on the first append
+	}
+
+	log.file.open(log.path, std::ios::in | std::ios::out | std::ios::binary);
+	if (!log.file.is_open()) {
+		std::cerr << "TLM error, can not open outbox log " << log.path << "\n";
+		return false;
+	}
+
+	std::string magic(log_magic.size(), '\0');
+	if (!log.file.read(magic.data(), magic.size()) || magic != log_magic) {
+		std::cerr << "TLM error, " << log.path << " is not an outbox log\n";
+		log.file.close();
+		return false;
+	}
+
+	// only the index gets read, the text stays on disk
+	uint64_t offset = log_magic.size();
+	char header[message_header_size];
+	while (offset + ack_size <= file_size && log.file.read(header, ack_size)) {
+		const uint64_t seq = getNum<uint64_t>(header+1);
+
+		if (header[0] == 'A') {
+			log.pending.erase(seq);
+			log.acks++;
+			offset += ack_size;
+			continue;
+		}
+
+		if (header[0] != 'M' || offset + message_header_size > file_size || !log.file.read(header+ack_size, message_header_size-ack_size)) {
+			break;
+		}
+
+		const uint32_t size = getNum<uint32_t>(header+10);
+		if (offset + message_header_size + size > file_size) {
+			break;
+		}
+
+		auto& pending = log.pending[seq];
+		pending.offset = offset + message_header_size;
+		pending.size = size;
+		pending.type = static_cast<Tox_Message_Type>(getNum<uint8_t>(header+9));
+
+		log.next_seq = std::max(log.next_seq, seq+1);
+		offset += message_header_size + size;
+		log.file.seekg(offset);
+	}
+	log.file.clear();
+
+	if (offset < file_size) {
+		// a crash mid append, the next record overwrites it
+		std::cerr << "TLM waring: ignoring " << file_size - offset << " broken bytes at the end of " << log.path << "\n";
+	}
+	log.size = offset;
+
+	return true;
+}
+
+bool ToxOutboxStore::append(FriendLog& log, const std::string& record) {
+	if (!log.file.is_open()) {
+		std::error_code ec;
+		std::filesystem::create_directories(_dir, ec);
+
+		// truncates, so a log that never got far enough to be read starts over
+		std::ofstream create{log.path, std::ios::binary | std::ios::trunc};
+		create.write(log_magic.data(), log_magic.size());
+		create.close();
+		log.file.open(log.path, std::ios::in | std::ios::out | std::ios::binary);
+		if (!create || !log.file.is_open()) {
+			std::cerr << "TLM error, can not create outbox log " << log.path << "\n";
+			log.file.close();
+			return false;
+		}
+		log.size = log_magic.size();
+	}
+
+	log.file.clear();
+	log.file.seekp(log.size);
+	log.file.write(record.data(), record.size());
+	log.file.flush();
+	if (!log.file) {
+		// size does not move, so whatever made it to disk gets overwritten
+		std::cerr << "TLM error, failed writing outbox log " << log.path << "\n";
+		log.file.clear();
+		return false;
+	}
+	log.size += record.size();
+
+	return true;
+}
+
+void ToxOutboxStore::flush(uint32_t friend_number, FriendLog& log) {
+	if (!_online.count(friend_number)) {
+		return;
+	}
+
+	// the outbox keeps them in order, and keeps retrying while the friend is offline
+	for (auto& [seq, pending] : log.pending) {
+		if (log.handed >= _batch_size) {
+			break;
+		}
+		if (pending.handed) {
+			continue;
+		}
+
+		std::string text(pending.size, '\0');
+		log.file.clear();
+		log.file.seekg(pending.offset);
+		if (!log.file.read(text.data(), text.size())) {
+			std::cerr << "TLM error, failed reading outbox log " << log.path << "\n";
+			log.file.clear();
+			break;
+		}
+
+		pending.handed = true;
+		log.handed++;
+		_outbox.friendSend(friend_number, pending.type, text, [this, friend_number, key = log.key, seq = seq](uint64_t, ToxOutbox::Result result, int err) {
+			if (result == ToxOutbox::Result::failed && err != 0) {
+				std::cerr << "TLM waring: dropping stored message for friend " << friend_number << ", sending failed with " << err << "\n";
+			}
+			done(friend_number, key, seq);
+		});
+	}
+}
+
+void ToxOutboxStore::done(uint32_t friend_number, const std::string& key, uint64_t seq) {
+	const auto it = _logs.find(key);
+	if (it == _logs.end()) {
+		return; // forgotten
+	}
+	auto& log = it->second;
+
+	const auto pending_it = log.pending.find(seq);
+	if (pending_it == log.pending.end()) {
+		return;
+	}
+	if (pending_it->second.handed) {
+		log.handed--;
+	}
+	log.pending.erase(pending_it);
+
+	if (append(log, ackRecord(seq))) {
+		log.acks++;
+	}
+
+	compact(log);
+
+	// only if the number still belongs to the same friend
+	if (getLog(friend_number) == &log) {
+		flush(friend_number, log);
+	}
+}
+
+void ToxOutboxStore::compact(FriendLog& log) {
+	std::error_code ec;
+
+	if (log.pending.empty()) {
+		// nothing left to keep
+		log.file.close();
+		std::filesystem::remove(log.path, ec);
+		log.size = 0;
+		log.acks = 0;
+		return;
+	}
+
+	if (log.acks < compact_min_acks || log.acks <= log.pending.size()) {
+		return;
+	}
+
+	const std::string tmp_path = log.path + ".tmp";
+	std::ofstream out{tmp_path, std::ios::binary | std::ios::trunc};
+	out.write(log_magic.data(), log_magic.size());
+
+	uint64_t offset = log_magic.size();
+	std::map<uint64_t, Pending> moved;
+	for (const auto& [seq, pending] : log.pending) {
+		std::string text(pending.size, '\0');
+		log.file.clear();
+		log.file.seekg(pending.offset);
+		if (!log.file.read(text.data(), text.size())) {
+			break;
+		}
+
+		const auto record = messageRecord(seq, pending.type, text);
+		out.write(record.data(), record.size());
+
+		auto& moved_pending = moved[seq];
+		moved_pending = pending;
+		moved_pending.offset = offset + message_header_size;
+		offset += record.size();
+	}
+	out.close();
+	log.file.clear();
+
+	if (!out || moved.size() != log.pending.size()) {
+		std::cerr << "TLM error, failed compacting outbox log " << log.path << "\n";
+		std::filesystem::remove(tmp_path, ec);
+		return;
+	}
+
+	// rename replaces the old log in one go, a crash leaves either one intact
+	log.file.close();
+	std::filesystem::rename(tmp_path, log.path, ec);
+	if (ec) {
+		std::cerr << "TLM error, failed replacing outbox log " << log.path << ": " << ec.message() << "\n";
+		std::filesystem::remove(tmp_path, ec);
+	} else {
+		log.pending = std::move(moved);
+		log.size = offset;
+		log.acks = 0;
+	}
+	log.file.open(log.path, std::ios::in | std::ios::out | std::ios::binary);
+}
+
+bool ToxOutboxStore::onToxEvent(const Tox_Event_Friend_Connection_Status* e) {
+	const auto friend_number = tox_event_friend_connection_status_get_friend_number(e);
+
+	if (tox_event_friend_connection_status_get_connection_status(e) == TOX_CONNECTION_NONE) {
+		_online.erase(friend_number);
+		return false;
+	}
+
+	_online.insert(friend_number);
+	if (auto* log = getLog(friend_number); log != nullptr) {
+		flush(friend_number, *log);
+	}
+
+	return false; // others might care too
+}
+
@@ -0,0 +1,79 @@
+#pragma once
+
+#include <solanaceae/toxcore/tox_event_interface.hpp>
+
+#include <string>
+#include <string_view>
+#include <map>
+#include <set>
+#include <fstream>
+#include <cstdint>
+
+// fwd
+struct ToxI;
+class ToxOutbox;
+
+// friend messages that wait for the friend to come online, even across restarts
+// one append only log per friend (named by public key), the text stays on disk until it gets sent
+// messages go out in order, at least once (a crash before the receipt sends it again)
+class ToxOutboxStore : public ToxEventI {
+	ToxI& _t;
+	ToxOutbox& _outbox;
+	std::string _dir;
+
+	struct Pending {
+		uint64_t offset {0}; // of the text
+		uint32_t size {0};
+		Tox_Message_Type type {TOX_MESSAGE_TYPE_NORMAL};
+		bool handed {false}; // sitting in the outbox
+	};
+
+	struct FriendLog {
+		std::string key; // hex public key
+		std::string path;
+		std::fstream file;
+		uint64_t size {0}; // end of the last complete record
+		uint64_t next_seq {1};
+
+		// index of the messages not done yet, by sequence number
+		std::map<uint64_t, Pending> pending;
+		size_t handed {0};
+		size_t acks {0}; // records of done messages, dropped by compaction
+	};
+
+	// opened on first use, by hex public key (friend numbers get reused after a delete)
+	std::map<std::string, FriendLog> _logs;
+	std::set<uint32_t> _online;
+
+	// messages handed to the outbox at a time, per friend
+	size_t _batch_size {32};
+
+	public:
+		ToxOutboxStore(ToxI& t, ToxEventProviderI& tep, ToxOutbox& outbox, std::string dir);
+
+		// false if the log could not be written
+		bool friendSend(uint32_t friend_number, Tox_Message_Type type, std::string_view message);
+
+		// messages not delivered yet, from the index only
+		size_t depth(uint32_t friend_number);
+
+		// closes the log of a friend about to be deleted, the messages stay on disk for its public key
+		void forgetFriend(uint32_t friend_number);
+
+	private:
+		// nullptr if the friend does not exist or the log is unusable
+		// asks tox for the public key every time, a friend number might belong to someone else by now
+		FriendLog* getLog(uint32_t friend_number);
+		bool openLog(FriendLog& log);
+		bool append(FriendLog& log, const std::string& record);
+
+		// hands the next messages to the outbox, if the friend is online
+		void flush(uint32_t friend_number, FriendLog& log);
+		void done(uint32_t friend_number, const std::string& key, uint64_t seq);
+		// rewrites the log with just the pending messages, once it is mostly acks
+		void compact(FriendLog& log);
+
+	protected:
+		bool onToxEvent(const Tox_Event_Friend_Connection_Status* e) override;
+};
+
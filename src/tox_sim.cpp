@@ -0,0 +1,565 @@
+#include "./tox_sim.hpp"
+
+#include "./solanaceae/tox_client.hpp"
+#include "./solanaceae/transfer_manager.hpp"
+#include "./tox_lua_module.hpp"
+
+#include <solanaceae/toxcore/tox_interface.hpp>
+
+#include <filesystem>
+#include <charconv>
+#include <map>
+#include <set>
+#include <thread>
+#include <algorithm>
+#include <iostream>
+
+class ToxSim::Probe : public ToxEventI {
+	ToxI& _t;
+	bool _accept_friends {false};
+
+	public:
+		NodeStats stats;
+
+		// waiting for receipts, friend_number and message_id
+		std::map<std::pair<uint32_t, uint32_t>, clock::time_point> pending_receipts;
+		// friend requests sent, until the friend comes online
+		std::map<uint32_t, clock::time_point> pending_friends;
+		std::set<uint32_t> online_friends;
+
+		std::set<uint32_t> joined_groups;
+		std::map<uint32_t, std::set<uint32_t>> group_peers;
+
+	public:
+		Probe(ToxI& t, ToxEventProviderI& tep, bool accept_friends) : _t(t), _accept_friends(accept_friends) {
+			tep.subscribe(this, Tox_Event::TOX_EVENT_FRIEND_REQUEST);
+			tep.subscribe(this, Tox_Event::TOX_EVENT_FRIEND_CONNECTION_STATUS);
+			tep.subscribe(this, Tox_Event::TOX_EVENT_FRIEND_MESSAGE);
+			tep.subscribe(this, Tox_Event::TOX_EVENT_FRIEND_READ_RECEIPT);
+			tep.subscribe(this, Tox_Event::TOX_EVENT_GROUP_MESSAGE);
+			tep.subscribe(this, Tox_Event::TOX_EVENT_GROUP_SELF_JOIN);
+			tep.subscribe(this, Tox_Event::TOX_EVENT_GROUP_PEER_JOIN);
+			tep.subscribe(this, Tox_Event::TOX_EVENT_GROUP_PEER_EXIT);
+			tep.subscribe(this, Tox_Event::TOX_EVENT_FILE_RECV_CHUNK);
+			tep.subscribe(this, Tox_Event::TOX_EVENT_FILE_CHUNK_REQUEST);
+		}
+
+	private:
+		// latency of a sim message, false if it is not one
+		static bool simLatency(const uint8_t* data, size_t size, clock::duration& latency) {
+			const std::string_view text{reinterpret_cast<const char*>(data), size};
+			if (text.substr(0, 4) != "sim ") {
+				return false;
+			}
+
+			// sim <node> <seq> <sent ns>
+			const auto last_space = text.find_last_of(' ');
+			int64_t sent_ns = 0;
+			const auto res = std::from_chars(text.data() + last_space + 1, text.data() + text.size(), sent_ns);
+			if (res.ec != std::errc{}) {
+				return false;
+			}
+
+			latency = clock::now().time_since_epoch() - std::chrono::nanoseconds{sent_ns};
+			return true;
+		}
+
+	protected: // events, none get consumed
+		bool onToxEvent(const Tox_Event_Friend_Request* e) override {
+			if (_accept_friends) {
+				const uint8_t* key = tox_event_friend_request_get_public_key(e);
+				_t.toxFriendAddNorequest({key, key + TOX_PUBLIC_KEY_SIZE});
+			}
+			return false;
+		}
+
+		bool onToxEvent(const Tox_Event_Friend_Connection_Status* e) override {
+			const uint32_t friend_number = tox_event_friend_connection_status_get_friend_number(e);
+			if (tox_event_friend_connection_status_get_connection_status(e) == TOX_CONNECTION_NONE) {
+				online_friends.erase(friend_number);
+				return false;
+			}
+
+			online_friends.insert(friend_number);
+			if (const auto it = pending_friends.find(friend_number); it != pending_friends.end()) {
+				stats.connect_latency.record(clock::now() - it->second);
+				pending_friends.erase(it);
+			}
+			return false;
+		}
+
+		bool onToxEvent(const Tox_Event_Friend_Message* e) override {
+			clock::duration latency;
+			if (simLatency(tox_event_friend_message_get_message(e), tox_event_friend_message_get_message_length(e), latency)) {
+				stats.friend_recv++;
+				stats.friend_latency.record(latency);
+			} else {
+				stats.other_recv++;
+			}
+			return false;
+		}
+
+		bool onToxEvent(const Tox_Event_Friend_Read_Receipt* e) override {
+			const auto key = std::make_pair(tox_event_friend_read_receipt_get_friend_number(e), tox_event_friend_read_receipt_get_message_id(e));
+			if (const auto it = pending_receipts.find(key); it != pending_receipts.end()) {
+				stats.receipts++;
+				stats.receipt_latency.record(clock::now() - it->second);
+				pending_receipts.erase(it);
+			}
+			return false;
+		}
+
+		bool onToxEvent(const Tox_Event_Group_Message* e) override {
+			clock::duration latency;
+			if (simLatency(tox_event_group_message_get_message(e), tox_event_group_message_get_message_length(e), latency)) {
+				stats.group_recv++;
+				stats.group_latency.record(latency);
+			} else {
+				stats.other_recv++;
+			}
+			return false;
+		}
+
+		bool onToxEvent(const Tox_Event_Group_Self_Join* e) override {
+			joined_groups.insert(tox_event_group_self_join_get_group_number(e));
+			return false;
+		}
+
+		bool onToxEvent(const Tox_Event_Group_Peer_Join* e) override {
+			group_peers[tox_event_group_peer_join_get_group_number(e)].insert(tox_event_group_peer_join_get_peer_id(e));
+			return false;
+		}
+
+		bool onToxEvent(const Tox_Event_Group_Peer_Exit* e) override {
+			group_peers[tox_event_group_peer_exit_get_group_number(e)].erase(tox_event_group_peer_exit_get_peer_id(e));
+			return false;
+		}
+
+		bool onToxEvent(const Tox_Event_File_Recv_Chunk* e) override {
+			stats.file_bytes_recv += tox_event_file_recv_chunk_get_length(e);
+			return false;
+		}
+
+		bool onToxEvent(const Tox_Event_File_Chunk_Request* e) override {
+			// a zero length request is the end of the transfer
+			if (tox_event_file_chunk_request_get_length(e) == 0) {
+				stats.files_sent++;
+				stats.last_file_sent = clock::now();
+			}
+			return false;
+		}
+};
+
+ToxSim::ToxSim(const Options& options) : _options(options) {
+	// relative to where we started, not the script dir
+	_options.recv_dir = std::filesystem::absolute(_options.recv_dir).string();
+
+	const size_t count = first_load_node + _options.load_nodes;
+	_nodes.resize(count);
+
+	ToxClient::NetworkOptions network_options;
+	network_options.ipv6 = false;
+	network_options.local_discovery = false;
+	network_options.start_port = _options.start_port;
+	network_options.end_port = _options.start_port + static_cast<uint16_t>(std::min<size_t>(count + 100, 65535 - _options.start_port));
+	network_options.bootstrap = std::vector<ToxClient::BootstrapNode>{}; // the first node has nobody to bootstrap from
+
+	for (size_t i = 0; i < count; i++) {
+		auto& node = _nodes[i];
+		node.tc = std::make_unique<ToxClient>("", network_options); // no profile, nothing gets saved
+		node.tc->setSelfName(i == bot_node ? "bot" : "sim" + std::to_string(i));
+		node.probe = std::make_unique<Probe>(*node.tc, *node.tc, i == bot_node && _options.accept_friends);
+		node.tm = std::make_unique<TransferManager>(*node.tc, *node.tc);
+
+		if (i == bootstrap_node) {
+			// everyone else bootstraps from here
+			ToxClient::BootstrapNode bootstrap;
+			bootstrap.host = "127.0.0.1";
+			bootstrap.port = tox_self_get_udp_port(node.tc->getTox(), nullptr);
+			bootstrap.public_key.resize(TOX_PUBLIC_KEY_SIZE);
+			tox_self_get_dht_id(node.tc->getTox(), bootstrap.public_key.data());
+			bootstrap.tcp_relay = false;
+			network_options.bootstrap = std::vector<ToxClient::BootstrapNode>{bootstrap};
+		}
+	}
+
+	auto& bot = _nodes[bot_node];
+	bot.tm->setRecvPolicy(TransferManager::recvIntoDir(_options.recv_dir));
+
+	if (!_options.script_dir.empty()) {
+		std::error_code ec;
+		// the module loads main.lua from the working directory
+		std::filesystem::current_path(_options.script_dir, ec);
+		if (ec) {
+			std::cerr << "SIM error: can not enter " << _options.script_dir << ": " << ec.message() << ", running without scripts\n";
+		} else {
+			bot.tlm = std::make_unique<ToxLuaModule>(*bot.tc, *bot.tc);
+			bot.tc->subscribeRaw([tlm = bot.tlm.get()](const Tox_Events*) { tlm->beginBatch(); });
+			bot.tc->subscribeRawDone([tlm = bot.tlm.get()](const Tox_Events*) { tlm->endBatch(); });
+		}
+	}
+
+	std::cout << "SIM " << count << " nodes, bootstrap on port " << tox_self_get_udp_port(_nodes[bootstrap_node].tc->getTox(), nullptr) << "\n";
+}
+
+ToxSim::~ToxSim(void) {
+	// the module and the transfers reference the clients
+	for (auto& node : _nodes) {
+		node.tlm.reset();
+		node.tm.reset();
+		node.probe.reset();
+		node.tc.reset();
+	}
+}
+
+void ToxSim::iterate(void) {
+	uint32_t interval = 50;
+	for (auto& node : _nodes) {
+		node.tc->iterate();
+		node.tm->iterate();
+		if (node.tlm) {
+			node.tlm->iterate();
+		}
+		interval = std::min(interval, node.tc->toxIterationInterval());
+	}
+
+	// with many nodes a round takes a while by itself
+	std::this_thread::sleep_for(std::chrono::milliseconds{std::clamp<uint32_t>(interval / 4, 1, 10)});
+}
+
+bool ToxSim::runUntil(const std::function<bool(void)>& tick, clock::duration timeout) {
+	const auto deadline = clock::now() + timeout;
+	while (clock::now() < deadline) {
+		if (tick()) {
+			return true;
+		}
+		iterate();
+	}
+	return false;
+}
+
+void ToxSim::resetStats(void) {
+	for (auto& node : _nodes) {
+		node.probe->stats = {};
+		node.probe->pending_receipts.clear();
+	}
+	_step_start = clock::now();
+}
+
+std::string ToxSim::simMessage(size_t node, uint64_t seq) {
+	const auto now_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(clock::now().time_since_epoch()).count();
+	return "sim " + std::to_string(node) + " " + std::to_string(seq) + " " + std::to_string(now_ns);
+}
+
+bool ToxSim::runStep(std::string_view step, std::ostream& os) {
+	// name:arg:arg
+	std::vector<std::string_view> parts;
+	while (true) {
+		const auto colon = step.find(':');
+		parts.push_back(step.substr(0, colon));
+		if (colon == std::string_view::npos) {
+			break;
+		}
+		step.remove_prefix(colon + 1);
+	}
+
+	const auto arg = [&parts](size_t i, double fallback) {
+		double value = fallback;
+		if (i < parts.size()) {
+			value = std::atof(std::string{parts[i]}.c_str());
+		}
+		return value;
+	};
+
+	resetStats();
+
+	const auto& name = parts.front();
+	bool ok = false;
+	if (name == "connect") {
+		ok = stepConnect(std::chrono::seconds{static_cast<int64_t>(arg(1, 60))});
+	} else if (name == "friends") {
+		ok = stepFriends(std::chrono::seconds{static_cast<int64_t>(arg(1, 120))});
+	} else if (name == "messages") {
+		ok = stepMessages(static_cast<uint64_t>(arg(1, 100)), arg(2, 0));
+	} else if (name == "group") {
+		ok = stepGroup(static_cast<uint64_t>(arg(1, 100)), arg(2, 0));
+	} else if (name == "files") {
+		ok = stepFiles(static_cast<uint64_t>(arg(1, 1024*1024)), static_cast<uint64_t>(arg(2, 1)));
+	} else if (name == "wait") {
+		ok = stepWait(std::chrono::milliseconds{static_cast<int64_t>(arg(1, 10) * 1000)});
+	} else {
+		std::cerr << "SIM error: unknown step " << name << "\n";
+		return false;
+	}
+
+	std::string full_step;
+	for (const auto& part : parts) {
+		full_step += (full_step.empty() ? "" : ":") + std::string{part};
+	}
+	report(os, full_step);
+	if (!ok) {
+		os << "SIM step " << full_step << " did not finish in time\n";
+	}
+	return ok;
+}
+
+bool ToxSim::stepConnect(clock::duration timeout) {
+	return runUntil([this](void) {
+		return std::all_of(_nodes.begin(), _nodes.end(), [](const Node& node) {
+			return node.tc->toxSelfGetConnectionStatus() != TOX_CONNECTION_NONE;
+		});
+	}, timeout);
+}
+
+bool ToxSim::stepFriends(clock::duration timeout) {
+	// every load node sends its request at the same time
+	const auto bot_address = _nodes[bot_node].tc->toxSelfGetAddress();
+	for (size_t i = first_load_node; i < _nodes.size(); i++) {
+		auto& node = _nodes[i];
+		if (node.bot_friend != UINT32_MAX) {
+			continue; // from an earlier step
+		}
+
+		const auto [friend_number, err] = node.tc->toxFriendAdd(bot_address, "sim");
+		if (!friend_number.has_value()) {
+			std::cerr << "SIM error: node " << i << " friend request failed " << err << "\n";
+			node.probe->stats.send_failed++;
+			continue;
+		}
+		node.bot_friend = friend_number.value();
+		node.probe->pending_friends[node.bot_friend] = clock::now();
+		node.probe->stats.sent++;
+	}
+
+	return runUntil([this](void) {
+		for (size_t i = first_load_node; i < _nodes.size(); i++) {
+			const auto& node = _nodes[i];
+			if (node.bot_friend == UINT32_MAX || node.probe->online_friends.count(node.bot_friend) == 0) {
+				return false;
+			}
+		}
+		return true;
+	}, timeout);
+}
+
+bool ToxSim::stepMessages(uint64_t count, double rate) {
+	std::vector<uint64_t> seq(_nodes.size(), 0);
+	const auto start = clock::now();
+
+	uint64_t expected = 0;
+	for (size_t i = first_load_node; i < _nodes.size(); i++) {
+		if (_nodes[i].bot_friend != UINT32_MAX) {
+			expected += count;
+		}
+	}
+
+	const auto tick = [&](void) {
+		const auto now = clock::now();
+		bool all_sent = true;
+		for (size_t i = first_load_node; i < _nodes.size(); i++) {
+			auto& node = _nodes[i];
+			if (node.bot_friend == UINT32_MAX) {
+				continue;
+			}
+
+			// as many as the rate allows by now, or until the send queue is full
+			const uint64_t due = rate > 0.0 ? std::min<uint64_t>(count, static_cast<uint64_t>(std::chrono::duration<double>(now - start).count() * rate) + 1) : count;
+			while (seq[i] < due) {
+				const auto [message_id, err] = node.tc->toxFriendSendMessage(node.bot_friend, TOX_MESSAGE_TYPE_NORMAL, simMessage(i, seq[i]));
+				if (!message_id.has_value()) {
+					if (err != TOX_ERR_FRIEND_SEND_MESSAGE_SENDQ && err != TOX_ERR_FRIEND_SEND_MESSAGE_FRIEND_NOT_CONNECTED) {
+						node.probe->stats.send_failed++;
+						seq[i]++; // not coming back
+						continue;
+					}
+					break; // try again next round
+				}
+				node.probe->pending_receipts[{node.bot_friend, message_id.value()}] = clock::now();
+				node.probe->stats.sent++;
+				seq[i]++;
+			}
+			all_sent = all_sent && seq[i] == count && node.probe->pending_receipts.empty();
+		}
+
+		return all_sent && _nodes[bot_node].probe->stats.friend_recv >= expected;
+	};
+
+	const double send_time = rate > 0.0 ? count / rate : 0.0;
+	return runUntil(tick, std::chrono::seconds{30 + static_cast<int64_t>(send_time)});
+}
+
+bool ToxSim::stepGroup(uint64_t count, double rate) {
+	const size_t creator = first_load_node;
+	if (_nodes.size() <= creator) {
+		return false;
+	}
+
+	// one public group, made by the first load node, everyone else joins by chat id
+	if (_nodes[creator].group == UINT32_MAX) {
+		auto& node = _nodes[creator];
+		const auto [group_number, err] = node.tc->toxGroupNew(TOX_GROUP_PRIVACY_STATE_PUBLIC, "sim", "sim" + std::to_string(creator));
+		if (!group_number.has_value()) {
+			std::cerr << "SIM error: creating the group failed " << err << "\n";
+			return false;
+		}
+		node.group = group_number.value();
+		node.probe->joined_groups.insert(node.group);
+
+		const auto chat_id = node.tc->toxGroupGetChatId(node.group).value_or(std::vector<uint8_t>{});
+		for (size_t i = bot_node; i < _nodes.size(); i++) {
+			if (i == creator) {
+				continue;
+			}
+			const auto [joined_number, join_err] = _nodes[i].tc->toxGroupJoin(chat_id, i == bot_node ? "bot" : "sim" + std::to_string(i), "");
+			if (!joined_number.has_value()) {
+				std::cerr << "SIM error: node " << i << " joining the group failed " << join_err << "\n";
+				continue;
+			}
+			_nodes[i].group = joined_number.value();
+		}
+	}
+
+	const size_t members = _nodes.size() - bot_node;
+	const bool settled = runUntil([this, members](void) {
+		for (size_t i = bot_node; i < _nodes.size(); i++) {
+			const auto& node = _nodes[i];
+			if (node.group == UINT32_MAX || node.probe->joined_groups.count(node.group) == 0) {
+				return false;
+			}
+			if (node.probe->group_peers[node.group].size() + 1 < members) {
+				return false;
+			}
+		}
+		return true;
+	}, std::chrono::seconds{60});
+	if (!settled) {
+		return false;
+	}
+	resetStats(); // joining is not part of the flood
+
+	std::vector<uint64_t> seq(_nodes.size(), 0);
+	const auto start = clock::now();
+	const uint64_t senders = _nodes.size() - first_load_node;
+	const uint64_t expected = count * senders * (members - 1);
+
+	const auto tick = [&](void) {
+		const auto now = clock::now();
+		uint64_t received = 0;
+		for (size_t i = bot_node; i < _nodes.size(); i++) {
+			auto& node = _nodes[i];
+			received += node.probe->stats.group_recv;
+			if (i == bot_node) {
+				continue;
+			}
+
+			const uint64_t due = rate > 0.0 ? std::min<uint64_t>(count, static_cast<uint64_t>(std::chrono::duration<double>(now - start).count() * rate) + 1) : count;
+			while (seq[i] < due) {
+				const auto [message_id, err] = node.tc->toxGroupSendMessage(node.group, TOX_MESSAGE_TYPE_NORMAL, simMessage(i, seq[i]));
+				if (!message_id.has_value()) {
+					if (err == TOX_ERR_GROUP_SEND_MESSAGE_FAIL_SEND) {
+						break; // try again next round
+					}
+					node.probe->stats.send_failed++;
+				} else {
+					node.probe->stats.sent++;
+				}
+				seq[i]++;
+			}
+		}
+		return received >= expected;
+	};
+
+	const double send_time = rate > 0.0 ? count / rate : 0.0;
+	return runUntil(tick, std::chrono::seconds{30 + static_cast<int64_t>(send_time)});
+}
+
+bool ToxSim::stepFiles(uint64_t size, uint64_t count) {
+	// the same data for everyone, the blob cache keeps it once
+	auto data = std::make_shared<std::vector<uint8_t>>(size);
+	for (size_t i = 0; i < data->size(); i++) {
+		(*data)[i] = static_cast<uint8_t>(i * 7 + i / 251);
+	}
+
+	std::error_code ec;
+	std::filesystem::create_directories(_options.recv_dir, ec);
+
+	uint64_t expected = 0;
+	for (size_t i = first_load_node; i < _nodes.size(); i++) {
+		auto& node = _nodes[i];
+		if (node.bot_friend == UINT32_MAX) {
+			continue;
+		}
+		for (uint64_t f = 0; f < count; f++) {
+			const auto filename = "sim_" + std::to_string(i) + "_" + std::to_string(f) + ".bin";
+			if (node.tm->friendSendMem(node.bot_friend, TOX_FILE_KIND_DATA, filename, data)) {
+				node.probe->stats.sent++;
+				expected++;
+			} else {
+				node.probe->stats.send_failed++;
+			}
+		}
+	}
+
+	return runUntil([this, expected](void) {
+		uint64_t done = 0;
+		for (size_t i = first_load_node; i < _nodes.size(); i++) {
+			done += _nodes[i].probe->stats.files_sent;
+		}
+		return done >= expected;
+	}, std::chrono::seconds{60} + std::chrono::seconds{static_cast<int64_t>(size * expected / (1024*1024))});
+}
+
+bool ToxSim::stepWait(clock::duration duration) {
+	runUntil([](void) { return false; }, duration);
+	return true;
+}
+
+static double ms(std::chrono::nanoseconds duration) {
+	return std::chrono::duration<double, std::milli>(duration).count();
+}
+
+static void reportLatency(std::ostream& os, const char* name, const LatencyHistogram& histogram) {
+	if (histogram.count() == 0) {
+		return;
+	}
+	os << " " << name << " ms p50 " << ms(histogram.quantile(0.5))
+		<< " p99 " << ms(histogram.quantile(0.99))
+		<< " max " << ms(histogram.max());
+}
+
+void ToxSim::report(std::ostream& os, std::string_view step) const {
+	const double seconds = std::chrono::duration<double>(clock::now() - _step_start).count();
+
+	uint64_t received = 0;
+	for (const auto& node : _nodes) {
+		received += node.probe->stats.friend_recv + node.probe->stats.group_recv;
+	}
+	os << "SIM step " << step << " took " << seconds << "s, " << (seconds > 0.0 ? received / seconds : 0.0) << " messages/s received\n";
+
+	for (size_t i = bot_node; i < _nodes.size(); i++) {
+		const auto& stats = _nodes[i].probe->stats;
+		os << "SIM   node " << i << (i == bot_node ? " (bot)" : "");
+		if (stats.sent != 0 || stats.send_failed != 0) {
+			os << " sent " << stats.sent << " failed " << stats.send_failed;
+		}
+		if (stats.receipts != 0) {
+			os << " receipts " << stats.receipts;
+		}
+		if (stats.friend_recv != 0 || stats.group_recv != 0 || stats.other_recv != 0) {
+			os << " recv " << stats.friend_recv << " friend " << stats.group_recv << " group " << stats.other_recv << " other";
+		}
+		if (stats.file_bytes_recv != 0) {
+			os << " file bytes recv " << stats.file_bytes_recv << " (" << stats.file_bytes_recv / seconds / 1024 << "KiB/s)";
+		}
+		if (stats.files_sent != 0) {
+			const double file_seconds = std::chrono::duration<double>(stats.last_file_sent - _step_start).count();
+			os << " files sent " << stats.files_sent << " in " << file_seconds << "s";
+		}
+		reportLatency(os, "connect", stats.connect_latency);
+		reportLatency(os, "friend", stats.friend_latency);
+		reportLatency(os, "group", stats.group_latency);
+		reportLatency(os, "receipt", stats.receipt_latency);
+		os << "\n";
+	}
+}
+
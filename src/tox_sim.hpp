@@ -0,0 +1,102 @@
+#pragma once
+
+#include "./solanaceae/latency_histogram.hpp"
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <memory>
+#include <functional>
+#include <chrono>
+#include <ostream>
+#include <cstdint>
+
+// fwd
+class ToxClient;
+class TransferManager;
+class ToxLuaModule;
+
+// many tox instances in one process, talking over loopback, to load test scripts without the internet
+// node 0 is the local bootstrap node, node 1 the bot (optionally running the scripts), the rest generate load
+// scenarios are a list of steps, eg. "friends" "messages:100:20" "group:50" "files:1048576:2"
+class ToxSim {
+	public:
+		using clock = std::chrono::steady_clock;
+
+		struct Options {
+			size_t load_nodes {4};
+			uint16_t start_port {33445}; // every node takes the next free port after it
+			std::string script_dir; // empty for a bot without scripts
+			bool accept_friends {true}; // the bot accepts requests itself, instead of leaving it to the scripts
+			std::string recv_dir {"sim_recv"}; // where the bot puts received files
+		};
+
+		// what a node saw during the current step
+		struct NodeStats {
+			uint64_t sent {0};
+			uint64_t send_failed {0};
+			uint64_t receipts {0};
+			uint64_t friend_recv {0}; // sim messages
+			uint64_t group_recv {0};
+			uint64_t other_recv {0}; // everything else, eg. replies of the bot
+			uint64_t file_bytes_recv {0};
+			uint64_t files_sent {0};
+			clock::time_point last_file_sent;
+
+			LatencyHistogram friend_latency; // one way, sent to received
+			LatencyHistogram group_latency;
+			LatencyHistogram receipt_latency; // sent to read receipt
+			LatencyHistogram connect_latency; // friend request to connected
+		};
+
+	private:
+		class Probe;
+
+		struct Node {
+			std::unique_ptr<ToxClient> tc;
+			std::unique_ptr<Probe> probe; // subscribed first, sees every event
+			std::unique_ptr<TransferManager> tm;
+			std::unique_ptr<ToxLuaModule> tlm; // bot only
+
+			uint32_t bot_friend {UINT32_MAX}; // load nodes, the bot in their friend list
+			uint32_t group {UINT32_MAX};
+		};
+
+		Options _options;
+		std::vector<Node> _nodes;
+
+		clock::time_point _step_start;
+
+		static constexpr size_t bootstrap_node = 0;
+		static constexpr size_t bot_node = 1;
+		static constexpr size_t first_load_node = 2;
+
+	public:
+		explicit ToxSim(const Options& options);
+		~ToxSim(void);
+
+		// runs one step and reports on it, false if the step is unknown or did not finish in time
+		bool runStep(std::string_view step, std::ostream& os);
+
+		size_t nodeCount(void) const { return _nodes.size(); }
+
+	private:
+		// one tox_iterate() for every node
+		void iterate(void);
+		// calls tick and iterates, until it returns true or the timeout hits
+		bool runUntil(const std::function<bool(void)>& tick, clock::duration timeout);
+
+		void resetStats(void);
+		void report(std::ostream& os, std::string_view step) const;
+
+		// "sim <node> <seq> <sent ns>", parsed by the probes
+		static std::string simMessage(size_t node, uint64_t seq);
+
+		bool stepConnect(clock::duration timeout);
+		bool stepFriends(clock::duration timeout);
+		bool stepMessages(uint64_t count, double rate);
+		bool stepGroup(uint64_t count, double rate);
+		bool stepFiles(uint64_t size, uint64_t count);
+		bool stepWait(clock::duration duration);
+};
+
@@ -0,0 +1,347 @@
+#include "./tox_state_cache.hpp"
+
+#include <solanaceae/toxcore/tox_interface.hpp>
+
+// assigning keeps the capacity, so names that change often stop allocating
+static void assignText(std::string& out, const uint8_t* data, size_t size) {
+	out.assign(reinterpret_cast<const char*>(data), size);
+}
+
+ToxStateCache::ToxStateCache(ToxI& t, ToxEventProviderI& tep) : _t(t) {
+	tep.subscribe(this, Tox_Event::TOX_EVENT_CONFERENCE_CONNECTED);
+	tep.subscribe(this, Tox_Event::TOX_EVENT_CONFERENCE_PEER_LIST_CHANGED);
+	tep.subscribe(this, Tox_Event::TOX_EVENT_CONFERENCE_PEER_NAME);
+	tep.subscribe(this, Tox_Event::TOX_EVENT_CONFERENCE_TITLE);
+
+	tep.subscribe(this, Tox_Event::TOX_EVENT_FRIEND_CONNECTION_STATUS);
+	tep.subscribe(this, Tox_Event::TOX_EVENT_FRIEND_NAME);
+	tep.subscribe(this, Tox_Event::TOX_EVENT_FRIEND_STATUS);
+	tep.subscribe(this, Tox_Event::TOX_EVENT_FRIEND_STATUS_MESSAGE);
+	tep.subscribe(this, Tox_Event::TOX_EVENT_FRIEND_TYPING);
+
+	tep.subscribe(this, Tox_Event::TOX_EVENT_GROUP_PEER_NAME);
+	tep.subscribe(this, Tox_Event::TOX_EVENT_GROUP_PEER_STATUS);
+	tep.subscribe(this, Tox_Event::TOX_EVENT_GROUP_TOPIC);
+	tep.subscribe(this, Tox_Event::TOX_EVENT_GROUP_PRIVACY_STATE);
+	tep.subscribe(this, Tox_Event::TOX_EVENT_GROUP_VOICE_STATE);
+	tep.subscribe(this, Tox_Event::TOX_EVENT_GROUP_TOPIC_LOCK);
+	tep.subscribe(this, Tox_Event::TOX_EVENT_GROUP_PEER_LIMIT);
+	tep.subscribe(this, Tox_Event::TOX_EVENT_GROUP_PEER_JOIN);
+	tep.subscribe(this, Tox_Event::TOX_EVENT_GROUP_PEER_EXIT);
+	tep.subscribe(this, Tox_Event::TOX_EVENT_GROUP_SELF_JOIN);
+	tep.subscribe(this, Tox_Event::TOX_EVENT_GROUP_MODERATION);
+
+	reset();
+}
+
+const ToxStateCache::Friend* ToxStateCache::getFriend(uint32_t friend_number) {
+	if (const auto it = _friends.find(friend_number); it != _friends.end()) {
+		_stats.hits++;
+		return &it->second;
+	}
+	return fillFriend(friend_number);
+}
+
+const ToxStateCache::Group* ToxStateCache::getGroup(uint32_t group_number) {
+	if (const auto it = _groups.find(group_number); it != _groups.end()) {
+		_stats.hits++;
+		return &it->second;
+	}
+	return fillGroup(group_number);
+}
+
+const ToxStateCache::GroupPeer* ToxStateCache::getGroupPeer(uint32_t group_number, uint32_t peer_id) {
+	auto group_it = _groups.find(group_number);
+	if (group_it == _groups.end()) {
+		if (fillGroup(group_number) == nullptr) {
+			return nullptr;
+		}
+		group_it = _groups.find(group_number);
+	}
+
+	auto& group = group_it->second;
+	if (const auto it = group.peers.find(peer_id); it != group.peers.end()) {
+		_stats.hits++;
+		return &it->second;
+	}
+	if (peer_id == group.self_peer_id) {
+		return nullptr; // we are not one of the peers
+	}
+	return fillGroupPeer(group, group_number, peer_id);
+}
+
+const ToxStateCache::Conference* ToxStateCache::getConference(uint32_t conference_number) {
+	if (const auto it = _conferences.find(conference_number); it != _conferences.end()) {
+		_stats.hits++;
+		return &it->second;
+	}
+	return nullptr;
+}
+
+void ToxStateCache::forgetFriend(uint32_t friend_number) {
+	_friends.erase(friend_number);
+}
+
+void ToxStateCache::forgetGroup(uint32_t group_number) {
+	_groups.erase(group_number);
+}
+
+void ToxStateCache::reset(void) {
+	_friends.clear();
+	_groups.clear();
+	_conferences.clear();
+
+	for (const uint32_t friend_number : _t.toxSelfGetFriendList()) {
+		fillFriend(friend_number);
+	}
+	for (const uint32_t group_number : _t.toxGroupGetList()) {
+		fillGroup(group_number);
+	}
+}
+
+ToxStateCache::Friend* ToxStateCache::fillFriend(uint32_t friend_number) {
+	if (!_t.toxFriendExists(friend_number)) {
+		return nullptr;
+	}
+	_stats.fills++;
+
+	auto& f = _friends[friend_number];
+	f.name = _t.toxFriendGetName(friend_number).value_or("");
+	f.status_message = _t.toxFriendGetStatusMessage(friend_number).value_or("");
+	f.status = _t.toxFriendGetStatus(friend_number).value_or(TOX_USER_STATUS_NONE);
+	f.connection_status = _t.toxFriendGetConnectionStatus(friend_number).value_or(TOX_CONNECTION_NONE);
+	f.typing = _t.toxFriendGetTyping(friend_number).value_or(false);
+	return &f;
+}
+
+ToxStateCache::Group* ToxStateCache::fillGroup(uint32_t group_number) {
+	auto name = _t.toxGroupGetName(group_number);
+	if (!name.has_value()) {
+		return nullptr;
+	}
+	_stats.fills++;
+
+	// keeps the peers and whatever only events tell us
+	auto& group = _groups[group_number];
+	group.name = std::move(name.value());
+	group.topic = _t.toxGroupGetTopic(group_number).value_or("");
+	group.self_peer_id = _t.toxGroupSelfGetPeerId(group_number).value_or(UINT32_MAX);
+	group.self_role = _t.toxGroupSelfGetRole(group_number).value_or(TOX_GROUP_ROLE_USER);
+	return &group;
+}
+
+ToxStateCache::GroupPeer* ToxStateCache::fillGroupPeer(Group& group, uint32_t group_number, uint32_t peer_id) {
+	auto name = _t.toxGroupPeerGetName(group_number, peer_id);
+	if (!name.has_value()) {
+		return nullptr;
+	}
+	_stats.fills++;
+
+	auto& peer = group.peers[peer_id];
+	peer.name = std::move(name.value());
+	peer.status = _t.toxGroupPeerGetStatus(group_number, peer_id).value_or(TOX_USER_STATUS_NONE);
+	peer.role = _t.toxGroupPeerGetRole(group_number, peer_id).value_or(TOX_GROUP_ROLE_USER);
+	return &peer;
+}
+
+ToxStateCache::Friend* ToxStateCache::eventFriend(uint32_t friend_number) {
+	if (const auto it = _friends.find(friend_number); it != _friends.end()) {
+		_stats.updates++;
+		return &it->second;
+	}
+	auto* f = fillFriend(friend_number);
+	if (f != nullptr) {
+		_stats.updates++;
+	}
+	return f;
+}
+
+ToxStateCache::Group* ToxStateCache::eventGroup(uint32_t group_number) {
+	if (const auto it = _groups.find(group_number); it != _groups.end()) {
+		_stats.updates++;
+		return &it->second;
+	}
+	auto* group = fillGroup(group_number);
+	if (group != nullptr) {
+		_stats.updates++;
+	}
+	return group;
+}
+
+ToxStateCache::GroupPeer* ToxStateCache::eventGroupPeer(uint32_t group_number, uint32_t peer_id) {
+	auto* group = eventGroup(group_number);
+	if (group == nullptr) {
+		return nullptr;
+	}
+	if (const auto it = group->peers.find(peer_id); it != group->peers.end()) {
+		return &it->second;
+	}
+	return fillGroupPeer(*group, group_number, peer_id);
+}
+
+bool ToxStateCache::onToxEvent(const Tox_Event_Conference_Connected* e) {
+	_stats.updates++;
+	_conferences[tox_event_conference_connected_get_conference_number(e)].connected = true;
+	return false;
+}
+
+bool ToxStateCache::onToxEvent(const Tox_Event_Conference_Peer_List_Changed* e) {
+	_stats.updates++;
+	// peer numbers got shuffled, names come back with the next name events
+	_conferences[tox_event_conference_peer_list_changed_get_conference_number(e)].peer_names.clear();
+	return false;
+}
+
+bool ToxStateCache::onToxEvent(const Tox_Event_Conference_Peer_Name* e) {
+	_stats.updates++;
+	auto& conference = _conferences[tox_event_conference_peer_name_get_conference_number(e)];
+	assignText(
+		conference.peer_names[tox_event_conference_peer_name_get_peer_number(e)],
+		tox_event_conference_peer_name_get_name(e),
+		tox_event_conference_peer_name_get_name_length(e)
+	);
+	return false;
+}
+
+bool ToxStateCache::onToxEvent(const Tox_Event_Conference_Title* e) {
+	_stats.updates++;
+	auto& conference = _conferences[tox_event_conference_title_get_conference_number(e)];
+	assignText(conference.title, tox_event_conference_title_get_title(e), tox_event_conference_title_get_title_length(e));
+	return false;
+}
+
+bool ToxStateCache::onToxEvent(const Tox_Event_Friend_Connection_Status* e) {
+	if (auto* f = eventFriend(tox_event_friend_connection_status_get_friend_number(e)); f != nullptr) {
+		f->connection_status = tox_event_friend_connection_status_get_connection_status(e);
+	}
+	return false;
+}
+
+bool ToxStateCache::onToxEvent(const Tox_Event_Friend_Name* e) {
+	if (auto* f = eventFriend(tox_event_friend_name_get_friend_number(e)); f != nullptr) {
+		assignText(f->name, tox_event_friend_name_get_name(e), tox_event_friend_name_get_name_length(e));
+	}
+	return false;
+}
+
+bool ToxStateCache::onToxEvent(const Tox_Event_Friend_Status* e) {
+	if (auto* f = eventFriend(tox_event_friend_status_get_friend_number(e)); f != nullptr) {
+		f->status = tox_event_friend_status_get_status(e);
+	}
+	return false;
+}
+
+bool ToxStateCache::onToxEvent(const Tox_Event_Friend_Status_Message* e) {
+	if (auto* f = eventFriend(tox_event_friend_status_message_get_friend_number(e)); f != nullptr) {
+		assignText(f->status_message, tox_event_friend_status_message_get_message(e), tox_event_friend_status_message_get_message_length(e));
+	}
+	return false;
+}
+
+bool ToxStateCache::onToxEvent(const Tox_Event_Friend_Typing* e) {
+	if (auto* f = eventFriend(tox_event_friend_typing_get_friend_number(e)); f != nullptr) {
+		f->typing = tox_event_friend_typing_get_typing(e);
+	}
+	return false;
+}
+
+bool ToxStateCache::onToxEvent(const Tox_Event_Group_Peer_Name* e) {
+	if (auto* peer = eventGroupPeer(tox_event_group_peer_name_get_group_number(e), tox_event_group_peer_name_get_peer_id(e)); peer != nullptr) {
+		assignText(peer->name, tox_event_group_peer_name_get_name(e), tox_event_group_peer_name_get_name_length(e));
+	}
+	return false;
+}
+
+bool ToxStateCache::onToxEvent(const Tox_Event_Group_Peer_Status* e) {
+	if (auto* peer = eventGroupPeer(tox_event_group_peer_status_get_group_number(e), tox_event_group_peer_status_get_peer_id(e)); peer != nullptr) {
+		peer->status = tox_event_group_peer_status_get_status(e);
+	}
+	return false;
+}
+
+bool ToxStateCache::onToxEvent(const Tox_Event_Group_Topic* e) {
+	if (auto* group = eventGroup(tox_event_group_topic_get_group_number(e)); group != nullptr) {
+		assignText(group->topic, tox_event_group_topic_get_topic(e), tox_event_group_topic_get_topic_length(e));
+	}
+	return false;
+}
+
+bool ToxStateCache::onToxEvent(const Tox_Event_Group_Privacy_State* e) {
+	if (auto* group = eventGroup(tox_event_group_privacy_state_get_group_number(e)); group != nullptr) {
+		group->privacy_state = tox_event_group_privacy_state_get_privacy_state(e);
+	}
+	return false;
+}
+
+bool ToxStateCache::onToxEvent(const Tox_Event_Group_Voice_State* e) {
+	if (auto* group = eventGroup(tox_event_group_voice_state_get_group_number(e)); group != nullptr) {
+		group->voice_state = tox_event_group_voice_state_get_voice_state(e);
+	}
+	return false;
+}
+
+bool ToxStateCache::onToxEvent(const Tox_Event_Group_Topic_Lock* e) {
+	if (auto* group = eventGroup(tox_event_group_topic_lock_get_group_number(e)); group != nullptr) {
+		group->topic_lock = tox_event_group_topic_lock_get_topic_lock(e);
+	}
+	return false;
+}
+
+bool ToxStateCache::onToxEvent(const Tox_Event_Group_Peer_Limit* e) {
+	if (auto* group = eventGroup(tox_event_group_peer_limit_get_group_number(e)); group != nullptr) {
+		group->peer_limit = tox_event_group_peer_limit_get_peer_limit(e);
+	}
+	return false;
+}
+
+bool ToxStateCache::onToxEvent(const Tox_Event_Group_Peer_Join* e) {
+	// the only time a peer costs tox calls
+	eventGroupPeer(tox_event_group_peer_join_get_group_number(e), tox_event_group_peer_join_get_peer_id(e));
+	return false;
+}
+
+bool ToxStateCache::onToxEvent(const Tox_Event_Group_Peer_Exit* e) {
+	// nothing to forget if the group is not cached
+	if (const auto it = _groups.find(tox_event_group_peer_exit_get_group_number(e)); it != _groups.end()) {
+		_stats.updates++;
+		it->second.peers.erase(tox_event_group_peer_exit_get_peer_id(e));
+	}
+	return false;
+}
+
+bool ToxStateCache::onToxEvent(const Tox_Event_Group_Self_Join* e) {
+	// (re)joined, peers show up again with their join events
+	const uint32_t group_number = tox_event_group_self_join_get_group_number(e);
+	_stats.updates++;
+	if (const auto it = _groups.find(group_number); it != _groups.end()) {
+		it->second.peers.clear();
+	}
+	fillGroup(group_number);
+	return false;
+}
+
+bool ToxStateCache::onToxEvent(const Tox_Event_Group_Moderation* e) {
+	auto* group = eventGroup(tox_event_group_moderation_get_group_number(e));
+	if (group == nullptr) {
+		return false;
+	}
+	const uint32_t target = tox_event_group_moderation_get_target_peer_id(e);
+
+	Tox_Group_Role role = TOX_GROUP_ROLE_USER;
+	switch (tox_event_group_moderation_get_mod_type(e)) {
+		case TOX_GROUP_MOD_EVENT_KICK:
+			group->peers.erase(target);
+			return false;
+		case TOX_GROUP_MOD_EVENT_OBSERVER: role = TOX_GROUP_ROLE_OBSERVER; break;
+		case TOX_GROUP_MOD_EVENT_USER: role = TOX_GROUP_ROLE_USER; break;
+		case TOX_GROUP_MOD_EVENT_MODERATOR: role = TOX_GROUP_ROLE_MODERATOR; break;
+	}
+
+	if (target == group->self_peer_id) {
+		group->self_role = role;
+	} else if (const auto it = group->peers.find(target); it != group->peers.end()) {
+		it->second.role = role;
+	}
+	return false;
+}
+
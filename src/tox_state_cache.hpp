@@ -0,0 +1,128 @@
+#pragma once
+
+#include <solanaceae/toxcore/tox_event_interface.hpp>
+
+#include <string>
+#include <unordered_map>
+#include <optional>
+#include <cstdint>
+
+// fwd
+struct ToxI;
+
+// mirror of friend, group, group peer and conference peer state, kept current from events
+// lookups are hash lookups, tox only gets asked for things seen the first time
+// subscribes before the scripts do, so handlers already see the new state
+class ToxStateCache : public ToxEventI {
+	ToxI& _t;
+
+	public:
+		struct Friend {
+			std::string name;
+			std::string status_message;
+			Tox_User_Status status {TOX_USER_STATUS_NONE};
+			Tox_Connection connection_status {TOX_CONNECTION_NONE};
+			bool typing {false};
+		};
+
+		struct GroupPeer {
+			std::string name;
+			Tox_User_Status status {TOX_USER_STATUS_NONE};
+			Tox_Group_Role role {TOX_GROUP_ROLE_USER};
+		};
+
+		struct Group {
+			std::string name;
+			std::string topic;
+			uint32_t self_peer_id {UINT32_MAX};
+			Tox_Group_Role self_role {TOX_GROUP_ROLE_USER};
+
+			// only known once the event came in, there are no getters for them
+			std::optional<Tox_Group_Privacy_State> privacy_state;
+			std::optional<Tox_Group_Voice_State> voice_state;
+			std::optional<Tox_Group_Topic_Lock> topic_lock;
+			std::optional<uint32_t> peer_limit;
+
+			std::unordered_map<uint32_t, GroupPeer> peers; // without ourself
+		};
+
+		struct Conference {
+			std::string title;
+			bool connected {false};
+			// by peer number, which change with the peer list, so it starts over on every change
+			std::unordered_map<uint32_t, std::string> peer_names;
+		};
+
+		struct Stats {
+			uint64_t hits {0};
+			uint64_t fills {0}; // asked tox
+			uint64_t updates {0}; // events applied
+		};
+
+	private:
+		std::unordered_map<uint32_t, Friend> _friends;
+		std::unordered_map<uint32_t, Group> _groups;
+		std::unordered_map<uint32_t, Conference> _conferences;
+
+		Stats _stats;
+
+	public:
+		ToxStateCache(ToxI& t, ToxEventProviderI& tep);
+
+		// nullptr if tox does not know it either
+		const Friend* getFriend(uint32_t friend_number);
+		const Group* getGroup(uint32_t group_number);
+		const GroupPeer* getGroupPeer(uint32_t group_number, uint32_t peer_id);
+		// conference peers have no getters, so this is only what the events told us
+		const Conference* getConference(uint32_t conference_number);
+
+		// for iterating, without filling anything
+		const std::unordered_map<uint32_t, Friend>& friends(void) const { return _friends; }
+		const std::unordered_map<uint32_t, Group>& groups(void) const { return _groups; }
+		const std::unordered_map<uint32_t, Conference>& conferences(void) const { return _conferences; }
+
+		// deleting friends and leaving groups has no event, the bindings call these
+		void forgetFriend(uint32_t friend_number);
+		void forgetGroup(uint32_t group_number);
+
+		// throws everything away and asks tox again
+		void reset(void);
+
+		const Stats& getStats(void) const { return _stats; }
+
+	private:
+		Friend* fillFriend(uint32_t friend_number);
+		Group* fillGroup(uint32_t group_number);
+		GroupPeer* fillGroupPeer(Group& group, uint32_t group_number, uint32_t peer_id);
+
+		// entry for an event, filled from tox if it is new
+		// nullptr if tox does not know it (eg. deleted since), the event is skipped then
+		Friend* eventFriend(uint32_t friend_number);
+		Group* eventGroup(uint32_t group_number);
+		GroupPeer* eventGroupPeer(uint32_t group_number, uint32_t peer_id);
+
+	protected:
+		bool onToxEvent(const Tox_Event_Conference_Connected* e) override;
+		bool onToxEvent(const Tox_Event_Conference_Peer_List_Changed* e) override;
+		bool onToxEvent(const Tox_Event_Conference_Peer_Name* e) override;
+		bool onToxEvent(const Tox_Event_Conference_Title* e) override;
+
+		bool onToxEvent(const Tox_Event_Friend_Connection_Status* e) override;
+		bool onToxEvent(const Tox_Event_Friend_Name* e) override;
+		bool onToxEvent(const Tox_Event_Friend_Status* e) override;
+		bool onToxEvent(const Tox_Event_Friend_Status_Message* e) override;
+		bool onToxEvent(const Tox_Event_Friend_Typing* e) override;
+
+		bool onToxEvent(const Tox_Event_Group_Peer_Name* e) override;
+		bool onToxEvent(const Tox_Event_Group_Peer_Status* e) override;
+		bool onToxEvent(const Tox_Event_Group_Topic* e) override;
+		bool onToxEvent(const Tox_Event_Group_Privacy_State* e) override;
+		bool onToxEvent(const Tox_Event_Group_Voice_State* e) override;
+		bool onToxEvent(const Tox_Event_Group_Topic_Lock* e) override;
+		bool onToxEvent(const Tox_Event_Group_Peer_Limit* e) override;
+		bool onToxEvent(const Tox_Event_Group_Peer_Join* e) override;
+		bool onToxEvent(const Tox_Event_Group_Peer_Exit* e) override;
+		bool onToxEvent(const Tox_Event_Group_Self_Join* e) override;
+		bool onToxEvent(const Tox_Event_Group_Moderation* e) override;
+};
+